@@ -61,6 +61,18 @@ public:
     }
   }
 
+  virtual std::vector<ImplicitRegistrationSet*> get_irss() override
+  {
+    std::vector<ImplicitRegistrationSet*> irss;
+
+    for (Irs::value_type& pair : _irss)
+    {
+      irss.push_back(pair.second);
+    }
+
+    return irss;
+  }
+
   Irs& get_irs()
   {
     return _irss;
@@ -0,0 +1,86 @@
+/**
+ * @file coalescing_hss_connection.h HSS connection that coalesces concurrent
+ * identical server assignment requests.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+#ifndef COALESCING_HSS_CONNECTION_H__
+#define COALESCING_HSS_CONNECTION_H__
+
+#include <tuple>
+
+#include "hss_connection.h"
+#include "single_flight.h"
+
+namespace HssConnection {
+
+// Wraps another HssConnection. When a SAR is made while an identical SAR
+// (i.e. one with the same value for every field) is already in flight, the
+// second SAR isn't sent to the HSS - instead, its callback is called with
+// the answer to the first. This stops bursts of requests for the same
+// subscriber (e.g. during a registration storm) each sending their own SAR.
+//
+// All other requests are passed straight through.
+class CoalescingHssConnection : public HssConnection
+{
+public:
+  // Does not take ownership of the wrapped connection.
+  CoalescingHssConnection(HssConnection* hss_connection) :
+    HssConnection(NULL),
+    _hss_connection(hss_connection)
+  {
+  }
+
+  virtual ~CoalescingHssConnection() {};
+
+  virtual void send_multimedia_auth_request(maa_cb callback,
+                                            MultimediaAuthRequest request,
+                                            SAS::TrailId trail,
+                                            Utils::StopWatch* stopwatch) override
+  {
+    _hss_connection->send_multimedia_auth_request(callback, request, trail, stopwatch);
+  }
+
+  virtual void send_user_auth_request(uaa_cb callback,
+                                      UserAuthRequest request,
+                                      SAS::TrailId trail,
+                                      Utils::StopWatch* stopwatch) override
+  {
+    _hss_connection->send_user_auth_request(callback, request, trail, stopwatch);
+  }
+
+  virtual void send_location_info_request(lia_cb callback,
+                                          LocationInfoRequest request,
+                                          SAS::TrailId trail,
+                                          Utils::StopWatch* stopwatch) override
+  {
+    _hss_connection->send_location_info_request(callback, request, trail, stopwatch);
+  }
+
+  // Sends the SAR, unless an identical one is in flight. Only the stopwatch
+  // of the request that is actually sent is paused while waiting for the
+  // HSS.
+  virtual void send_server_assignment_request(saa_cb callback,
+                                              ServerAssignmentRequest request,
+                                              SAS::TrailId trail,
+                                              Utils::StopWatch* stopwatch) override;
+
+private:
+  typedef std::tuple<std::string,
+                     std::string,
+                     std::string,
+                     int,
+                     bool,
+                     std::string> SarKey;
+
+  HssConnection* _hss_connection;
+  SingleFlight<SarKey, saa_cb> _sars;
+};
+
+}; // namespace HssConnection
+#endif
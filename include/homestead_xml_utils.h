@@ -12,15 +12,77 @@
 #ifndef XMLUTILS_H__
 #define XMLUTILS_H__
 
+#include <list>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include "reg_state.h"
 #include "charging_addresses.h"
+#include "identity_index.h"
 #include "rapidxml/rapidxml.hpp"
 #include "implicit_reg_set.h"
 
 namespace XmlUtils
 {
+  // An IMS subscription, parsed once so that its identities can be read and
+  // it can be added to documents without parsing it again. All the identities
+  // are extracted in a single pass when it's parsed.
+  //
+  // This owns the parsed document, so it can't be copied - share it by
+  // reference instead.
+  class ParsedImsSubscription
+  {
+  public:
+    ParsedImsSubscription(const std::string& xml);
+    virtual ~ParsedImsSubscription() {}
+
+    // The XML this was parsed from.
+    const std::string& xml() const { return _xml; }
+
+    // The IMSSubscription node, or NULL if the XML couldn't be parsed or
+    // doesn't contain one.
+    rapidxml::xml_node<>* ims_subscription_node() const
+    {
+      return _ims_subscription;
+    }
+
+    // All the public IDs, in document order without duplicates.
+    const std::vector<std::string>& public_ids() const { return _public_ids; }
+
+    // The default public ID (the first unbarred public ID), or an empty
+    // string if every public ID is barred.
+    const std::string& default_id() const { return _default_id; }
+
+    // The private ID, or an empty string if there isn't one.
+    const std::string& private_id() const { return _identity_index.private_id; }
+
+    // All the identities, with their flags, to be stored alongside the XML.
+    const IdentityIndex& identity_index() const { return _identity_index; }
+
+  private:
+    ParsedImsSubscription(const ParsedImsSubscription&) = delete;
+    ParsedImsSubscription& operator=(const ParsedImsSubscription&) = delete;
+
+    std::string _xml;
+    rapidxml::xml_document<> _doc;
+    rapidxml::xml_node<>* _ims_subscription;
+    IdentityIndex _identity_index;
+    std::vector<std::string> _public_ids;
+    std::string _default_id;
+  };
+
+  // Gets the identities in the IMS subscription in a single forward scan,
+  // without building a DOM or copying the XML. This finds the same
+  // identities as ParsedImsSubscription, but returns false if the XML uses
+  // anything the scanner doesn't handle (or isn't valid), in which case it
+  // must be parsed instead.
+  bool scan_identity_index(const std::string& xml, IdentityIndex& index);
+
+  // Gets the identities in the IMS subscription, scanning it if possible and
+  // parsing it if not.
+  IdentityIndex get_identity_index(const std::string& xml);
+
   std::vector<std::string> get_public_ids(const std::string& user_data);
   void get_default_id(const std::string& user_data,
                       std::string& default_id);
@@ -32,18 +94,66 @@ namespace XmlUtils
   int build_ClearwaterRegData_xml(ImplicitRegistrationSet* irs,
                                   std::string& xml_str,
                                   RegistrationState prev_reg_state);
+  int build_ClearwaterRegData_xml(ImplicitRegistrationSet* irs,
+                                  const ParsedImsSubscription& ims_sub,
+                                  std::string& xml_str,
+                                  RegistrationState prev_reg_state);
   void add_reg_state_node(RegistrationState state,
                           rapidxml::xml_document<> &doc,
                           rapidxml::xml_node<>* root,
                           const char* nodename,
                           std::string& regtype);
-  int add_ims_subscription_node(std::string xml,
-                                rapidxml::xml_document<> &doc,
-                                rapidxml::xml_node<>* root,
-                                rapidxml::xml_document<> &prev_doc);
   void add_charging_addr_node(const ChargingAddresses& charging_addrs,
                               rapidxml::xml_document<> &doc,
                               rapidxml::xml_node<>* root);
+
+  // Bounded cache of rendered ClearwaterRegData XML documents, so that
+  // repeated reads of an unchanged IRS don't have to parse and print its IMS
+  // subscription each time.
+  //
+  // Entries are keyed by the default IMPU, the version of the IRS and the
+  // registration states in the document. Each entry also holds the IMS
+  // subscription and charging addresses it was built from, and is only used
+  // if they still match - the version is only unique within one store, and
+  // may be reused if that store restarts.
+  class ClearwaterRegDataCache
+  {
+  public:
+    ClearwaterRegDataCache(size_t max_entries) : _max_entries(max_entries) {}
+    virtual ~ClearwaterRegDataCache() {}
+
+    // Gets the cached document for this IRS and previous registration state.
+    // Returns false if there isn't one, in which case the caller should build
+    // the document and put it in the cache.
+    bool get(ImplicitRegistrationSet* irs,
+             RegistrationState prev_reg_state,
+             std::string& xml_str);
+
+    // Caches the document built for this IRS and previous registration state.
+    // IRSs without a version are never cached.
+    void put(ImplicitRegistrationSet* irs,
+             RegistrationState prev_reg_state,
+             const std::string& xml_str);
+
+  private:
+    struct Entry
+    {
+      std::string xml;
+      std::string ims_sub_xml;
+      ChargingAddresses charging_addresses;
+      std::list<std::string>::iterator lru_it;
+    };
+
+    static std::string make_key(ImplicitRegistrationSet* irs,
+                                RegistrationState prev_reg_state);
+
+    std::mutex _lock;
+
+    // Most recently used at the front.
+    std::list<std::string> _lru;
+    std::unordered_map<std::string, Entry> _entries;
+    size_t _max_entries;
+  };
 }
 
 #endif
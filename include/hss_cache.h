@@ -43,6 +43,17 @@ public:
                                                                Utils::StopWatch* stopwatch,
                                                                ImplicitRegistrationSet*& result) = 0;
 
+  // Get the IRS for a given impu, but only if that can be done without
+  // blocking (e.g. because it's held in memory). Unlike the other methods,
+  // this can be called on any thread. Returns false if the IRS would have to
+  // be read from the store, in which case get_implicit_registration_set_for_impu
+  // must be used instead.
+  virtual bool try_get_implicit_registration_set_for_impu(const std::string& impu,
+                                                          ImplicitRegistrationSet*& result)
+  {
+    return false;
+  }
+
   // Get the list of IRSs for the given list of impus
   // Used for RTR when we have a list of impus
   virtual Store::Status get_implicit_registration_sets_for_impis(const std::vector<std::string>& impis,
@@ -12,10 +12,15 @@
 #define HSS_CACHE_PROCESSOR_H_
 
 #include "hss_cache.h"
+#include "single_flight.h"
 #include "threadpool.h"
+#include "snmp_event_accumulator_by_scope_table.h"
 #include "ims_subscription.h"
 #include "sas.h"
 
+#include <condition_variable>
+#include <mutex>
+
 typedef std::function<void(Store::Status)> failure_callback;
 typedef std::function<void(ImplicitRegistrationSet*)> irs_success_callback;
 typedef std::function<void(std::vector<ImplicitRegistrationSet*>)> irs_vector_success_callback;
@@ -31,11 +36,28 @@ public:
   // start_threads() must be called to create and start the thread pool.
   HssCacheProcessor(HssCache* cache);
 
-  // Starts the threadpool with the required number of threads
+  // Starts the threadpool with the required number of threads.
+  //
+  // If num_shards is greater than 1, the threads are split as evenly as
+  // possible between that many shards, each with its own queue. max_queue
+  // limits the requests queued across all the shards, rather than each one,
+  // so that a busy shard can use the queue space that idle shards aren't.
+  // Each request goes to the shard picked by hashing its key:
+  // - writes of IRSs use the default IMPU of the (first) IRS
+  // - lookups use the IMPU or IMPI requested (or the first, if several)
+  // - writes of IMS subscriptions use the default IMPU of their first IRS.
+  // A lookup by an associated IMPU or an IMPI can therefore go to a
+  // different shard from writes to the same IRS, so requests for a
+  // subscriber aren't guaranteed to run in order, or on the same threads.
+  //
+  // Every shard reports its queue size to queue_size_table, and, if
+  // shard_queue_size_tables has an entry for it, to that table too.
   bool start_threads(int num_threads,
                      ExceptionHandler* exception_handler,
                      unsigned int max_queue,
-                     SNMP::EventAccumulatorByScopeTable* queue_size_table);
+                     SNMP::EventAccumulatorByScopeTable* queue_size_table,
+                     int num_shards = 1,
+                     const std::vector<SNMP::EventAccumulatorByScopeTable*>& shard_queue_size_tables = {});
 
   // Stops the threadpool
   void stop();
@@ -78,6 +100,11 @@ public:
   // ---------------------------------------------------------------------------
 
   // Get the IRS for a given impu
+  //
+  // If the cache can provide the IRS without blocking, the success callback
+  // is called before this returns, on the calling thread. Otherwise,
+  // concurrent requests for the same impu are coalesced, so that only one of
+  // them reads from the cache. Each request is given its own copy of the IRS.
   virtual void get_implicit_registration_set_for_impu(irs_success_callback success_cb,
                                                       failure_callback failure_cb,
                                                       std::string impu,
@@ -152,8 +179,70 @@ private:
   // The actual HssCache object used to store the data
   HssCache* _cache;
 
-  // The threadpool on which the requests are run.
-  FunctorThreadPool* _thread_pool;
+  // Returns the shard that requests with the given key are run on.
+  size_t shard_for_key(const std::string& key) const;
+
+  // Returns the number of threads to give the given shard, so that the
+  // threads are split between the shards with none left over.
+  static int threads_for_shard(int num_threads, int num_shards, int shard);
+
+  // Adds the work to the thread pool of the shard for the given key. The time
+  // it waits for a thread is recorded against the request's trail. If the
+  // queue shared by the shards is full, this blocks until there's space.
+  void add_work(const std::string& key,
+                SAS::TrailId trail,
+                std::function<void()>& work);
+
+  // The threadpools on which the requests are run - one per shard.
+  std::vector<FunctorThreadPool*> _thread_pools;
+
+  // The limit on requests queued across all the shards, and how many are
+  // queued. Only used when there's more than one shard - a single shard's
+  // thread pool limits its own queue.
+  unsigned int _max_queue;
+  unsigned int _queued;
+  bool _stopping;
+  std::mutex _queue_lock;
+  std::condition_variable _queue_cond;
+
+  // Passes the queue size of a shard to both the table for all the shards
+  // and the shard's own table.
+  class ShardQueueSizeTable : public SNMP::EventAccumulatorByScopeTable
+  {
+  public:
+    ShardQueueSizeTable(SNMP::EventAccumulatorByScopeTable* all_shards_table,
+                        SNMP::EventAccumulatorByScopeTable* shard_table) :
+      _all_shards_table(all_shards_table),
+      _shard_table(shard_table)
+    {
+    }
+
+    virtual ~ShardQueueSizeTable() {};
+
+    virtual void accumulate(uint32_t sample) override
+    {
+      if (_all_shards_table != nullptr)
+      {
+        _all_shards_table->accumulate(sample);
+      }
+
+      _shard_table->accumulate(sample);
+    }
+
+  private:
+    SNMP::EventAccumulatorByScopeTable* _all_shards_table;
+    SNMP::EventAccumulatorByScopeTable* _shard_table;
+  };
+
+  std::vector<ShardQueueSizeTable*> _shard_queue_size_tables;
+
+  // Stops any more requests joining the IRS gets in flight for any of the
+  // IRS's IMPUs, as they might not see a change that's being made to it.
+  void detach_irs(const ImplicitRegistrationSet* irs);
+
+  // The IRS gets in flight, keyed by the impu requested.
+  typedef std::pair<irs_success_callback, failure_callback> irs_callbacks;
+  SingleFlight<std::string, irs_callbacks> _irs_gets;
 };
 
 #endif
@@ -12,6 +12,8 @@
 #ifndef HTTP_HANDLERS_H__
 #define HTTP_HANDLERS_H__
 
+#include <memory>
+
 #include "cx.h"
 #include "diameterstack.h"
 #include "httpstack_utils.h"
@@ -20,7 +22,9 @@
 #include "health_checker.h"
 #include "hss_connection.h"
 #include "hss_cache_processor.h"
+#include "homestead_xml_utils.h"
 #include "implicit_reg_set.h"
+#include "stage_latency.h"
 
 // JSON string constants
 const std::string JSON_DIGEST_HA1 = "digest_ha1";
@@ -44,6 +48,14 @@ const std::string JSON_WILDCARD = "wildcard-identity";
 const std::string AUTH_FIELD_NAME = "resync-auth";
 const std::string SERVER_NAME_FIELD = "server-name";
 
+// HTTP header names used for conditional requests
+const std::string HEADER_ETAG = "ETag";
+const std::string HEADER_IF_NONE_MATCH = "If-None-Match";
+
+#ifndef HTTP_NOT_MODIFIED
+#define HTTP_NOT_MODIFIED 304
+#endif
+
 class HssCacheTask : public HttpStackUtils::Task
 {
 public:
@@ -204,16 +216,22 @@ public:
     Config(bool _hss_configured = true,
            int _hss_reregistration_time = 3600,
            int _record_ttl = 7200,
-           bool _support_shared_ifcs = true) :
+           bool _support_shared_ifcs = true,
+           XmlUtils::ClearwaterRegDataCache* _reg_data_cache = NULL) :
       hss_configured(_hss_configured),
       hss_reregistration_time(_hss_reregistration_time),
       record_ttl(_record_ttl),
-      support_shared_ifcs(_support_shared_ifcs) {}
+      support_shared_ifcs(_support_shared_ifcs),
+      reg_data_cache(_reg_data_cache) {}
 
     bool hss_configured;
     int hss_reregistration_time;
     int record_ttl;
     bool support_shared_ifcs;
+
+    // Cache of rendered ClearwaterRegData documents, or NULL if they
+    // shouldn't be cached.
+    XmlUtils::ClearwaterRegDataCache* reg_data_cache;
   };
 
   ImpuRegDataTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
@@ -261,6 +279,9 @@ protected:
 
   virtual void send_reply();
   void put_in_cache();
+  const XmlUtils::ParsedImsSubscription& parsed_ims_sub();
+  const IdentityIndex& identity_index();
+  static std::string reg_data_etag(const ImplicitRegistrationSet* irs);
   bool is_deregistration_request(RequestType type);
   bool is_auth_failure_request(RequestType type);
   Cx::ServerAssignmentType sar_type_for_request(RequestType type);
@@ -292,6 +313,13 @@ protected:
   // wildcard sent from Sprout.
   std::string _sprout_wildcard;
   std::string _hss_wildcard;
+
+  // Times the SAR currently in flight, if any.
+  std::unique_ptr<StageLatency::Timer> _sar_timer;
+
+  // The IRS's IMS subscription, parsed at most once for each XML the IRS
+  // has over the course of this request. Use parsed_ims_sub() to get it.
+  std::unique_ptr<XmlUtils::ParsedImsSubscription> _parsed_ims_sub;
 };
 
 class ImpuReadRegDataTask : public ImpuRegDataTask
@@ -0,0 +1,104 @@
+/**
+ * @file identity_index.h The identities extracted from an IMS subscription.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IDENTITY_INDEX_H__
+#define IDENTITY_INDEX_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// A compact index of the identities in an IMS subscription. It's extracted
+/// when the subscription is parsed, and stored alongside it, so that anything
+/// that only needs the identities doesn't have to parse the XML again.
+///
+/// An empty index means the identities aren't known (e.g. because the
+/// subscription was stored without them), and must be got by parsing the
+/// XML.
+class IdentityIndex
+{
+public:
+  /// Flags describing each public identity.
+  enum Flags
+  {
+    /// The identity is barred.
+    BARRED = 0x01,
+
+    /// The identity is a wildcard, taken from the PublicIdentity's
+    /// extension rather than its Identity.
+    WILDCARD = 0x02
+  };
+
+  /// A public identity and its flags.
+  struct Identity
+  {
+    Identity(const std::string& uri, uint8_t flags) : uri(uri), flags(flags) {}
+
+    std::string uri;
+    uint8_t flags;
+
+    bool operator==(const Identity& other) const
+    {
+      return (uri == other.uri) && (flags == other.flags);
+    }
+  };
+
+  /// The public identities, in the order they appear in the subscription,
+  /// without duplicates.
+  std::vector<Identity> identities;
+
+  /// The private identity, or an empty string if there isn't one.
+  std::string private_id;
+
+  inline bool empty() const { return identities.empty(); }
+
+  inline void clear()
+  {
+    identities.clear();
+    private_id.clear();
+  }
+
+  /// Gets all the public identities.
+  std::vector<std::string> public_ids() const
+  {
+    std::vector<std::string> ids;
+    ids.reserve(identities.size());
+
+    for (const Identity& identity : identities)
+    {
+      ids.push_back(identity.uri);
+    }
+
+    return ids;
+  }
+
+  /// Gets the default public identity (the first unbarred public identity),
+  /// or an empty string if they're all barred.
+  std::string default_id() const
+  {
+    for (const Identity& identity : identities)
+    {
+      if ((identity.flags & BARRED) == 0)
+      {
+        return identity.uri;
+      }
+    }
+
+    return "";
+  }
+
+  bool operator==(const IdentityIndex& other) const
+  {
+    return (identities == other.identities) && (private_id == other.private_id);
+  }
+};
+
+#endif
@@ -15,8 +15,13 @@
 #include <string>
 #include <vector>
 #include "charging_addresses.h"
+#include "identity_index.h"
 #include "reg_state.h"
 
+namespace XmlUtils
+{
+  class ParsedImsSubscription;
+}
 
 class ImplicitRegistrationSet
 {
@@ -36,15 +41,36 @@ public:
   virtual const std::string& get_ims_sub_xml() const = 0;
   virtual RegistrationState get_reg_state() const = 0;
   virtual std::vector<std::string> get_associated_impis() const = 0;
+
+  // Returns the IMPUs in the IRS other than the default IMPU.
+  virtual std::vector<std::string> get_associated_impus() const = 0;
+
   virtual const ChargingAddresses& get_charging_addresses() const = 0;
   virtual int32_t get_ttl() const = 0;
 
+  // Returns the identities in the IMS subscription, if they're known without
+  // parsing it. If the returned index is empty, they must be got from the
+  // XML instead.
+  virtual const IdentityIndex& get_identity_index() const = 0;
+
+  // Returns a version number for the contents of this IRS, which differs
+  // whenever they do, or 0 if there isn't one (e.g. because the IRS has been
+  // modified since it was read).
+  virtual uint64_t get_version() const = 0;
+
   virtual void set_ims_sub_xml(const std::string& xml) = 0;
+
+  // As above, for XML that the caller has already parsed, so that the IRS
+  // doesn't need to parse it again.
+  virtual void set_ims_sub_xml(const XmlUtils::ParsedImsSubscription& ims_sub) = 0;
   virtual void set_reg_state(RegistrationState state) = 0;
   virtual void add_associated_impi(const std::string& impi) = 0;
   virtual void delete_associated_impi(const std::string& impi) = 0;
   virtual void set_charging_addresses(const ChargingAddresses& addresses) = 0;
   virtual void set_ttl(int32_t ttl) = 0;
+
+  // Returns a copy of this IRS, which the caller owns.
+  virtual ImplicitRegistrationSet* clone() const = 0;
 };
 
 #endif
@@ -0,0 +1,97 @@
+/**
+ * @file impu_dictionary.h Training and loading of IMPU compression
+ * dictionaries
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IMPU_DICTIONARY_H_
+#define IMPU_DICTIONARY_H_
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Builds an LZ4 dictionary from the IMPU records a deployment actually
+// stores, so that the operator-specific parts of its service profiles (AS
+// URIs, trigger points, SIP headers, etc.) compress well.
+//
+// The trainer is given samples of the JSON for IMPUs as they're written.
+// Once it has enough, it trains a dictionary from them and writes it to a
+// file, which can then be loaded on every node with load_impu_dictionaries.
+class ImpuDictionaryTrainer
+{
+public:
+  // Creates a trainer that collects num_samples samples (or as many as fit
+  // in MAX_SAMPLE_BYTES), and then writes a dictionary of at most max_size
+  // bytes to output_file.
+  ImpuDictionaryTrainer(const std::string& output_file,
+                        size_t num_samples,
+                        size_t max_size);
+
+  // Waits for any training in progress to finish.
+  virtual ~ImpuDictionaryTrainer();
+
+  // Whether the trainer still needs samples. This is cheap, so callers
+  // should check it before building a sample.
+  bool wants_samples() const { return !_done; }
+
+  // Adds a sample for the given key. Only the first sample for each key is
+  // used, so that frequently written records don't skew the dictionary.
+  // Once the last sample needed is added, the dictionary is trained and
+  // written on a background thread, so this never blocks the caller for
+  // longer than it takes to copy the sample.
+  void add_sample(const std::string& key, const std::string& sample);
+
+  // Waits for the dictionary to be trained and written, if training has
+  // started.
+  void wait_for_training();
+
+  // Trains a dictionary of at most max_size bytes from the samples.
+  //
+  // This looks for the byte strings that occur in the most samples, and
+  // fills the dictionary with those that will save the most (the number of
+  // samples they occur in times their length), with the most valuable at the
+  // end, where LZ4 can find them most cheaply.
+  static std::string train(const std::vector<std::string>& samples,
+                           size_t max_size);
+
+  // The most sample data the trainer holds at once, to bound the memory
+  // used by training.
+  static const size_t MAX_SAMPLE_BYTES = 8 * 1024 * 1024;
+
+private:
+  // Trains a dictionary from the samples and writes it to the output file.
+  // Run on _training_thread.
+  void train_and_write(std::vector<std::string> samples, size_t sample_bytes);
+
+  bool write_dictionary(const std::string& dictionary);
+
+  const std::string _output_file;
+  const size_t _num_samples;
+  const size_t _max_size;
+
+  std::mutex _lock;
+  std::set<std::string> _sampled_keys;
+  std::vector<std::string> _samples;
+  size_t _sample_bytes;
+  std::atomic<bool> _done;
+  std::thread _training_thread;
+};
+
+// Loads the trained dictionaries from the given directory. Each dictionary is
+// in a file called <id>.dict, where id is between 1 and
+// ImpuStore::Impu::MAX_DICTIONARY_ID. Other files are ignored.
+//
+// Returns the number of dictionaries loaded.
+int load_impu_dictionaries(const std::string& directory);
+
+#endif
@@ -12,10 +12,17 @@
 #define IMPU_STORE_H_
 
 #include "charging_addresses.h"
+#include "identity_index.h"
 #include "reg_state.h"
+#include "stage_latency.h"
 #include "store.h"
 
 #include <algorithm>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 #include <lz4.h>
@@ -40,17 +47,80 @@ void encode_varbyte(uint64_t uncomp_size_len, std::string& data);
  */
 uint64_t decode_varbyte(const std::string& data, size_t& offset);
 
+class ImpuDictionaryTrainer;
+
 class ImpuStore
 {
 public:
+  // The on-wire formats for IMPUs, identified by the version byte at the start
+  // of each record. Every format can be read, but IMPUs are only written in
+  // the format the ImpuStore is configured with, so that a newer format can
+  // be turned on once every node that reads the store understands it.
+  enum DataVersion
+  {
+    // LZ4 compressed JSON
+    DATA_VERSION_JSON_LZ4 = 0,
+
+    // Length-prefixed binary fields, with the service profile stored as an
+    // opaque blob
+    DATA_VERSION_BINARY = 1,
+
+    // LZ4 compressed JSON, as for version 0, but compressed using a trained
+    // dictionary (see add_dictionary), identified by the byte after the
+    // version
+    DATA_VERSION_TRAINED_LZ4 = 2
+  };
+
   class Impu
   {
+  public:
+    // Trained dictionaries have IDs from 1 to MAX_DICTIONARY_ID, and are at
+    // most MAX_DICTIONARY_SIZE bytes (as LZ4 ignores anything more).
+    static const int MAX_DICTIONARY_ID = 255;
+    static const size_t MAX_DICTIONARY_SIZE = 65536;
+
   private:
-    static thread_local LZ4_stream_t* _thrd_lz4_stream;
-    static thread_local struct preserved_hash_table_entry_t* _thrd_lz4_hash;
+    // A stream with a dictionary loaded into it, preserved so that it can be
+    // copied into a working stream cheaply.
+    struct DictionaryStream
+    {
+      LZ4_stream_t* stream;
+      struct preserved_hash_table_entry_t* hash;
+    };
+
+    // The dictionary streams for each dictionary the thread has compressed
+    // data with.
+    static thread_local std::map<const std::string*, DictionaryStream> _thrd_lz4_dict_streams;
+
+    // The stream and output buffer used to compress data on a thread, so
+    // that they're only allocated once. The buffer is grown to the largest
+    // size needed by any record.
+    static thread_local LZ4_stream_t* _thrd_lz4_work_stream;
+    static thread_local std::vector<char> _thrd_comp_buffer;
+
+    // Buffers reused by every decode on a thread, so that decoding a record
+    // doesn't have to allocate memory for the decompressed JSON or, unless
+    // the record is unusually large, for the JSON DOM.
+    // The pool is declared as 64-bit words so that it's suitably aligned.
+    static const size_t JSON_POOL_SIZE = 16384;
+    static thread_local std::vector<char> _thrd_decomp_buffer;
+    static thread_local uint64_t _thrd_json_pool[JSON_POOL_SIZE / sizeof(uint64_t)];
 
     const static std::string _dict_v0;
 
+    // The trained dictionaries, indexed by ID. A dictionary is empty if none
+    // has been loaded with its ID.
+    static std::string _trained_dicts[MAX_DICTIONARY_ID + 1];
+
+    // Decompresses and decodes LZ4 compressed JSON, stored as [length]
+    // [compressed JSON] starting at offset in data.
+    static Impu* from_compressed_json(const std::string& impu,
+                                      const std::string& data,
+                                      size_t offset,
+                                      const std::string& dictionary,
+                                      uint64_t cas,
+                                      ImpuStore* store);
+
   protected:
     Impu(const std::string impu,
          uint64_t cas,
@@ -69,12 +139,59 @@ public:
 
     virtual bool is_default_impu() = 0;
 
-    virtual Store::Status to_data(std::string& data);
-
+    // Returns a heap-allocated copy of this IMPU, owned by the caller.
+    virtual Impu* clone() const = 0;
+
+    // Encodes the IMPU in the given on-wire format (see DataVersion). For
+    // DATA_VERSION_TRAINED_LZ4, dictionary_id is the trained dictionary to
+    // use - if it hasn't been loaded, version 0 is used instead.
+    virtual Store::Status to_data(std::string& data,
+                                  int version = DATA_VERSION_JSON_LZ4,
+                                  int dictionary_id = 0);
+
+    // Gets the JSON representing the IMPU.
+    std::string to_json();
+
+    // Loads a trained dictionary with the given ID. This must be done before
+    // any IMPUs are encoded or decoded, and each ID can only be loaded once.
+    // Returns false if the ID or dictionary isn't valid.
+    static bool add_dictionary(int id, const std::string& dictionary);
+
+    // Whether a trained dictionary has been loaded with the given ID.
+    static bool has_dictionary(int id);
+
+    // Compresses the data against the given dictionary, which must not
+    // change while any thread may be using it. On success, sets comp_size to
+    // the compressed size and buffer to the compressed data, which belongs
+    // to the calling thread and is only valid until the thread next
+    // compresses some data. On failure, comp_size is not greater than 0.
+    static void compress_data(const std::string& data,
+                              const std::string& dictionary,
+                              const char*& buffer,
+                              int& comp_size);
+
+    // Compresses the data against the version 0 dictionary, as for
+    // compress_data.
     static void compress_data_v0(const std::string& data,
-                                 char*& buffer,
+                                 const char*& buffer,
                                  int& comp_size);
 
+    // Decompresses data stored as [length][LZ4 compressed data] starting at
+    // offset in data, using the given dictionary. On success, returns the
+    // decompressed data, null terminated, which belongs to the calling
+    // thread and is only valid until the thread next decompresses some data,
+    // and sets length to its length. On failure, returns nullptr.
+    static char* decompress_data(const std::string& data,
+                                 size_t offset,
+                                 const std::string& dictionary,
+                                 int& length);
+
+    // Decompresses data against the version 0 dictionary, as for
+    // decompress_data.
+    static char* decompress_data_v0(const std::string& data,
+                                    size_t offset,
+                                    int& length);
+
     static Impu* from_data(const std::string& impu,
                            std::string& data,
                            uint64_t cas,
@@ -82,6 +199,8 @@ public:
 
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) = 0;
 
+    virtual void write_binary(std::string& data) = 0;
+
     const std::string impu;
     const uint64_t cas;
     const int64_t expiry;
@@ -109,8 +228,22 @@ public:
     {
     }
 
+    // Creates a default IMPU with no associated IMPUs, IMPIs, charging
+    // addresses or service profile, for the decoders to fill in.
+    DefaultImpu(const std::string& impu,
+                RegistrationState registration_state,
+                uint64_t cas,
+                int64_t expiry,
+                const ImpuStore* store) :
+      Impu(impu, cas, expiry, store),
+      registration_state(registration_state)
+    {
+    }
+
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer);
 
+    virtual void write_binary(std::string& data);
+
     virtual ~DefaultImpu(){}
 
     static Impu* from_json(const std::string& impu,
@@ -118,6 +251,14 @@ public:
                            uint64_t cas,
                            ImpuStore* store);
 
+    // Decodes the fields of a binary record that follow the IMPU type, which
+    // start at offset in data. Returns nullptr if the record is invalid.
+    static Impu* from_binary(const std::string& impu,
+                             const std::string& data,
+                             size_t offset,
+                             uint64_t cas,
+                             ImpuStore* store);
+
     bool has_associated_impu(const std::string& impu)
     {
       return std::find(associated_impus.begin(),
@@ -127,11 +268,29 @@ public:
 
     virtual bool is_default_impu(){ return true; }
 
+    virtual Impu* clone() const { return new DefaultImpu(*this); }
+
     RegistrationState registration_state;
     ChargingAddresses charging_addresses;
     std::vector<std::string> associated_impus;
     std::vector<std::string> impis;
     std::string service_profile;
+
+    // If set, the service profile is encoded as a reference to the copy
+    // stored under this hash, shared between every IMPU with the same
+    // service profile, rather than inline. The ImpuStore sets this when
+    // writing the IMPU, and fills in the service profile from it when
+    // reading the IMPU.
+    std::string service_profile_hash;
+
+    // The identities in the service profile, if they're known. They're only
+    // stored if the ImpuStore is configured to store them - otherwise the
+    // ImpuStore clears this when writing the IMPU.
+    IdentityIndex identity_index;
+
+    // Set on an IMPU got by get_impu_for_update whose shared service profile
+    // wasn't found. Its service profile is empty.
+    bool service_profile_missing = false;
   };
 
   class AssociatedImpu : public Impu
@@ -151,14 +310,24 @@ public:
 
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer);
 
+    virtual void write_binary(std::string& data);
+
     virtual bool is_default_impu(){ return false; }
 
+    virtual Impu* clone() const { return new AssociatedImpu(*this); }
+
     const std::string default_impu;
 
     static Impu* from_json(const std::string& impu,
                            rapidjson::Value& json,
                            uint64_t cas,
                            ImpuStore* store);
+
+    static Impu* from_binary(const std::string& impu,
+                             const std::string& data,
+                             size_t offset,
+                             uint64_t cas,
+                             ImpuStore* store);
   };
 
   class ImpiMapping
@@ -246,11 +415,173 @@ public:
     std::vector<std::string> _default_impus;
   };
 
-  virtual ~ImpuStore() {};
+  // Bounded in-memory cache of decoded IMPUs, so that repeated reads of the
+  // same IMPU don't have to go to the store and decode the record again.
+  //
+  // The cache is split into shards, each with its own lock and LRU list, to
+  // keep contention between cache threads low. An entry is served until the
+  // record it was read from expires or until it has been in the cache for
+  // max_age_ms, whichever is sooner. Only writes made through this node
+  // invalidate entries, so changes made by other nodes aren't seen until the
+  // entry ages out - the cache is only safe to turn on with a single homestead
+  // node per site. Entries carry the CAS they were read with, so a stale entry
+  // used for an update only ever causes the CAS write to fail with
+  // DATA_CONTENTION, at which point the entry is invalidated.
+  //
+  // Each IMPU has a generation, which invalidating it bumps. A reader gets
+  // the generation before reading the IMPU from the store, and the IMPU is
+  // only cached if it hasn't been invalidated since, so that a read that
+  // races with a write can't put the overwritten IMPU back in the cache.
+  class LocalCache
+  {
+  public:
+    LocalCache(size_t max_entries, int max_age_ms);
+    virtual ~LocalCache();
+
+    // Returns a copy of the cached IMPU, owned by the caller, or nullptr if
+    // there's no valid entry for this IMPU.
+    Impu* get(const std::string& impu);
+
+    // Returns the current generation of this IMPU, to pass to put when
+    // caching a copy of it read from the store after this call.
+    uint64_t generation(const std::string& impu);
+
+    // Caches a copy of the IMPU, replacing any existing entry, unless the
+    // IMPU has been invalidated since the given generation.
+    void put(const Impu* impu, uint64_t generation);
+
+    // Removes any entry for this IMPU, and bumps its generation.
+    void invalidate(const std::string& impu);
+
+  private:
+    static const int NUM_SHARDS = 16;
+
+    // Generations are kept for a fixed number of slots per shard, rather than
+    // per IMPU, so that they don't use unbounded memory. IMPUs that share a
+    // slot just invalidate each other's concurrent reads.
+    static const int GENERATIONS_PER_SHARD = 64;
+
+    struct Entry
+    {
+      Impu* impu;
+      uint64_t inserted_ms;
+      std::list<std::string>::iterator lru_it;
+    };
+
+    struct Shard
+    {
+      std::mutex lock;
+
+      // Most recently used at the front.
+      std::list<std::string> lru;
+      std::unordered_map<std::string, Entry> entries;
+
+      uint64_t generations[GENERATIONS_PER_SHARD] = {};
+    };
+
+    Shard& get_shard(const std::string& impu, uint64_t*& generation);
+    static void remove_entry(Shard& shard,
+                             std::unordered_map<std::string, Entry>::iterator it);
+    static uint64_t now_ms();
+
+    Shard _shards[NUM_SHARDS];
+    size_t _max_entries_per_shard;
+    int _max_age_ms;
+  };
+
+  // Bounded in-memory cache of shared service profiles, keyed by their hash.
+  // As a hash always refers to the same service profile, entries never go
+  // stale, and are only evicted to make room for others.
+  class ServiceProfileCache
+  {
+  public:
+    ServiceProfileCache(size_t max_entries) : _max_entries(max_entries) {}
+    virtual ~ServiceProfileCache() {}
+
+    // Gets the service profile with the given hash. Returns false if it
+    // isn't cached.
+    bool get(const std::string& hash, std::string& profile);
+
+    // Gets the latest expiry that this node has seen the given service
+    // profile stored with, when writing or reading it. Returns false if it
+    // isn't cached.
+    bool get_stored_expiry(const std::string& hash,
+                           const std::string& profile,
+                           int64_t& stored_expiry);
+
+    // Caches the service profile, keeping the latest stored expiry if it's
+    // already cached.
+    void put(const std::string& hash,
+             const std::string& profile,
+             int64_t stored_expiry);
+
+  private:
+    struct Entry
+    {
+      std::string profile;
+      int64_t stored_expiry;
+      std::list<std::string>::iterator lru_it;
+    };
+
+    std::mutex _lock;
 
-  ImpuStore(Store* store) : _store(store)
+    // Most recently used at the front.
+    std::list<std::string> _lru;
+    std::unordered_map<std::string, Entry> _entries;
+    size_t _max_entries;
+  };
+
+  // Gets the hash that identifies a service profile in the store.
+  static std::string hash_service_profile(const std::string& profile);
+
+  virtual ~ImpuStore()
   {
+    delete _cache;
+    delete _profile_cache;
+  };
 
+  // Creates an ImpuStore backed by the given store. If cache_size and
+  // cache_max_age_ms are both non-zero, decoded IMPUs are also cached locally.
+  // IMPUs are written in the given DataVersion, using the trained dictionary
+  // with the given ID for DATA_VERSION_TRAINED_LZ4.
+  //
+  // If share_service_profiles is set, each distinct service profile is
+  // stored once, and default IMPUs refer to it by its hash. Service profiles
+  // shared by other nodes are read whether or not it's set. If
+  // service_profile_cache_size is non-zero, up to that many shared service
+  // profiles are cached locally.
+  //
+  // If store_identity_index is set, default IMPUs are stored with an index
+  // of the identities in their service profile, so that readers don't need
+  // to parse it. Indexes stored by other nodes are read whether or not it's
+  // set.
+  ImpuStore(Store* store,
+            size_t cache_size = 0,
+            int cache_max_age_ms = 0,
+            int data_version = DATA_VERSION_JSON_LZ4,
+            int dictionary_id = 0,
+            bool share_service_profiles = false,
+            size_t service_profile_cache_size = 0,
+            bool store_identity_index = false) :
+    _store(store),
+    _cache(nullptr),
+    _data_version(data_version),
+    _dictionary_id(dictionary_id),
+    _dictionary_trainer(nullptr),
+    _share_service_profiles(share_service_profiles),
+    _profile_cache(nullptr),
+    _store_identity_index(store_identity_index),
+    _io_stage(StageLatency::NONE)
+  {
+    if ((cache_size > 0) && (cache_max_age_ms > 0))
+    {
+      _cache = new LocalCache(cache_size, cache_max_age_ms);
+    }
+
+    if (service_profile_cache_size > 0)
+    {
+      _profile_cache = new ServiceProfileCache(service_profile_cache_size);
+    }
   }
 
   // Sets the IMPU in the store without checking the CAS value, overwriting any
@@ -264,10 +595,35 @@ public:
   // Sets the IMPU using CAS
   virtual Store::Status set_impu(Impu* impu, SAS::TrailId trail);
 
+  // Fails with ERROR if the IMPU is a default IMPU whose shared service
+  // profile has gone (e.g. because the store has evicted it), as the IMPU
+  // still exists but can't be read.
   virtual Store::Status get_impu(const std::string& impu,
                                  Impu*& out_impu,
                                  SAS::TrailId trail);
 
+  // Gets the IMPU in order to write over it. This is the same as get_impu,
+  // except that a default IMPU whose shared service profile has gone is
+  // returned with service_profile_missing set, so that the caller has its
+  // CAS.
+  virtual Store::Status get_impu_for_update(const std::string& impu,
+                                            Impu*& out_impu,
+                                            SAS::TrailId trail);
+
+  // Gets the IMPU from the local cache only, so never blocks on the store.
+  // Returns a copy owned by the caller, or nullptr if the IMPU isn't cached
+  // (or there's no local cache).
+  virtual Impu* get_cached_impu(const std::string& impu);
+
+  // Gets all of the given IMPUs as a single batch.
+  // Returns OK if the lookup succeeded, even if some (or all) of the IMPUs
+  // weren't found, and adds an entry to out_impus for each IMPU that was
+  // found. If any lookup fails with an error, returns that error and leaves
+  // out_impus unchanged.
+  virtual Store::Status get_impus(const std::vector<std::string>& impus,
+                                  std::vector<Impu*>& out_impus,
+                                  SAS::TrailId trail);
+
   virtual Store::Status delete_impu(Impu* impu, SAS::TrailId trail);
 
   virtual Store::Status set_impi_mapping(ImpiMapping* mapping, SAS::TrailId trail);
@@ -279,8 +635,65 @@ public:
 
   virtual Store::Status delete_impi_mapping(ImpiMapping* mapping, SAS::TrailId trail);
 
+  // Passes the JSON for each IMPU written to the store to the trainer, until
+  // it has all the samples it needs. The trainer isn't owned by the store.
+  void set_dictionary_trainer(ImpuDictionaryTrainer* trainer)
+  {
+    _dictionary_trainer = trainer;
+  }
+
+  // Sets the stage that the time spent reading from and writing to the
+  // underlying store is recorded against (e.g. to distinguish local and
+  // remote stores). By default it isn't recorded.
+  void set_io_stage(StageLatency::Stage stage)
+  {
+    _io_stage = stage;
+  }
+
 private:
+  // Implements get_impu and get_impu_for_update.
+  Store::Status read_impu(const std::string& impu,
+                          Impu*& out_impu,
+                          SAS::TrailId trail,
+                          bool for_update);
+
+  // Encodes the IMPU for writing to the store, sharing its service profile
+  // if configured to.
+  Store::Status encode_impu(Impu* impu, std::string& data, SAS::TrailId trail);
+
+  void sample_for_dictionary(Impu* impu);
+
+  // Stores the IMPU's service profile to be shared, unless it's already
+  // stored to last at least as long as the IMPU. The stored copy's expiry is
+  // only ever extended, as IMPUs written by other nodes may refer to it.
+  // Returns the hash it's stored under, or an empty string if it couldn't be
+  // shared and should be written inline.
+  std::string share_service_profile(DefaultImpu* impu, SAS::TrailId trail);
+
+  // Fills in the service profile of an IMPU that refers to a shared one.
+  // Returns NOT_FOUND if the shared service profile doesn't exist.
+  Store::Status resolve_service_profile(DefaultImpu* impu, SAS::TrailId trail);
+
+  // Shared service profiles are stored as [version][expiry][length][LZ4
+  // compressed XML], where the expiry is 8 bytes, most significant first.
+  static bool encode_service_profile(const std::string& profile,
+                                     int64_t expiry,
+                                     std::string& data);
+  static bool decode_service_profile(const std::string& data,
+                                     std::string& profile,
+                                     int64_t& expiry);
+
+  void invalidate_cached_impu(const std::string& impu);
+
   Store* _store;
+  LocalCache* _cache;
+  int _data_version;
+  int _dictionary_id;
+  ImpuDictionaryTrainer* _dictionary_trainer;
+  bool _share_service_profiles;
+  ServiceProfileCache* _profile_cache;
+  bool _store_identity_index;
+  StageLatency::Stage _io_stage;
 };
 
 #endif
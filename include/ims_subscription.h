@@ -24,6 +24,10 @@ public:
   virtual void set_charging_addrs(const ChargingAddresses& new_addresses) = 0;
 
   virtual ImplicitRegistrationSet* get_irs_for_default_impu(const std::string& impu) = 0;
+
+  // Returns all the IRSs in the subscription. The subscription still owns
+  // them.
+  virtual std::vector<ImplicitRegistrationSet*> get_irss() = 0;
 };
 
 #endif
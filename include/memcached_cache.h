@@ -16,9 +16,17 @@
 #include "hss_cache.h"
 #include "impu_store.h"
 #include "threadpool.h"
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
+#include "snmp_event_accumulator_by_scope_table.h"
 
+#include <deque>
+#include <functional>
+#include <list>
 #include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class MemcachedImplicitRegistrationSet : public ImplicitRegistrationSet
@@ -39,6 +47,7 @@ public:
     _existing(true),
     _ims_sub_xml(default_impu->service_profile),
     _ims_sub_xml_set(false),
+    _identity_index(default_impu->identity_index),
     _charging_addresses(default_impu->charging_addresses),
     _charging_addresses_set(false),
     _registration_state(default_impu->registration_state),
@@ -118,7 +127,20 @@ public:
     return _ttl;
   }
 
+  virtual const IdentityIndex& get_identity_index() const override
+  {
+    return _identity_index;
+  }
+
+  // The CAS this IRS was read with identifies its contents, as long as it
+  // hasn't been changed since.
+  virtual uint64_t get_version() const override
+  {
+    return ((_existing) && (!has_changed())) ? _cas : 0;
+  }
+
   virtual void set_ims_sub_xml(const std::string& xml) override;
+  virtual void set_ims_sub_xml(const XmlUtils::ParsedImsSubscription& ims_sub) override;
 
   virtual void set_reg_state(RegistrationState state) override
   {
@@ -141,6 +163,11 @@ public:
     _ttl = ttl;
   }
 
+  virtual ImplicitRegistrationSet* clone() const override
+  {
+    return new MemcachedImplicitRegistrationSet(*this);
+  }
+
   // Functions for MemcachedCache
 
   bool is_existing() const { return _existing; }
@@ -169,7 +196,7 @@ public:
 
   void mark_as_refreshed(){ _refreshed = true; }
 
-  std::vector<std::string> get_associated_impus() const
+  virtual std::vector<std::string> get_associated_impus() const override
   {
     std::vector<std::string> impus;
 
@@ -204,6 +231,11 @@ public:
   // Delete all of the IMPIs
   void delete_impis();
 
+  // Fold any changes from an older copy of this IRS into this one, so that
+  // writing this IRS to a store also makes the changes the older copy would
+  // have made.
+  void coalesce(const MemcachedImplicitRegistrationSet& older);
+
   // Enumerate the different states a piece of data (an IMPU or IMPI)
   // can be in.
   enum State
@@ -252,6 +284,9 @@ private:
   std::string _ims_sub_xml;
   bool _ims_sub_xml_set;
 
+  // Kept in step with _ims_sub_xml.
+  IdentityIndex _identity_index;
+
   ChargingAddresses _charging_addresses;
   bool _charging_addresses_set;
 
@@ -261,6 +296,10 @@ private:
   ImpuStore::DefaultImpu* create_impu(uint64_t cas,
                                       const ImpuStore* store);
 
+  // Sets the IMS subscription, given the identities in it.
+  void set_ims_sub_xml(const std::string& xml,
+                       const IdentityIndex& identity_index);
+
   static bool has_changed_data(const Data& data)
   {
     for (Data::value_type pair : data)
@@ -291,26 +330,117 @@ public:
 class MemcachedCache : public BaseHssCache
 {
 public:
+  // Bounded in-memory cache of the identities (IMPUs and IMPIs) that recent
+  // lookups didn't find in any store, so that repeated lookups of unknown
+  // identities (e.g. from scanners or misconfigured UEs) don't each read from
+  // every remote store.
+  //
+  // An entry is only added if every store answered the lookup, and is kept
+  // for ttl_ms, after which the identity is looked up in full again.
+  // Writing an identity removes its entry, and stops any lookup of it that
+  // is already in progress from adding one.
+  class NegativeCache
+  {
+  public:
+    NegativeCache(size_t max_entries,
+                  int ttl_ms,
+                  SNMP::CounterTable* hits_table = nullptr,
+                  SNMP::CounterTable* misses_table = nullptr);
+    virtual ~NegativeCache() {}
+
+    // Returns true if a recent lookup of the key found nothing, in which
+    // case the caller doesn't need to look it up. Otherwise, the caller must
+    // look the key up and then call end_lookup with the returned token.
+    bool start_lookup(const std::string& key, uint64_t& token);
+
+    // Records the result of a lookup started with start_lookup.
+    void end_lookup(const std::string& key, uint64_t token, bool found);
+
+    // Removes any entry for the key, as it's being written.
+    void invalidate(const std::string& key);
+
+  private:
+    struct Entry
+    {
+      uint64_t expiry_ms;
+      std::list<std::string>::iterator lru_it;
+    };
+
+    // The lookups of a key that are in progress, and the number of times
+    // the key has been invalidated while they were.
+    struct Lookups
+    {
+      int count;
+      uint64_t invalidations;
+    };
+
+    void remove_entry(std::unordered_map<std::string, Entry>::iterator it);
+    static uint64_t now_ms();
+
+    std::mutex _lock;
+
+    // Most recently added at the front.
+    std::list<std::string> _lru;
+    std::unordered_map<std::string, Entry> _entries;
+    std::unordered_map<std::string, Lookups> _lookups;
+
+    size_t _max_entries;
+    int _ttl_ms;
+    SNMP::CounterTable* _hits_table;
+    SNMP::CounterTable* _misses_table;
+  };
+
+  // If remote_read_timeout_ms is non-zero, reads from the remote stores that
+  // take longer than this are treated as having failed.
+  //
+  // If replication_threads is non-zero, writes to the remote stores are
+  // queued and made by a pool of that many threads once the write to the
+  // local store has succeeded, rather than by the calling thread. At most
+  // max_replication_queue default IMPUs can have writes queued at once (0
+  // means no limit) - once this is reached, writes for other default IMPUs
+  // are made by the calling thread.
+  //
+  // If negative_cache_ttl_ms and negative_cache_size are both non-zero, up to
+  // negative_cache_size IMPUs and IMPIs that weren't found in any store are
+  // remembered for negative_cache_ttl_ms, and aren't looked up in the remote
+  // stores again until then.
+  //
+  // If lazy_refresh_s is non-zero, refreshing an IRS only rewrites the
+  // records for its unchanged associated IMPUs and IMPIs if they would
+  // otherwise expire before the IRS. These records are written to last
+  // lazy_refresh_s longer than the IRS, so they're only rewritten about once
+  // every lazy_refresh_s, however often the IRS is refreshed.
+  //
+  // Writes to the local store for the same IRS are always made one at a
+  // time. The number of writes that had to wait for another write to the
+  // same IRS is counted in serialized_writes_table, and the number of CAS
+  // writes that still hit contention (e.g. with another node) and had to be
+  // retried is counted in contention_retries_table.
+  //
+  // If local_write_threads is non-zero, the reads and writes to the local
+  // store that a write needs for several IMPIs or associated IMPUs are made
+  // in parallel on a pool of that many threads. This pool is separate from
+  // the one used for the remote stores, so slow remote stores can't hold up
+  // local writes. Otherwise they're made one at a time by the calling thread.
   MemcachedCache(ImpuStore* local_store,
                  const std::vector<ImpuStore*>& remote_stores,
                  int num_threads,
-                 ExceptionHandler* exception_handler) :
-    BaseHssCache(),
-    _local_store(local_store),
-    _remote_stores(remote_stores),
-    _thread_pool(num_threads,
-                 exception_handler,
-                 exception_callback,
-                 0)
-  {
-    _thread_pool.start();
-  }
-
-  virtual ~MemcachedCache()
-  {
-    _thread_pool.stop();
-    _thread_pool.join();
-  }
+                 ExceptionHandler* exception_handler,
+                 int remote_read_timeout_ms = 0,
+                 int replication_threads = 0,
+                 unsigned int max_replication_queue = 0,
+                 SNMP::EventAccumulatorByScopeTable* replication_queue_size_table = nullptr,
+                 SNMP::EventAccumulatorTable* replication_lag_table = nullptr,
+                 size_t negative_cache_size = 0,
+                 int negative_cache_ttl_ms = 0,
+                 SNMP::CounterTable* negative_cache_hits_table = nullptr,
+                 SNMP::CounterTable* negative_cache_misses_table = nullptr,
+                 int lazy_refresh_s = 0,
+                 SNMP::CounterTable* serialized_writes_table = nullptr,
+                 SNMP::CounterTable* contention_retries_table = nullptr,
+                 int local_write_threads = 0);
+
+  virtual ~MemcachedCache();
 
   // Dummy exception handler callback for the thread pool
   static void inline exception_callback(std::function<void()> callable)
@@ -329,6 +459,19 @@ public:
                                                                Utils::StopWatch* stopwatch,
                                                                ImplicitRegistrationSet*& result) override;
 
+  // Get the IRS for a given IMPU if it's in the local store's cache. The
+  // remote stores are never consulted, as they're only used when the IMPU
+  // isn't in the local store.
+  virtual bool try_get_implicit_registration_set_for_impu(const std::string& impu,
+                                                          ImplicitRegistrationSet*& result) override;
+
+  // Get the list of IRSs for the given list of IMPUs, looking all of the
+  // IMPUs up in each store as a single batch
+  virtual Store::Status get_implicit_registration_sets_for_impus(const std::vector<std::string>& impus,
+                                                                 SAS::TrailId trail,
+                                                                 Utils::StopWatch* stopwatch,
+                                                                 std::vector<ImplicitRegistrationSet*>& result) override;
+
   // Save the IRS in the cache
   // Must include updating the impi mapping table if impis have been added
   virtual Store::Status put_implicit_registration_set(ImplicitRegistrationSet* irs,
@@ -372,7 +515,91 @@ protected:
 private:
   ImpuStore* _local_store;
   std::vector<ImpuStore*> _remote_stores;
+  int _remote_read_timeout_ms;
   FunctorThreadPool _thread_pool;
+  int _num_threads;
+
+  // The number of reads running or queued on the thread pool for each remote
+  // store, and the most each may have. Reads that time out carry on in the
+  // background, so without a limit a remote site that stops responding
+  // would soon tie up every thread in the pool.
+  std::mutex _remote_reads_lock;
+  std::vector<int> _remote_reads_in_flight;
+  int _max_remote_reads;
+
+  // The pool on which the reads and writes to the local store for a single
+  // write are run in parallel, or null if they're run by the calling thread.
+  FunctorThreadPool* _local_write_pool;
+
+  // Remote replication
+
+  enum ReplicationType
+  {
+    REPLICATE_PUT,
+    REPLICATE_DELETE
+  };
+
+  // A write of an IRS to the remote stores that is waiting to be made.
+  struct ReplicationRequest
+  {
+    ReplicationRequest(ReplicationType type,
+                       MemcachedImplicitRegistrationSet* irs,
+                       SAS::TrailId trail) :
+      type(type),
+      irs(irs),
+      trail(trail)
+    {
+      queued.start();
+    }
+
+    ~ReplicationRequest()
+    {
+      delete irs; irs = nullptr;
+    }
+
+    ReplicationType type;
+    MemcachedImplicitRegistrationSet* irs;
+    SAS::TrailId trail;
+
+    // Times how long the request has been waiting, for the replication lag
+    // statistic.
+    Utils::StopWatch queued;
+  };
+
+  FunctorThreadPool* _replication_pool;
+  unsigned int _max_replication_queue;
+  SNMP::EventAccumulatorTable* _replication_lag_table;
+
+  // The replication requests that haven't been started yet, keyed by default
+  // IMPU. A default IMPU has an entry for as long as a replication thread is
+  // working through its requests, so that writes for the same IRS are always
+  // made to the remote stores one at a time and in order.
+  std::map<std::string, std::deque<ReplicationRequest*>> _replication_queues;
+  std::mutex _replication_lock;
+
+  // Identities recently not found in any store, or nullptr if the negative
+  // cache is disabled.
+  NegativeCache* _negative_cache;
+
+  // How much longer than the IRS the records for its associated IMPUs and
+  // IMPIs last, or 0 if these are rewritten on every refresh.
+  int _lazy_refresh_s;
+
+  // Locks that serialize writes for the same IRS, so that concurrent writes
+  // from this node don't make each other's CAS fail. They're striped by
+  // default IMPU to bound memory.
+  static const int NUM_WRITE_LOCKS = 256;
+  std::mutex _write_locks[NUM_WRITE_LOCKS];
+
+  SNMP::CounterTable* _serialized_writes_table;
+  SNMP::CounterTable* _contention_retries_table;
+
+  // Takes the write locks for the IRSs. They're taken in a fixed order, so
+  // that writes for overlapping sets of IRSs can't deadlock.
+  std::vector<std::unique_lock<std::mutex>> lock_irss(const std::vector<MemcachedImplicitRegistrationSet*>& irss);
+
+  // Counts a CAS write that hit DATA_CONTENTION and is being retried.
+  void count_contention_retry();
 
   // Get the Impu for this impu, by first checking the local store and then any
   // remote stores if no Impu is found in the local store.
@@ -392,18 +619,67 @@ private:
                                     SAS::TrailId trail,
                                     Utils::StopWatch* stopwatch);
 
+  // Get the Impus for these impus, by first checking the local store and then
+  // any remote stores for any that aren't found in the local store. Each
+  // store is asked for all of the impus it's needed for in a single batch.
+  // If successful, adds each Impu found to out_impus, keyed by impu.
+  // If not, does not alter out_impus.
+  Store::Status get_impus_for_impus_gr(const std::vector<std::string>& impus,
+                                       std::map<std::string, ImpuStore::Impu*>& out_impus,
+                                       SAS::TrailId trail,
+                                       Utils::StopWatch* stopwatch);
+
+  // Read from all of the remote stores in parallel, using get_fn to perform
+  // the read on each store, and merge_fn to combine the successful results.
+  // Remote stores that already have the most reads in flight allowed are
+  // skipped, and treated as not answering.
+  // If all_answered is provided, it's set to whether every remote store
+  // answered the read (with a result or NOT_FOUND) in time, i.e. whether
+  // anything not in the result is definitely not in any remote store.
+  template <class T>
+  Store::Status get_from_remote_stores(std::function<Store::Status(ImpuStore*, T*&)> get_fn,
+                                       T*& out_result,
+                                       Utils::StopWatch* stopwatch,
+                                       std::function<bool(T*&, T*&)> merge_fn,
+                                       bool* all_answered = nullptr);
+
+  // Stop remembering that the identities in the IRSs weren't found, as
+  // they're about to be written.
+  void invalidate_negative_cache(const std::vector<MemcachedImplicitRegistrationSet*>& irss);
+
   // Per Store IRS methods
 
   typedef std::function<Store::Status(ImpuStore*, Utils::StopWatch*)> store_action;
 
-  // Performs the action on each store, calling the progress_cb once the action
-  // has been performed on the local store
+  // Performs the action on the local store, calling the progress_cb once the
+  // action has succeeded, and then replicates the change to each of the IRSs
+  // to the remote stores. Changes to the same IRS are replicated in the order
+  // they were made to the local store.
   // If a StopWatch is provided, it will be paused when performing network I/O
   // for the local store, but not for the remotes.
   Store::Status perform(store_action action,
+                        ReplicationType type,
+                        const std::vector<MemcachedImplicitRegistrationSet*>& irss,
                         progress_callback progress_cb,
+                        SAS::TrailId trail,
                         Utils::StopWatch* stopwatch);
 
+  // Queue the request for a replication thread, coalescing it with any
+  // request for the same IRS that hasn't been started yet. Takes ownership of
+  // the request. Returns true if there's no replication thread to make it
+  // (because there's no replication pool, or the queues are full), in which
+  // case the caller must call process_replication_queue for the IRS.
+  bool queue_replication(ReplicationRequest* request);
+
+  // Make the queued replication requests for the default IMPU, in order,
+  // until there are none left.
+  void process_replication_queue(const std::string& default_impu);
+
+  // Write the IRS to each of the remote stores.
+  void replicate_irs(ReplicationType type,
+                     MemcachedImplicitRegistrationSet* irs,
+                     SAS::TrailId trail);
+
   Store::Status put_irs_action(MemcachedImplicitRegistrationSet* irs,
                                SAS::TrailId trail,
                                ImpuStore* store,
@@ -441,8 +717,22 @@ private:
                                 ImpuStore* store,
                                 Utils::StopWatch* stopwatch);
 
+  // Runs each of the operations on the store, and waits for them all to
+  // complete. If there's more than one, they're run in parallel so that
+  // their network round trips overlap - on the local write pool for the
+  // local store, and on the remote thread pool for the remote stores. If a
+  // StopWatch is provided, it's paused while we wait for the pool.
+  void run_in_parallel(const std::vector<std::function<void()>>& ops,
+                       ImpuStore* store,
+                       Utils::StopWatch* stopwatch);
+
   // Associated IMPU handling
 
+  // Removes the deleted associated IMPUs, and writes the added (and, if the
+  // IRS is being refreshed, the unchanged ones that need it - see
+  // lazy_refresh_s on the constructor). All of the reads and writes
+  // for each step are made in parallel, and deletes that hit DATA_CONTENTION
+  // are retried together.
   Store::Status update_irs_associated_impus(MemcachedImplicitRegistrationSet* irs,
                                             SAS::TrailId trail,
                                             ImpuStore* store,
@@ -450,6 +740,11 @@ private:
 
   // IMPI Mapping Handling
 
+  // Updates the IMPI mappings for the IRS's IMPIs. The mappings are updated
+  // in rounds - all of the mappings that need to be read are read in
+  // parallel, the changes are merged into them, and they're all written
+  // back in parallel with CAS. Only the mappings that hit DATA_CONTENTION
+  // go round again.
   Store::Status update_irs_impi_mappings(MemcachedImplicitRegistrationSet* irs,
                                          SAS::TrailId trail,
                                          ImpuStore* store,
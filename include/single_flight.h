@@ -0,0 +1,103 @@
+/**
+ * @file single_flight.h Coalescing of concurrent requests for the same key.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SINGLE_FLIGHT_H_
+#define SINGLE_FLIGHT_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Tracks the requests that are in flight, so that concurrent requests for the
+// same key can join a single request rather than each making their own.
+//
+// The first caller to join() for a key is given a Flight, and must make the
+// request and then call complete() with that Flight once it has the result.
+// Callers that join() while the request is in flight just add their callback
+// to it. complete() returns the callbacks of everyone that joined, (the first
+// caller's first), and the caller passes the result to each of them.
+//
+// Callbacks are always called by whoever completes the flight, without the
+// lock held, so they are free to start new requests.
+template <class Key, class Callback>
+class SingleFlight
+{
+public:
+  struct Flight
+  {
+    std::vector<Callback> callbacks;
+  };
+
+  typedef std::shared_ptr<Flight> FlightPtr;
+
+  // Adds the callback to the flight for the key, if there is one, and
+  // returns null. Otherwise starts a new flight and returns it, in which case
+  // the caller must make the request and complete() the flight.
+  FlightPtr join(const Key& key, const Callback& callback)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    FlightPtr& flight = _flights[key];
+
+    if (flight)
+    {
+      flight->callbacks.push_back(callback);
+      return nullptr;
+    }
+
+    flight = std::make_shared<Flight>();
+    flight->callbacks.push_back(callback);
+    return flight;
+  }
+
+  // Ends the flight, returning the callbacks of everyone that joined it. No
+  // one can join the flight once this has been called.
+  std::vector<Callback> complete(const Key& key, const FlightPtr& flight)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    typename std::map<Key, FlightPtr>::iterator it = _flights.find(key);
+
+    if ((it != _flights.end()) && (it->second == flight))
+    {
+      _flights.erase(it);
+    }
+
+    std::vector<Callback> callbacks;
+    callbacks.swap(flight->callbacks);
+    return callbacks;
+  }
+
+  // Stops anyone else joining the flight for the key (if there is one), so
+  // that later requests for the key start a new flight. This is used when
+  // the result of the request in flight might already be out of date. The
+  // callbacks that have already joined are still called when the flight
+  // completes.
+  void detach(const Key& key)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _flights.erase(key);
+  }
+
+  // The number of flights that can currently be joined.
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _flights.size();
+  }
+
+private:
+  std::mutex _lock;
+  std::map<Key, FlightPtr> _flights;
+};
+
+#endif
@@ -0,0 +1,105 @@
+/**
+ * @file stage_latency.h Breakdown of request latency by processing stage.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STAGE_LATENCY_H__
+#define STAGE_LATENCY_H__
+
+#include <chrono>
+
+#include "sas.h"
+
+class StatisticsManager;
+
+// Records how long requests spend in each stage of their processing, so that
+// when latency goes up we can tell where the time went. The time spent in each
+// stage is accumulated into that stage's statistic. A request can spend time
+// in the same stage many times (e.g. once per store read), so only the times
+// of at least SAS_THRESHOLD_US are also logged to SAS on the request's trail,
+// to show which stage made a slow request slow without flooding SAS.
+//
+// Stages aren't exclusive - e.g. the time spent writing to the local store
+// includes the time spent compressing the IMPUs written.
+class StageLatency
+{
+public:
+  enum Stage
+  {
+    // Waiting in the cache processor's queue for a cache thread.
+    CACHE_QUEUE,
+
+    // Reading from or writing to the local site's IMPU store.
+    LOCAL_STORE,
+
+    // Reading from or writing to remote sites' IMPU stores.
+    REMOTE_STORE,
+
+    // Waiting for the HSS to answer a SAR.
+    HSS_SAR,
+
+    // Building the ClearwaterRegData XML for a reg-data response.
+    XML_BUILD,
+
+    // Encoding (and compressing) IMPUs to write to a store.
+    COMPRESSION,
+
+    // Decompressing and decoding IMPUs read from a store.
+    DECOMPRESSION,
+
+    NUM_STAGES,
+
+    // Not a stage - latency recorded against this is ignored.
+    NONE = NUM_STAGES
+  };
+
+  // The shortest time in a stage that is logged to SAS.
+  static const unsigned long SAS_THRESHOLD_US = 10000;
+
+  // Sets the statistics manager that stage latencies are reported to. Until
+  // this is called, they are only logged to SAS.
+  static void configure(StatisticsManager* stats_manager);
+
+  // Records that the request on the given trail spent latency_us in the stage.
+  static void record(Stage stage, SAS::TrailId trail, unsigned long latency_us);
+
+  // Times a stage from when it is created until it is stopped (or destroyed),
+  // and records the time spent in it.
+  class Timer
+  {
+  public:
+    Timer(Stage stage, SAS::TrailId trail) :
+      _stage(stage),
+      _trail(trail),
+      _start(std::chrono::steady_clock::now()),
+      _running(stage != NONE)
+    {
+    }
+
+    ~Timer()
+    {
+      stop();
+    }
+
+    // Records the time since the timer was created. Has no effect if the
+    // timer has already been stopped.
+    void stop();
+
+  private:
+    Stage _stage;
+    SAS::TrailId _trail;
+    std::chrono::steady_clock::time_point _start;
+    bool _running;
+  };
+
+private:
+  static StatisticsManager* _stats_manager;
+};
+
+#endif
@@ -35,6 +35,15 @@ public:
   ACCUMULATOR_UPDATE_METHOD(H_hss_subscription_latency_us);
   ACCUMULATOR_UPDATE_METHOD(H_hsprov_latency_us);
 
+  // The latency of each stage of processing a request (see stage_latency.h).
+  ACCUMULATOR_UPDATE_METHOD(H_cache_queue_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_local_store_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_remote_store_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_hss_sar_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_xml_build_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_compression_latency_us);
+  ACCUMULATOR_UPDATE_METHOD(H_decompression_latency_us);
+
   COUNTER_INCR_METHOD(H_incoming_requests);
   COUNTER_INCR_METHOD(H_rejected_overload);
 
@@ -52,6 +61,13 @@ private:
   SNMP::EventAccumulatorTable* H_hss_digest_latency_us;
   SNMP::EventAccumulatorTable* H_hss_subscription_latency_us;
   SNMP::EventAccumulatorTable* H_hsprov_latency_us;
+  SNMP::EventAccumulatorTable* H_cache_queue_latency_us;
+  SNMP::EventAccumulatorTable* H_local_store_latency_us;
+  SNMP::EventAccumulatorTable* H_remote_store_latency_us;
+  SNMP::EventAccumulatorTable* H_hss_sar_latency_us;
+  SNMP::EventAccumulatorTable* H_xml_build_latency_us;
+  SNMP::EventAccumulatorTable* H_compression_latency_us;
+  SNMP::EventAccumulatorTable* H_decompression_latency_us;
 
   SNMP::CounterTable* H_incoming_requests;
   SNMP::CounterTable* H_rejected_overload;
@@ -12,9 +12,15 @@ homestead_test:
 homestead_full_test:
 	${MAKE} -C ${HOMESTEAD_DIR} full_test
 
+homestead_bench:
+	${MAKE} -C ${HOMESTEAD_DIR} bench
+
+homestead_loadgen:
+	${MAKE} -C ${HOMESTEAD_DIR} loadgen
+
 homestead_clean:
 	${MAKE} -C ${HOMESTEAD_DIR} clean
 
 homestead_distclean: homestead_clean
 
-.PHONY: homestead homestead_test homestead_clean homestead_distclean
+.PHONY: homestead homestead_test homestead_bench homestead_loadgen homestead_clean homestead_distclean
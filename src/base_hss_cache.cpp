@@ -21,7 +21,7 @@ Store::Status BaseHssCache::get_implicit_registration_sets_for_impi(const std::s
 
   if (status == Store::Status::OK)
   {
-    status = BaseHssCache::get_implicit_registration_sets_for_impus(impus, trail, stopwatch, result);
+    status = get_implicit_registration_sets_for_impus(impus, trail, stopwatch, result);
   }
 
   return status;
@@ -0,0 +1,227 @@
+/**
+ * @file bench.cpp Minimal harness for homestead's microbenchmarks.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+
+#include "bench.h"
+
+// Count every heap allocation made on each thread, so that we can report
+// allocations per operation. Only the thread running the benchmark is
+// counted, so work handed off to other threads (e.g. the MemcachedCache's
+// thread pool) isn't included.
+static thread_local unsigned long thrd_allocations = 0;
+
+void* operator new(size_t size)
+{
+  thrd_allocations++;
+
+  void* p = malloc(size ? size : 1);
+
+  if (p == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete[](void* p) noexcept
+{
+  operator delete(p);
+}
+
+namespace Bench {
+
+// Scaling factor for iterations, in percent, set from the command line.
+static int iterations_percent = 100;
+
+static std::map<std::string, std::function<void()>>& suites()
+{
+  static std::map<std::string, std::function<void()>> suites;
+  return suites;
+}
+
+Suite::Suite(const std::string& name, std::function<void()> fn)
+{
+  suites()[name] = fn;
+}
+
+int iterations(int requested)
+{
+  return std::max(requested * iterations_percent / 100, 1);
+}
+
+void run(const std::string& name,
+         int iterations,
+         std::function<void()> op)
+{
+  run(name, iterations, nullptr, op);
+}
+
+void run(const std::string& name,
+         int iterations,
+         std::function<void()> setup,
+         std::function<void()> op)
+{
+  iterations = Bench::iterations(iterations);
+
+  // Warm up, so that thread local buffers, caches, etc. are populated
+  for (int ii = 0; ii < std::min(iterations, 10); ++ii)
+  {
+    if (setup)
+    {
+      setup();
+    }
+
+    op();
+  }
+
+  std::vector<double> latencies_us;
+  latencies_us.reserve(iterations);
+  unsigned long allocations = 0;
+  double total_us = 0;
+
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    if (setup)
+    {
+      setup();
+    }
+
+    unsigned long allocations_before = thrd_allocations;
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+    op();
+
+    std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+    allocations += thrd_allocations - allocations_before;
+
+    latencies_us.push_back(elapsed.count());
+    total_us += elapsed.count();
+  }
+
+  std::sort(latencies_us.begin(), latencies_us.end());
+
+  std::function<double(double)> percentile =
+    [&latencies_us](double p) -> double
+  {
+    size_t index = (size_t)(p * (latencies_us.size() - 1));
+    return latencies_us[index];
+  };
+
+  printf("%-50s %10.0f ops/s %8.1f allocs/op   p50 %8.2f us  p90 %8.2f us  p99 %8.2f us\n",
+         name.c_str(),
+         iterations / (total_us / 1000000.0),
+         (double)allocations / iterations,
+         percentile(0.5),
+         percentile(0.9),
+         percentile(0.99));
+}
+
+std::string service_profile_of_size(size_t size)
+{
+  std::string profile =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription>"
+    "<PrivateID>impi@example.com</PrivateID><ServiceProfile>"
+    "<PublicIdentity><Identity>sip:impu@example.com</Identity>"
+    "<Extension><IdentityType>0</IdentityType></Extension>"
+    "</PublicIdentity>";
+
+  int priority = 0;
+
+  while (profile.size() < size)
+  {
+    profile += "<InitialFilterCriteria><Priority>" +
+               std::to_string(priority++) +
+               "</Priority><TriggerPoint><ConditionTypeCNF>0</ConditionTypeCNF>"
+               "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+               "<Method>INVITE</Method></SPT></TriggerPoint><ApplicationServer>"
+               "<ServerName>sip:as" + std::to_string(priority) +
+               ".example.com</ServerName><DefaultHandling>0</DefaultHandling>"
+               "</ApplicationServer></InitialFilterCriteria>";
+  }
+
+  profile += "</ServiceProfile></IMSSubscription>";
+
+  return profile;
+}
+
+std::vector<std::string> associated_impus(int count)
+{
+  std::vector<std::string> impus;
+
+  for (int ii = 0; ii < count; ++ii)
+  {
+    impus.push_back("sip:assoc_impu_" + std::to_string(ii) + "@example.com");
+  }
+
+  return impus;
+}
+
+} // namespace Bench
+
+static void usage()
+{
+  printf("Usage: homestead_bench [--quick] [filter]\n"
+         "  --quick    Run each benchmark for a tenth of the usual iterations\n"
+         "  filter     Only run the suites whose names contain this string\n");
+}
+
+int main(int argc, char** argv)
+{
+  std::string filter;
+
+  for (int ii = 1; ii < argc; ++ii)
+  {
+    if (strcmp(argv[ii], "--quick") == 0)
+    {
+      Bench::iterations_percent = 10;
+    }
+    else if (argv[ii][0] == '-')
+    {
+      usage();
+      return 1;
+    }
+    else
+    {
+      filter = argv[ii];
+    }
+  }
+
+  for (std::pair<const std::string, std::function<void()>>& suite : Bench::suites())
+  {
+    if (suite.first.find(filter) != std::string::npos)
+    {
+      printf("\n== %s ==\n", suite.first.c_str());
+      suite.second();
+    }
+  }
+
+  return 0;
+}
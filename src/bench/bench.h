@@ -0,0 +1,63 @@
+/**
+ * @file bench.h Minimal harness for homestead's microbenchmarks.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Bench {
+
+// Runs the operation the given number of times (after a short warm up), and
+// prints its throughput, the number of heap allocations it makes per run
+// and its latency percentiles.
+void run(const std::string& name,
+         int iterations,
+         std::function<void()> op);
+
+// Runs the operation as for run(), but first calls setup before every run,
+// outside the timed region, e.g. to put the store in the state the
+// operation expects.
+void run(const std::string& name,
+         int iterations,
+         std::function<void()> setup,
+         std::function<void()> op);
+
+// A suite of benchmarks, registered at static initialization time so that
+// the harness's main() can run them all (or those matching a filter).
+struct Suite
+{
+  Suite(const std::string& name, std::function<void()> fn);
+};
+
+// The number of iterations each benchmark is run for. This can be scaled
+// down from the command line for a quick smoke test.
+int iterations(int requested);
+
+// Helpers for building realistic test data.
+
+// Builds a service profile of roughly the given size, made up of initial
+// filter criteria, as that's what makes real service profiles large.
+std::string service_profile_of_size(size_t size);
+
+// Builds the given number of associated IMPUs.
+std::vector<std::string> associated_impus(int count);
+
+} // namespace Bench
+
+#define BENCH_SUITE(NAME) \
+  static void NAME(); \
+  static Bench::Suite NAME##_suite(#NAME, NAME); \
+  static void NAME()
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * @file impu_store_bench.cpp Benchmarks for encoding and decoding the records
+ * in the IMPU store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "bench.h"
+#include "impu_store.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string IMPI = "impi@example.com";
+static const ChargingAddresses CHARGING_ADDRESSES({ "ccf1", "ccf2" },
+                                                  { "ecf1", "ecf2" });
+
+static const int ITERATIONS = 20000;
+
+// The IRS sizes (number of associated IMPUs) and service profile sizes (in
+// bytes) to benchmark. A size of 0 gives the smallest service profile (about
+// 0.2KB).
+static const std::vector<int> IRS_SIZES = { 1, 10, 100 };
+static const std::vector<size_t> PROFILE_SIZES = { 0, 1024, 4096, 16384, 65536 };
+
+static std::string version_name(int version)
+{
+  return (version == ImpuStore::DATA_VERSION_BINARY) ? "binary" : "json_lz4";
+}
+
+BENCH_SUITE(DefaultImpuCodec)
+{
+  for (int irs_size : IRS_SIZES)
+  {
+    for (size_t profile_size : PROFILE_SIZES)
+    {
+      ImpuStore::DefaultImpu default_impu(IMPU,
+                                          Bench::associated_impus(irs_size),
+                                          { IMPI },
+                                          RegistrationState::REGISTERED,
+                                          CHARGING_ADDRESSES,
+                                          Bench::service_profile_of_size(profile_size),
+                                          0L,
+                                          time(0) + 300,
+                                          nullptr);
+
+      for (int version : { ImpuStore::DATA_VERSION_JSON_LZ4,
+                           ImpuStore::DATA_VERSION_BINARY })
+      {
+        std::string suffix = " " + version_name(version) +
+                             " irs=" + std::to_string(irs_size) +
+                             " profile=" + std::to_string(profile_size);
+        std::string data;
+
+        Bench::run("to_data" + suffix,
+                   ITERATIONS,
+                   [&data]() { data.clear(); },
+                   [&default_impu, &data, version]()
+                   {
+                     default_impu.to_data(data, version);
+                   });
+
+        Bench::run("from_data" + suffix,
+                   ITERATIONS,
+                   [&data]()
+                   {
+                     ImpuStore::Impu* impu =
+                       ImpuStore::Impu::from_data(IMPU, data, 0L, nullptr);
+                     delete impu;
+                   });
+      }
+    }
+  }
+}
+
+BENCH_SUITE(ImpiMappingCodec)
+{
+  for (int irs_count : { 1, 10 })
+  {
+    std::vector<std::string> default_impus = Bench::associated_impus(irs_count);
+    ImpuStore::ImpiMapping mapping(IMPI, default_impus, 0L, time(0) + 300);
+    std::string suffix = " irss=" + std::to_string(irs_count);
+    std::string data;
+
+    Bench::run("to_data" + suffix,
+               ITERATIONS,
+               [&data]() { data.clear(); },
+               [&mapping, &data]() { mapping.to_data(data); });
+
+    Bench::run("from_data" + suffix,
+               ITERATIONS,
+               [&data]()
+               {
+                 ImpuStore::ImpiMapping* decoded =
+                   ImpuStore::ImpiMapping::from_data(IMPI, data, 0L);
+                 delete decoded;
+               });
+  }
+}
@@ -0,0 +1,766 @@
+/**
+ * @file loadgen.cpp Load generator for homestead's HTTP signalling API.
+ *
+ * Runs homestead's signalling HTTP stack in-process, backed by a stub HSS and
+ * an in-memory store, and drives it from a number of HTTP clients according
+ * to a scenario file. Reports the throughput and latency of each request type.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include <curl/curl.h>
+
+#include "rapidjson/document.h"
+
+#include "coalescing_hss_connection.h"
+#include "exception_handler.h"
+#include "health_checker.h"
+#include "hss_cache_processor.h"
+#include "http_handlers.h"
+#include "httpstack.h"
+#include "httpstack_utils.h"
+#include "localstore.h"
+#include "memcached_cache.h"
+#include "stub_hss_connection.h"
+
+// The types of request the load generator can make. RTR isn't an HTTP
+// request - it drives the cache operations that homestead makes on receiving
+// an RTR from the HSS.
+enum struct RequestType
+{
+  REGISTRATION_STATUS,
+  AV,
+  REG,
+  CALL,
+  DEREG,
+  LOCATION,
+  RTR,
+  NUM_TYPES
+};
+
+static const int NUM_REQUEST_TYPES = (int)RequestType::NUM_TYPES;
+
+// The names of the request types, as used in scenario files and results.
+static const char* REQUEST_NAMES[NUM_REQUEST_TYPES] =
+{
+  "registration-status",
+  "av",
+  "reg",
+  "call",
+  "dereg",
+  "location",
+  "rtr"
+};
+
+// The upper bounds of the latency histogram buckets, in microseconds. There
+// is an extra bucket for anything slower than the last of these.
+static const std::vector<uint32_t> HISTOGRAM_BUCKETS_US =
+  { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000 };
+
+struct Scenario
+{
+  std::string description;
+
+  // The number of subscribers, each with one IMPI and an IRS.
+  int subscribers = 1000;
+
+  // The number of associated IMPUs in each IRS, and the rough size of each
+  // service profile.
+  int associated_impus = 1;
+  int profile_size = 2048;
+
+  // Whether every subscriber is registered before the run starts.
+  bool preregister = false;
+
+  // The number of concurrent HTTP clients, and how long to run for.
+  int clients = 8;
+  int duration_s = 10;
+
+  // Homestead's configuration.
+  int http_threads = 8;
+  int cache_threads = 8;
+  int cache_shards = 1;
+  int reg_data_cache_size = 10000;
+
+  // The relative weights of each type of HTTP request.
+  std::vector<int> weights = std::vector<int>(NUM_REQUEST_TYPES, 0);
+
+  // If rtr_interval_ms is non-zero, a burst of rtr_burst_size RTRs (each for
+  // a random subscriber) is made at that interval.
+  int rtr_interval_ms = 0;
+  int rtr_burst_size = 0;
+};
+
+// The results for one request type.
+struct Results
+{
+  std::vector<uint32_t> latencies_us;
+  uint64_t errors = 0;
+
+  void merge(const Results& other)
+  {
+    latencies_us.insert(latencies_us.end(),
+                        other.latencies_us.begin(),
+                        other.latencies_us.end());
+    errors += other.errors;
+  }
+};
+
+typedef std::vector<Results> ResultsByType;
+
+static std::string impi_for(int subscriber)
+{
+  return "user" + std::to_string(subscriber) + "@example.com";
+}
+
+static std::string impu_for(int subscriber)
+{
+  return "sip:user" + std::to_string(subscriber) + "@example.com";
+}
+
+static bool read_int(const rapidjson::Value& json, const char* name, int& value)
+{
+  if (!json.HasMember(name))
+  {
+    return true;
+  }
+
+  if (!json[name].IsInt())
+  {
+    fprintf(stderr, "'%s' must be an integer\n", name);
+    return false;
+  }
+
+  value = json[name].GetInt();
+  return true;
+}
+
+// Reads the scenario from the given JSON file. Returns false (having reported
+// why) if it is invalid.
+static bool read_scenario(const std::string& path, Scenario& scenario)
+{
+  std::ifstream file(path);
+
+  if (!file)
+  {
+    fprintf(stderr, "Failed to open scenario file %s\n", path.c_str());
+    return false;
+  }
+
+  std::stringstream contents;
+  contents << file.rdbuf();
+
+  rapidjson::Document document;
+  document.Parse<0>(contents.str().c_str());
+
+  if (document.HasParseError() || !document.IsObject())
+  {
+    fprintf(stderr, "Scenario file %s isn't a valid JSON object\n", path.c_str());
+    return false;
+  }
+
+  if (document.HasMember("description") && document["description"].IsString())
+  {
+    scenario.description = document["description"].GetString();
+  }
+
+  if (document.HasMember("preregister"))
+  {
+    if (!document["preregister"].IsBool())
+    {
+      fprintf(stderr, "'preregister' must be true or false\n");
+      return false;
+    }
+
+    scenario.preregister = document["preregister"].GetBool();
+  }
+
+  if (!read_int(document, "subscribers", scenario.subscribers) ||
+      !read_int(document, "associated_impus", scenario.associated_impus) ||
+      !read_int(document, "profile_size", scenario.profile_size) ||
+      !read_int(document, "clients", scenario.clients) ||
+      !read_int(document, "duration_s", scenario.duration_s) ||
+      !read_int(document, "http_threads", scenario.http_threads) ||
+      !read_int(document, "cache_threads", scenario.cache_threads) ||
+      !read_int(document, "cache_shards", scenario.cache_shards) ||
+      !read_int(document, "reg_data_cache_size", scenario.reg_data_cache_size) ||
+      !read_int(document, "rtr_interval_ms", scenario.rtr_interval_ms) ||
+      !read_int(document, "rtr_burst_size", scenario.rtr_burst_size))
+  {
+    return false;
+  }
+
+  if (!document.HasMember("mix") || !document["mix"].IsObject())
+  {
+    fprintf(stderr, "Scenario must contain a 'mix' object\n");
+    return false;
+  }
+
+  const rapidjson::Value& mix = document["mix"];
+
+  for (rapidjson::Value::ConstMemberIterator it = mix.MemberBegin();
+       it != mix.MemberEnd();
+       ++it)
+  {
+    const char* name = it->name.GetString();
+    const char** type = std::find_if(REQUEST_NAMES,
+                                     REQUEST_NAMES + (int)RequestType::RTR,
+                                     [name](const char* n)
+                                     {
+                                       return strcmp(n, name) == 0;
+                                     });
+
+    if ((type == REQUEST_NAMES + (int)RequestType::RTR) ||
+        !it->value.IsInt() ||
+        (it->value.GetInt() < 0))
+    {
+      fprintf(stderr, "Invalid entry '%s' in the mix\n", name);
+      return false;
+    }
+
+    scenario.weights[type - REQUEST_NAMES] = it->value.GetInt();
+  }
+
+  if (std::accumulate(scenario.weights.begin(), scenario.weights.end(), 0) == 0)
+  {
+    fprintf(stderr, "The mix must contain at least one request type\n");
+    return false;
+  }
+
+  if ((scenario.subscribers <= 0) || (scenario.clients <= 0))
+  {
+    fprintf(stderr, "'subscribers' and 'clients' must be positive\n");
+    return false;
+  }
+
+  return true;
+}
+
+static size_t discard_body(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  return size * nmemb;
+}
+
+// An HTTP client, making requests to the homestead under test over a single
+// keep-alive connection.
+class Client
+{
+public:
+  Client(const std::string& server) : _server(server), _curl(curl_easy_init())
+  {
+    curl_easy_setopt(_curl, CURLOPT_WRITEFUNCTION, &discard_body);
+    curl_easy_setopt(_curl, CURLOPT_NOSIGNAL, 1L);
+  }
+
+  ~Client()
+  {
+    curl_easy_cleanup(_curl);
+  }
+
+  // Makes a request of the given type for the given subscriber, in the same
+  // shape that Sprout makes it. Returns whether homestead answered with a
+  // 200 OK.
+  bool send(RequestType type, int subscriber)
+  {
+    std::string impi = impi_for(subscriber);
+    std::string impu = impu_for(subscriber);
+
+    switch (type)
+    {
+    case RequestType::REGISTRATION_STATUS:
+      return get("/impi/" + impi + "/registration-status?impu=" + impu);
+
+    case RequestType::AV:
+      return get("/impi/" + impi + "/av?impu=" + impu);
+
+    case RequestType::REG:
+      return put("/impu/" + impu + "/reg-data?private_id=" + impi,
+                 "{\"reqtype\": \"reg\", \"server_name\": \"" +
+                 HssConnection::StubHssConnection::SERVER_NAME + "\"}");
+
+    case RequestType::CALL:
+      return put("/impu/" + impu + "/reg-data", "{\"reqtype\": \"call\"}");
+
+    case RequestType::DEREG:
+      return put("/impu/" + impu + "/reg-data?private_id=" + impi,
+                 "{\"reqtype\": \"dereg-user\"}");
+
+    case RequestType::LOCATION:
+      return get("/impu/" + impu + "/location");
+
+    default:
+      return false; // LCOV_EXCL_LINE
+    }
+  }
+
+private:
+  bool get(const std::string& path)
+  {
+    curl_easy_setopt(_curl, CURLOPT_CUSTOMREQUEST, NULL);
+    curl_easy_setopt(_curl, CURLOPT_HTTPGET, 1L);
+    return perform(path);
+  }
+
+  bool put(const std::string& path, const std::string& body)
+  {
+    curl_easy_setopt(_curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt(_curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE, (long)body.size());
+    return perform(path);
+  }
+
+  bool perform(const std::string& path)
+  {
+    std::string url = _server + path;
+    curl_easy_setopt(_curl, CURLOPT_URL, url.c_str());
+
+    long http_rc = 0;
+
+    if (curl_easy_perform(_curl) == CURLE_OK)
+    {
+      curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    }
+
+    return (http_rc == 200);
+  }
+
+  std::string _server;
+  CURL* _curl;
+};
+
+// Emulates the cache operations homestead makes on receiving an RTR for the
+// given subscriber - i.e. looks up the subscriber's IRSs by IMPI and deletes
+// them. Returns whether that succeeded.
+static bool registration_termination(HssCacheProcessor* cache, int subscriber)
+{
+  std::mutex lock;
+  std::condition_variable cond;
+  bool done = false;
+  bool success = false;
+
+  std::function<void(bool)> complete = [&](bool ok)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    success = ok;
+    done = true;
+    cond.notify_one();
+  };
+
+  cache->get_implicit_registration_sets_for_impis(
+    [cache, complete](std::vector<ImplicitRegistrationSet*> irss)
+    {
+      if (irss.empty())
+      {
+        complete(true);
+        return;
+      }
+
+      // We own the IRSs, and must delete them once the cache is done with
+      // them.
+      std::function<void(bool)> delete_complete = [irss, complete](bool ok)
+      {
+        for (ImplicitRegistrationSet* irs : irss)
+        {
+          delete irs;
+        }
+
+        complete(ok);
+      };
+
+      cache->delete_implicit_registration_sets(
+        [delete_complete]() { delete_complete(true); },
+        []() {},
+        [delete_complete](Store::Status rc) { delete_complete(false); },
+        irss,
+        0,
+        nullptr);
+    },
+    [complete](Store::Status rc) { complete(rc == Store::Status::NOT_FOUND); },
+    { impi_for(subscriber) },
+    0,
+    nullptr);
+
+  std::unique_lock<std::mutex> guard(lock);
+  cond.wait(guard, [&done]() { return done; });
+  return success;
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p)
+{
+  return sorted.empty() ? 0 : sorted[(size_t)(p * (sorted.size() - 1))];
+}
+
+static void report(const Scenario& scenario,
+                   ResultsByType& results,
+                   double elapsed_s,
+                   HssConnection::StubHssConnection& hss)
+{
+  uint64_t total = 0;
+
+  printf("\n%-20s %9s %7s %9s %9s %9s %9s %9s\n",
+         "request", "count", "errors", "req/s",
+         "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+
+  for (int type = 0; type < NUM_REQUEST_TYPES; ++type)
+  {
+    std::vector<uint32_t>& latencies = results[type].latencies_us;
+
+    if (latencies.empty())
+    {
+      continue;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    total += latencies.size();
+
+    printf("%-20s %9lu %7lu %9.0f %9u %9u %9u %9u\n",
+           REQUEST_NAMES[type],
+           latencies.size(),
+           results[type].errors,
+           latencies.size() / elapsed_s,
+           percentile(latencies, 0.5),
+           percentile(latencies, 0.9),
+           percentile(latencies, 0.99),
+           latencies.back());
+  }
+
+  printf("%-20s %9lu %7s %9.0f\n", "total", total, "", total / elapsed_s);
+
+  // Print a histogram of the latencies of each request type, with the
+  // percentage of requests falling in each bucket.
+  printf("\nLatency histogram (%% of requests)\n%-20s", "request");
+
+  for (uint32_t bound : HISTOGRAM_BUCKETS_US)
+  {
+    printf(" %7s", (bound < 1000) ?
+                     (std::to_string(bound) + "us").c_str() :
+                     (std::to_string(bound / 1000) + "ms").c_str());
+  }
+
+  printf(" %7s\n", "more");
+
+  for (int type = 0; type < NUM_REQUEST_TYPES; ++type)
+  {
+    const std::vector<uint32_t>& latencies = results[type].latencies_us;
+
+    if (latencies.empty())
+    {
+      continue;
+    }
+
+    printf("%-20s", REQUEST_NAMES[type]);
+
+    std::vector<uint32_t>::const_iterator bucket_start = latencies.begin();
+
+    for (uint32_t bound : HISTOGRAM_BUCKETS_US)
+    {
+      std::vector<uint32_t>::const_iterator bucket_end =
+        std::upper_bound(bucket_start, latencies.end(), bound);
+      printf(" %6.1f%%", 100.0 * (bucket_end - bucket_start) / latencies.size());
+      bucket_start = bucket_end;
+    }
+
+    printf(" %6.1f%%\n", 100.0 * (latencies.end() - bucket_start) / latencies.size());
+  }
+
+  printf("\nStub HSS answered %lu MARs, %lu UARs, %lu LIRs, %lu SARs\n",
+         (uint64_t)hss.mars,
+         (uint64_t)hss.uars,
+         (uint64_t)hss.lirs,
+         (uint64_t)hss.sars);
+}
+
+static void usage()
+{
+  printf("Usage: homestead_loadgen [--port <port>] <scenario file>\n"
+         "  --port     The local port to run homestead's HTTP stack on\n"
+         "             (default 8889)\n");
+}
+
+int main(int argc, char** argv)
+{
+  std::string scenario_file;
+  int port = 8889;
+
+  for (int ii = 1; ii < argc; ++ii)
+  {
+    if ((strcmp(argv[ii], "--port") == 0) && (ii + 1 < argc))
+    {
+      port = atoi(argv[++ii]);
+    }
+    else if (argv[ii][0] == '-')
+    {
+      usage();
+      return 1;
+    }
+    else
+    {
+      scenario_file = argv[ii];
+    }
+  }
+
+  Scenario scenario;
+
+  if (scenario_file.empty())
+  {
+    usage();
+    return 1;
+  }
+
+  if (!read_scenario(scenario_file, scenario))
+  {
+    return 1;
+  }
+
+  printf("Scenario: %s\n", scenario_file.c_str());
+
+  if (!scenario.description.empty())
+  {
+    printf("  %s\n", scenario.description.c_str());
+  }
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  // Build homestead as main() does, but with the HSS and the IMPU store
+  // replaced by in-process stand-ins.
+  HealthChecker health_checker;
+  ExceptionHandler exception_handler(3600, false, &health_checker);
+
+  LocalStore local_data_store;
+  ImpuStore local_store(&local_data_store);
+  MemcachedCache memcached_cache(&local_store, {}, 0, &exception_handler);
+  HssCacheProcessor cache_processor(&memcached_cache);
+
+  if (!cache_processor.start_threads(scenario.cache_threads,
+                                     &exception_handler,
+                                     0,
+                                     nullptr,
+                                     scenario.cache_shards))
+  {
+    fprintf(stderr, "Failed to start the cache threads\n");
+    return 1;
+  }
+
+  HssConnection::StubHssConnection hss(scenario.associated_impus,
+                                       scenario.profile_size);
+  HssConnection::CoalescingHssConnection coalescing_hss(&hss);
+
+  HssCacheTask::configure_cache(&cache_processor);
+  HssCacheTask::configure_hss_connection(&coalescing_hss,
+                                         HssConnection::StubHssConnection::SERVER_NAME);
+
+  ImpiTask::Config impi_handler_config("Unknown",
+                                       HssConnection::StubHssConnection::SCHEME_DIGEST,
+                                       "Digest-AKAv1-MD5",
+                                       "Digest-AKAv2-SHA-256");
+  ImpiRegistrationStatusTask::Config registration_status_handler_config("example.com");
+  ImpuLocationInfoTask::Config location_info_handler_config;
+  XmlUtils::ClearwaterRegDataCache* reg_data_cache = NULL;
+
+  if (scenario.reg_data_cache_size > 0)
+  {
+    reg_data_cache = new XmlUtils::ClearwaterRegDataCache(scenario.reg_data_cache_size);
+  }
+
+  ImpuRegDataTask::Config impu_handler_config(true, 3600, 7200, true, reg_data_cache);
+
+  HttpStackUtils::SpawningHandler<ImpiAvTask, ImpiTask::Config> impi_av_handler(&impi_handler_config);
+  HttpStackUtils::SpawningHandler<ImpiRegistrationStatusTask, ImpiRegistrationStatusTask::Config> impi_reg_status_handler(&registration_status_handler_config);
+  HttpStackUtils::SpawningHandler<ImpuLocationInfoTask, ImpuLocationInfoTask::Config> impu_loc_info_handler(&location_info_handler_config);
+  HttpStackUtils::SpawningHandler<ImpuRegDataTask, ImpuRegDataTask::Config> impu_reg_data_handler(&impu_handler_config);
+
+  HttpStack http_stack(scenario.http_threads, &exception_handler);
+
+  try
+  {
+    http_stack.initialize();
+    http_stack.bind_tcp_socket("127.0.0.1", port);
+    http_stack.register_handler("^/impi/[^/]*/av",
+                                &impi_av_handler);
+    http_stack.register_handler("^/impi/[^/]*/registration-status$",
+                                &impi_reg_status_handler);
+    http_stack.register_handler("^/impu/[^/]*/location$",
+                                &impu_loc_info_handler);
+    http_stack.register_handler("^/impu/[^/]*/reg-data$",
+                                &impu_reg_data_handler);
+    http_stack.start();
+  }
+  catch (HttpStack::Exception& e)
+  {
+    fprintf(stderr, "Failed to start the HTTP stack - function %s, rc %d\n",
+            e._func, e._rc);
+    return 1;
+  }
+
+  std::string server = "http://127.0.0.1:" + std::to_string(port);
+
+  if (scenario.preregister)
+  {
+    printf("Registering %d subscribers...\n", scenario.subscribers);
+
+    std::atomic<int> next_subscriber(0);
+    std::vector<std::thread> threads;
+
+    for (int ii = 0; ii < scenario.clients; ++ii)
+    {
+      threads.emplace_back([&server, &scenario, &next_subscriber]()
+      {
+        Client client(server);
+
+        for (int subscriber = next_subscriber++;
+             subscriber < scenario.subscribers;
+             subscriber = next_subscriber++)
+        {
+          client.send(RequestType::REG, subscriber);
+        }
+      });
+    }
+
+    for (std::thread& thread : threads)
+    {
+      thread.join();
+    }
+  }
+
+  printf("Running %d clients for %ds...\n", scenario.clients, scenario.duration_s);
+
+  std::vector<ResultsByType> client_results(scenario.clients,
+                                            ResultsByType(NUM_REQUEST_TYPES));
+  ResultsByType rtr_results(NUM_REQUEST_TYPES);
+  std::atomic<bool> running(true);
+  std::vector<std::thread> threads;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point end =
+    start + std::chrono::seconds(scenario.duration_s);
+
+  for (int ii = 0; ii < scenario.clients; ++ii)
+  {
+    threads.emplace_back([&server, &scenario, &client_results, &running, ii]()
+    {
+      Client client(server);
+      ResultsByType& results = client_results[ii];
+      std::mt19937 rng(ii);
+      std::discrete_distribution<int> pick_type(scenario.weights.begin(),
+                                                scenario.weights.end());
+      std::uniform_int_distribution<int> pick_subscriber(0, scenario.subscribers - 1);
+
+      while (running)
+      {
+        int type = pick_type(rng);
+        std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+
+        bool ok = client.send((RequestType)type, pick_subscriber(rng));
+
+        results[type].latencies_us.push_back(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - sent).count());
+
+        if (!ok)
+        {
+          results[type].errors++;
+        }
+      }
+    });
+  }
+
+  if ((scenario.rtr_interval_ms > 0) && (scenario.rtr_burst_size > 0))
+  {
+    // Each RTR in a burst is made from its own thread, as the HSS would send
+    // them concurrently.
+    threads.emplace_back([&scenario, &cache_processor, &rtr_results, &running, &end]()
+    {
+      std::mt19937 rng(scenario.clients);
+      std::uniform_int_distribution<int> pick_subscriber(0, scenario.subscribers - 1);
+      std::mutex results_lock;
+      Results& results = rtr_results[(int)RequestType::RTR];
+
+      while (running)
+      {
+        std::chrono::steady_clock::time_point next_burst =
+          std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(scenario.rtr_interval_ms);
+        std::vector<std::thread> rtrs;
+
+        for (int ii = 0; ii < scenario.rtr_burst_size; ++ii)
+        {
+          int subscriber = pick_subscriber(rng);
+          rtrs.emplace_back([&cache_processor, &results_lock, &results, subscriber]()
+          {
+            std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+            bool ok = registration_termination(&cache_processor, subscriber);
+            uint32_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - sent).count();
+
+            std::lock_guard<std::mutex> guard(results_lock);
+            results.latencies_us.push_back(latency_us);
+
+            if (!ok)
+            {
+              results.errors++;
+            }
+          });
+        }
+
+        for (std::thread& rtr : rtrs)
+        {
+          rtr.join();
+        }
+
+        std::this_thread::sleep_until(std::min(next_burst, end));
+      }
+    });
+  }
+
+  std::this_thread::sleep_until(end);
+  running = false;
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  double elapsed_s = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  ResultsByType results(NUM_REQUEST_TYPES);
+
+  for (const ResultsByType& client : client_results)
+  {
+    for (int type = 0; type < NUM_REQUEST_TYPES; ++type)
+    {
+      results[type].merge(client[type]);
+    }
+  }
+
+  results[(int)RequestType::RTR].merge(rtr_results[(int)RequestType::RTR]);
+
+  report(scenario, results, elapsed_s, hss);
+
+  http_stack.stop();
+  http_stack.wait_stopped();
+  cache_processor.stop();
+  cache_processor.wait_stopped();
+  delete reg_data_cache;
+  curl_global_cleanup();
+
+  return 0;
+}
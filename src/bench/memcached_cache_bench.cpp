@@ -0,0 +1,119 @@
+/**
+ * @file memcached_cache_bench.cpp Benchmarks for the MemcachedCache, against
+ * an in-process store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "bench.h"
+#include "localstore.h"
+#include "memcached_cache.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string IMPI = "impi@example.com";
+
+static const int ITERATIONS = 5000;
+
+// Builds the IMS subscription XML for an IRS with the given number of
+// associated IMPUs, and a service profile of roughly the given size.
+static std::string ims_subscription(int irs_size, size_t profile_size)
+{
+  std::string xml =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription>"
+    "<PrivateID>" + IMPI + "</PrivateID><ServiceProfile>"
+    "<PublicIdentity><Identity>" + IMPU + "</Identity>"
+    "<Extension><IdentityType>0</IdentityType></Extension></PublicIdentity>";
+
+  for (const std::string& impu : Bench::associated_impus(irs_size))
+  {
+    xml += "<PublicIdentity><Identity>" + impu + "</Identity>"
+           "<Extension><IdentityType>0</IdentityType></Extension>"
+           "</PublicIdentity>";
+  }
+
+  // Pad the profile out with iFCs taken from a profile of the right size.
+  std::string profile = Bench::service_profile_of_size(profile_size);
+  size_t ifcs_start = profile.find("<InitialFilterCriteria>");
+  size_t ifcs_end = profile.find("</ServiceProfile>");
+
+  if (ifcs_start != std::string::npos)
+  {
+    xml += profile.substr(ifcs_start, ifcs_end - ifcs_start);
+  }
+
+  xml += "</ServiceProfile></IMSSubscription>";
+
+  return xml;
+}
+
+BENCH_SUITE(MemcachedCacheOps)
+{
+  LocalStore local_data_store;
+  ImpuStore local_store(&local_data_store);
+  MemcachedCache cache(&local_store, {}, 0, nullptr);
+  progress_callback progress_cb = []() {};
+
+  for (int irs_size : { 1, 10, 100 })
+  {
+    for (size_t profile_size : { 1024, 16384 })
+    {
+      std::string xml = ims_subscription(irs_size, profile_size);
+      std::string suffix = " irs=" + std::to_string(irs_size) +
+                           " profile=" + std::to_string(profile_size);
+
+      std::function<void()> put_new_irs = [&cache, &xml, progress_cb]()
+      {
+        ImplicitRegistrationSet* irs = cache.create_implicit_registration_set();
+        irs->set_ttl(300);
+        irs->set_ims_sub_xml(xml);
+        irs->set_reg_state(RegistrationState::REGISTERED);
+        irs->add_associated_impi(IMPI);
+        cache.put_implicit_registration_set(irs, progress_cb, 0L, nullptr);
+        delete irs;
+      };
+
+      local_data_store.flush_all();
+
+      Bench::run("put new" + suffix,
+                 ITERATIONS,
+                 [&local_data_store]() { local_data_store.flush_all(); },
+                 put_new_irs);
+
+      Bench::run("get" + suffix,
+                 ITERATIONS,
+                 [&cache]()
+                 {
+                   ImplicitRegistrationSet* irs = nullptr;
+                   cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+                   delete irs;
+                 });
+
+      Bench::run("refresh" + suffix,
+                 ITERATIONS,
+                 [&cache, progress_cb]()
+                 {
+                   ImplicitRegistrationSet* irs = nullptr;
+                   cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+                   irs->set_ttl(300);
+                   cache.put_implicit_registration_set(irs, progress_cb, 0L, nullptr);
+                   delete irs;
+                 });
+
+      Bench::run("delete" + suffix,
+                 ITERATIONS,
+                 put_new_irs,
+                 [&cache, progress_cb]()
+                 {
+                   ImplicitRegistrationSet* irs = nullptr;
+                   cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+                   cache.delete_implicit_registration_set(irs, progress_cb, 0L, nullptr);
+                   delete irs;
+                 });
+    }
+  }
+}
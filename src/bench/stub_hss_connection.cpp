@@ -0,0 +1,137 @@
+/**
+ * @file stub_hss_connection.cpp HSS connection that answers every request
+ * immediately, for load testing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "stub_hss_connection.h"
+
+namespace HssConnection {
+
+const std::string StubHssConnection::SCHEME_DIGEST = "SIP Digest";
+const std::string StubHssConnection::SERVER_NAME = "sip:scscf.example.com";
+
+// The Diameter result code for a successful UAR or LIR.
+static const int32_t DIAMETER_SUCCESS = 2001;
+
+StubHssConnection::StubHssConnection(int associated_impus,
+                                     size_t profile_size) :
+  HssConnection(NULL),
+  mars(0),
+  uars(0),
+  lirs(0),
+  sars(0),
+  _associated_impus(associated_impus),
+  _profile_size(profile_size)
+{
+}
+
+void StubHssConnection::send_multimedia_auth_request(maa_cb callback,
+                                                     MultimediaAuthRequest request,
+                                                     SAS::TrailId trail,
+                                                     Utils::StopWatch* stopwatch)
+{
+  ++mars;
+
+  // The answer takes ownership of the AV.
+  DigestAuthVector* digest = new DigestAuthVector();
+  digest->ha1 = "ha1";
+  digest->realm = "example.com";
+  digest->qop = "auth";
+
+  MultimediaAuthAnswer answer(ResultCode::SUCCESS, digest, SCHEME_DIGEST);
+  callback(answer);
+}
+
+void StubHssConnection::send_user_auth_request(uaa_cb callback,
+                                               UserAuthRequest request,
+                                               SAS::TrailId trail,
+                                               Utils::StopWatch* stopwatch)
+{
+  ++uars;
+
+  UserAuthAnswer answer(ResultCode::SUCCESS,
+                        DIAMETER_SUCCESS,
+                        SERVER_NAME,
+                        ServerCapabilities());
+  callback(answer);
+}
+
+void StubHssConnection::send_location_info_request(lia_cb callback,
+                                                   LocationInfoRequest request,
+                                                   SAS::TrailId trail,
+                                                   Utils::StopWatch* stopwatch)
+{
+  ++lirs;
+
+  LocationInfoAnswer answer(ResultCode::SUCCESS,
+                            DIAMETER_SUCCESS,
+                            SERVER_NAME,
+                            ServerCapabilities(),
+                            "");
+  callback(answer);
+}
+
+void StubHssConnection::send_server_assignment_request(saa_cb callback,
+                                                       ServerAssignmentRequest request,
+                                                       SAS::TrailId trail,
+                                                       Utils::StopWatch* stopwatch)
+{
+  ++sars;
+
+  ServerAssignmentAnswer answer(ResultCode::SUCCESS,
+                                ChargingAddresses({ "ccf1" }, { "ecf1" }),
+                                ims_subscription(request.impu, request.impi),
+                                "");
+  callback(answer);
+}
+
+std::string StubHssConnection::ims_subscription(const std::string& impu,
+                                                const std::string& impi) const
+{
+  std::string xml =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription>"
+    "<PrivateID>" + impi + "</PrivateID><ServiceProfile>"
+    "<PublicIdentity><Identity>" + impu + "</Identity></PublicIdentity>";
+
+  // Derive the associated IMPUs from the requested IMPU, e.g.
+  // sip:user@example.com has sip:user-1@example.com, sip:user-2@example.com...
+  size_t at = impu.find('@');
+
+  for (int ii = 1; ii <= _associated_impus; ++ii)
+  {
+    std::string associated_impu = impu;
+    associated_impu.insert((at != std::string::npos) ? at : impu.size(),
+                           "-" + std::to_string(ii));
+    xml += "<PublicIdentity><Identity>" + associated_impu +
+           "</Identity></PublicIdentity>";
+  }
+
+  // Pad the service profile out with iFCs, as that's what makes real service
+  // profiles large.
+  int priority = 0;
+
+  while (xml.size() < _profile_size)
+  {
+    xml += "<InitialFilterCriteria><Priority>" +
+           std::to_string(priority++) +
+           "</Priority><TriggerPoint><ConditionTypeCNF>0</ConditionTypeCNF>"
+           "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+           "<Method>INVITE</Method></SPT></TriggerPoint><ApplicationServer>"
+           "<ServerName>sip:as" + std::to_string(priority) +
+           ".example.com</ServerName><DefaultHandling>0</DefaultHandling>"
+           "</ApplicationServer></InitialFilterCriteria>";
+  }
+
+  xml += "</ServiceProfile></IMSSubscription>";
+
+  return xml;
+}
+
+}; // namespace HssConnection
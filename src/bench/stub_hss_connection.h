@@ -0,0 +1,79 @@
+/**
+ * @file stub_hss_connection.h HSS connection that answers every request
+ * immediately, for load testing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STUB_HSS_CONNECTION_H__
+#define STUB_HSS_CONNECTION_H__
+
+#include <atomic>
+
+#include "hss_connection.h"
+
+namespace HssConnection {
+
+// An HssConnection that doesn't talk to an HSS at all. Every request
+// succeeds, and its answer is passed to the callback before the send
+// function returns.
+//
+// Server assignment answers contain an IMS subscription for the requested
+// IMPU and IMPI, with the given number of associated IMPUs (derived from the
+// requested IMPU) and a service profile padded out to roughly the given size
+// with iFCs.
+class StubHssConnection : public HssConnection
+{
+public:
+  StubHssConnection(int associated_impus, size_t profile_size);
+
+  virtual ~StubHssConnection() {};
+
+  virtual void send_multimedia_auth_request(maa_cb callback,
+                                            MultimediaAuthRequest request,
+                                            SAS::TrailId trail,
+                                            Utils::StopWatch* stopwatch) override;
+
+  virtual void send_user_auth_request(uaa_cb callback,
+                                      UserAuthRequest request,
+                                      SAS::TrailId trail,
+                                      Utils::StopWatch* stopwatch) override;
+
+  virtual void send_location_info_request(lia_cb callback,
+                                          LocationInfoRequest request,
+                                          SAS::TrailId trail,
+                                          Utils::StopWatch* stopwatch) override;
+
+  virtual void send_server_assignment_request(saa_cb callback,
+                                              ServerAssignmentRequest request,
+                                              SAS::TrailId trail,
+                                              Utils::StopWatch* stopwatch) override;
+
+  // The scheme the stub HSS returns digest AVs with.
+  static const std::string SCHEME_DIGEST;
+
+  // The S-CSCF the stub HSS returns in UAAs and LIAs.
+  static const std::string SERVER_NAME;
+
+  // The number of requests of each type that have been answered.
+  std::atomic<uint64_t> mars;
+  std::atomic<uint64_t> uars;
+  std::atomic<uint64_t> lirs;
+  std::atomic<uint64_t> sars;
+
+private:
+  // Builds the IMS subscription the stub HSS holds for the given IMPU and IMPI.
+  std::string ims_subscription(const std::string& impu,
+                               const std::string& impi) const;
+
+  int _associated_impus;
+  size_t _profile_size;
+};
+
+}; // namespace HssConnection
+#endif
@@ -0,0 +1,115 @@
+/**
+ * @file xml_utils_bench.cpp Benchmarks for extracting the identities from an
+ * IMS subscription.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "bench.h"
+#include "homestead_xml_utils.h"
+
+static const int ITERATIONS = 5000;
+
+// The number of service profiles in the IMS subscription, the number of
+// public identities in each, and the approximate size of each service
+// profile (in bytes), to benchmark.
+static const std::vector<int> PROFILE_COUNTS = { 1, 4, 16 };
+static const std::vector<int> IDENTITY_COUNTS = { 1, 10 };
+static const std::vector<size_t> PROFILE_SIZES = { 1024, 16384 };
+
+// Builds an IMS subscription with the given number of service profiles, each
+// with the given number of public identities and padded out to roughly the
+// given size with initial filter criteria.
+static std::string ims_subscription(int profile_count,
+                                    int identity_count,
+                                    size_t profile_size)
+{
+  // Take the initial filter criteria from a single service profile of the
+  // right size.
+  std::string ifcs = Bench::service_profile_of_size(profile_size);
+  size_t ifcs_start = ifcs.find("<InitialFilterCriteria>");
+  size_t ifcs_end = ifcs.find("</ServiceProfile>");
+  ifcs = (ifcs_start != std::string::npos) ?
+         ifcs.substr(ifcs_start, ifcs_end - ifcs_start) :
+         "";
+
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription>"
+                    "<PrivateID>impi@example.com</PrivateID>";
+  std::vector<std::string> impus =
+    Bench::associated_impus(profile_count * identity_count);
+
+  for (int profile = 0; profile < profile_count; ++profile)
+  {
+    xml += "<ServiceProfile>";
+
+    for (int identity = 0; identity < identity_count; ++identity)
+    {
+      xml += "<PublicIdentity><Identity>" +
+             impus[profile * identity_count + identity] +
+             "</Identity><BarringIndication>0</BarringIndication>"
+             "<Extension><IdentityType>0</IdentityType></Extension>"
+             "</PublicIdentity>";
+    }
+
+    xml += ifcs + "</ServiceProfile>";
+  }
+
+  xml += "</IMSSubscription>";
+
+  return xml;
+}
+
+BENCH_SUITE(IdentityExtraction)
+{
+  for (int profile_count : PROFILE_COUNTS)
+  {
+    for (int identity_count : IDENTITY_COUNTS)
+    {
+      for (size_t profile_size : PROFILE_SIZES)
+      {
+        std::string xml = ims_subscription(profile_count,
+                                           identity_count,
+                                           profile_size);
+        std::string suffix = " profiles=" + std::to_string(profile_count) +
+                             " identities=" + std::to_string(identity_count) +
+                             " size=" + std::to_string(xml.size());
+
+        // Check that the scanner handles the XML and agrees with rapidxml,
+        // otherwise we'd be benchmarking the fallback.
+        IdentityIndex scanned;
+        XmlUtils::ParsedImsSubscription parsed(xml);
+
+        if ((!XmlUtils::scan_identity_index(xml, scanned)) ||
+            (!(scanned == parsed.identity_index())))
+        {
+          fprintf(stderr, "Scanned identities don't match parsed identities%s\n",
+                  suffix.c_str());
+          exit(1);
+        }
+
+        Bench::run("parse" + suffix,
+                   ITERATIONS,
+                   [&xml]()
+                   {
+                     XmlUtils::ParsedImsSubscription ims_sub(xml);
+                   });
+
+        Bench::run("scan" + suffix,
+                   ITERATIONS,
+                   [&xml]()
+                   {
+                     IdentityIndex index;
+                     XmlUtils::scan_identity_index(xml, index);
+                   });
+      }
+    }
+  }
+}
@@ -0,0 +1,60 @@
+/**
+ * @file coalescing_hss_connection.cpp HSS connection that coalesces concurrent
+ * identical server assignment requests.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "coalescing_hss_connection.h"
+#include "log.h"
+
+namespace HssConnection {
+
+void CoalescingHssConnection::send_server_assignment_request(saa_cb callback,
+                                                             ServerAssignmentRequest request,
+                                                             SAS::TrailId trail,
+                                                             Utils::StopWatch* stopwatch)
+{
+  SarKey key(request.impi,
+             request.impu,
+             request.server_name,
+             request.type,
+             request.support_shared_ifcs,
+             request.wildcard_impu);
+
+  SingleFlight<SarKey, saa_cb>::FlightPtr flight = _sars.join(key, callback);
+
+  if (!flight)
+  {
+    TRC_DEBUG("Joining in-flight SAR for %s (type %d)",
+              request.impu.c_str(),
+              request.type);
+    return;
+  }
+
+  _hss_connection->send_server_assignment_request(
+    [this, key, flight](const ServerAssignmentAnswer& saa)
+    {
+      std::vector<saa_cb> callbacks = _sars.complete(key, flight);
+
+      if (callbacks.size() > 1)
+      {
+        TRC_DEBUG("Passing SAA to %lu coalesced SARs", callbacks.size());
+      }
+
+      for (saa_cb& cb : callbacks)
+      {
+        cb(saa);
+      }
+    },
+    request,
+    trail,
+    stopwatch);
+}
+
+}; // namespace HssConnection
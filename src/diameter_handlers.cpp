@@ -376,7 +376,10 @@ void PushProfileTask::on_get_ims_sub_success(ImsSubscription* ims_sub)
   // it's not going to change the default impu for that IRS
   if (_ims_sub_present)
   {
-    XmlUtils::get_default_id(_ims_subscription, new_default_id);
+    // Parse the new IMS subscription once, for all the identities we need
+    // from it and for updating the IRS.
+    XmlUtils::ParsedImsSubscription parsed_ims_sub(_ims_subscription);
+    new_default_id = parsed_ims_sub.default_id();
 
     ImplicitRegistrationSet* irs = _ims_sub->get_irs_for_default_impu(new_default_id);
     if (!irs)
@@ -396,7 +399,7 @@ void PushProfileTask::on_get_ims_sub_success(ImsSubscription* ims_sub)
     // If we've got here, the PPR is allowed. We should now check that the IRS
     // from the PPR contains a SIP URI and throw an error log if it doesn't,
     // although we continue as normal even if it doesn't.
-    _impus = XmlUtils::get_public_ids(_ims_subscription);
+    _impus = parsed_ims_sub.public_ids();
     bool found_sip_uri = false;
 
     for (std::vector<std::string>::iterator it = _impus.begin();
@@ -430,7 +433,7 @@ void PushProfileTask::on_get_ims_sub_success(ImsSubscription* ims_sub)
     // charging addresses later.
     // Note - we don't update the TTL for the data, since we only do that on
     // (re)-registration
-    irs->set_ims_sub_xml(_ims_subscription);
+    irs->set_ims_sub_xml(parsed_ims_sub);
 
     // Notify Sprout of the change
     HTTPCode rc = _cfg->sprout_conn->change_associated_identities(new_default_id,
@@ -10,6 +10,7 @@
  */
 
 #include <algorithm>
+#include <cstring>
 
 #include "homestead_xml_utils.h"
 #include "xml_utils.h"
@@ -39,6 +40,17 @@ int build_ClearwaterRegData_xml(ImplicitRegistrationSet* irs,
 int build_ClearwaterRegData_xml(ImplicitRegistrationSet* irs,
                                 std::string& xml_str,
                                 RegistrationState prev_reg_state)
+{
+  ParsedImsSubscription ims_sub(irs->get_ims_sub_xml());
+  return build_ClearwaterRegData_xml(irs, ims_sub, xml_str, prev_reg_state);
+}
+
+// As above, but using the IRS's IMS subscription already parsed by the
+// caller.
+int build_ClearwaterRegData_xml(ImplicitRegistrationSet* irs,
+                                const ParsedImsSubscription& ims_sub,
+                                std::string& xml_str,
+                                RegistrationState prev_reg_state)
 {
   rapidxml::xml_document<> doc;
   rapidxml::xml_node<>* root = doc.allocate_node(rapidxml::node_type::node_element,
@@ -66,18 +78,17 @@ int build_ClearwaterRegData_xml(ImplicitRegistrationSet* irs,
                        previous_state_string);
   }
 
-  std::string xml = irs->get_ims_sub_xml();
-  if (xml != "")
+  if (ims_sub.xml() != "")
   {
-    // Parse the XML document - note we need to pass in the prev_doc here to
-    // ensure it isn't destroyed before the XML is printed.
-    rapidxml::xml_document<> prev_doc;
-    int rc = add_ims_subscription_node(xml, doc, root, prev_doc);
-
-    if (rc == HTTP_SERVER_ERROR)
+    // The cloned node shares its names and values with the parsed IMS
+    // subscription, which outlives the printing of this document.
+    if (ims_sub.ims_subscription_node() == NULL)
     {
+      TRC_DEBUG("Missing or invalid IMS Subscription in XML");
       return HTTP_SERVER_ERROR;
     }
+
+    root->append_node(doc.clone_node(ims_sub.ims_subscription_node()));
   }
 
   ChargingAddresses charging_addrs = irs->get_charging_addresses();
@@ -92,6 +103,89 @@ int build_ClearwaterRegData_xml(ImplicitRegistrationSet* irs,
   return HTTP_OK;
 }
 
+std::string ClearwaterRegDataCache::make_key(ImplicitRegistrationSet* irs,
+                                             RegistrationState prev_reg_state)
+{
+  std::string key = irs->get_default_impu();
+  key += '\0';
+  key += std::to_string(irs->get_version());
+  key += '\0';
+  key += std::to_string(irs->get_reg_state());
+  key += '\0';
+  key += std::to_string(prev_reg_state);
+  return key;
+}
+
+bool ClearwaterRegDataCache::get(ImplicitRegistrationSet* irs,
+                                 RegistrationState prev_reg_state,
+                                 std::string& xml_str)
+{
+  if (irs->get_version() == 0)
+  {
+    return false;
+  }
+
+  std::string key = make_key(irs, prev_reg_state);
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = _entries.find(key);
+
+  if ((it == _entries.end()) ||
+      (it->second.ims_sub_xml != irs->get_ims_sub_xml()) ||
+      (!(it->second.charging_addresses == irs->get_charging_addresses())))
+  {
+    return false;
+  }
+
+  // Move the entry to the front of the LRU list.
+  _lru.splice(_lru.begin(), _lru, it->second.lru_it);
+
+  TRC_DEBUG("Using cached ClearwaterRegData XML for %s",
+            irs->get_default_impu().c_str());
+  xml_str = it->second.xml;
+  return true;
+}
+
+void ClearwaterRegDataCache::put(ImplicitRegistrationSet* irs,
+                                 RegistrationState prev_reg_state,
+                                 const std::string& xml_str)
+{
+  if (irs->get_version() == 0)
+  {
+    return;
+  }
+
+  std::string key = make_key(irs, prev_reg_state);
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = _entries.find(key);
+
+  if (it != _entries.end())
+  {
+    _lru.splice(_lru.begin(), _lru, it->second.lru_it);
+  }
+  else
+  {
+    if (_entries.size() >= _max_entries)
+    {
+      // Evict the least recently used entry to make room.
+      _entries.erase(_lru.back());
+      _lru.pop_back();
+    }
+
+    _lru.push_front(key);
+    it = _entries.insert(std::make_pair(key, Entry())).first;
+    it->second.lru_it = _lru.begin();
+  }
+
+  Entry& entry = it->second;
+  entry.xml = xml_str;
+  entry.ims_sub_xml = irs->get_ims_sub_xml();
+  entry.charging_addresses = irs->get_charging_addresses();
+}
+
 // Builds a RegistrationState or PreviousRegistrationState node, and adds it to
 // the passed in XML doc.
 //
@@ -128,49 +222,6 @@ void add_reg_state_node(RegistrationState state,
   root->append_node(reg);
 }
 
-// Builds the IMSSubscription node, and adds it to the passed in XML doc.
-int add_ims_subscription_node(std::string xml,
-                              rapidxml::xml_document<> &doc,
-                              rapidxml::xml_node<>* root,
-                              rapidxml::xml_document<> &prev_doc)
-{
-  rapidxml::xml_node<>* is = NULL;
-
-  // Parse the XML document, saving off the passed-in string first (as parsing
-  // is destructive). This doesn't need freeing - prev_doc is on the stack,
-  // and this uses its memory pool.
-  char* user_data_str = prev_doc.allocate_string(xml.c_str());
-
-  try
-  {
-    prev_doc.parse<rapidxml::parse_strip_xml_namespaces>(user_data_str);
-
-    if (prev_doc.first_node(RegDataXMLUtils::IMS_SUBSCRIPTION))
-    {
-      is = doc.clone_node(prev_doc.first_node(RegDataXMLUtils::IMS_SUBSCRIPTION));
-    }
-    else
-    {
-      TRC_DEBUG("Missing IMS Subscription in XML");
-      prev_doc.clear();
-      return HTTP_SERVER_ERROR;
-    }
-  }
-  catch (rapidxml::parse_error err)
-  {
-    TRC_DEBUG("Parse error in IMS Subscription document: %s\n\n%s", err.what(), xml.c_str());
-    prev_doc.clear();
-    return HTTP_SERVER_ERROR;
-  }
-
-  if (is != NULL)
-  {
-    root->append_node(is);
-  }
-
-  return HTTP_OK;
-}
-
 // Builds the ChargingAddresses node, and adds it to the xml doc passed in.
 void add_charging_addr_node(const ChargingAddresses& charging_addrs,
                             rapidxml::xml_document<> &doc,
@@ -226,154 +277,819 @@ void add_charging_addr_node(const ChargingAddresses& charging_addrs,
   root->append_node(cfs);
 }
 
-// Parses the given User-Data XML to retrieve a list of all the public IDs.
-std::vector<std::string> get_public_ids(const std::string& user_data)
-{
-  std::string unused_default_id;
-  return get_public_and_default_ids(user_data, unused_default_id);
-}
-
-// Parses the given User-Data XML to retrieve the default public ID (the first
-// unbarred public ID).
-void get_default_id(const std::string& user_data,
-                    std::string &default_id)
+// Parses the IMS subscription, and extracts its public, default and private
+// IDs.
+ParsedImsSubscription::ParsedImsSubscription(const std::string& xml) :
+  _xml(xml),
+  _ims_subscription(NULL)
 {
-  std::vector<std::string> unused_public_ids;
-  unused_public_ids = get_public_and_default_ids(user_data, default_id);
-}
+  // Parsing is destructive, so parse a copy of the XML. This doesn't need
+  // freeing - it's allocated from the document's memory pool.
+  char* xml_str = _doc.allocate_string(_xml.c_str());
 
-// Parses the given User-Data XML to retrieve a list of all the public IDs, and
-// the default public ID (the first unbarred public ID).
-std::vector<std::string> get_public_and_default_ids(const std::string &user_data,
-                                                    std::string &default_id)
-{
-  std::vector<std::string> public_ids;
-  std::vector<std::string> unbarred_public_ids;
+  try
+  {
+    _doc.parse<rapidxml::parse_strip_xml_namespaces>(xml_str);
+  }
+  catch (rapidxml::parse_error err)
+  {
+    TRC_DEBUG("Parse error in IMS Subscription document: %s\n\n%s", err.what(), _xml.c_str());
+    _doc.clear();
+  }
 
-  // Parse the XML document, saving off the passed-in string first (as parsing
-  // is destructive).
-  rapidxml::xml_document<> doc;
+  _ims_subscription = _doc.first_node(RegDataXMLUtils::IMS_SUBSCRIPTION);
 
-  // This doesn't need freeing - doc is on the stack, and this
-  // uses its memory pool.
-  char* user_data_str = doc.allocate_string(user_data.c_str());
+  if (_ims_subscription == NULL)
+  {
+    return;
+  }
 
-  try
+  rapidxml::xml_node<>* id = _ims_subscription->first_node(RegDataXMLUtils::PRIVATE_ID);
+  if (id)
   {
-    doc.parse<rapidxml::parse_strip_xml_namespaces>(user_data_str);
+    _identity_index.private_id = id->value();
+
+    if (_identity_index.private_id.compare("null") == 0)
+    {
+      _identity_index.private_id = ""; // LCOV_EXCL_LINE
+    }
   }
-  catch (rapidxml::parse_error err)
+  else
   {
-    TRC_DEBUG("Parse error in IMS Subscription document: %s\n\n%s", err.what(), user_data.c_str());
-    doc.clear();
+    TRC_DEBUG("Missing Private ID in IMS Subscription document: \n\n%s", _xml.c_str());
   }
 
   // Walk through all nodes in the hierarchy IMSSubscription->ServiceProfile->PublicIdentity
   // ->Identity.
-  rapidxml::xml_node<>* is = doc.first_node(RegDataXMLUtils::IMS_SUBSCRIPTION);
-  if (is)
+  for (rapidxml::xml_node<>* sp = _ims_subscription->first_node(RegDataXMLUtils::SERVICE_PROFILE);
+       sp;
+       sp = sp->next_sibling(RegDataXMLUtils::SERVICE_PROFILE))
   {
-    for (rapidxml::xml_node<>* sp = is->first_node(RegDataXMLUtils::SERVICE_PROFILE);
-         sp;
-         sp = sp->next_sibling(RegDataXMLUtils::SERVICE_PROFILE))
+    for (rapidxml::xml_node<>* pi = sp->first_node(RegDataXMLUtils::PUBLIC_IDENTITY);
+         pi;
+         pi = pi->next_sibling(RegDataXMLUtils::PUBLIC_IDENTITY))
     {
-      for (rapidxml::xml_node<>* pi = sp->first_node(RegDataXMLUtils::PUBLIC_IDENTITY);
-           pi;
-           pi = pi->next_sibling(RegDataXMLUtils::PUBLIC_IDENTITY))
+      rapidxml::xml_node<>* id = pi->first_node(RegDataXMLUtils::IDENTITY);
+      uint8_t flags = 0;
+      rapidxml::xml_node<>* barring_indication = pi->first_node(RegDataXMLUtils::BARRING_INDICATION);
+      if ((barring_indication) &&
+          (strcmp(barring_indication->value(), RegDataXMLUtils::STATE_UNBARRED) != 0))
       {
-        rapidxml::xml_node<>* id = pi->first_node(RegDataXMLUtils::IDENTITY);
-        std::string barring_value = RegDataXMLUtils::STATE_UNBARRED;
-        rapidxml::xml_node<>* barring_indication = pi->first_node(RegDataXMLUtils::BARRING_INDICATION);
-        if (barring_indication)
-        {
-          barring_value = barring_indication->value();
-        }
+        flags |= IdentityIndex::BARRED;
+      }
+
+      if (id)
+      {
+        std::string uri = std::string(id->value());
 
-        if (id)
+        rapidxml::xml_node<>* extension = pi->first_node(RegDataXMLUtils::EXTENSION);
+        if (extension)
         {
-          std::string uri = std::string(id->value());
+          RegDataXMLUtils::parse_extension_identity(uri, extension);
 
-          rapidxml::xml_node<>* extension = pi->first_node(RegDataXMLUtils::EXTENSION);
-          if (extension)
+          if (uri != id->value())
           {
-            RegDataXMLUtils::parse_extension_identity(uri, extension);
+            flags |= IdentityIndex::WILDCARD;
           }
+        }
+
+        if (std::find(_public_ids.begin(), _public_ids.end(), uri) ==
+            _public_ids.end())
+        {
+          _public_ids.push_back(uri);
+          _identity_index.identities.emplace_back(uri, flags);
 
-          if (std::find(public_ids.begin(), public_ids.end(), uri) ==
-              public_ids.end())
+          // The default id is the first unbarred public identity.
+          if ((_default_id.empty()) && ((flags & IdentityIndex::BARRED) == 0))
           {
-            public_ids.push_back(uri);
-            if (barring_value == RegDataXMLUtils::STATE_UNBARRED)
-            {
-              unbarred_public_ids.push_back(uri);
-            }
+            _default_id = uri;
           }
         }
-        else
-        {
-          TRC_WARNING("PublicIdentity node was missing Identity child: %s", user_data.c_str());
-        }
+      }
+      else
+      {
+        TRC_WARNING("PublicIdentity node was missing Identity child: %s", _xml.c_str());
       }
     }
   }
+}
 
-  if (public_ids.size() == 0)
+// Scans an IMS subscription for its identities in a single forward pass,
+// without building a DOM or copying the XML.
+//
+// It follows the same rules as rapidxml (parsing with
+// parse_strip_xml_namespaces), so finds the same identities as
+// ParsedImsSubscription. Anything it doesn't handle in exactly the same way
+// (e.g. a DOCTYPE, or numeric character references, which rapidxml rejects
+// if they're invalid) makes it give up, so the caller can parse the XML
+// instead. In particular, it leaves invalid XML to rapidxml to reject.
+//
+// The time goes in finding the next '<' (and the end of each attribute
+// value), which is done with memchr, as glibc vectorises it for the CPU it's
+// running on.
+class IdentityScanner
+{
+public:
+  IdentityScanner(const std::string& xml, IdentityIndex& index) :
+    _xml(xml),
+    _p(xml.data()),
+    _end(xml.data() + xml.size()),
+    _index(index),
+    _depth(0),
+    _seen_ims_subscription(false),
+    _seen_private_id(false),
+    _capture(NULL),
+    _capture_depth(0)
   {
-    TRC_ERROR("Failed to extract any ServiceProfile/PublicIdentity/Identity nodes from %s", user_data.c_str());
+    _kinds[0] = OTHER;
   }
 
-  // Set the default id - this is the first unbarred public identity.
-  if (unbarred_public_ids.size() != 0)
+  // Scans the XML into the index. Returns false if the scanner couldn't
+  // handle it, in which case the index is only partially filled in.
+  bool scan();
+
+private:
+  // The elements the scanner is interested in.
+  enum Kind
   {
-    default_id = unbarred_public_ids.front();
+    OTHER,
+    IMS_SUBSCRIPTION,
+    PRIVATE_ID,
+    SERVICE_PROFILE,
+    PUBLIC_IDENTITY,
+    IDENTITY,
+    BARRING_INDICATION,
+    EXTENSION
+  };
+
+  // Only elements down to the children of the PublicIdentity's Extension
+  // are of interest, so only their kinds are tracked.
+  static const int MAX_TRACKED_DEPTH = 6;
+
+  // The parts of the PublicIdentity currently being scanned.
+  struct PublicIdentity
+  {
+    bool has_identity;
+    std::string identity;
+    bool has_barring_indication;
+    std::string barring_indication;
+    bool has_extension;
+    bool wildcard_extension;
+    const char* extension_start;
+    const char* extension_end;
+  };
+
+  bool scan_data(const char* start, const char* end);
+  bool scan_markup();
+  bool scan_element();
+  bool scan_closing_tag();
+  bool skip_past(const char* terminator);
+  void open_element(const char* name, size_t length, const char* tag_start);
+  bool close_element();
+  bool finish_public_identity();
+  bool parse_extension(std::string& uri);
+
+  Kind kind_at(int depth) const
+  {
+    return (depth < MAX_TRACKED_DEPTH) ? _kinds[depth] : OTHER;
   }
 
-  return public_ids;
+  // Character classes, as defined by rapidxml, looked up in a table as
+  // they're tested for every character of every tag. None of them include
+  // NUL, so the NUL at the end of the XML stops any loop over them.
+  enum CharClass
+  {
+    WHITESPACE = 0x01,
+    NAME = 0x02,
+    ATTRIBUTE_NAME = 0x04
+  };
+
+  struct CharClasses
+  {
+    CharClasses()
+    {
+      for (int c = 0; c < 256; ++c)
+      {
+        bool whitespace = (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t');
+        bool name = (c != '\0') && !whitespace && (c != '/') && (c != '>') && (c != '?');
+        bool attribute_name = name && (c != '<') && (c != '=') && (c != '!');
+        classes[c] = (whitespace ? WHITESPACE : 0) |
+                     (name ? NAME : 0) |
+                     (attribute_name ? ATTRIBUTE_NAME : 0);
+      }
+    }
+
+    uint8_t classes[256];
+  };
+
+  static const CharClasses CHAR_CLASSES;
+
+  static bool is(char c, CharClass char_class)
+  {
+    return (CHAR_CLASSES.classes[(uint8_t)c] & char_class) != 0;
+  }
+
+  void skip(CharClass char_class)
+  {
+    while (is(*_p, char_class))
+    {
+      ++_p;
+    }
+  }
+
+  static bool name_is(const char* name, size_t length, const char* expected)
+  {
+    return (strlen(expected) == length) && (memcmp(name, expected, length) == 0);
+  }
+
+  static bool has_character_reference(const char* start, const char* end);
+  static void decode(const char* start, const char* end, std::string& value);
+
+  const std::string& _xml;
+  const char* _p;
+  const char* const _end;
+  IdentityIndex& _index;
+
+  int _depth;
+  Kind _kinds[MAX_TRACKED_DEPTH];
+
+  // rapidxml's first_node() only finds the first of these.
+  bool _seen_ims_subscription;
+  bool _seen_private_id;
+
+  PublicIdentity _public_identity;
+
+  // The value of the element at _capture_depth (if any) goes here. As for
+  // rapidxml, that's the first text directly inside it that isn't all
+  // whitespace.
+  std::string* _capture;
+  int _capture_depth;
+};
+
+const IdentityScanner::CharClasses IdentityScanner::CHAR_CLASSES;
+
+bool IdentityScanner::scan()
+{
+  // rapidxml stops at the first NUL, so leave XML with one in to it. That
+  // leaves the one at the end for the scanner to stop at.
+  if (memchr(_p, '\0', _end - _p) != NULL)
+  {
+    return false;
+  }
+
+  // Skip any UTF-8 byte order mark.
+  if ((_end - _p >= 3) && (memcmp(_p, "\xEF\xBB\xBF", 3) == 0))
+  {
+    _p += 3;
+  }
+
+  while (true)
+  {
+    const char* markup = (const char*)memchr(_p, '<', _end - _p);
+
+    if (!scan_data(_p, (markup != NULL) ? markup : _end))
+    {
+      return false;
+    }
+
+    if (markup == NULL)
+    {
+      break;
+    }
+
+    _p = markup + 1;
+
+    if (!scan_markup())
+    {
+      return false;
+    }
+  }
+
+  // Any elements still open are unterminated.
+  if (_depth != 0)
+  {
+    return false;
+  }
+
+  if (_seen_ims_subscription)
+  {
+    if (!_seen_private_id)
+    {
+      TRC_DEBUG("Missing Private ID in IMS Subscription document: \n\n%s", _xml.c_str());
+    }
+    else if (_index.private_id.compare("null") == 0)
+    {
+      _index.private_id = ""; // LCOV_EXCL_LINE
+    }
+  }
+
+  return true;
 }
 
-// Parses the given User-Data XML to retrieve the single PrivateID element.
-std::string get_private_id(const std::string& user_data)
+// Handles the text between two pieces of markup.
+bool IdentityScanner::scan_data(const char* start, const char* end)
 {
-  std::string impi;
+  const char* text = start;
 
-  // Parse the XML document, saving off the passed-in string first (as parsing
-  // is destructive).
-  rapidxml::xml_document<> doc;
+  while ((text < end) && (is(*text, WHITESPACE)))
+  {
+    ++text;
+  }
 
-  // This doesn't need freeing - prev_doc is on the stack, and this
-  // uses its memory pool.
-  char* user_data_str = doc.allocate_string(user_data.c_str());
+  if (text == end)
+  {
+    // rapidxml ignores text that's all whitespace.
+    return true;
+  }
+
+  if ((_depth == 0) || (has_character_reference(start, end)))
+  {
+    return false;
+  }
+
+  if ((_capture != NULL) && (_depth == _capture_depth))
+  {
+    // The text keeps its leading and trailing whitespace.
+    decode(start, end, *_capture);
+    _capture = NULL;
+  }
+
+  return true;
+}
+
+// Handles the markup starting at _p, just after the '<'.
+bool IdentityScanner::scan_markup()
+{
+  if (_p == _end)
+  {
+    return false;
+  }
+
+  switch (*_p)
+  {
+  case '/':
+    return scan_closing_tag();
+
+  case '?':
+    // An XML declaration or processing instruction.
+    ++_p;
+    return skip_past("?>");
+
+  case '!':
+    if ((_end - _p >= 3) && (memcmp(_p, "!--", 3) == 0))
+    {
+      _p += 3;
+      return skip_past("-->");
+    }
+    else if ((_end - _p >= 8) && (memcmp(_p, "![CDATA[", 8) == 0))
+    {
+      // CDATA doesn't count towards an element's value, so can be skipped.
+      _p += 8;
+      return skip_past("]]>");
+    }
+
+    // Anything else (e.g. a DOCTYPE) is left to rapidxml.
+    return false;
+
+  default:
+    return scan_element();
+  }
+}
+
+bool IdentityScanner::scan_element()
+{
+  const char* tag_start = _p - 1;
+  const char* name = _p;
+  skip(NAME);
+
+  size_t length = _p - name;
+  const char* colon = (const char*)memchr(name, ':', length);
+
+  if (colon != NULL)
+  {
+    // Strip the namespace prefix. Leave anything unusual to rapidxml.
+    if (colon == name)
+    {
+      return false;
+    }
+
+    length -= (colon + 1 - name);
+    name = colon + 1;
+
+    if (memchr(name, ':', length) != NULL)
+    {
+      return false;
+    }
+  }
+
+  if (length == 0)
+  {
+    return false;
+  }
+
+  skip(WHITESPACE);
+
+  while (is(*_p, ATTRIBUTE_NAME))
+  {
+    skip(ATTRIBUTE_NAME);
+    skip(WHITESPACE);
+
+    if (*_p != '=')
+    {
+      return false;
+    }
+
+    ++_p;
+    skip(WHITESPACE);
+
+    if ((*_p != '"') && (*_p != '\''))
+    {
+      return false;
+    }
+
+    const char* value = _p + 1;
+    const char* value_end = (const char*)memchr(value, *_p, _end - value);
+
+    if ((value_end == NULL) || (has_character_reference(value, value_end)))
+    {
+      return false;
+    }
+
+    _p = value_end + 1;
+    skip(WHITESPACE);
+  }
+
+  if (*_p == '>')
+  {
+    ++_p;
+    open_element(name, length, tag_start);
+    return true;
+  }
+  else if ((*_p == '/') && (_p[1] == '>'))
+  {
+    _p += 2;
+    open_element(name, length, tag_start);
+    return close_element();
+  }
+
+  return false;
+}
+
+bool IdentityScanner::scan_closing_tag()
+{
+  // Like rapidxml, don't check that the name matches the opening tag.
+  ++_p;
+  skip(NAME);
+  skip(WHITESPACE);
+
+  if ((_depth == 0) || (*_p != '>'))
+  {
+    return false;
+  }
+
+  ++_p;
+  return close_element();
+}
+
+bool IdentityScanner::skip_past(const char* terminator)
+{
+  size_t length = strlen(terminator);
+  const char* found = (const char*)memmem(_p, _end - _p, terminator, length);
+
+  if (found == NULL)
+  {
+    return false;
+  }
+
+  _p = found + length;
+  return true;
+}
+
+void IdentityScanner::open_element(const char* name,
+                                   size_t length,
+                                   const char* tag_start)
+{
+  Kind parent = kind_at(_depth);
+  Kind kind = OTHER;
+  ++_depth;
+
+  if (_depth == 1)
+  {
+    if ((!_seen_ims_subscription) &&
+        (name_is(name, length, RegDataXMLUtils::IMS_SUBSCRIPTION)))
+    {
+      _seen_ims_subscription = true;
+      kind = IMS_SUBSCRIPTION;
+    }
+  }
+  else if (parent == IMS_SUBSCRIPTION)
+  {
+    if ((!_seen_private_id) &&
+        (name_is(name, length, RegDataXMLUtils::PRIVATE_ID)))
+    {
+      _seen_private_id = true;
+      _capture = &_index.private_id;
+      _capture_depth = _depth;
+      kind = PRIVATE_ID;
+    }
+    else if (name_is(name, length, RegDataXMLUtils::SERVICE_PROFILE))
+    {
+      kind = SERVICE_PROFILE;
+    }
+  }
+  else if (parent == SERVICE_PROFILE)
+  {
+    if (name_is(name, length, RegDataXMLUtils::PUBLIC_IDENTITY))
+    {
+      _public_identity.has_identity = false;
+      _public_identity.identity.clear();
+      _public_identity.has_barring_indication = false;
+      _public_identity.barring_indication.clear();
+      _public_identity.has_extension = false;
+      _public_identity.wildcard_extension = false;
+      kind = PUBLIC_IDENTITY;
+    }
+  }
+  else if (parent == PUBLIC_IDENTITY)
+  {
+    if ((!_public_identity.has_identity) &&
+        (name_is(name, length, RegDataXMLUtils::IDENTITY)))
+    {
+      _public_identity.has_identity = true;
+      _capture = &_public_identity.identity;
+      _capture_depth = _depth;
+      kind = IDENTITY;
+    }
+    else if ((!_public_identity.has_barring_indication) &&
+             (name_is(name, length, RegDataXMLUtils::BARRING_INDICATION)))
+    {
+      _public_identity.has_barring_indication = true;
+      _capture = &_public_identity.barring_indication;
+      _capture_depth = _depth;
+      kind = BARRING_INDICATION;
+    }
+    else if ((!_public_identity.has_extension) &&
+             (name_is(name, length, RegDataXMLUtils::EXTENSION)))
+    {
+      _public_identity.has_extension = true;
+      _public_identity.extension_start = tag_start;
+      kind = EXTENSION;
+    }
+  }
+
+  if ((_depth > 4) && (kind_at(4) == EXTENSION))
+  {
+    // The Extension only affects the identity if it holds more than just an
+    // IdentityType, e.g. a WildcardedIMPU.
+    if ((_depth != 5) || (!name_is(name, length, RegDataXMLUtils::IDENTITY_TYPE)))
+    {
+      _public_identity.wildcard_extension = true;
+    }
+  }
+
+  if (_depth < MAX_TRACKED_DEPTH)
+  {
+    _kinds[_depth] = kind;
+  }
+}
+
+bool IdentityScanner::close_element()
+{
+  Kind kind = kind_at(_depth);
+  bool ok = true;
+
+  if (_depth == _capture_depth)
+  {
+    // The element didn't have a value.
+    _capture = NULL;
+    _capture_depth = 0;
+  }
+
+  if (kind == EXTENSION)
+  {
+    _public_identity.extension_end = _p;
+  }
+  else if (kind == PUBLIC_IDENTITY)
+  {
+    ok = finish_public_identity();
+  }
+
+  --_depth;
+  return ok;
+}
+
+// Adds the PublicIdentity that's just been scanned to the index, in the same
+// way as ParsedImsSubscription.
+bool IdentityScanner::finish_public_identity()
+{
+  if (!_public_identity.has_identity)
+  {
+    TRC_WARNING("PublicIdentity node was missing Identity child: %s", _xml.c_str());
+    return true;
+  }
+
+  std::string uri = _public_identity.identity;
+  uint8_t flags = 0;
+
+  if ((_public_identity.has_barring_indication) &&
+      (_public_identity.barring_indication != RegDataXMLUtils::STATE_UNBARRED))
+  {
+    flags |= IdentityIndex::BARRED;
+  }
+
+  if ((_public_identity.has_extension) && (_public_identity.wildcard_extension))
+  {
+    if (!parse_extension(uri))
+    {
+      return false;
+    }
+
+    if (uri != _public_identity.identity)
+    {
+      flags |= IdentityIndex::WILDCARD;
+    }
+  }
+
+  for (const IdentityIndex::Identity& identity : _index.identities)
+  {
+    if (identity.uri == uri)
+    {
+      return true;
+    }
+  }
+
+  _index.identities.emplace_back(uri, flags);
+  return true;
+}
+
+// Parses just the PublicIdentity's Extension, to get the identity from it
+// exactly as ParsedImsSubscription does. This is only needed for wildcards,
+// and the Extension is small.
+bool IdentityScanner::parse_extension(std::string& uri)
+{
+  std::string extension_xml(_public_identity.extension_start,
+                            _public_identity.extension_end);
+  rapidxml::xml_document<> doc;
 
   try
   {
-    doc.parse<rapidxml::parse_strip_xml_namespaces>(user_data_str);
+    doc.parse<rapidxml::parse_strip_xml_namespaces>(&extension_xml[0]);
   }
   catch (rapidxml::parse_error err)
   {
-    TRC_ERROR("Parse error in IMS Subscription document: %s\n\n%s", err.what(), user_data.c_str());
-    doc.clear();
+    return false; // LCOV_EXCL_LINE - we've already checked it's valid
   }
 
-  rapidxml::xml_node<>* is = doc.first_node(RegDataXMLUtils::IMS_SUBSCRIPTION);
-  if (is)
+  rapidxml::xml_node<>* extension = doc.first_node();
+
+  if (extension == NULL)
   {
-    rapidxml::xml_node<>* id = is->first_node(RegDataXMLUtils::PRIVATE_ID);
-    if (id)
+    return false; // LCOV_EXCL_LINE - as above
+  }
+
+  RegDataXMLUtils::parse_extension_identity(uri, extension);
+  return true;
+}
+
+// rapidxml rejects invalid numeric character references, so they're left to
+// it to decode.
+bool IdentityScanner::has_character_reference(const char* start, const char* end)
+{
+  const char* amp = (const char*)memchr(start, '&', end - start);
+
+  while (amp != NULL)
+  {
+    if ((amp + 1 < end) && (amp[1] == '#'))
     {
-      impi = id->value();
+      return true;
     }
-    else
+
+    amp = (const char*)memchr(amp + 1, '&', end - amp - 1);
+  }
+
+  return false;
+}
+
+// Decodes the predefined entities, as rapidxml does. Anything else starting
+// with '&' is left as it is.
+void IdentityScanner::decode(const char* start, const char* end, std::string& value)
+{
+  static const struct
+  {
+    const char* entity;
+    size_t length;
+    char c;
+  } ENTITIES[] = {{"&amp;", 5, '&'},
+                  {"&apos;", 6, '\''},
+                  {"&quot;", 6, '"'},
+                  {"&gt;", 4, '>'},
+                  {"&lt;", 4, '<'}};
+
+  value.clear();
+
+  while (start < end)
+  {
+    const char* amp = (const char*)memchr(start, '&', end - start);
+
+    if (amp == NULL)
+    {
+      value.append(start, end);
+      break;
+    }
+
+    value.append(start, amp);
+    start = amp + 1;
+    value.push_back('&');
+
+    for (const auto& entity : ENTITIES)
     {
-      TRC_ERROR("Missing Private ID in IMS Subscription document: \n\n%s", user_data.c_str());
+      if (((size_t)(end - amp) >= entity.length) &&
+          (memcmp(amp, entity.entity, entity.length) == 0))
+      {
+        value.back() = entity.c;
+        start = amp + entity.length;
+        break;
+      }
     }
   }
+}
+
+// Gets the identities in the IMS subscription without building a DOM.
+// Returns false (and leaves the index empty) if the XML needs parsing
+// properly.
+bool scan_identity_index(const std::string& xml, IdentityIndex& index)
+{
+  index.clear();
+  IdentityScanner scanner(xml, index);
+
+  if (!scanner.scan())
+  {
+    index.clear();
+    return false;
+  }
+
+  return true;
+}
+
+// Gets the identities in the IMS subscription, scanning it if possible and
+// parsing it if not.
+IdentityIndex get_identity_index(const std::string& xml)
+{
+  IdentityIndex index;
 
-  if (impi.compare("null") == 0)
+  if (!scan_identity_index(xml, index))
   {
-    impi = ""; // LCOV_EXCL_LINE
+    TRC_DEBUG("Parsing IMS subscription, as it couldn't be scanned");
+    ParsedImsSubscription ims_sub(xml);
+    index = ims_sub.identity_index();
   }
 
-  return impi;
+  return index;
+}
+
+// Parses the given User-Data XML to retrieve a list of all the public IDs.
+std::vector<std::string> get_public_ids(const std::string& user_data)
+{
+  std::string unused_default_id;
+  return get_public_and_default_ids(user_data, unused_default_id);
+}
+
+// Parses the given User-Data XML to retrieve the default public ID (the first
+// unbarred public ID).
+void get_default_id(const std::string& user_data,
+                    std::string &default_id)
+{
+  std::vector<std::string> unused_public_ids;
+  unused_public_ids = get_public_and_default_ids(user_data, default_id);
+}
+
+// Parses the given User-Data XML to retrieve a list of all the public IDs, and
+// the default public ID (the first unbarred public ID).
+std::vector<std::string> get_public_and_default_ids(const std::string &user_data,
+                                                    std::string &default_id)
+{
+  IdentityIndex index = get_identity_index(user_data);
+  std::vector<std::string> public_ids = index.public_ids();
+
+  if (public_ids.empty())
+  {
+    TRC_ERROR("Failed to extract any ServiceProfile/PublicIdentity/Identity nodes from %s", user_data.c_str());
+  }
+
+  std::string index_default_id = index.default_id();
+
+  if (!index_default_id.empty())
+  {
+    default_id = index_default_id;
+  }
+
+  return public_ids;
+}
+
+// Parses the given User-Data XML to retrieve the single PrivateID element.
+std::string get_private_id(const std::string& user_data)
+{
+  return get_identity_index(user_data).private_id;
 }
 
 }
@@ -10,6 +10,10 @@
  */
 
 #include "hss_cache_processor.h"
+#include "stage_latency.h"
+
+#include <algorithm>
+#include <chrono>
 
 // HSS Cache Processor is just plumbing - placing things on a FunctorThreadPool,
 // calling the callbacks when they complete. All of the interesting business
@@ -19,41 +23,172 @@
 
 HssCacheProcessor::HssCacheProcessor(HssCache* cache) :
   _cache(cache),
-  _thread_pool(NULL)
+  _max_queue(0),
+  _queued(0),
+  _stopping(false)
 {
 }
 
 bool HssCacheProcessor::start_threads(int num_threads,
                                       ExceptionHandler* exception_handler,
                                       unsigned int max_queue,
-                                      SNMP::EventAccumulatorByScopeTable* queue_size_table)
+                                      SNMP::EventAccumulatorByScopeTable* queue_size_table,
+                                      int num_shards,
+                                      const std::vector<SNMP::EventAccumulatorByScopeTable*>& shard_queue_size_tables)
 {
-  TRC_INFO("Starting threadpool with %d threads", num_threads);
-  _thread_pool = new FunctorThreadPool(num_threads,
-                                       exception_handler,
-                                       exception_callback,
-                                       max_queue,
-                                       queue_size_table);
-
-  return _thread_pool->start();
+  num_shards = std::max(num_shards, 1);
+
+  // With several shards, the queue limit is shared between them and applied
+  // in add_work, so their thread pools don't limit their own queues.
+  _max_queue = (num_shards > 1) ? max_queue : 0;
+  _queued = 0;
+  _stopping = false;
+  unsigned int shard_max_queue = (num_shards > 1) ? 0 : max_queue;
+
+  TRC_INFO("Starting %d threadpool(s) with %d threads in total",
+           num_shards,
+           num_threads);
+
+  bool started = true;
+
+  for (int ii = 0; ii < num_shards; ++ii)
+  {
+    SNMP::EventAccumulatorByScopeTable* shard_queue_size_table = queue_size_table;
+
+    if ((ii < (int)shard_queue_size_tables.size()) &&
+        (shard_queue_size_tables[ii] != nullptr))
+    {
+      ShardQueueSizeTable* table =
+        new ShardQueueSizeTable(queue_size_table, shard_queue_size_tables[ii]);
+      _shard_queue_size_tables.push_back(table);
+      shard_queue_size_table = table;
+    }
+
+    FunctorThreadPool* thread_pool = new FunctorThreadPool(threads_for_shard(num_threads, num_shards, ii),
+                                                           exception_handler,
+                                                           exception_callback,
+                                                           shard_max_queue,
+                                                           shard_queue_size_table);
+    _thread_pools.push_back(thread_pool);
+    started = thread_pool->start() && started;
+  }
+
+  return started;
 }
 
 void HssCacheProcessor::stop()
 {
   TRC_STATUS("Stopping threadpool");
-  if (_thread_pool)
+
+  // Release anything waiting for space in the shared queue.
+  {
+    std::lock_guard<std::mutex> lock(_queue_lock);
+    _stopping = true;
+  }
+  _queue_cond.notify_all();
+
+  for (FunctorThreadPool* thread_pool : _thread_pools)
   {
-    _thread_pool->stop();
+    thread_pool->stop();
   }
 }
 
 void HssCacheProcessor::wait_stopped()
 {
   TRC_STATUS("Waiting for threadpool to stop");
-  if (_thread_pool)
+  for (FunctorThreadPool* thread_pool : _thread_pools)
+  {
+    thread_pool->join();
+    delete thread_pool;
+  }
+
+  _thread_pools.clear();
+
+  for (ShardQueueSizeTable* table : _shard_queue_size_tables)
+  {
+    delete table;
+  }
+
+  _shard_queue_size_tables.clear();
+}
+
+size_t HssCacheProcessor::shard_for_key(const std::string& key) const
+{
+  size_t shard = 0;
+
+  if (_thread_pools.size() > 1)
+  {
+    shard = std::hash<std::string>()(key) % _thread_pools.size();
+  }
+
+  return shard;
+}
+
+int HssCacheProcessor::threads_for_shard(int num_threads,
+                                         int num_shards,
+                                         int shard)
+{
+  // The first few shards get one of the threads left over from dividing them
+  // evenly. Every shard needs at least one thread.
+  int threads = num_threads / num_shards;
+
+  if (shard < num_threads % num_shards)
+  {
+    threads++;
+  }
+
+  return std::max(threads, 1);
+}
+
+void HssCacheProcessor::add_work(const std::string& key,
+                                 SAS::TrailId trail,
+                                 std::function<void()>& work)
+{
+  size_t shard = shard_for_key(key);
+  bool counted = false;
+
+  if (_max_queue > 0)
+  {
+    std::unique_lock<std::mutex> lock(_queue_lock);
+    _queue_cond.wait(lock, [this]() { return _stopping ||
+                                             (_queued < _max_queue); });
+    _queued++;
+    counted = true;
+  }
+
+  // Record how long the work waits in the queue for a thread, and free up its
+  // space in the shared queue once it has one.
+  std::chrono::steady_clock::time_point queued = std::chrono::steady_clock::now();
+  std::function<void()> timed_work = [this, counted, queued, trail, work]()
+  {
+    if (counted)
+    {
+      {
+        std::lock_guard<std::mutex> lock(_queue_lock);
+        _queued--;
+      }
+      _queue_cond.notify_one();
+    }
+
+    StageLatency::record(StageLatency::CACHE_QUEUE,
+                         trail,
+                         std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - queued).count());
+    work();
+  };
+
+  _thread_pools[shard]->add_work(timed_work);
+}
+
+void HssCacheProcessor::detach_irs(const ImplicitRegistrationSet* irs)
+{
+  // Lookups are keyed by the IMPU requested, which can be any IMPU in the
+  // IRS, not just the default one.
+  _irs_gets.detach(irs->get_default_impu());
+
+  for (const std::string& impu : irs->get_associated_impus())
   {
-    _thread_pool->join();
-    delete _thread_pool; _thread_pool = NULL;
+    _irs_gets.detach(impu);
   }
 }
 
@@ -68,9 +203,32 @@ void HssCacheProcessor::get_implicit_registration_set_for_impu(irs_success_callb
                                                                 SAS::TrailId trail,
                                                                 Utils::StopWatch* stopwatch)
 {
+  // If the cache can give us the IRS without blocking, call the callback
+  // straight away, rather than tying up a thread from the pool. Only lookups
+  // that need to go to the store are run on the pool.
+  ImplicitRegistrationSet* cached = NULL;
+
+  if (_cache->try_get_implicit_registration_set_for_impu(impu, cached))
+  {
+    TRC_DEBUG("Found IRS for %s without blocking", impu.c_str());
+    success_cb(cached);
+    return;
+  }
+
+  // If there's already a request in flight for this impu, just wait for its
+  // result.
+  SingleFlight<std::string, irs_callbacks>::FlightPtr flight =
+    _irs_gets.join(impu, irs_callbacks(success_cb, failure_cb));
+
+  if (!flight)
+  {
+    TRC_DEBUG("Joining in-flight IRS lookup for %s", impu.c_str());
+    return;
+  }
+
   // Create a work item that can run on the thread pool, capturing required
   // variables to complete the work
-  std::function<void()> work = [this, impu, trail, success_cb, failure_cb, stopwatch]()->void
+  std::function<void()> work = [this, impu, trail, flight, stopwatch]()->void
   {
     ImplicitRegistrationSet* result = NULL;
     Store::Status rc = _cache->get_implicit_registration_set_for_impu(impu,
@@ -78,18 +236,36 @@ void HssCacheProcessor::get_implicit_registration_set_for_impu(irs_success_callb
                                                                       stopwatch,
                                                                       result);
 
+    std::vector<irs_callbacks> callbacks = _irs_gets.complete(impu, flight);
+
     if (rc == Store::Status::OK)
     {
-      success_cb(result);
+      // Each request owns its IRS, so the requests that joined this one get
+      // copies. Take them all before calling any callbacks, as the callbacks
+      // are free to change or delete the IRS they're given.
+      std::vector<ImplicitRegistrationSet*> results(1, result);
+
+      for (size_t ii = 1; ii < callbacks.size(); ++ii)
+      {
+        results.push_back(result->clone());
+      }
+
+      for (size_t ii = 0; ii < callbacks.size(); ++ii)
+      {
+        callbacks[ii].first(results[ii]);
+      }
     }
     else
     {
-      failure_cb(rc);
+      for (irs_callbacks& cbs : callbacks)
+      {
+        cbs.second(rc);
+      }
     }
   };
 
   // Add the work to the pool
-  _thread_pool->add_work(work);
+  add_work(impu, trail, work);
 }
 
 void HssCacheProcessor::get_implicit_registration_sets_for_impis(irs_vector_success_callback success_cb,
@@ -118,8 +294,9 @@ void HssCacheProcessor::get_implicit_registration_sets_for_impis(irs_vector_succ
     }
   };
 
-  // Add the work to the pool
-  _thread_pool->add_work(work);
+  // Add the work to the pool. The request is for several subscribers, so
+  // it's sent to the shard for the first.
+  add_work(impis.empty() ? "" : impis[0], trail, work);
 }
 
 void HssCacheProcessor::get_implicit_registration_sets_for_impus(irs_vector_success_callback success_cb,
@@ -148,8 +325,9 @@ void HssCacheProcessor::get_implicit_registration_sets_for_impus(irs_vector_succ
     }
   };
 
-  // Add the work to the pool
-  _thread_pool->add_work(work);
+  // Add the work to the pool. The request is for several subscribers, so
+  // it's sent to the shard for the first.
+  add_work(impus.empty() ? "" : impus[0], trail, work);
 }
 
 void HssCacheProcessor::put_implicit_registration_set(void_success_cb success_cb,
@@ -159,6 +337,10 @@ void HssCacheProcessor::put_implicit_registration_set(void_success_cb success_cb
                                                       SAS::TrailId trail,
                                                       Utils::StopWatch* stopwatch)
 {
+  // Lookups already in flight for this IRS might not see this change, so
+  // don't let any more requests join them.
+  detach_irs(irs);
+
   // Create a work item that can run on the thread pool, capturing required
   // variables to complete the work
   std::function<void()> work = [this, irs, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
@@ -176,7 +358,7 @@ void HssCacheProcessor::put_implicit_registration_set(void_success_cb success_cb
   };
 
   // Add the work to the pool
-  _thread_pool->add_work(work);
+  add_work(irs->get_default_impu(), trail, work);
 }
 
 void HssCacheProcessor::delete_implicit_registration_set(void_success_cb success_cb,
@@ -186,6 +368,10 @@ void HssCacheProcessor::delete_implicit_registration_set(void_success_cb success
                                                          SAS::TrailId trail,
                                                          Utils::StopWatch* stopwatch)
 {
+  // Lookups already in flight for this IRS might not see this change, so
+  // don't let any more requests join them.
+  detach_irs(irs);
+
   // Create a work item that can run on the thread pool, capturing required
   // variables to complete the work
   std::function<void()> work = [this, irs, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
@@ -203,7 +389,7 @@ void HssCacheProcessor::delete_implicit_registration_set(void_success_cb success
   };
 
   // Add the work to the pool
-  _thread_pool->add_work(work);
+  add_work(irs->get_default_impu(), trail, work);
 }
 
 void HssCacheProcessor::delete_implicit_registration_sets(void_success_cb success_cb,
@@ -213,6 +399,13 @@ void HssCacheProcessor::delete_implicit_registration_sets(void_success_cb succes
                                                           SAS::TrailId trail,
                                                           Utils::StopWatch* stopwatch)
 {
+  // Lookups already in flight for these IRSs might not see this change, so
+  // don't let any more requests join them.
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    detach_irs(irs);
+  }
+
   // Create a work item that can run on the thread pool, capturing required
   // variables to complete the work
   std::function<void()> work = [this, irss, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
@@ -229,8 +422,9 @@ void HssCacheProcessor::delete_implicit_registration_sets(void_success_cb succes
     }
   };
 
-  // Add the work to the pool
-  _thread_pool->add_work(work);
+  // Add the work to the pool. The request is for several subscribers, so
+  // it's sent to the shard for the first.
+  add_work(irss.empty() ? "" : irss[0]->get_default_impu(), trail, work);
 }
 
 void HssCacheProcessor::get_ims_subscription(ims_sub_success_cb success_cb,
@@ -257,7 +451,7 @@ void HssCacheProcessor::get_ims_subscription(ims_sub_success_cb success_cb,
   };
 
   // Add the work to the pool
-  _thread_pool->add_work(work);
+  add_work(impi, trail, work);
 }
 
 void HssCacheProcessor::put_ims_subscription(void_success_cb success_cb,
@@ -267,6 +461,15 @@ void HssCacheProcessor::put_ims_subscription(void_success_cb success_cb,
                                              SAS::TrailId trail,
                                              Utils::StopWatch* stopwatch)
 {
+  // Lookups already in flight for the subscription's IRSs might not see this
+  // change, so don't let any more requests join them.
+  std::vector<ImplicitRegistrationSet*> irss = subscription->get_irss();
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    detach_irs(irs);
+  }
+
   // Create a work item that can run on the thread pool, capturing required
   // variables to complete the work
   std::function<void()> work = [this, subscription, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
@@ -283,8 +486,9 @@ void HssCacheProcessor::put_ims_subscription(void_success_cb success_cb,
     }
   };
 
-  // Add the work to the pool
-  _thread_pool->add_work(work);
+  // Add the work to the pool. The request is for several IRSs, so it's sent
+  // to the shard for the first, as for writes of several IRSs.
+  add_work(irss.empty() ? "" : irss[0]->get_default_impu(), trail, work);
 }
 
 // LCOV_EXCL_STOP
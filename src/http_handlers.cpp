@@ -19,7 +19,7 @@
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidxml/rapidxml.hpp"
-#include "boost/algorithm/string/join.hpp"
+#include "boost/algorithm/string.hpp"
 #include "base64.h"
 
 using std::placeholders::_1;
@@ -774,6 +774,32 @@ void ImpuRegDataTask::get_reg_data()
                                                  _req.get_stopwatch());
 }
 
+// Checks whether the value of an If-None-Match header matches an entity tag.
+// The value is either "*" or a comma separated list of entity tags, which are
+// compared weakly (i.e. ignoring any W/ prefix), as RFC 7232 requires.
+bool etag_matches(const std::string& if_none_match, const std::string& etag)
+{
+  std::vector<std::string> tags;
+  boost::algorithm::split(tags, if_none_match, boost::algorithm::is_any_of(","));
+
+  for (std::string& tag : tags)
+  {
+    boost::algorithm::trim(tag);
+
+    if (boost::algorithm::starts_with(tag, "W/"))
+    {
+      tag.erase(0, 2);
+    }
+
+    if ((tag == "*") || (tag == etag))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 std::string regstate_to_str(RegistrationState state)
 {
   switch (state)
@@ -884,7 +910,7 @@ void ImpuRegDataTask::process_received_reg_data()
   // record of this binding.
   if (_impi.empty())
   {
-    _impi = XmlUtils::get_private_id(service_profile);
+    _impi = identity_index().private_id;
   }
   else if ((!service_profile.empty()) &&
            ((associated_impis.empty()) ||
@@ -1023,27 +1049,71 @@ void ImpuRegDataTask::send_reply()
   std::string xml_str;
   int rc;
 
+  // GETs are tagged with the version of the IRS, so that a client that
+  // already has the document can ask for it only if it's changed.
+  std::string etag;
+
+  if ((_http_rc == HTTP_OK) && (_req.method() == htp_method_GET))
+  {
+    etag = reg_data_etag(_irs);
+  }
+
   // Check whether we have a saved failure return code
   if (_http_rc != HTTP_OK)
   {
     rc = _http_rc;
   }
+  else if ((!etag.empty()) &&
+           (etag_matches(_req.header(HEADER_IF_NONE_MATCH), etag)))
+  {
+    // The client's copy is current, so there's no need to build the document.
+    TRC_DEBUG("Reg data for %s is unchanged (ETag %s)",
+              _impu.c_str(), etag.c_str());
+    _req.add_header(HEADER_ETAG, etag);
+    rc = HTTP_NOT_MODIFIED;
+  }
   else
   {
+    StageLatency::Timer xml_timer(StageLatency::XML_BUILD, this->trail());
+
     // If this is a PUT of type REG or CALL then include the previous
     // registration state on the response.
+    RegistrationState prev_reg_state = RegistrationState::UNKNOWN;
+
     if ((_type == RequestType::REG) || (_type == RequestType::CALL))
     {
-      rc = XmlUtils::build_ClearwaterRegData_xml(_irs, xml_str, _cached_reg_state);
+      prev_reg_state = _cached_reg_state;
+    }
+
+    // If the IRS hasn't changed since we read it (e.g. for a GET, or a CALL
+    // for a registered subscriber) then the document may already be cached.
+    if ((_cfg->reg_data_cache != NULL) &&
+        (_cfg->reg_data_cache->get(_irs, prev_reg_state, xml_str)))
+    {
+      rc = HTTP_OK;
     }
     else
     {
-      // Don't signal a previous registration state.
-      rc = XmlUtils::build_ClearwaterRegData_xml(_irs, xml_str);
+      rc = XmlUtils::build_ClearwaterRegData_xml(_irs,
+                                                 parsed_ims_sub(),
+                                                 xml_str,
+                                                 prev_reg_state);
+
+      if ((rc == HTTP_OK) && (_cfg->reg_data_cache != NULL))
+      {
+        _cfg->reg_data_cache->put(_irs, prev_reg_state, xml_str);
+      }
     }
 
+    xml_timer.stop();
+
     if (rc == HTTP_OK)
     {
+      if (!etag.empty())
+      {
+        _req.add_header(HEADER_ETAG, etag);
+      }
+
       _req.add_content(xml_str);
     }
     else
@@ -1058,6 +1128,60 @@ void ImpuRegDataTask::send_reply()
   send_http_reply(rc);
 }
 
+// Adds the string to a 64-bit FNV-1a hash, followed by a separator so that
+// moving characters from one string to the next changes the hash. Entity tags
+// must be the same on every node, so we can't use std::hash.
+static void add_to_hash(uint64_t& hash, const std::string& str)
+{
+  for (char c : str)
+  {
+    hash ^= (unsigned char)c;
+    hash *= 1099511628211ULL;
+  }
+
+  hash ^= 0xff;
+  hash *= 1099511628211ULL;
+}
+
+// Builds the entity tag for the IRS's reg data. It's made from the IRS's
+// version (the CAS of the default IMPU) and registration state, and a hash
+// of the IMS subscription and charging addresses, in case the version is
+// reused for different contents (e.g. after the store has lost the record).
+// Returns an empty string if the IRS doesn't have a version, in which case
+// the reg data can't be tagged.
+std::string ImpuRegDataTask::reg_data_etag(const ImplicitRegistrationSet* irs)
+{
+  uint64_t version = irs->get_version();
+
+  if (version == 0)
+  {
+    return "";
+  }
+
+  uint64_t hash = 14695981039346656037ULL;
+  add_to_hash(hash, irs->get_ims_sub_xml());
+
+  const ChargingAddresses& charging_addresses = irs->get_charging_addresses();
+  add_to_hash(hash, std::to_string(charging_addresses.ccfs.size()));
+
+  for (const std::string& ccf : charging_addresses.ccfs)
+  {
+    add_to_hash(hash, ccf);
+  }
+
+  for (const std::string& ecf : charging_addresses.ecfs)
+  {
+    add_to_hash(hash, ecf);
+  }
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "\"%llu-%d-%016llx\"",
+           (unsigned long long)version,
+           (int)irs->get_reg_state(),
+           (unsigned long long)hash);
+  return buf;
+}
+
 void ImpuRegDataTask::send_server_assignment_request(Cx::ServerAssignmentType type)
 {
   // Create the SAR to send to the hss
@@ -1075,15 +1199,42 @@ void ImpuRegDataTask::send_server_assignment_request(Cx::ServerAssignmentType ty
   HssConnection::saa_cb callback =
     std::bind(&ImpuRegDataTask::on_sar_response, this, _1);
 
+  // Time how long the HSS takes to answer. This must be started before the
+  // SAR is sent, as the answer may be handled (and this task deleted) before
+  // send_server_assignment_request returns.
+  _sar_timer.reset(new StageLatency::Timer(StageLatency::HSS_SAR, this->trail()));
+
   // Send the request
   _hss->send_server_assignment_request(callback, request, this->trail(), _req.get_stopwatch());
 }
 
+const XmlUtils::ParsedImsSubscription& ImpuRegDataTask::parsed_ims_sub()
+{
+  // Only parse the IRS's IMS subscription if we haven't already parsed this
+  // XML.
+  if ((!_parsed_ims_sub) ||
+      (_parsed_ims_sub->xml() != _irs->get_ims_sub_xml()))
+  {
+    _parsed_ims_sub.reset(new XmlUtils::ParsedImsSubscription(_irs->get_ims_sub_xml()));
+  }
+
+  return *_parsed_ims_sub;
+}
+
+const IdentityIndex& ImpuRegDataTask::identity_index()
+{
+  // Use the identities stored with the IRS if there are any, so we don't
+  // need to parse the IMS subscription just to get them.
+  const IdentityIndex& index = _irs->get_identity_index();
+
+  return index.empty() ? parsed_ims_sub().identity_index() : index;
+}
+
 void ImpuRegDataTask::put_in_cache()
 {
-  std::string default_public_id = "";
-  std::vector<std::string> public_ids =
-    XmlUtils::get_public_and_default_ids(_irs->get_ims_sub_xml(), default_public_id);
+  const IdentityIndex& index = identity_index();
+  std::string default_public_id = index.default_id();
+  std::vector<std::string> public_ids = index.public_ids();
 
   if (!public_ids.empty())
   {
@@ -1097,7 +1248,7 @@ void ImpuRegDataTask::put_in_cache()
     {
       bool found_sip_uri = false;
 
-      for (std::vector<std::string>::iterator it = public_ids.begin();
+      for (std::vector<std::string>::const_iterator it = public_ids.begin();
            (it != public_ids.end()) && (!found_sip_uri);
            ++it)
       {
@@ -1179,6 +1330,8 @@ void ImpuRegDataTask::on_put_reg_data_failure(Store::Status rc)
 
 void ImpuRegDataTask::on_sar_response(const HssConnection::ServerAssignmentAnswer& saa)
 {
+  _sar_timer.reset();
+
   HssConnection::ResultCode rc = saa.get_result();
   TRC_DEBUG("Received Server-Assignment answer with result code %d", rc);
 
@@ -1264,8 +1417,10 @@ void ImpuRegDataTask::on_sar_response(const HssConnection::ServerAssignmentAnswe
     // triggered by a deregistration or auth failure) so cache the User-Data.
 
     // Get the charging addresses and user data.
+    // Parse the new User-Data once, for both the IRS and this task.
     _irs->set_charging_addresses(saa.get_charging_addresses());
-    _irs->set_ims_sub_xml(saa.get_service_profile());
+    _parsed_ims_sub.reset(new XmlUtils::ParsedImsSubscription(saa.get_service_profile()));
+    _irs->set_ims_sub_xml(*_parsed_ims_sub);
 
     // We need to update the TTL on receiving an SAA
     _irs->set_ttl(_cfg->record_ttl);
@@ -0,0 +1,372 @@
+/**
+ * @file impu_dictionary.cpp Training and loading of IMPU compression
+ * dictionaries
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "impu_dictionary.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "impu_store.h"
+#include "log.h"
+
+// The length of the byte strings that training counts. Shorter strings than
+// this aren't worth LZ4 finding in a dictionary, as it needs a 4 byte match
+// and then has to encode the offset.
+static const size_t WINDOW = 16;
+
+// The extension of dictionary files.
+static const std::string DICTIONARY_EXTENSION = ".dict";
+
+// Hashes the WINDOW bytes at the start of data (FNV-1a).
+static uint64_t hash_window(const char* data)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t ii = 0; ii < WINDOW; ++ii)
+  {
+    hash ^= (unsigned char)data[ii];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+ImpuDictionaryTrainer::ImpuDictionaryTrainer(const std::string& output_file,
+                                             size_t num_samples,
+                                             size_t max_size) :
+  _output_file(output_file),
+  _num_samples(num_samples),
+  _max_size(max_size),
+  _sample_bytes(0),
+  _done(false)
+{
+}
+
+ImpuDictionaryTrainer::~ImpuDictionaryTrainer()
+{
+  wait_for_training();
+}
+
+void ImpuDictionaryTrainer::add_sample(const std::string& key,
+                                       const std::string& sample)
+{
+  std::vector<std::string> samples;
+  size_t sample_bytes;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if ((_done) || (!_sampled_keys.insert(key).second))
+    {
+      return;
+    }
+
+    _samples.push_back(sample);
+    _sample_bytes += sample.size();
+
+    if ((_samples.size() < _num_samples) &&
+        (_sample_bytes < MAX_SAMPLE_BYTES))
+    {
+      return;
+    }
+
+    // We have all the samples we need. Take them, so that we can train
+    // without holding the lock, and free the keys.
+    _done = true;
+    samples.swap(_samples);
+    sample_bytes = _sample_bytes;
+    _sampled_keys.clear();
+  }
+
+  // Training can take a while with a lot of sample data, and the caller is
+  // in the middle of writing an IMPU, so leave it to a thread of its own.
+  // Only the caller that set _done gets here, so this only happens once.
+  _training_thread = std::thread(&ImpuDictionaryTrainer::train_and_write,
+                                 this,
+                                 std::move(samples),
+                                 sample_bytes);
+}
+
+void ImpuDictionaryTrainer::wait_for_training()
+{
+  if (_training_thread.joinable())
+  {
+    _training_thread.join();
+  }
+}
+
+void ImpuDictionaryTrainer::train_and_write(std::vector<std::string> samples,
+                                            size_t sample_bytes)
+{
+  TRC_STATUS("Training IMPU dictionary from %lu samples (%lu bytes)",
+             samples.size(),
+             sample_bytes);
+
+  std::string dictionary = train(samples, _max_size);
+
+  if (dictionary.empty())
+  {
+    TRC_WARNING("IMPU samples have nothing in common - no dictionary written");
+    return;
+  }
+
+  write_dictionary(dictionary);
+}
+
+std::string ImpuDictionaryTrainer::train(const std::vector<std::string>& samples,
+                                         size_t max_size)
+{
+  // A string is worth having in the dictionary if it's in enough of the
+  // samples - we use 5%, but require it to be in at least two of them
+  // (unless there's only one sample).
+  size_t min_count = std::max<size_t>(2, samples.size() / 20);
+  min_count = std::min(min_count, samples.size());
+
+  if ((min_count == 0) || (max_size < WINDOW))
+  {
+    return "";
+  }
+
+  // Count the number of samples that each window is in.
+  std::unordered_map<uint64_t, uint32_t> counts;
+
+  for (const std::string& sample : samples)
+  {
+    std::unordered_set<uint64_t> seen;
+
+    for (size_t ii = 0; ii + WINDOW <= sample.size(); ++ii)
+    {
+      uint64_t hash = hash_window(sample.data() + ii);
+
+      if (seen.insert(hash).second)
+      {
+        counts[hash]++;
+      }
+    }
+  }
+
+  // The candidates are the longest runs of overlapping windows that are
+  // each in enough samples. A run often starts or ends with windows that
+  // are partly made of data that's only common by chance (e.g. the last
+  // digit of a number), so the ends of each run are trimmed back to windows
+  // in at least half as many samples as its most common window. Each
+  // candidate is scored by the number of bytes it would save, i.e. its
+  // length times the number of samples its rarest window is in.
+  std::unordered_map<std::string, uint64_t> candidates;
+  std::vector<uint32_t> run_counts;
+
+  for (const std::string& sample : samples)
+  {
+    size_t ii = 0;
+
+    while (ii + WINDOW <= sample.size())
+    {
+      run_counts.clear();
+
+      for (; ii + WINDOW <= sample.size(); ++ii)
+      {
+        uint32_t count = counts[hash_window(sample.data() + ii)];
+
+        if (count < min_count)
+        {
+          break;
+        }
+
+        run_counts.push_back(count);
+      }
+
+      if (run_counts.empty())
+      {
+        ++ii;
+        continue;
+      }
+
+      size_t start = ii - run_counts.size();
+      uint32_t peak = *std::max_element(run_counts.begin(), run_counts.end());
+      size_t first = 0;
+      size_t last = run_counts.size() - 1;
+
+      while (run_counts[first] * 2 < peak)
+      {
+        ++first;
+      }
+
+      while (run_counts[last] * 2 < peak)
+      {
+        --last;
+      }
+
+      uint32_t run_count = *std::min_element(run_counts.begin() + first,
+                                             run_counts.begin() + last + 1);
+      size_t length = std::min(last - first + WINDOW, max_size);
+      uint64_t& score = candidates[sample.substr(start + first, length)];
+      score = std::max(score, (uint64_t)run_count * length);
+    }
+  }
+
+  std::vector<std::pair<uint64_t, const std::string*>> ranked;
+  ranked.reserve(candidates.size());
+
+  for (const std::pair<const std::string, uint64_t>& candidate : candidates)
+  {
+    ranked.push_back(std::make_pair(candidate.second, &candidate.first));
+  }
+
+  // Best first, breaking ties on the string so that training is
+  // deterministic.
+  std::sort(ranked.begin(),
+            ranked.end(),
+            [](const std::pair<uint64_t, const std::string*>& a,
+               const std::pair<uint64_t, const std::string*>& b)
+            {
+              return (a.first > b.first) ||
+                     ((a.first == b.first) && (*a.second < *b.second));
+            });
+
+  // Take the best candidates that fit, skipping any that are mostly in the
+  // dictionary already (as the same common data is often found with
+  // slightly different data either side).
+  std::vector<const std::string*> chosen;
+  std::unordered_set<uint64_t> covered;
+  size_t chosen_size = 0;
+
+  for (const std::pair<uint64_t, const std::string*>& candidate : ranked)
+  {
+    const std::string& segment = *candidate.second;
+
+    if (chosen_size + segment.size() > max_size)
+    {
+      continue;
+    }
+
+    size_t windows = segment.size() - WINDOW + 1;
+    size_t windows_covered = 0;
+
+    for (size_t ii = 0; ii < windows; ++ii)
+    {
+      windows_covered += covered.count(hash_window(segment.data() + ii));
+    }
+
+    if (windows_covered * 2 > windows)
+    {
+      continue;
+    }
+
+    for (size_t ii = 0; ii < windows; ++ii)
+    {
+      covered.insert(hash_window(segment.data() + ii));
+    }
+
+    chosen.push_back(&segment);
+    chosen_size += segment.size();
+  }
+
+  // LZ4 encodes closer matches more cheaply, and they stay in reach of the
+  // data for longer, so put the best candidates at the end.
+  std::string dictionary;
+  dictionary.reserve(chosen_size);
+
+  for (std::vector<const std::string*>::reverse_iterator it = chosen.rbegin();
+       it != chosen.rend();
+       ++it)
+  {
+    dictionary.append(**it);
+  }
+
+  return dictionary;
+}
+
+bool ImpuDictionaryTrainer::write_dictionary(const std::string& dictionary)
+{
+  std::ofstream file(_output_file, std::ios::out | std::ios::binary | std::ios::trunc);
+  file.write(dictionary.data(), dictionary.size());
+  file.close();
+
+  if (file.fail())
+  {
+    TRC_ERROR("Failed to write IMPU dictionary to %s", _output_file.c_str());
+    return false;
+  }
+
+  TRC_STATUS("Wrote %lu byte IMPU dictionary to %s",
+             dictionary.size(),
+             _output_file.c_str());
+  return true;
+}
+
+int load_impu_dictionaries(const std::string& directory)
+{
+  DIR* dir = opendir(directory.c_str());
+
+  if (dir == nullptr)
+  {
+    TRC_ERROR("Failed to open IMPU dictionary directory %s",
+              directory.c_str());
+    return 0;
+  }
+
+  // Sort the files, so that they're loaded in a predictable order.
+  std::map<int, std::string> files;
+  struct dirent* entry;
+
+  while ((entry = readdir(dir)) != nullptr)
+  {
+    std::string name = entry->d_name;
+
+    if ((name.size() <= DICTIONARY_EXTENSION.size()) ||
+        (name.compare(name.size() - DICTIONARY_EXTENSION.size(),
+                      DICTIONARY_EXTENSION.size(),
+                      DICTIONARY_EXTENSION) != 0))
+    {
+      continue;
+    }
+
+    std::string id_str = name.substr(0, name.size() - DICTIONARY_EXTENSION.size());
+
+    if ((id_str.size() > 3) ||
+        (id_str.find_first_not_of("0123456789") != std::string::npos))
+    {
+      TRC_WARNING("Ignoring IMPU dictionary with invalid name: %s",
+                  name.c_str());
+      continue;
+    }
+
+    files[std::stoi(id_str)] = directory + "/" + name;
+  }
+
+  closedir(dir);
+
+  int loaded = 0;
+
+  for (const std::pair<const int, std::string>& file : files)
+  {
+    std::ifstream stream(file.second, std::ios::in | std::ios::binary);
+    std::stringstream contents;
+    contents << stream.rdbuf();
+
+    if ((stream.fail()) ||
+        (!ImpuStore::Impu::add_dictionary(file.first, contents.str())))
+    {
+      TRC_ERROR("Failed to load IMPU dictionary from %s", file.second.c_str());
+      continue;
+    }
+
+    loaded++;
+  }
+
+  return loaded;
+}
@@ -12,9 +12,16 @@
 #include "impu_store.h"
 
 #include <climits>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <set>
+#include <time.h>
 
+#include "impu_dictionary.h"
 #include "json_parse_utils.h"
 #include "log.h"
+#include "stage_latency.h"
 
 const std::string ImpuStore::Impu::_dict_v0 =
   "{\"registration_state\":true,\"service_profile\":\"<IMSSubscription>"
@@ -28,8 +35,13 @@ const std::string ImpuStore::Impu::_dict_v0 =
   "<SessionCase></SessionCase>\",\"expiry\":,\"assoc_impu\":[\"],\"impis\":[],"
   "\"ecfs\":[],\"ccfs\":[]}\"default_impu\":\"";
 
-thread_local LZ4_stream_t* ImpuStore::Impu::_thrd_lz4_stream;
-thread_local struct preserved_hash_table_entry_t* ImpuStore::Impu::_thrd_lz4_hash;
+std::string ImpuStore::Impu::_trained_dicts[ImpuStore::Impu::MAX_DICTIONARY_ID + 1];
+
+thread_local std::map<const std::string*, ImpuStore::Impu::DictionaryStream> ImpuStore::Impu::_thrd_lz4_dict_streams;
+thread_local LZ4_stream_t* ImpuStore::Impu::_thrd_lz4_work_stream;
+thread_local std::vector<char> ImpuStore::Impu::_thrd_comp_buffer;
+thread_local std::vector<char> ImpuStore::Impu::_thrd_decomp_buffer;
+thread_local uint64_t ImpuStore::Impu::_thrd_json_pool[ImpuStore::Impu::JSON_POOL_SIZE / sizeof(uint64_t)];
 
 // General
 static const char * const JSON_EXPIRY = "expiry";
@@ -40,6 +52,10 @@ static const char * const JSON_DEFAULT_IMPU = "default_impu";
 // IRS (Default IMPU)
 static const char * const JSON_ASSOCIATED_IMPUS = "assoc_impu";
 static const char * const JSON_SERVICE_PROFILE = "service_profile";
+static const char * const JSON_SERVICE_PROFILE_HASH = "service_profile_hash";
+static const char * const JSON_IDENTITIES = "identities";
+static const char * const JSON_IDENTITY_FLAGS = "identity_flags";
+static const char * const JSON_PRIVATE_ID = "private_id";
 static const char * const JSON_REGISTRATION_STATE = "registration_state";
 static const char * const JSON_IMPIS = "impis";
 static const char * const JSON_CCFS = "ccfs";
@@ -52,9 +68,18 @@ static const char * const JSON_DEFAULT_IMPUS = "default_impus";
 // compression.
 static const int ACCELERATION = 1;
 
-// The maximum buffer size to use for IMPU compression
-// 128 KB
-static const int MAX_BUFFER_LEN = 131072;
+// The table that shared service profiles are stored in, and the version of
+// the format they're stored in (see encode_service_profile).
+static const std::string SERVICE_PROFILE_TABLE = "service_profile";
+static const char SERVICE_PROFILE_VERSION = 1;
+
+// Types of IMPU in binary (version 1) records
+static const char BINARY_DEFAULT_IMPU = 0;
+static const char BINARY_ASSOCIATED_IMPU = 1;
+
+// Registration states in binary records
+static const char BINARY_UNREGISTERED = 0;
+static const char BINARY_REGISTERED = 1;
 
 void encode_varbyte(uint64_t uncomp_size, std::string& data)
 {
@@ -116,6 +141,138 @@ uint64_t decode_varbyte(const std::string& data, size_t& offset)
   return length;
 }
 
+// Binary records are made up of integers and strings. Integers are stored
+// with seven bits in each byte and the top bit set if there are more to come,
+// as for encode_varbyte, except that zero takes a single byte. Strings are
+// stored as their length followed by their bytes, and lists of strings as the
+// number of strings followed by each string.
+static void write_binary_int(uint64_t value, std::string& data)
+{
+  do
+  {
+    char byte = value & 0x7f;
+    value = value >> 7;
+
+    if (value > 0)
+    {
+      byte |= 0x80;
+    }
+
+    data.push_back(byte);
+  } while (value != 0);
+}
+
+static void write_binary_string(const std::string& value, std::string& data)
+{
+  write_binary_int(value.size(), data);
+  data.append(value);
+}
+
+template <class C>
+static void write_binary_strings(const C& values, std::string& data)
+{
+  write_binary_int(values.size(), data);
+
+  for (const std::string& value : values)
+  {
+    write_binary_string(value, data);
+  }
+}
+
+// Reads the fields of a binary record in turn. Each read fails, rather than
+// running off the end of the data, if the record is truncated or corrupt.
+class BinaryReader
+{
+public:
+  BinaryReader(const std::string& data, size_t offset) :
+    _data(data),
+    _offset(offset)
+  {
+  }
+
+  bool read_int(uint64_t& value)
+  {
+    value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (_offset >= _data.size())
+      {
+        return false;
+      }
+
+      uint8_t byte = _data[_offset++];
+      value |= (uint64_t)(byte & 0x7f) << shift;
+
+      if ((byte & 0x80) == 0)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool read_byte(char& value)
+  {
+    if (_offset >= _data.size())
+    {
+      return false;
+    }
+
+    value = _data[_offset++];
+    return true;
+  }
+
+  bool read_string(std::string& value)
+  {
+    uint64_t length;
+
+    if (!read_int(length) || (length > _data.size() - _offset))
+    {
+      return false;
+    }
+
+    value.assign(_data, _offset, length);
+    _offset += length;
+    return true;
+  }
+
+  template <class C>
+  bool read_strings(C& values)
+  {
+    uint64_t count;
+
+    // Each string takes at least a byte, so a count larger than the data
+    // remaining must be corrupt.
+    if (!read_int(count) || (count > _data.size() - _offset))
+    {
+      return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      values.emplace_back();
+
+      if (!read_string(values.back()))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool at_end() const
+  {
+    return _offset == _data.size();
+  }
+
+private:
+  const std::string& _data;
+  size_t _offset;
+};
+
 ImpuStore::Impu* ImpuStore::Impu::from_data(const std::string& impu,
                                             std::string& data,
                                             unsigned long cas,
@@ -128,90 +285,178 @@ ImpuStore::Impu* ImpuStore::Impu::from_data(const std::string& impu,
   }
 
   // Version is stored in character 0.
-  if (data[0] == 0)
+  if (data[0] == DATA_VERSION_JSON_LZ4)
   {
     // Version 0 - LZ4 compression
     // Data is stored as [version][length][zlib4 compressed JSON]
-    size_t offset = 1;
+    return from_compressed_json(impu, data, 1, _dict_v0, cas, store);
+  }
+  else if (data[0] == DATA_VERSION_BINARY)
+  {
+    // Version 1 - binary encoding
+    // Data is stored as [version][IMPU type][fields for that type]
+    if (data.size() < 2)
+    {
+      TRC_WARNING("Binary IMPU data has no type");
+      return nullptr;
+    }
+
+    if (data[1] == BINARY_DEFAULT_IMPU)
+    {
+      return ImpuStore::DefaultImpu::from_binary(impu, data, 2, cas, store);
+    }
+    else if (data[1] == BINARY_ASSOCIATED_IMPU)
+    {
+      return ImpuStore::AssociatedImpu::from_binary(impu, data, 2, cas, store);
+    }
+    else
+    {
+      TRC_WARNING("Unknown binary IMPU type: %u", data[1]);
+      return nullptr;
+    }
+  }
+  else if (data[0] == DATA_VERSION_TRAINED_LZ4)
+  {
+    // Version 2 - LZ4 compression with a trained dictionary
+    // Data is stored as [version][dictionary ID][length][compressed JSON]
+    if (data.size() < 2)
+    {
+      TRC_WARNING("Trained LZ4 IMPU data has no dictionary ID");
+      return nullptr;
+    }
 
-    // Size of uncompressed data
-    uint64_t length_long = decode_varbyte(data, offset);
+    int dictionary_id = (unsigned char)data[1];
 
-    if (length_long == 0)
+    if (!has_dictionary(dictionary_id))
     {
-      // Data is corrupt
+      TRC_WARNING("IMPU data compressed with unknown dictionary: %d",
+                  dictionary_id);
       return nullptr;
     }
 
-    int length = (int) length_long;
-    const char* compressed = data.c_str() + offset;
-    int compressed_size = data.size() - offset;
-    char* json = new char[length + 1];
-    json[length] = '\0';
+    return from_compressed_json(impu,
+                                data,
+                                2,
+                                _trained_dicts[dictionary_id],
+                                cas,
+                                store);
+  }
+  else
+  {
+    TRC_WARNING("Unknown IMPU version: %u", data[0]);
+
+    return nullptr;
+  }
+}
+
+char* ImpuStore::Impu::decompress_data(const std::string& data,
+                                      size_t offset,
+                                      const std::string& dictionary,
+                                      int& length)
+{
+  // Data is stored as [length][compressed data] from the offset.
+  uint64_t length_long = decode_varbyte(data, offset);
+
+  if (length_long == 0)
+  {
+    // Data is corrupt
+    return nullptr;
+  }
 
-    TRC_DEBUG("Decompressing %llu bytes of data into %llu bytes",
-              compressed_size,
-              length);
+  length = (int) length_long;
+  const char* compressed = data.c_str() + offset;
+  int compressed_size = data.size() - offset;
 
-    int rc = LZ4_decompress_safe_usingDict(compressed,
-                                           json,
-                                           compressed_size,
-                                           length,
-                                           _dict_v0.c_str(),
-                                           _dict_v0.size());
+  // Decompress into this thread's buffer, growing it if this is the
+  // largest record the thread has seen.
+  if (_thrd_decomp_buffer.size() < (size_t)length + 1)
+  {
+    _thrd_decomp_buffer.resize(length + 1);
+  }
 
+  char* decompressed = _thrd_decomp_buffer.data();
+  decompressed[length] = '\0';
 
-    if (rc == 0 || rc != length)
-    {
-      TRC_WARNING("Failed to decompress LZ4 IMPU data - read %d/%d",
-                  rc, length);
+  TRC_DEBUG("Decompressing %llu bytes of data into %llu bytes",
+            compressed_size,
+            length);
+
+  int rc = LZ4_decompress_safe_usingDict(compressed,
+                                         decompressed,
+                                         compressed_size,
+                                         length,
+                                         dictionary.c_str(),
+                                         dictionary.size());
+
+  if (rc == 0 || rc != length)
+  {
+    TRC_WARNING("Failed to decompress LZ4 data - read %d/%d",
+                rc, length);
+
+    return nullptr;
+  }
+
+  return decompressed;
+}
 
-      delete[] json;
+char* ImpuStore::Impu::decompress_data_v0(const std::string& data,
+                                         size_t offset,
+                                         int& length)
+{
+  return decompress_data(data, offset, _dict_v0, length);
+}
+
+ImpuStore::Impu* ImpuStore::Impu::from_compressed_json(const std::string& impu,
+                                                       const std::string& data,
+                                                       size_t offset,
+                                                       const std::string& dictionary,
+                                                       uint64_t cas,
+                                                       ImpuStore* store)
+{
+  int length;
+  char* json = decompress_data(data, offset, dictionary, length);
 
+  if (json == nullptr)
+  {
+    return nullptr;
+  }
+  else
+  {
+    // Parse the JSON in place, so the DOM's strings point into the
+    // decompression buffer rather than being copied, and build the DOM in
+    // this thread's memory pool. The pool only allocates if the DOM
+    // outgrows it, and anything it allocates is freed with the document.
+    rapidjson::MemoryPoolAllocator<> allocator(_thrd_json_pool,
+                                               sizeof(_thrd_json_pool));
+    rapidjson::Document doc(&allocator);
+    doc.ParseInsitu<0>(json);
+
+    if (doc.HasParseError())
+    {
+      // The in place parse has overwritten the JSON, so we can't log it
+      TRC_WARNING("Failed to parse %d bytes of IMPU as JSON - Error: %s",
+                  length,
+                  rapidjson::GetParseError_En(doc.GetParseError()));
+      return nullptr;
+    }
+    else if (!doc.IsObject())
+    {
+      TRC_WARNING("IMPU JSON didn't represent object - %s",
+                  json);
       return nullptr;
     }
     else
     {
-      rapidjson::Document doc;
-      doc.Parse<0>(json);
-
-      if (doc.HasParseError())
-      {
-        TRC_WARNING("Failed to parse IMPU as JSON %s - Error: %s",
-                    json,
-                    rapidjson::GetParseError_En(doc.GetParseError()));
-        delete[] json;
-        return nullptr;
-      }
-      else if (!doc.IsObject())
+      if (doc.HasMember(JSON_DEFAULT_IMPU))
       {
-        TRC_WARNING("IMPU JSON didn't represent object - %s",
-                    json);
-        delete[] json;
-        return nullptr;
+        return ImpuStore::AssociatedImpu::from_json(impu, doc, cas, store);
       }
       else
       {
-        // Successfully parsed the JSON, so we can reclaim the memory
-        delete[] json;
-
-        if (doc.HasMember(JSON_DEFAULT_IMPU))
-        {
-          return ImpuStore::AssociatedImpu::from_json(impu, doc, cas, store);
-        }
-        else
-        {
-          return ImpuStore::DefaultImpu::from_json(impu, doc, cas, store);
-        }
+        return ImpuStore::DefaultImpu::from_json(impu, doc, cas, store);
       }
     }
   }
-  else
-  {
-    TRC_WARNING("Unknown IMPU version: %u", data[0]);
-
-    return nullptr;
-  }
 }
 
 ImpuStore::Impu* ImpuStore::AssociatedImpu::from_json(std::string const& impu,
@@ -233,11 +478,6 @@ ImpuStore::Impu* ImpuStore::DefaultImpu::from_json(std::string const& impu,
                                                    unsigned long cas,
                                                    ImpuStore* store)
 {
-  std::vector<std::string> assoc_impus;
-  std::vector<std::string> impis;
-  std::deque<std::string> ccfs;
-  std::deque<std::string> ecfs;
-  std::string service_profile;
   int64_t expiry = 0L;
 
   bool state;
@@ -249,128 +489,329 @@ ImpuStore::Impu* ImpuStore::DefaultImpu::from_json(std::string const& impu,
     RegistrationState::UNREGISTERED;
 
   JSON_SAFE_GET_INT_64_MEMBER(json, JSON_EXPIRY, expiry);
-  JSON_SAFE_GET_STRING_MEMBER(json, JSON_SERVICE_PROFILE, service_profile);
 
-  extract_json_string_array(json, JSON_ASSOCIATED_IMPUS, assoc_impus);
-  extract_json_string_array(json, JSON_IMPIS, impis);
-  extract_json_string_array(json, JSON_CCFS, ccfs);
-  extract_json_string_array(json, JSON_ECFS, ecfs);
+  // Extract the rest of the fields straight into the IMPU, rather than
+  // building them up separately and then copying them in.
+  std::unique_ptr<DefaultImpu> default_impu(new DefaultImpu(impu,
+                                                            reg_state,
+                                                            cas,
+                                                            expiry,
+                                                            store));
+
+  JSON_SAFE_GET_STRING_MEMBER(json, JSON_SERVICE_PROFILE, default_impu->service_profile);
+  JSON_SAFE_GET_STRING_MEMBER(json, JSON_SERVICE_PROFILE_HASH, default_impu->service_profile_hash);
+
+  extract_json_string_array(json, JSON_ASSOCIATED_IMPUS, default_impu->associated_impus);
+  extract_json_string_array(json, JSON_IMPIS, default_impu->impis);
+  extract_json_string_array(json, JSON_CCFS, default_impu->charging_addresses.ccfs);
+  extract_json_string_array(json, JSON_ECFS, default_impu->charging_addresses.ecfs);
+
+  if ((json.HasMember(JSON_IDENTITIES)) &&
+      (json[JSON_IDENTITIES].IsArray()) &&
+      (json.HasMember(JSON_IDENTITY_FLAGS)) &&
+      (json[JSON_IDENTITY_FLAGS].IsArray()) &&
+      (json[JSON_IDENTITIES].Size() == json[JSON_IDENTITY_FLAGS].Size()))
+  {
+    const rapidjson::Value& identities = json[JSON_IDENTITIES];
+    const rapidjson::Value& flags = json[JSON_IDENTITY_FLAGS];
+    IdentityIndex& index = default_impu->identity_index;
+
+    for (rapidjson::SizeType ii = 0; ii < identities.Size(); ++ii)
+    {
+      if ((!identities[ii].IsString()) || (!flags[ii].IsUint()))
+      {
+        // Ignore the whole index, so the identities get parsed from the
+        // service profile instead.
+        TRC_WARNING("Ignoring invalid identity index for IMPU %s", impu.c_str());
+        index.clear();
+        break;
+      }
+
+      index.identities.emplace_back(identities[ii].GetString(),
+                                    (uint8_t)flags[ii].GetUint());
+    }
 
-  ChargingAddresses charging_addresses = ChargingAddresses(ccfs, ecfs);
+    if (!index.empty())
+    {
+      JSON_SAFE_GET_STRING_MEMBER(json, JSON_PRIVATE_ID, index.private_id);
+    }
+  }
 
-  return new DefaultImpu(impu,
-                         assoc_impus,
-                         impis,
-                         reg_state,
-                         charging_addresses,
-                         service_profile,
-                         cas,
-                         expiry,
-                         store);
+  return default_impu.release();
+}
+
+ImpuStore::Impu* ImpuStore::AssociatedImpu::from_binary(const std::string& impu,
+                                                        const std::string& data,
+                                                        size_t offset,
+                                                        uint64_t cas,
+                                                        ImpuStore* store)
+{
+  BinaryReader reader(data, offset);
+  uint64_t expiry;
+  std::string default_impu;
+
+  if (!reader.read_int(expiry) ||
+      !reader.read_string(default_impu) ||
+      !reader.at_end())
+  {
+    TRC_WARNING("Invalid binary data for associated IMPU %s", impu.c_str());
+    return nullptr;
+  }
+
+  return new AssociatedImpu(impu, default_impu, cas, (int64_t)expiry, store);
+}
+
+ImpuStore::Impu* ImpuStore::DefaultImpu::from_binary(const std::string& impu,
+                                                     const std::string& data,
+                                                     size_t offset,
+                                                     uint64_t cas,
+                                                     ImpuStore* store)
+{
+  BinaryReader reader(data, offset);
+  uint64_t expiry;
+  char state;
+
+  if (!reader.read_int(expiry) || !reader.read_byte(state))
+  {
+    TRC_WARNING("Invalid binary data for default IMPU %s", impu.c_str());
+    return nullptr;
+  }
+
+  RegistrationState reg_state = (state == BINARY_REGISTERED) ?
+    RegistrationState::REGISTERED :
+    RegistrationState::UNREGISTERED;
+
+  // As for from_json, read the rest of the fields straight into the IMPU.
+  std::unique_ptr<DefaultImpu> default_impu(new DefaultImpu(impu,
+                                                            reg_state,
+                                                            cas,
+                                                            (int64_t)expiry,
+                                                            store));
+
+  if (!reader.read_strings(default_impu->associated_impus) ||
+      !reader.read_strings(default_impu->impis) ||
+      !reader.read_strings(default_impu->charging_addresses.ccfs) ||
+      !reader.read_strings(default_impu->charging_addresses.ecfs) ||
+      !reader.read_string(default_impu->service_profile) ||
+      (!reader.at_end() &&
+       !reader.read_string(default_impu->service_profile_hash)))
+  {
+    TRC_WARNING("Invalid binary data for default IMPU %s", impu.c_str());
+    return nullptr;
+  }
+
+  if (!reader.at_end())
+  {
+    // There's an identity index, stored as the identities, then a string
+    // holding a byte of flags for each of them, then the private ID.
+    std::vector<std::string> identities;
+    std::string flags;
+    IdentityIndex& index = default_impu->identity_index;
+
+    if (!reader.read_strings(identities) ||
+        !reader.read_string(flags) ||
+        !reader.read_string(index.private_id) ||
+        !reader.at_end() ||
+        (flags.size() != identities.size()))
+    {
+      TRC_WARNING("Invalid binary data for default IMPU %s", impu.c_str());
+      return nullptr;
+    }
+
+    index.identities.reserve(identities.size());
+
+    for (size_t ii = 0; ii < identities.size(); ++ii)
+    {
+      index.identities.emplace_back(identities[ii], (uint8_t)flags[ii]);
+    }
+  }
+
+  return default_impu.release();
 }
 
 void ImpuStore::Impu::compress_data_v0(const std::string& data,
-                                       char*& buffer,
+                                       const char*& buffer,
                                        int& comp_size)
 {
-  unsigned int uncomp_size = data.size();
+  compress_data(data, _dict_v0, buffer, comp_size);
+}
+
+void ImpuStore::Impu::compress_data(const std::string& data,
+                                    const std::string& dictionary,
+                                    const char*& buffer,
+                                    int& comp_size)
+{
+  int uncomp_size = data.size();
 
-  // Check we have a LZ4 stream with the V0 dict pre-prepared.
-  if (_thrd_lz4_stream == NULL)
+  // Check we have a LZ4 stream with this dictionary pre-prepared, and a
+  // stream to compress with. The dictionaries live as long as the process,
+  // so they're identified by address.
+  if (_thrd_lz4_work_stream == NULL)
   {
-    _thrd_lz4_stream = LZ4_createStream();
-    LZ4_loadDict(_thrd_lz4_stream, _dict_v0.c_str(), _dict_v0.size());
-    LZ4_stream_preserve(_thrd_lz4_stream, &_thrd_lz4_hash);
+    _thrd_lz4_work_stream = LZ4_createStream();
   }
 
-  // Compress the data using LZ4
-  LZ4_stream_t* stream = LZ4_createStream();
+  std::map<const std::string*, DictionaryStream>::iterator dict_stream =
+    _thrd_lz4_dict_streams.find(&dictionary);
 
-  size_t buffer_length = 2048; // 2KB
-  buffer = (char*) malloc(buffer_length);
+  if (dict_stream == _thrd_lz4_dict_streams.end())
+  {
+    DictionaryStream new_stream;
+    new_stream.stream = LZ4_createStream();
+    LZ4_loadDict(new_stream.stream, dictionary.c_str(), dictionary.size());
+    LZ4_stream_preserve(new_stream.stream, &new_stream.hash);
 
-  do
+    dict_stream = _thrd_lz4_dict_streams.insert(
+                      std::make_pair(&dictionary, new_stream)).first;
+  }
+
+  // Make sure the output buffer can hold the data however badly it
+  // compresses, so we only ever have to compress it once.
+  int bound = LZ4_compressBound(uncomp_size);
+
+  // LCOV_EXCL_START
+  if (bound <= 0)
   {
-    LZ4_stream_restore_preserved(stream, _thrd_lz4_stream, _thrd_lz4_hash);
-    comp_size = LZ4_compress_fast_continue(stream,
-                                           data.c_str(),
-                                           buffer,
-                                           uncomp_size,
-                                           buffer_length,
-                                           ACCELERATION);
+    TRC_WARNING("Failed to attempt to compress %d bytes of data - too large",
+                uncomp_size);
+    buffer = nullptr;
+    comp_size = 0;
+    return;
+  }
+  // LCOV_EXCL_STOP
 
-    if (comp_size <= 0)
-    {
-      // Compression failed - retry with a bigger buffer.
-      // Buffer size is the only reason it can fail. We stop
-      // the buffer growing beyond reason.
-      int new_buffer_length = buffer_length * 2;
+  if (_thrd_comp_buffer.size() < (size_t)bound)
+  {
+    _thrd_comp_buffer.resize(bound);
+  }
 
-      // LCOV_EXCL_START
-      if (new_buffer_length > MAX_BUFFER_LEN)
-      {
-        TRC_WARNING("Failed to attempt to compress %lu bytes of data - won't "
-                    "fit into %lu bytes, proposed new buffer of %lu bytes "
-                    "exceeds maximum of %lu bytes",
-                    uncomp_size, buffer_length,
-                    new_buffer_length, MAX_BUFFER_LEN);
-        break;
-      }
-      // LCOV_EXCL_STOP
+  // Compress the data using LZ4, starting from a clean copy of the stream
+  // with the dictionary loaded.
+  LZ4_resetStream(_thrd_lz4_work_stream);
+  LZ4_stream_restore_preserved(_thrd_lz4_work_stream,
+                               dict_stream->second.stream,
+                               dict_stream->second.hash);
+
+  buffer = _thrd_comp_buffer.data();
+  comp_size = LZ4_compress_fast_continue(_thrd_lz4_work_stream,
+                                         data.c_str(),
+                                         _thrd_comp_buffer.data(),
+                                         uncomp_size,
+                                         bound,
+                                         ACCELERATION);
+}
+
+bool ImpuStore::Impu::add_dictionary(int id, const std::string& dictionary)
+{
+  if ((id < 1) || (id > MAX_DICTIONARY_ID))
+  {
+    TRC_ERROR("Invalid IMPU dictionary ID: %d", id);
+    return false;
+  }
 
-      buffer_length = new_buffer_length;
+  if ((dictionary.empty()) || (dictionary.size() > MAX_DICTIONARY_SIZE))
+  {
+    TRC_ERROR("Invalid IMPU dictionary %d - %lu bytes", id, dictionary.size());
+    return false;
+  }
 
-      buffer = (char*) realloc((void*)buffer, buffer_length);
-      LZ4_resetStream(stream);
+  if (has_dictionary(id))
+  {
+    // Threads may have compressed data with the existing dictionary, so it
+    // can't be changed.
+    if (_trained_dicts[id] != dictionary)
+    {
+      TRC_ERROR("IMPU dictionary %d is already loaded", id);
+      return false;
     }
-  } while(comp_size == 0);
 
-  LZ4_freeStream(stream);
+    return true;
+  }
+
+  TRC_STATUS("Loaded IMPU dictionary %d - %lu bytes", id, dictionary.size());
+  _trained_dicts[id] = dictionary;
+  return true;
+}
+
+bool ImpuStore::Impu::has_dictionary(int id)
+{
+  return (id >= 1) && (id <= MAX_DICTIONARY_ID) && (!_trained_dicts[id].empty());
+}
+
+std::string ImpuStore::Impu::to_json()
+{
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  writer.StartObject();
+  write_json(writer);
+  writer.EndObject();
+  return buffer.GetString();
 }
 
-Store::Status ImpuStore::Impu::to_data(std::string& data)
+Store::Status ImpuStore::Impu::to_data(std::string& data,
+                                       int version,
+                                       int dictionary_id)
 {
+  if (version == DATA_VERSION_BINARY)
+  {
+    // The buffer contains a version (1) followed by the binary encoding of
+    // the IMPU, which starts with the type of IMPU.
+    data.push_back((char) DATA_VERSION_BINARY);
+    write_binary(data);
+
+    return Store::Status::OK;
+  }
+
+  const std::string* dictionary = &_dict_v0;
+
+  if (version == DATA_VERSION_TRAINED_LZ4)
+  {
+    if (has_dictionary(dictionary_id))
+    {
+      dictionary = &_trained_dicts[dictionary_id];
+    }
+    else
+    {
+      // We can't use a dictionary we don't have, but every node can read
+      // version 0, so fall back to that.
+      TRC_DEBUG("Dictionary %d not loaded - using version 0", dictionary_id);
+      version = DATA_VERSION_JSON_LZ4;
+    }
+  }
+
   // We get the JSON representing the IMPU, compress it using
   // lz4, and then build a buffer to return.
-  // The buffer contains a version (0), the uncompressed size
+  // The buffer contains a version (0, or 2 followed by the ID of the
+  // trained dictionary), the uncompressed size
   // (an array of 7 bits, with bit 0x80 set if there is more
   // to come), and the compressed data.
 
   unsigned int uncomp_size;
   int comp_size;
-  char* buffer; // Buffer for compressed data
+
+  // Buffer for compressed data. This belongs to the thread, and is valid
+  // until it next compresses some data.
+  const char* buffer;
 
   // Scope the JSON string so we don't have to keep it in
   // memory too long
   {
     TRC_DEBUG("Determining JSON for %s", impu.c_str());
 
-    std::string json;
-
-    {
-      // Gather the JSON
-      rapidjson::StringBuffer buffer;
-      rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-      writer.StartObject();
-      write_json(writer);
-      writer.EndObject();
-      json = buffer.GetString();
-    }
+    std::string json = to_json();
 
     uncomp_size = json.size();
 
     TRC_DEBUG("Wrote IMPU %s to JSON: %lu bytes", impu.c_str(), uncomp_size);
 
-    compress_data_v0(json, buffer, comp_size);
+    compress_data(json, *dictionary, buffer, comp_size);
   }
 
   // LCOV_EXCL_START
   // This only happens when we fail to compress some data,
   // which isn't hittable in the UTs
-  if (comp_size == 0)
+  if (comp_size <= 0)
   {
-    free(buffer);
-
     return Store::Status::ERROR;
   }
   // LCOV_EXCL_STOP
@@ -390,10 +831,15 @@ Store::Status ImpuStore::Impu::to_data(std::string& data)
   // (8 + 6) / 7 => 2
   int uncomp_size_len = (uncomp_size_bits + 6) / 7;
 
-  data.reserve(1 + uncomp_size_len + comp_size);
+  data.reserve(2 + uncomp_size_len + comp_size);
 
   // Version
-  data.push_back((char) 0);
+  data.push_back((char) version);
+
+  if (version == DATA_VERSION_TRAINED_LZ4)
+  {
+    data.push_back((char) dictionary_id);
+  }
 
   // Length of the uncompressed data
   encode_varbyte(uncomp_size, data);
@@ -401,9 +847,6 @@ Store::Status ImpuStore::Impu::to_data(std::string& data)
   // Add the compressed data to the buffer
   data.append(buffer, comp_size);
 
-  // Finally, we can free the compressed data
-  free(buffer);
-
   return Store::Status::OK;
 }
 
@@ -429,8 +872,18 @@ void ImpuStore::DefaultImpu::write_json(rapidjson::Writer<rapidjson::StringBuffe
   }
 
   writer.Bool(state);
-  writer.String(JSON_SERVICE_PROFILE);
-  writer.String(service_profile.c_str());
+
+  if (service_profile_hash.empty())
+  {
+    writer.String(JSON_SERVICE_PROFILE);
+    writer.String(service_profile.c_str());
+  }
+  else
+  {
+    writer.String(JSON_SERVICE_PROFILE_HASH);
+    writer.String(service_profile_hash.c_str());
+  }
+
   writer.String(JSON_EXPIRY);
   writer.Int64(expiry);
 
@@ -438,16 +891,110 @@ void ImpuStore::DefaultImpu::write_json(rapidjson::Writer<rapidjson::StringBuffe
   write_json_string_array(writer, JSON_IMPIS, impis);
   write_json_string_array(writer, JSON_ECFS, charging_addresses.ecfs);
   write_json_string_array(writer, JSON_CCFS, charging_addresses.ccfs);
-}
 
-void ImpuStore::AssociatedImpu::write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
-{
+  if (!identity_index.empty())
+  {
+    writer.String(JSON_IDENTITIES);
+    writer.StartArray();
+
+    for (const IdentityIndex::Identity& identity : identity_index.identities)
+    {
+      writer.String(identity.uri.c_str());
+    }
+
+    writer.EndArray();
+
+    writer.String(JSON_IDENTITY_FLAGS);
+    writer.StartArray();
+
+    for (const IdentityIndex::Identity& identity : identity_index.identities)
+    {
+      writer.Uint(identity.flags);
+    }
+
+    writer.EndArray();
+
+    writer.String(JSON_PRIVATE_ID);
+    writer.String(identity_index.private_id.c_str());
+  }
+}
+
+void ImpuStore::AssociatedImpu::write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
+{
   writer.String(JSON_DEFAULT_IMPU);
   writer.String(default_impu.c_str());
   writer.String(JSON_EXPIRY);
   writer.Int64(expiry);
 }
 
+void ImpuStore::DefaultImpu::write_binary(std::string& data)
+{
+  data.reserve(data.size() + service_profile.size() + 256);
+  data.push_back(BINARY_DEFAULT_IMPU);
+  write_binary_int(expiry, data);
+
+  if (registration_state == RegistrationState::REGISTERED)
+  {
+    data.push_back(BINARY_REGISTERED);
+  }
+  else
+  {
+    if (registration_state != RegistrationState::UNREGISTERED)
+    {
+      TRC_WARNING("Unexpected registration state: %u",
+                  registration_state);
+    }
+
+    data.push_back(BINARY_UNREGISTERED);
+  }
+
+  write_binary_strings(associated_impus, data);
+  write_binary_strings(impis, data);
+  write_binary_strings(charging_addresses.ccfs, data);
+  write_binary_strings(charging_addresses.ecfs, data);
+
+  // The service profile goes last, as it's the bulk of the record. If it's
+  // shared, it's left empty and followed by its hash.
+  if (service_profile_hash.empty())
+  {
+    write_binary_string(service_profile, data);
+  }
+  else
+  {
+    write_binary_string("", data);
+  }
+
+  // The hash and identity index are both optional, so the hash is written
+  // (even if it's empty) whenever there's an index after it.
+  if ((!service_profile_hash.empty()) || (!identity_index.empty()))
+  {
+    write_binary_string(service_profile_hash, data);
+  }
+
+  if (!identity_index.empty())
+  {
+    std::string flags;
+    flags.reserve(identity_index.identities.size());
+    write_binary_int(identity_index.identities.size(), data);
+
+    for (const IdentityIndex::Identity& identity : identity_index.identities)
+    {
+      write_binary_string(identity.uri, data);
+      flags.push_back((char)identity.flags);
+    }
+
+    write_binary_string(flags, data);
+    write_binary_string(identity_index.private_id, data);
+  }
+}
+
+void ImpuStore::AssociatedImpu::write_binary(std::string& data)
+{
+  data.push_back(BINARY_ASSOCIATED_IMPU);
+  write_binary_int(expiry, data);
+  write_binary_string(default_impu, data);
+}
+
 ImpuStore::ImpiMapping* ImpuStore::ImpiMapping::from_data(const std::string& impi,
                                                           const std::string& data,
                                                           unsigned long cas)
@@ -491,25 +1038,73 @@ Store::Status ImpuStore::ImpiMapping::to_data(std::string& data)
   return Store::Status::OK;
 }
 
+ImpuStore::Impu* ImpuStore::get_cached_impu(const std::string& impu)
+{
+  ImpuStore::Impu* cached_impu = nullptr;
+
+  if (_cache != nullptr)
+  {
+    cached_impu = _cache->get(impu);
+
+    if (cached_impu != nullptr)
+    {
+      TRC_DEBUG("Found %s in local IMPU cache", impu.c_str());
+    }
+  }
+
+  return cached_impu;
+}
+
 Store::Status ImpuStore::get_impu(const std::string& impu,
                                   ImpuStore::Impu*& out_impu,
                                   SAS::TrailId trail)
 {
+  return read_impu(impu, out_impu, trail, false);
+}
+
+Store::Status ImpuStore::get_impu_for_update(const std::string& impu,
+                                             ImpuStore::Impu*& out_impu,
+                                             SAS::TrailId trail)
+{
+  return read_impu(impu, out_impu, trail, true);
+}
+
+Store::Status ImpuStore::read_impu(const std::string& impu,
+                                   ImpuStore::Impu*& out_impu,
+                                   SAS::TrailId trail,
+                                   bool for_update)
+{
+  ImpuStore::Impu* cached_impu = get_cached_impu(impu);
+
+  if (cached_impu != nullptr)
+  {
+    out_impu = cached_impu;
+    return Store::Status::OK;
+  }
+
+  // Get the IMPU's generation before reading it, so that we don't cache it
+  // if it's written while we're reading it.
+  uint64_t generation = (_cache != nullptr) ? _cache->generation(impu) : 0;
+
   std::string data;
   uint64_t cas;
 
+  StageLatency::Timer io_timer(_io_stage, trail);
   Store::Status status = _store->get_data("impu",
                                           impu,
                                           data,
                                           cas,
                                           trail,
                                           false);
+  io_timer.stop();
 
   if (status == Store::Status::OK)
   {
     // Use a temporary variable to hold the Impu* so that we don't change
     // out_impu if we fail to decode the impu
+    StageLatency::Timer decompression_timer(StageLatency::DECOMPRESSION, trail);
     ImpuStore::Impu* temp_impu = ImpuStore::Impu::from_data(impu, data, cas, this);
+    decompression_timer.stop();
 
     if (temp_impu == nullptr)
     {
@@ -519,7 +1114,94 @@ Store::Status ImpuStore::get_impu(const std::string& impu,
     }
     else
     {
-      out_impu = temp_impu;
+      if ((temp_impu->is_default_impu()) &&
+          (!((DefaultImpu*)temp_impu)->service_profile_hash.empty()))
+      {
+        status = resolve_service_profile((DefaultImpu*)temp_impu, trail);
+
+        if (status == Store::Status::NOT_FOUND)
+        {
+          if (for_update)
+          {
+            // The caller is going to write over the IMPU, so needs its CAS
+            // even though it can't be read.
+            ((DefaultImpu*)temp_impu)->service_profile_missing = true;
+            out_impu = temp_impu;
+            return Store::Status::OK;
+          }
+
+          // The IMPU exists, so mustn't be reported as not found (which would
+          // make it look unregistered). It can't be read until it's written
+          // again, with its service profile.
+          TRC_ERROR("Service profile for %s is missing - can't read it",
+                    impu.c_str());
+          status = Store::Status::ERROR;
+        }
+      }
+
+      if (status != Store::Status::OK)
+      {
+        delete temp_impu; temp_impu = nullptr;
+      }
+      else
+      {
+        if (_cache != nullptr)
+        {
+          _cache->put(temp_impu, generation);
+        }
+
+        out_impu = temp_impu;
+      }
+    }
+  }
+
+  return status;
+}
+
+// The Store interface has no multi-key get, so the batch is issued as
+// back-to-back gets on this thread, each of which may be satisfied from the
+// local cache. Callers should still use this in preference to get_impu when
+// they have several IMPUs to look up, so that they only make a single request
+// of each store.
+Store::Status ImpuStore::get_impus(const std::vector<std::string>& impus,
+                                   std::vector<ImpuStore::Impu*>& out_impus,
+                                   SAS::TrailId trail)
+{
+  Store::Status status = Store::Status::OK;
+  std::vector<ImpuStore::Impu*> found;
+  std::set<std::string> requested;
+
+  for (const std::string& impu : impus)
+  {
+    if (!requested.insert(impu).second)
+    {
+      // We've already looked this IMPU up as part of this batch
+      continue;
+    }
+
+    ImpuStore::Impu* data = nullptr;
+    Store::Status inner_status = get_impu(impu, data, trail);
+
+    if (inner_status == Store::Status::OK)
+    {
+      found.push_back(data);
+    }
+    else if (inner_status != Store::Status::NOT_FOUND)
+    {
+      status = inner_status;
+      break;
+    }
+  }
+
+  if (status == Store::Status::OK)
+  {
+    out_impus.insert(out_impus.end(), found.begin(), found.end());
+  }
+  else
+  {
+    for (ImpuStore::Impu* data : found)
+    {
+      delete data;
     }
   }
 
@@ -529,31 +1211,39 @@ Store::Status ImpuStore::get_impu(const std::string& impu,
 Store::Status ImpuStore::set_impu_without_cas(ImpuStore::Impu* impu,
                                               SAS::TrailId trail)
 {
+  invalidate_cached_impu(impu->impu);
+
   std::string data;
 
-  Store::Status status = impu->to_data(data);
+  Store::Status status = encode_impu(impu, data, trail);
 
   if (status == Store::Status::OK)
   {
     int now = time(0);
 
+    StageLatency::Timer io_timer(_io_stage, trail);
     status = _store->set_data_without_cas("impu",
                                           impu->impu,
                                           data,
                                           impu->expiry - now,
                                           trail,
                                           false);
+    io_timer.stop();
   }
 
+  invalidate_cached_impu(impu->impu);
+
   return status;
 }
 
 Store::Status ImpuStore::add_impu(ImpuStore::Impu* impu,
                                   SAS::TrailId trail)
 {
+  invalidate_cached_impu(impu->impu);
+
   std::string data;
 
-  Store::Status status = impu->to_data(data);
+  Store::Status status = encode_impu(impu, data, trail);
 
   if (status == Store::Status::OK)
   {
@@ -561,6 +1251,7 @@ Store::Status ImpuStore::add_impu(ImpuStore::Impu* impu,
 
     // Set the data with a CAS of 0, which will fail if there's data already
     // present
+    StageLatency::Timer io_timer(_io_stage, trail);
     status = _store->set_data("impu",
                               impu->impu,
                               data,
@@ -568,8 +1259,11 @@ Store::Status ImpuStore::add_impu(ImpuStore::Impu* impu,
                               impu->expiry - now,
                               trail,
                               false);
+    io_timer.stop();
   }
 
+  invalidate_cached_impu(impu->impu);
+
   return status;
 }
 
@@ -579,14 +1273,22 @@ Store::Status ImpuStore::set_impu(ImpuStore::Impu* impu,
   TRC_DEBUG("Writing %s to store (SAS Trail: %lu)",
             impu->impu.c_str(), trail);
 
+  // Drop any cached copy whatever the outcome. If the write succeeds the
+  // cached copy is out of date, and if it fails with DATA_CONTENTION then the
+  // caller will re-read the IMPU and must see what's really in the store.
+  // We do this again once the write has completed, in case a concurrent read
+  // cached the old IMPU in the meantime.
+  invalidate_cached_impu(impu->impu);
+
   std::string data;
 
-  Store::Status status = impu->to_data(data);
+  Store::Status status = encode_impu(impu, data, trail);
 
   if (status == Store::Status::OK)
   {
     int now = time(0);
 
+    StageLatency::Timer io_timer(_io_stage, trail);
     status = _store->set_data("impu",
                               impu->impu,
                               data,
@@ -594,8 +1296,11 @@ Store::Status ImpuStore::set_impu(ImpuStore::Impu* impu,
                               impu->expiry - now,
                               trail,
                               false);
+    io_timer.stop();
   }
 
+  invalidate_cached_impu(impu->impu);
+
   TRC_DEBUG("Wrote %s to store (SAS Trail: %lu) with result: %u",
             impu->impu.c_str(), trail, status);
 
@@ -605,7 +1310,322 @@ Store::Status ImpuStore::set_impu(ImpuStore::Impu* impu,
 Store::Status ImpuStore::delete_impu(ImpuStore::Impu* impu,
                                      SAS::TrailId trail)
 {
-  return _store->delete_data("impu", impu->impu, trail);
+  invalidate_cached_impu(impu->impu);
+
+  StageLatency::Timer io_timer(_io_stage, trail);
+  Store::Status status = _store->delete_data("impu", impu->impu, trail);
+  io_timer.stop();
+
+  invalidate_cached_impu(impu->impu);
+
+  return status;
+}
+
+Store::Status ImpuStore::encode_impu(ImpuStore::Impu* impu,
+                                     std::string& data,
+                                     SAS::TrailId trail)
+{
+  if (impu->is_default_impu())
+  {
+    DefaultImpu* default_impu = (DefaultImpu*)impu;
+
+    // Work out whether to write the service profile inline from scratch, as
+    // the service profile may have changed since the IMPU was read.
+    default_impu->service_profile_hash = "";
+
+    if ((_share_service_profiles) && (!default_impu->service_profile.empty()))
+    {
+      default_impu->service_profile_hash =
+        share_service_profile(default_impu, trail);
+    }
+
+    if (!_store_identity_index)
+    {
+      default_impu->identity_index.clear();
+    }
+  }
+
+  sample_for_dictionary(impu);
+
+  StageLatency::Timer compression_timer(StageLatency::COMPRESSION, trail);
+  return impu->to_data(data, _data_version, _dictionary_id);
+}
+
+std::string ImpuStore::hash_service_profile(const std::string& profile)
+{
+  // A 64-bit FNV-1a hash, qualified by the length of the service profile.
+  // This must be the same on every node, so we can't use std::hash.
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (char c : profile)
+  {
+    hash ^= (unsigned char)c;
+    hash *= 1099511628211ULL;
+  }
+
+  char buf[40];
+  snprintf(buf, sizeof(buf), "%016llx-%llx",
+           (unsigned long long)hash,
+           (unsigned long long)profile.size());
+  return buf;
+}
+
+std::string ImpuStore::share_service_profile(ImpuStore::DefaultImpu* impu,
+                                             SAS::TrailId trail)
+{
+  const std::string& profile = impu->service_profile;
+  std::string hash = hash_service_profile(profile);
+
+  // If we've already stored this service profile to last as long as this
+  // IMPU, there's nothing to write.
+  int64_t stored_expiry = 0;
+
+  if ((_profile_cache != nullptr) &&
+      (_profile_cache->get_stored_expiry(hash, profile, stored_expiry)) &&
+      (stored_expiry >= impu->expiry))
+  {
+    TRC_DEBUG("Service profile %s already stored until %ld",
+              hash.c_str(), stored_expiry);
+    return hash;
+  }
+
+  Store::Status status;
+
+  do
+  {
+    // Read the stored copy of the service profile (if there is one). If it's
+    // a different service profile, the hashes collide, and we have to write
+    // this one inline. Otherwise, it may already last long enough - if not,
+    // we extend it, but never shorten it, as other IMPUs (possibly written by
+    // other nodes) refer to it.
+    std::string data;
+    uint64_t cas = 0;
+    StageLatency::Timer read_timer(_io_stage, trail);
+    status = _store->get_data(SERVICE_PROFILE_TABLE,
+                              hash,
+                              data,
+                              cas,
+                              trail,
+                              false);
+    read_timer.stop();
+
+    stored_expiry = 0;
+
+    if (status == Store::Status::OK)
+    {
+      std::string existing;
+
+      StageLatency::Timer decompression_timer(StageLatency::DECOMPRESSION, trail);
+      bool decoded = decode_service_profile(data, existing, stored_expiry);
+      decompression_timer.stop();
+
+      if ((!decoded) || (existing != profile))
+      {
+        TRC_WARNING("Service profile %s doesn't match stored copy - not sharing it",
+                    hash.c_str());
+        return "";
+      }
+
+      if (stored_expiry >= impu->expiry)
+      {
+        TRC_DEBUG("Service profile %s is stored until %ld",
+                  hash.c_str(), stored_expiry);
+
+        if (_profile_cache != nullptr)
+        {
+          _profile_cache->put(hash, profile, stored_expiry);
+        }
+
+        return hash;
+      }
+    }
+    else if (status == Store::Status::NOT_FOUND)
+    {
+      // Write with a CAS of 0, so that we don't overwrite a copy that
+      // another node stores in the meantime.
+      cas = 0;
+    }
+    else
+    {
+      TRC_DEBUG("Failed to check for service profile %s - not sharing it",
+                hash.c_str());
+      return "";
+    }
+
+    // Give it twice the time this IMPU has left, so that refreshing IMPUs
+    // that refer to it only needs to extend it about once every half life.
+    int now = time(0);
+    stored_expiry = std::max(stored_expiry,
+                             impu->expiry + std::max((int64_t)0, impu->expiry - now));
+
+    StageLatency::Timer compression_timer(StageLatency::COMPRESSION, trail);
+    bool encoded = encode_service_profile(profile, stored_expiry, data);
+    compression_timer.stop();
+
+    if (!encoded)
+    {
+      return ""; // LCOV_EXCL_LINE
+    }
+
+    StageLatency::Timer write_timer(_io_stage, trail);
+    status = _store->set_data(SERVICE_PROFILE_TABLE,
+                              hash,
+                              data,
+                              cas,
+                              stored_expiry - now,
+                              trail,
+                              false);
+    write_timer.stop();
+
+    if (status == Store::Status::OK)
+    {
+      TRC_DEBUG("Stored service profile %s (%lu bytes, %ld seconds)",
+                hash.c_str(), profile.size(), stored_expiry - now);
+    }
+  } while (status == Store::Status::DATA_CONTENTION);
+
+  if (status != Store::Status::OK)
+  {
+    TRC_DEBUG("Failed to store service profile %s - not sharing it",
+              hash.c_str());
+    return "";
+  }
+
+  if (_profile_cache != nullptr)
+  {
+    _profile_cache->put(hash, profile, stored_expiry);
+  }
+
+  return hash;
+}
+
+Store::Status ImpuStore::resolve_service_profile(ImpuStore::DefaultImpu* impu,
+                                                 SAS::TrailId trail)
+{
+  const std::string& hash = impu->service_profile_hash;
+
+  if ((_profile_cache != nullptr) &&
+      (_profile_cache->get(hash, impu->service_profile)))
+  {
+    return Store::Status::OK;
+  }
+
+  std::string data;
+  uint64_t cas;
+  StageLatency::Timer io_timer(_io_stage, trail);
+  Store::Status status = _store->get_data(SERVICE_PROFILE_TABLE,
+                                          hash,
+                                          data,
+                                          cas,
+                                          trail,
+                                          false);
+  io_timer.stop();
+
+  if (status == Store::Status::OK)
+  {
+    int64_t stored_expiry;
+
+    StageLatency::Timer decompression_timer(StageLatency::DECOMPRESSION, trail);
+    bool decoded = decode_service_profile(data, impu->service_profile, stored_expiry);
+    decompression_timer.stop();
+
+    if ((!decoded) ||
+        (hash_service_profile(impu->service_profile) != hash))
+    {
+      TRC_WARNING("Invalid data for service profile %s", hash.c_str());
+      impu->service_profile = "";
+      return Store::Status::ERROR;
+    }
+
+    if (_profile_cache != nullptr)
+    {
+      _profile_cache->put(hash, impu->service_profile, stored_expiry);
+    }
+  }
+  else if (status == Store::Status::NOT_FOUND)
+  {
+    TRC_WARNING("Service profile %s for %s not found",
+                hash.c_str(), impu->impu.c_str());
+  }
+
+  return status;
+}
+
+bool ImpuStore::encode_service_profile(const std::string& profile,
+                                       int64_t expiry,
+                                       std::string& data)
+{
+  const char* buffer;
+  int comp_size;
+
+  Impu::compress_data_v0(profile, buffer, comp_size);
+
+  // LCOV_EXCL_START
+  if (comp_size <= 0)
+  {
+    return false;
+  }
+  // LCOV_EXCL_STOP
+
+  data.clear();
+  data.reserve(19 + comp_size);
+  data.push_back(SERVICE_PROFILE_VERSION);
+
+  for (int shift = 56; shift >= 0; shift -= 8)
+  {
+    data.push_back((char)((uint64_t)expiry >> shift));
+  }
+
+  encode_varbyte(profile.size(), data);
+  data.append(buffer, comp_size);
+
+  return true;
+}
+
+bool ImpuStore::decode_service_profile(const std::string& data,
+                                       std::string& profile,
+                                       int64_t& expiry)
+{
+  if ((data.size() < 10) || (data[0] != SERVICE_PROFILE_VERSION))
+  {
+    return false;
+  }
+
+  uint64_t stored_expiry = 0;
+
+  for (size_t ii = 1; ii < 9; ++ii)
+  {
+    stored_expiry = (stored_expiry << 8) | (unsigned char)data[ii];
+  }
+
+  expiry = (int64_t)stored_expiry;
+
+  int length;
+  char* decompressed = Impu::decompress_data_v0(data, 9, length);
+
+  if (decompressed == nullptr)
+  {
+    return false;
+  }
+
+  profile.assign(decompressed, length);
+  return true;
+}
+
+void ImpuStore::sample_for_dictionary(ImpuStore::Impu* impu)
+{
+  if ((_dictionary_trainer != nullptr) && (_dictionary_trainer->wants_samples()))
+  {
+    _dictionary_trainer->add_sample(impu->impu, impu->to_json());
+  }
+}
+
+void ImpuStore::invalidate_cached_impu(const std::string& impu)
+{
+  if (_cache != nullptr)
+  {
+    _cache->invalidate(impu);
+  }
 }
 
 Store::Status ImpuStore::get_impi_mapping(const std::string impi,
@@ -615,12 +1635,14 @@ Store::Status ImpuStore::get_impi_mapping(const std::string impi,
   std::string data;
   uint64_t cas;
 
+  StageLatency::Timer io_timer(_io_stage, trail);
   Store::Status status = _store->get_data("impi_mapping",
                                           impi,
                                           data,
                                           cas,
                                           trail,
                                           Store::Format::JSON);
+  io_timer.stop();
 
   if (status == Store::Status::OK)
   {
@@ -655,6 +1677,7 @@ Store::Status ImpuStore::set_impi_mapping(ImpiMapping* mapping,
   {
     int now = time(0);
 
+    StageLatency::Timer io_timer(_io_stage, trail);
     status = _store->set_data("impi_mapping",
                               mapping->impi,
                               data,
@@ -670,6 +1693,7 @@ Store::Status ImpuStore::set_impi_mapping(ImpiMapping* mapping,
 Store::Status ImpuStore::delete_impi_mapping(ImpiMapping* mapping,
                                              SAS::TrailId trail)
 {
+  StageLatency::Timer io_timer(_io_stage, trail);
   return _store->delete_data("impi_mapping", mapping->impi, trail);
 }
 
@@ -697,3 +1721,217 @@ void ImpuStore::ImpiMapping::write_json(rapidjson::Writer<rapidjson::StringBuffe
   writer.String(JSON_EXPIRY);
   writer.Int64(_expiry);
 }
+
+ImpuStore::LocalCache::LocalCache(size_t max_entries, int max_age_ms) :
+  _max_entries_per_shard(std::max((size_t)1, max_entries / NUM_SHARDS)),
+  _max_age_ms(max_age_ms)
+{
+}
+
+ImpuStore::LocalCache::~LocalCache()
+{
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    for (std::pair<const std::string, Entry>& entry : _shards[ii].entries)
+    {
+      delete entry.second.impu;
+    }
+  }
+}
+
+ImpuStore::Impu* ImpuStore::LocalCache::get(const std::string& impu)
+{
+  uint64_t* generation;
+  Shard& shard = get_shard(impu, generation);
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(impu);
+
+  if (it == shard.entries.end())
+  {
+    return nullptr;
+  }
+
+  Entry& entry = it->second;
+
+  if ((entry.impu->expiry <= time(0)) ||
+      (now_ms() - entry.inserted_ms >= (uint64_t)_max_age_ms))
+  {
+    TRC_DEBUG("Local IMPU cache entry for %s is stale", impu.c_str());
+    remove_entry(shard, it);
+    return nullptr;
+  }
+
+  // Move the entry to the front of the LRU list.
+  shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru_it);
+
+  return entry.impu->clone();
+}
+
+uint64_t ImpuStore::LocalCache::generation(const std::string& impu)
+{
+  uint64_t* generation;
+  Shard& shard = get_shard(impu, generation);
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  return *generation;
+}
+
+void ImpuStore::LocalCache::put(const Impu* impu, uint64_t generation)
+{
+  Impu* copy = impu->clone();
+
+  uint64_t* current_generation;
+  Shard& shard = get_shard(impu->impu, current_generation);
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  if (*current_generation != generation)
+  {
+    // The IMPU has been written since it was read, so what we have may
+    // already be out of date.
+    TRC_DEBUG("Not caching %s as it has been invalidated since it was read",
+              impu->impu.c_str());
+    delete copy;
+    return;
+  }
+
+  std::unordered_map<std::string, Entry>::iterator it =
+    shard.entries.find(impu->impu);
+
+  if (it != shard.entries.end())
+  {
+    remove_entry(shard, it);
+  }
+  else if (shard.entries.size() >= _max_entries_per_shard)
+  {
+    // Evict the least recently used entry to make room.
+    remove_entry(shard, shard.entries.find(shard.lru.back()));
+  }
+
+  shard.lru.push_front(impu->impu);
+
+  Entry entry;
+  entry.impu = copy;
+  entry.inserted_ms = now_ms();
+  entry.lru_it = shard.lru.begin();
+  shard.entries[impu->impu] = entry;
+}
+
+void ImpuStore::LocalCache::invalidate(const std::string& impu)
+{
+  uint64_t* generation;
+  Shard& shard = get_shard(impu, generation);
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  (*generation)++;
+
+  std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(impu);
+
+  if (it != shard.entries.end())
+  {
+    remove_entry(shard, it);
+  }
+}
+
+ImpuStore::LocalCache::Shard& ImpuStore::LocalCache::get_shard(const std::string& impu,
+                                                               uint64_t*& generation)
+{
+  size_t hash = std::hash<std::string>()(impu);
+  Shard& shard = _shards[hash % NUM_SHARDS];
+  generation = &shard.generations[(hash / NUM_SHARDS) % GENERATIONS_PER_SHARD];
+  return shard;
+}
+
+void ImpuStore::LocalCache::remove_entry(Shard& shard,
+                                         std::unordered_map<std::string, Entry>::iterator it)
+{
+  delete it->second.impu;
+  shard.lru.erase(it->second.lru_it);
+  shard.entries.erase(it);
+}
+
+uint64_t ImpuStore::LocalCache::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+bool ImpuStore::ServiceProfileCache::get(const std::string& hash,
+                                         std::string& profile)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = _entries.find(hash);
+
+  if (it == _entries.end())
+  {
+    return false;
+  }
+
+  // Move the entry to the front of the LRU list.
+  _lru.splice(_lru.begin(), _lru, it->second.lru_it);
+
+  profile = it->second.profile;
+  return true;
+}
+
+bool ImpuStore::ServiceProfileCache::get_stored_expiry(const std::string& hash,
+                                                       const std::string& profile,
+                                                       int64_t& stored_expiry)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = _entries.find(hash);
+
+  if ((it == _entries.end()) || (it->second.profile != profile))
+  {
+    return false;
+  }
+
+  _lru.splice(_lru.begin(), _lru, it->second.lru_it);
+
+  stored_expiry = it->second.stored_expiry;
+  return true;
+}
+
+void ImpuStore::ServiceProfileCache::put(const std::string& hash,
+                                         const std::string& profile,
+                                         int64_t stored_expiry)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = _entries.find(hash);
+
+  if (it != _entries.end())
+  {
+    Entry& entry = it->second;
+    _lru.splice(_lru.begin(), _lru, entry.lru_it);
+
+    if (entry.profile == profile)
+    {
+      entry.stored_expiry = std::max(entry.stored_expiry, stored_expiry);
+    }
+    else
+    {
+      entry.profile = profile;
+      entry.stored_expiry = stored_expiry;
+    }
+
+    return;
+  }
+
+  if (_entries.size() >= _max_entries)
+  {
+    // Evict the least recently used entry to make room.
+    _entries.erase(_lru.back());
+    _lru.pop_back();
+  }
+
+  _lru.push_front(hash);
+
+  Entry& entry = _entries[hash];
+  entry.profile = profile;
+  entry.stored_expiry = stored_expiry;
+  entry.lru_it = _lru.begin();
+}
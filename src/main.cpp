@@ -17,13 +17,16 @@
 #include "accesslogger.h"
 #include "log.h"
 #include "statisticsmanager.h"
+#include "stage_latency.h"
 #include "load_monitor.h"
 #include "diameterstack.h"
 #include "diameter_handlers.h"
+#include "coalescing_hss_connection.h"
 #include "diameter_hss_connection.h"
 #include "httpstack.h"
 #include "http_handlers.h"
 #include "logger.h"
+#include "impu_dictionary.h"
 #include "memcached_cache.h"
 #include "memcachedstore.h"
 #include "hsprov_hss_connection.h"
@@ -62,6 +65,24 @@ struct options
   int max_peers;
   std::string server_name;
   int impu_cache_ttl;
+  int impu_memory_cache_ttl;
+  int impu_memory_cache_size;
+  int impu_data_version;
+  std::string impu_dictionary_dir;
+  int impu_dictionary_id;
+  std::string impu_dictionary_training_file;
+  int impu_dictionary_training_samples;
+  bool share_service_profiles;
+  int service_profile_cache_size;
+  bool store_identity_index;
+  int remote_store_timeout_ms;
+  int replication_threads;
+  int max_replication_queue;
+  int negative_cache_ttl_ms;
+  int negative_cache_size;
+  int lazy_refresh_s;
+  int cache_shards;
+  int reg_data_cache_size;
   int hss_reregistration_time;
   int reg_max_expires;
   std::string sprout_http_name;
@@ -125,6 +146,24 @@ enum OptionTypes
   REG_MAX_EXPIRES,
   CASSANDRA_THREADS,
   RAM_RECORD_EVERYTHING,
+  IMPU_MEMORY_CACHE_TTL,
+  IMPU_MEMORY_CACHE_SIZE,
+  REMOTE_STORE_TIMEOUT_MS,
+  REPLICATION_THREADS,
+  MAX_REPLICATION_QUEUE,
+  NEGATIVE_CACHE_TTL_MS,
+  NEGATIVE_CACHE_SIZE,
+  LAZY_REFRESH,
+  CACHE_SHARDS,
+  IMPU_DATA_VERSION,
+  IMPU_DICTIONARY_DIR,
+  IMPU_DICTIONARY_ID,
+  IMPU_DICTIONARY_TRAINING_FILE,
+  IMPU_DICTIONARY_TRAINING_SAMPLES,
+  SHARE_SERVICE_PROFILES,
+  SERVICE_PROFILE_CACHE_SIZE,
+  STORE_IDENTITY_INDEX,
+  REG_DATA_CACHE_SIZE,
 };
 
 const static struct option long_opt[] =
@@ -146,6 +185,24 @@ const static struct option long_opt[] =
   {"max-peers",                   required_argument, NULL, 'p'},
   {"server-name",                 required_argument, NULL, 's'},
   {"impu-cache-ttl",              required_argument, NULL, 'i'},
+  {"impu-memory-cache-ttl",       required_argument, NULL, IMPU_MEMORY_CACHE_TTL},
+  {"impu-memory-cache-size",      required_argument, NULL, IMPU_MEMORY_CACHE_SIZE},
+  {"impu-data-version",           required_argument, NULL, IMPU_DATA_VERSION},
+  {"impu-dictionary-dir",         required_argument, NULL, IMPU_DICTIONARY_DIR},
+  {"impu-dictionary-id",          required_argument, NULL, IMPU_DICTIONARY_ID},
+  {"impu-dictionary-training-file", required_argument, NULL, IMPU_DICTIONARY_TRAINING_FILE},
+  {"impu-dictionary-training-samples", required_argument, NULL, IMPU_DICTIONARY_TRAINING_SAMPLES},
+  {"share-service-profiles",      no_argument,       NULL, SHARE_SERVICE_PROFILES},
+  {"service-profile-cache-size",  required_argument, NULL, SERVICE_PROFILE_CACHE_SIZE},
+  {"store-identity-index",        no_argument,       NULL, STORE_IDENTITY_INDEX},
+  {"remote-store-timeout-ms",     required_argument, NULL, REMOTE_STORE_TIMEOUT_MS},
+  {"replication-threads",         required_argument, NULL, REPLICATION_THREADS},
+  {"max-replication-queue",       required_argument, NULL, MAX_REPLICATION_QUEUE},
+  {"negative-cache-ttl-ms",       required_argument, NULL, NEGATIVE_CACHE_TTL_MS},
+  {"negative-cache-size",         required_argument, NULL, NEGATIVE_CACHE_SIZE},
+  {"lazy-refresh",                required_argument, NULL, LAZY_REFRESH},
+  {"cache-shards",                required_argument, NULL, CACHE_SHARDS},
+  {"reg-data-cache-size",         required_argument, NULL, REG_DATA_CACHE_SIZE},
   {"hss-reregistration-time",     required_argument, NULL, 'I'},
   {"reg-max-expires",             required_argument, NULL, REG_MAX_EXPIRES},
   {"sprout-http-name",            required_argument, NULL, 'j'},
@@ -208,12 +265,83 @@ void usage(void)
        " -s, --server-name <name>   Set Server-Name on Cx messages\n"
        " -i, --impu-cache-ttl <secs>\n"
        "                            IMPU cache time-to-live in seconds (default: 0)\n"
+       "     --impu-memory-cache-ttl <secs>\n"
+       "                            Time in seconds to cache decoded IMPUs in memory for (default:\n"
+       "                            0 - no caching). Writes from other homestead nodes aren't seen\n"
+       "                            until a cached IMPU ages out, so this is only safe with a single\n"
+       "                            homestead node per site\n"
+       "     --impu-memory-cache-size N\n"
+       "                            Maximum number of IMPUs to cache in memory per IMPU store\n"
+       "                            (default: 10000)\n"
+       "     --impu-data-version N  Format to write IMPUs to the IMPU stores in - 0 for compressed\n"
+       "                            JSON, 1 for binary or 2 for JSON compressed with a trained\n"
+       "                            dictionary (see --impu-dictionary-id). All formats can be read,\n"
+       "                            but only use a newer format once every node in every site\n"
+       "                            supports it (default: 0)\n"
+       "     --impu-dictionary-dir <directory>\n"
+       "                            Directory to load trained IMPU compression dictionaries from.\n"
+       "                            Each is in a file called <id>.dict, where id is from 1 to 255\n"
+       "     --impu-dictionary-id N Trained dictionary to compress IMPUs with when writing data\n"
+       "                            version 2. Only use a dictionary once it's loaded on every node\n"
+       "                            in every site\n"
+       "     --impu-dictionary-training-file <file>\n"
+       "                            Train an IMPU compression dictionary from the IMPUs written to\n"
+       "                            the local IMPU store, and write it to this file\n"
+       "     --impu-dictionary-training-samples N\n"
+       "                            Number of IMPUs to train the dictionary from (default: 1000)\n"
+       "     --share-service-profiles\n"
+       "                            Store each distinct service profile in the IMPU stores once,\n"
+       "                            shared by all the IMPUs that have it. Only use this once every\n"
+       "                            node in every site supports it\n"
+       "     --service-profile-cache-size N\n"
+       "                            Maximum number of shared service profiles to cache in memory\n"
+       "                            per IMPU store (default: 1000)\n"
+       "     --store-identity-index\n"
+       "                            Store the identities in each service profile alongside it in the\n"
+       "                            IMPU stores, so they can be read without parsing the XML. Only use\n"
+       "                            this once every node in every site supports it\n"
        " -I, --hss-reregistration-time <secs>\n"
        "                            How often a RE_REGISTRATION SAR should be sent to the HSS in seconds (default: 1800)\n"
        " -j, --http-sprout-name <name>\n"
        "                            Set HTTP address to send deregistration information from RTRs\n"
        "     --local-site-name <name>\n"
        "                            The name of the local site (used in a geo-redundant deployment)\n"
+       "     --remote-store-timeout-ms <milliseconds>\n"
+       "                            How long to wait for the remote sites' IMPU stores to respond\n"
+       "                            to a read before giving up on them (default: 0 - no limit)\n"
+       "     --replication-threads N\n"
+       "                            Number of threads to use to replicate writes to the remote\n"
+       "                            sites' IMPU stores (default: 10). If 0, writes are replicated\n"
+       "                            by the cache threads\n"
+       "     --max-replication-queue N\n"
+       "                            Maximum number of subscribers with writes waiting to be\n"
+       "                            replicated to the remote sites' IMPU stores, beyond which the\n"
+       "                            cache threads replicate writes themselves (default: 1000)\n"
+       "     --negative-cache-ttl-ms <milliseconds>\n"
+       "                            How long to remember that an IMPU or IMPI wasn't found in any\n"
+       "                            IMPU store, and so not look it up in the remote sites' IMPU\n"
+       "                            stores again (default: 0 - don't remember)\n"
+       "     --negative-cache-size N\n"
+       "                            Maximum number of IMPUs and IMPIs to remember weren't found in\n"
+       "                            any IMPU store (default: 10000)\n"
+       "     --lazy-refresh <seconds>\n"
+       "                            When a registration is refreshed, only rewrite the records for\n"
+       "                            its associated IMPUs and IMPIs if they would otherwise expire\n"
+       "                            before it. These records are written to last this much longer\n"
+       "                            than the registration (default: 0 - rewrite them on every\n"
+       "                            refresh)\n"
+       "     --cache-shards N\n"
+       "                            Split the cache threads into this many shards, each with its\n"
+       "                            own queue and queue size statistic, to reduce contention on\n"
+       "                            the queue. Requests are sent to the shard for the IMPU or IMPI\n"
+       "                            they're for, but this doesn't keep a subscriber's requests in\n"
+       "                            order or on the same threads. The threads are split as evenly\n"
+       "                            as possible, and the queue limit is shared between the shards\n"
+       "                            (default: 1)\n"
+       "     --reg-data-cache-size N\n"
+       "                            Maximum number of rendered registration data documents to\n"
+       "                            cache in memory, for subscribers whose data hasn't changed\n"
+       "                            (default: 10000, 0 - no caching)\n"
        "     --scheme-unknown <string>\n"
        "                            String to use to specify unknown SIP-Auth-Scheme (default: Unknown)\n"
        "     --scheme-digest <string>\n"
@@ -387,6 +515,96 @@ int init_options(int argc, char**argv, struct options& options)
       options.impu_cache_ttl = atoi(optarg);
       break;
 
+    case IMPU_MEMORY_CACHE_TTL:
+      TRC_INFO("IMPU memory cache TTL: %s", optarg);
+      options.impu_memory_cache_ttl = atoi(optarg);
+      break;
+
+    case IMPU_MEMORY_CACHE_SIZE:
+      TRC_INFO("IMPU memory cache size: %s", optarg);
+      options.impu_memory_cache_size = atoi(optarg);
+      break;
+
+    case IMPU_DATA_VERSION:
+      TRC_INFO("IMPU data version: %s", optarg);
+      options.impu_data_version = atoi(optarg);
+      break;
+
+    case IMPU_DICTIONARY_DIR:
+      TRC_INFO("IMPU dictionary directory: %s", optarg);
+      options.impu_dictionary_dir = std::string(optarg);
+      break;
+
+    case IMPU_DICTIONARY_ID:
+      TRC_INFO("IMPU dictionary ID: %s", optarg);
+      options.impu_dictionary_id = atoi(optarg);
+      break;
+
+    case IMPU_DICTIONARY_TRAINING_FILE:
+      TRC_INFO("IMPU dictionary training file: %s", optarg);
+      options.impu_dictionary_training_file = std::string(optarg);
+      break;
+
+    case IMPU_DICTIONARY_TRAINING_SAMPLES:
+      TRC_INFO("IMPU dictionary training samples: %s", optarg);
+      options.impu_dictionary_training_samples = atoi(optarg);
+      break;
+
+    case SHARE_SERVICE_PROFILES:
+      TRC_INFO("Sharing service profiles in the IMPU stores");
+      options.share_service_profiles = true;
+      break;
+
+    case SERVICE_PROFILE_CACHE_SIZE:
+      TRC_INFO("Service profile cache size: %s", optarg);
+      options.service_profile_cache_size = atoi(optarg);
+      break;
+
+    case STORE_IDENTITY_INDEX:
+      TRC_INFO("Storing identity indexes in the IMPU stores");
+      options.store_identity_index = true;
+      break;
+
+    case REMOTE_STORE_TIMEOUT_MS:
+      TRC_INFO("Remote store timeout: %s", optarg);
+      options.remote_store_timeout_ms = atoi(optarg);
+      break;
+
+    case REPLICATION_THREADS:
+      TRC_INFO("Replication threads: %s", optarg);
+      options.replication_threads = atoi(optarg);
+      break;
+
+    case MAX_REPLICATION_QUEUE:
+      TRC_INFO("Maximum replication queue: %s", optarg);
+      options.max_replication_queue = atoi(optarg);
+      break;
+
+    case NEGATIVE_CACHE_TTL_MS:
+      TRC_INFO("Negative cache TTL: %s ms", optarg);
+      options.negative_cache_ttl_ms = atoi(optarg);
+      break;
+
+    case NEGATIVE_CACHE_SIZE:
+      TRC_INFO("Negative cache size: %s", optarg);
+      options.negative_cache_size = atoi(optarg);
+      break;
+
+    case LAZY_REFRESH:
+      TRC_INFO("Lazy refresh: %s seconds", optarg);
+      options.lazy_refresh_s = atoi(optarg);
+      break;
+
+    case CACHE_SHARDS:
+      TRC_INFO("Cache shards: %s", optarg);
+      options.cache_shards = atoi(optarg);
+      break;
+
+    case REG_DATA_CACHE_SIZE:
+      TRC_INFO("Registration data cache size: %s", optarg);
+      options.reg_data_cache_size = atoi(optarg);
+      break;
+
     case 'I':
       TRC_INFO("HSS reregistration time: %s", optarg);
       options.hss_reregistration_time = atoi(optarg);
@@ -627,7 +845,14 @@ void create_memcached_cache(HssCacheProcessor*& cache_processor,
                             std::string& impu_store_location,
                             int af,
                             int threads,
-                            ExceptionHandler* exception_handler)
+                            ExceptionHandler* exception_handler,
+                            SNMP::EventAccumulatorByScopeTable* replication_queue_size_table,
+                            SNMP::EventAccumulatorTable* replication_lag_table,
+                            SNMP::CounterTable* negative_cache_hits_table,
+                            SNMP::CounterTable* negative_cache_misses_table,
+                            SNMP::CounterTable* serialized_writes_table,
+                            SNMP::CounterTable* contention_retries_table,
+                            ImpuDictionaryTrainer* impu_dictionary_trainer)
 {
   astaire_comm_monitor = new CommunicationMonitor(new Alarm(alarm_manager,
                                                             "homestead",
@@ -655,7 +880,19 @@ void create_memcached_cache(HssCacheProcessor*& cache_processor,
                                                                       astaire_resolver,
                                                                       false,
                                                                       astaire_comm_monitor);
-    local_impu_store = new ImpuStore(local_impu_data_store);
+    local_impu_store = new ImpuStore(local_impu_data_store,
+                                     options.impu_memory_cache_size,
+                                     options.impu_memory_cache_ttl * 1000,
+                                     options.impu_data_version,
+                                     options.impu_dictionary_id,
+                                     options.share_service_profiles,
+                                     options.service_profile_cache_size,
+                                     options.store_identity_index);
+
+    if (impu_dictionary_trainer != nullptr)
+    {
+      local_impu_store->set_dictionary_trainer(impu_dictionary_trainer);
+    }
 
     for (std::vector<std::string>::iterator it = remote_impu_stores_locations.begin();
            it != remote_impu_stores_locations.end();
@@ -667,13 +904,33 @@ void create_memcached_cache(HssCacheProcessor*& cache_processor,
                                                                            true,
                                                                            remote_astaire_comm_monitor);
       remote_impu_data_stores.push_back(remote_data_store);
-      remote_impu_stores.push_back(new ImpuStore(remote_data_store));
+      remote_impu_stores.push_back(new ImpuStore(remote_data_store,
+                                                 options.impu_memory_cache_size,
+                                                 options.impu_memory_cache_ttl * 1000,
+                                                 options.impu_data_version,
+                                                 options.impu_dictionary_id,
+                                                 options.share_service_profiles,
+                                                 options.service_profile_cache_size,
+                                                 options.store_identity_index));
     }
 
     memcached_cache = new MemcachedCache(local_impu_store,
                                          remote_impu_stores,
                                          threads * remote_impu_stores_locations.size(),
-                                         exception_handler);
+                                         exception_handler,
+                                         options.remote_store_timeout_ms,
+                                         options.replication_threads,
+                                         options.max_replication_queue,
+                                         replication_queue_size_table,
+                                         replication_lag_table,
+                                         options.negative_cache_size,
+                                         options.negative_cache_ttl_ms,
+                                         negative_cache_hits_table,
+                                         negative_cache_misses_table,
+                                         options.lazy_refresh_s,
+                                         serialized_writes_table,
+                                         contention_retries_table,
+                                         threads);
     cache_processor = new HssCacheProcessor(memcached_cache);
   }
   else
@@ -712,6 +969,24 @@ int main(int argc, char**argv)
   options.server_name = "sip:server-name.unknown";
   options.access_log_enabled = false;
   options.impu_cache_ttl = 0;
+  options.impu_memory_cache_ttl = 0;
+  options.impu_memory_cache_size = 10000;
+  options.impu_data_version = ImpuStore::DATA_VERSION_JSON_LZ4;
+  options.impu_dictionary_dir = "";
+  options.impu_dictionary_id = 0;
+  options.impu_dictionary_training_file = "";
+  options.impu_dictionary_training_samples = 1000;
+  options.share_service_profiles = false;
+  options.service_profile_cache_size = 1000;
+  options.store_identity_index = false;
+  options.remote_store_timeout_ms = 0;
+  options.replication_threads = 10;
+  options.max_replication_queue = 1000;
+  options.negative_cache_ttl_ms = 0;
+  options.negative_cache_size = 10000;
+  options.lazy_refresh_s = 0;
+  options.cache_shards = 1;
+  options.reg_data_cache_size = 10000;
   options.hss_reregistration_time = 1800;
   options.reg_max_expires = 300;
   options.sprout_http_name = "sprout-http-name.unknown";
@@ -820,6 +1095,7 @@ int main(int argc, char**argv)
   // Set up the statistics (Homestead specific and Diameter)
   snmp_setup("homestead");
   StatisticsManager* stats_manager = new StatisticsManager();
+  StageLatency::configure(stats_manager);
   SNMP::CounterTable* realm_counter = SNMP::CounterTable::create("H_diameter_invalid_dest_realm",
                                                                  ".1.2.826.0.1.1578918.9.5.8");
   SNMP::CounterTable* host_counter = SNMP::CounterTable::create("H_diameter_invalid_dest_host",
@@ -839,6 +1115,36 @@ int main(int argc, char**argv)
   SNMP::EventAccumulatorByScopeTable* cache_queue_size_table =
     SNMP::EventAccumulatorByScopeTable::create("cache_queue_size",
                                                ".1.2.826.0.1.1578918.9.5.16");
+  std::vector<SNMP::EventAccumulatorByScopeTable*> cache_shard_queue_size_tables;
+  if (options.cache_shards > 1)
+  {
+    // Each shard also reports its own queue size, so that a busy shard
+    // stands out.
+    for (int ii = 0; ii < options.cache_shards; ++ii)
+    {
+      cache_shard_queue_size_tables.push_back(
+        SNMP::EventAccumulatorByScopeTable::create("cache_shard_queue_size_" + std::to_string(ii),
+                                                   ".1.2.826.0.1.1578918.9.5.29." + std::to_string(ii + 1)));
+    }
+  }
+  SNMP::EventAccumulatorByScopeTable* replication_queue_size_table =
+    SNMP::EventAccumulatorByScopeTable::create("replication_queue_size",
+                                               ".1.2.826.0.1.1578918.9.5.17");
+  SNMP::EventAccumulatorTable* replication_lag_table =
+    SNMP::EventAccumulatorTable::create("H_replication_lag_us",
+                                        ".1.2.826.0.1.1578918.9.5.18");
+  SNMP::CounterTable* negative_cache_hits_table =
+    SNMP::CounterTable::create("H_negative_cache_hits",
+                               ".1.2.826.0.1.1578918.9.5.19");
+  SNMP::CounterTable* negative_cache_misses_table =
+    SNMP::CounterTable::create("H_negative_cache_misses",
+                               ".1.2.826.0.1.1578918.9.5.20");
+  SNMP::CounterTable* serialized_writes_table =
+    SNMP::CounterTable::create("H_irs_writes_serialized",
+                               ".1.2.826.0.1.1578918.9.5.21");
+  SNMP::CounterTable* contention_retries_table =
+    SNMP::CounterTable::create("H_irs_write_contention_retries",
+                               ".1.2.826.0.1.1578918.9.5.22");
 
   // Must happen after all SNMP tables have been registered.
   init_snmp_handler_threads("homestead");
@@ -896,6 +1202,33 @@ int main(int argc, char**argv)
   CommunicationMonitor* remote_astaire_comm_monitor = nullptr;
   HssCacheProcessor* cache_processor;
 
+  if (options.impu_dictionary_dir != "")
+  {
+    int dictionaries = load_impu_dictionaries(options.impu_dictionary_dir);
+    TRC_STATUS("Loaded %d IMPU dictionaries from %s",
+               dictionaries,
+               options.impu_dictionary_dir.c_str());
+  }
+
+  if ((options.impu_data_version == ImpuStore::DATA_VERSION_TRAINED_LZ4) &&
+      (!ImpuStore::Impu::has_dictionary(options.impu_dictionary_id)))
+  {
+    TRC_WARNING("IMPU dictionary %d isn't loaded - writing IMPUs in data version 0",
+                options.impu_dictionary_id);
+  }
+
+  ImpuDictionaryTrainer* impu_dictionary_trainer = nullptr;
+
+  if (options.impu_dictionary_training_file != "")
+  {
+    TRC_STATUS("Training IMPU dictionary from %d IMPUs",
+               options.impu_dictionary_training_samples);
+    impu_dictionary_trainer =
+      new ImpuDictionaryTrainer(options.impu_dictionary_training_file,
+                                options.impu_dictionary_training_samples,
+                                ImpuStore::Impu::MAX_DICTIONARY_SIZE);
+  }
+
   create_memcached_cache(cache_processor,
                          options,
                          dns_resolver,
@@ -912,13 +1245,22 @@ int main(int argc, char**argv)
                          impu_store_location,
                          af,
                          options.cache_threads,
-                         exception_handler);
+                         exception_handler,
+                         replication_queue_size_table,
+                         replication_lag_table,
+                         negative_cache_hits_table,
+                         negative_cache_misses_table,
+                         serialized_writes_table,
+                         contention_retries_table,
+                         impu_dictionary_trainer);
 
   HssCacheTask::configure_cache(cache_processor);
   bool started = cache_processor->start_threads(options.cache_threads,
                                                 exception_handler,
                                                 0,
-                                                cache_queue_size_table);
+                                                cache_queue_size_table,
+                                                options.cache_shards,
+                                                cache_shard_queue_size_tables);
   if (!started)
   {
     CL_HOMESTEAD_CACHE_INIT_FAIL.log();
@@ -1068,7 +1410,12 @@ int main(int argc, char**argv)
                                                        options.scheme_akav1,
                                                        options.scheme_akav2);
 
-  HssCacheTask::configure_hss_connection(hss_conn, options.server_name);
+  // Concurrent identical SARs (e.g. from a burst of requests for the same
+  // subscriber) only need to be sent to the HSS once.
+  HssConnection::HssConnection* coalescing_hss_conn =
+    new HssConnection::CoalescingHssConnection(hss_conn);
+
+  HssCacheTask::configure_hss_connection(coalescing_hss_conn, options.server_name);
 
   ImpiTask::Config impi_handler_config(options.scheme_unknown,
                                        options.scheme_digest,
@@ -1078,10 +1425,18 @@ int main(int argc, char**argv)
                                                                           options.home_domain :
                                                                           options.dest_realm);
   ImpuLocationInfoTask::Config location_info_handler_config;
+  XmlUtils::ClearwaterRegDataCache* reg_data_cache = NULL;
+
+  if (options.reg_data_cache_size > 0)
+  {
+    reg_data_cache = new XmlUtils::ClearwaterRegDataCache(options.reg_data_cache_size);
+  }
+
   ImpuRegDataTask::Config impu_handler_config(hss_configured,
                                               options.hss_reregistration_time,
                                               record_ttl,
-                                              options.request_shared_ifcs);
+                                              options.request_shared_ifcs,
+                                              reg_data_cache);
 
   HttpStackUtils::PingHandler ping_handler;
   HttpStackUtils::SpawningHandler<ImpiDigestTask, ImpiTask::Config> impi_digest_handler(&impi_handler_config);
@@ -1209,6 +1564,8 @@ int main(int argc, char**argv)
   cache_processor->stop();
   cache_processor->wait_stopped();
 
+  delete reg_data_cache; reg_data_cache = NULL;
+
   if (hss_configured)
   {
     realm_manager->stop();
@@ -1246,7 +1603,6 @@ int main(int argc, char**argv)
   delete http_conn; http_conn = nullptr;
   delete realm_counter; realm_counter = nullptr;
   delete host_counter; host_counter = nullptr;
-  delete stats_manager; stats_manager = nullptr;
   delete mar_results_table; mar_results_table = nullptr;
   delete sar_results_table; sar_results_table = nullptr;
   delete uar_results_table; uar_results_table = nullptr;
@@ -1254,6 +1610,10 @@ int main(int argc, char**argv)
   delete ppr_results_table; ppr_results_table = nullptr;
   delete rtr_results_table; rtr_results_table = nullptr;
   delete cache_queue_size_table; cache_queue_size_table = nullptr;
+  for (SNMP::EventAccumulatorByScopeTable* table : cache_shard_queue_size_tables)
+  {
+    delete table;
+  }
 
   delete http_stack_sig; http_stack_sig = NULL;
   delete http_stack_mgmt; http_stack_mgmt = NULL;
@@ -1263,6 +1623,18 @@ int main(int argc, char**argv)
 
   delete cache_processor; cache_processor = NULL;
   delete memcached_cache; memcached_cache = nullptr;
+
+  // The cache's threads have all stopped now, so nothing else can record a
+  // stage latency.
+  StageLatency::configure(NULL);
+  delete stats_manager; stats_manager = nullptr;
+  delete impu_dictionary_trainer; impu_dictionary_trainer = nullptr;
+  delete replication_queue_size_table; replication_queue_size_table = nullptr;
+  delete replication_lag_table; replication_lag_table = nullptr;
+  delete negative_cache_hits_table; negative_cache_hits_table = nullptr;
+  delete negative_cache_misses_table; negative_cache_misses_table = nullptr;
+  delete serialized_writes_table; serialized_writes_table = nullptr;
+  delete contention_retries_table; contention_retries_table = nullptr;
   delete load_monitor; load_monitor = NULL;
 
   delete sas_service; sas_service = NULL;
@@ -11,7 +11,12 @@
 
 #include "memcached_cache.h"
 #include <string>
-#include <future>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
 #include "homestead_xml_utils.h"
 #include "log.h"
 #include "utils.h"
@@ -19,7 +24,344 @@
 using std::placeholders::_1;
 using std::placeholders::_2;
 
-typedef std::tuple<Store::Status, ImpuStore::Impu*, unsigned long> impu_result_t;
+// The prefixes of the negative cache keys for IMPUs and IMPIs, so that an IMPU
+// and IMPI with the same value have separate entries.
+static const std::string IMPU_KEY_PREFIX = "impu:";
+static const std::string IMPI_KEY_PREFIX = "impi:";
+
+// State shared between a caller and the reads it has fanned out to the remote
+// stores. The caller and each remote read hold a reference, so the state (and
+// any result that arrives after the caller has stopped waiting) is freed by
+// whichever of them finishes last.
+template <class T>
+struct RemoteReadState
+{
+  RemoteReadState(size_t outstanding) :
+    outstanding(outstanding),
+    failed(0),
+    result(nullptr),
+    complete(false),
+    abandoned(false),
+    remote_time(0L)
+  {
+  }
+
+  ~RemoteReadState()
+  {
+    delete result; result = nullptr;
+  }
+
+  std::mutex lock;
+  std::condition_variable cond;
+
+  // The number of remote reads that haven't completed yet.
+  size_t outstanding;
+
+  // The number of remote reads that completed with an error (rather than a
+  // result or NOT_FOUND).
+  size_t failed;
+
+  // The successful results received so far, if any, and whether they're all
+  // the caller needs.
+  T* result;
+  bool complete;
+
+  // Set once the caller has stopped waiting for results.
+  bool abandoned;
+
+  // The longest time spent by any remote read that completed before the
+  // caller stopped waiting.
+  unsigned long remote_time;
+};
+
+// A batch of IMPUs read from a store, keyed by IMPU.
+struct ImpuBatch
+{
+  ImpuBatch(const std::vector<ImpuStore::Impu*>& data)
+  {
+    for (ImpuStore::Impu* impu : data)
+    {
+      impus[impu->impu] = impu;
+    }
+  }
+
+  ~ImpuBatch()
+  {
+    for (std::pair<const std::string, ImpuStore::Impu*>& entry : impus)
+    {
+      delete entry.second;
+    }
+  }
+
+  // Takes any IMPUs from the other batch that aren't already in this one.
+  void merge(ImpuBatch& other)
+  {
+    std::map<std::string, ImpuStore::Impu*>::iterator it = other.impus.begin();
+
+    while (it != other.impus.end())
+    {
+      if (impus.insert(*it).second)
+      {
+        it = other.impus.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  std::map<std::string, ImpuStore::Impu*> impus;
+};
+
+// State shared between a caller and the operations it is running in parallel.
+struct ParallelOpsState
+{
+  ParallelOpsState(size_t outstanding) :
+    outstanding(outstanding)
+  {
+  }
+
+  std::mutex lock;
+  std::condition_variable cond;
+
+  // The number of operations that haven't completed yet.
+  size_t outstanding;
+};
+
+// An update to the IMPI mapping for one of an IRS's IMPIs.
+struct ImpiMappingUpdate
+{
+  enum struct Write
+  {
+    NONE,
+    SET,
+    DELETE
+  };
+
+  ImpiMappingUpdate(const std::string& impi,
+                    MemcachedImplicitRegistrationSet::State state) :
+    impi(impi),
+    state(state),
+    needs_read(state != MemcachedImplicitRegistrationSet::State::ADDED),
+    mapping(nullptr),
+    read_status(Store::Status::OK),
+    write(Write::NONE),
+    status(Store::Status::OK)
+  {
+  }
+
+  ~ImpiMappingUpdate()
+  {
+    delete mapping; mapping = nullptr;
+  }
+
+  std::string impi;
+  MemcachedImplicitRegistrationSet::State state;
+
+  // Whether we need to read the current mapping before updating it. We
+  // don't read the mappings of IMPIs we think are new, unless we find out
+  // that they aren't.
+  bool needs_read;
+
+  // The mapping we've read (or created), and the Status of the read.
+  ImpuStore::ImpiMapping* mapping;
+  Store::Status read_status;
+
+  // What we need to write back to the store, and the Status of doing so.
+  Write write;
+  Store::Status status;
+};
+
+// Merges the IRS's changes into the IMPI mapping we've read (if any), and works
+// out what we need to write back to the store. The IRS expires at irs_expiry,
+// and any mapping we write lasts lazy_refresh_s beyond that.
+static void merge_impi_mapping(ImpiMappingUpdate* update,
+                               MemcachedImplicitRegistrationSet* irs,
+                               int64_t irs_expiry,
+                               int lazy_refresh_s)
+{
+  const std::string& default_impu = irs->get_default_impu();
+  int64_t expiry = irs_expiry + lazy_refresh_s;
+
+  update->write = ImpiMappingUpdate::Write::NONE;
+  update->status = Store::Status::OK;
+
+  switch (update->state)
+  {
+  case MemcachedImplicitRegistrationSet::State::DELETED:
+    // Failing to find the mapping (or to read it at all) shouldn't affect our
+    // overall Status, as there's nothing to remove
+    if ((update->read_status == Store::Status::OK) &&
+        (update->mapping->has_default_impu(default_impu)))
+    {
+      update->mapping->remove_default_impu(default_impu);
+
+      if (update->mapping->is_empty())
+      {
+        update->write = ImpiMappingUpdate::Write::DELETE;
+      }
+      else
+      {
+        update->write = ImpiMappingUpdate::Write::SET;
+      }
+    }
+    break;
+
+  case MemcachedImplicitRegistrationSet::State::UNCHANGED:
+    if ((lazy_refresh_s > 0) &&
+        (update->read_status == Store::Status::OK) &&
+        (update->mapping->has_default_impu(default_impu)) &&
+        (update->mapping->get_expiry() >= irs_expiry))
+    {
+      // The refresh is lazy, and the mapping won't expire before the IRS, so
+      // there's no need to rewrite it yet
+      TRC_DEBUG("IMPI mapping for %s doesn't need refreshing yet",
+                update->impi.c_str());
+      break;
+    }
+
+    if (update->read_status == Store::Status::OK)
+    {
+      update->mapping->set_expiry(expiry);
+
+      // Although we believe the IMPI-IMPU mapping is unchanged,
+      // in the background it may have been deleted, and re-added,
+      // so we should check that the data is still consistent with
+      // the Default IMPU record
+      if (!update->mapping->has_default_impu(default_impu))
+      {
+        update->mapping->add_default_impu(default_impu);
+      }
+    }
+    else
+    {
+      delete update->mapping;
+      update->mapping = new ImpuStore::ImpiMapping(update->impi,
+                                                   default_impu,
+                                                   expiry);
+    }
+
+    update->write = ImpiMappingUpdate::Write::SET;
+    break;
+
+  case MemcachedImplicitRegistrationSet::State::ADDED:
+    if (!update->needs_read)
+    {
+      // Given we think this IMPI-IMPU mapping is new, and given
+      // multiple IMPI mapping to multiple IRS is rare, we assume
+      // that the IMPI-IMPU mapping does not exist. If it does, we'll
+      // perform a CAS contention resolution
+      update->mapping = new ImpuStore::ImpiMapping(update->impi,
+                                                   default_impu,
+                                                   expiry);
+      update->write = ImpiMappingUpdate::Write::SET;
+    }
+    else if (update->read_status == Store::Status::OK)
+    {
+      // We found an existing mapping, so update the one we found
+      update->mapping->set_expiry(expiry);
+
+      if (!update->mapping->has_default_impu(default_impu))
+      {
+        update->mapping->add_default_impu(default_impu);
+        update->write = ImpiMappingUpdate::Write::SET;
+      }
+      else if (irs->is_refreshed())
+      {
+        update->write = ImpiMappingUpdate::Write::SET;
+      }
+
+      // Otherwise we aren't being refreshed, and the IMPU is present, so
+      // the data is already good
+    }
+    else if (update->read_status == Store::Status::NOT_FOUND)
+    {
+      // If we've failed to find something in the store, having just had
+      // DATA_CONTENTION, then just write the new mapping again, as we
+      // shouldn't hit DATA_CONTENTION next time
+      update->mapping = new ImpuStore::ImpiMapping(update->impi,
+                                                   default_impu,
+                                                   expiry);
+      update->write = ImpiMappingUpdate::Write::SET;
+    }
+    else
+    {
+      // We've hit some other error, so just bail out
+      update->status = update->read_status;
+    }
+    break;
+  }
+}
+
+// An update to the record for one of an IRS's associated IMPUs.
+struct AssociatedImpuUpdate
+{
+  AssociatedImpuUpdate(const std::string& impu) :
+    impu(impu),
+    mapping(nullptr),
+    status(Store::Status::OK)
+  {
+  }
+
+  ~AssociatedImpuUpdate()
+  {
+    delete mapping; mapping = nullptr;
+  }
+
+  std::string impu;
+
+  // The record for the IMPU that we've read from the store, if any, and the
+  // Status of updating it.
+  ImpuStore::Impu* mapping;
+  Store::Status status;
+};
+
+// Checks whether a record read from the store is an associated IMPU that
+// belongs to the IRS.
+static bool belongs_to_irs(ImpuStore::Impu* mapping,
+                           MemcachedImplicitRegistrationSet* irs)
+{
+  return ((mapping != nullptr) &&
+          (!mapping->is_default_impu()) &&
+          (((ImpuStore::AssociatedImpu*)mapping)->default_impu == irs->get_default_impu()));
+}
+
+// Checks that the IMPU pointed at by an associated IMPU is a default IMPU that
+// has the associated IMPU in its IRS. If it isn't, we've probably hit a window
+// condition.
+static bool is_valid_default_impu(const std::string& assoc_impu,
+                                  ImpuStore::Impu* data)
+{
+  // Is the target IMPU a default IMPU?
+  bool is_default = data->is_default_impu();
+
+  // Does the target IMPU have the source Associated IMPU as
+  // a default IMPU?
+  bool is_associated = (is_default &&
+                        ((ImpuStore::DefaultImpu*)data)->has_associated_impu(assoc_impu));
+
+  if (!is_default)
+  {
+    TRC_INFO("Non-default IMPU pointed by associated IMPU record");
+  }
+  else if (!is_associated)
+  {
+    TRC_INFO("Default IMPU does not contain IMPU as associated");
+  }
+
+  return (is_default && is_associated);
+}
+
+// Merge function for remote reads where we just want the first successful
+// result.
+template <class T>
+static bool use_first_result(T*& remote_data, T*& result)
+{
+  result = remote_data;
+  remote_data = nullptr;
+  return true;
+}
 
 // LCOV_EXCL_START
 static void pause_stopwatch(Utils::StopWatch* stopwatch, const std::string& reason)
@@ -49,15 +391,19 @@ ImpuStore::DefaultImpu* MemcachedImplicitRegistrationSet::create_impu(uint64_t c
 
   int now = time(0);
 
-  return new ImpuStore::DefaultImpu(_default_impu,
-                                    impus,
-                                    impis,
-                                    _registration_state,
-                                    _charging_addresses,
-                                    get_ims_sub_xml(),
-                                    cas,
-                                    _ttl + now,
-                                    store);
+  ImpuStore::DefaultImpu* impu =
+    new ImpuStore::DefaultImpu(_default_impu,
+                               impus,
+                               impis,
+                               _registration_state,
+                               _charging_addresses,
+                               get_ims_sub_xml(),
+                               cas,
+                               _ttl + now,
+                               store);
+  impu->identity_index = _identity_index;
+
+  return impu;
 }
 
 ImpuStore::DefaultImpu* MemcachedImplicitRegistrationSet::get_impu()
@@ -127,18 +473,34 @@ void set_elements(const std::vector<std::string>& updated,
 }
 
 void MemcachedImplicitRegistrationSet::set_ims_sub_xml(const std::string& xml)
+{
+  // We only need the identities from the XML, so scan it for them rather
+  // than parsing it.
+  set_ims_sub_xml(xml, XmlUtils::get_identity_index(xml));
+}
+
+void MemcachedImplicitRegistrationSet::set_ims_sub_xml(const XmlUtils::ParsedImsSubscription& ims_sub)
+{
+  set_ims_sub_xml(ims_sub.xml(), ims_sub.identity_index());
+}
+
+void MemcachedImplicitRegistrationSet::set_ims_sub_xml(const std::string& xml,
+                                                       const IdentityIndex& identity_index)
 {
   TRC_DEBUG("Setting XML for IMPU: %s to %s",
             _default_impu.c_str(),
             xml.c_str());
   _ims_sub_xml_set = true;
   _ims_sub_xml = xml;
+  _identity_index = identity_index;
 
-  std::string default_impu;
+  std::string default_impu = identity_index.default_id();
+  std::vector<std::string> assoc_impus = identity_index.public_ids();
 
-  std::vector<std::string> assoc_impus =
-    XmlUtils::get_public_and_default_ids(xml,
-                                         default_impu);
+  if (assoc_impus.empty())
+  {
+    TRC_ERROR("Failed to extract any ServiceProfile/PublicIdentity/Identity nodes from %s", xml.c_str());
+  }
 
   if (_default_impu != default_impu)
   {
@@ -203,9 +565,12 @@ void MemcachedImplicitRegistrationSet::update_from_impu_from_store(ImpuStore::De
     _registration_state = impu->registration_state;
   }
 
-  if (!_ims_sub_xml_set)
+  // If the IMPU's shared service profile has gone, we keep our own, so that
+  // writing the IRS stores it again.
+  if ((!_ims_sub_xml_set) && (!impu->service_profile_missing))
   {
     _ims_sub_xml = impu->service_profile;
+    _identity_index = impu->identity_index;
   }
 
   if (!_charging_addresses_set)
@@ -263,6 +628,50 @@ void MemcachedImplicitRegistrationSet::delete_impis()
   delete_tracked(_impis);
 }
 
+// Coalesce two data sets
+// Any element that was changed in the older data set, but is unchanged in the
+// data set, takes its state from the older data set. Elements deleted in the
+// older data set are also marked as deleted if they're missing from the data
+// set, as the store may still have them.
+void coalesce_data_sets(MemcachedImplicitRegistrationSet::Data& data,
+                        const MemcachedImplicitRegistrationSet::Data& older)
+{
+  for (const MemcachedImplicitRegistrationSet::Data::value_type& entry : older)
+  {
+    if (entry.second == MemcachedImplicitRegistrationSet::State::UNCHANGED)
+    {
+      continue;
+    }
+
+    MemcachedImplicitRegistrationSet::Data::iterator it = data.find(entry.first);
+
+    if (it == data.end())
+    {
+      if (entry.second == MemcachedImplicitRegistrationSet::State::DELETED)
+      {
+        data[entry.first] = MemcachedImplicitRegistrationSet::State::DELETED;
+      }
+    }
+    else if (it->second == MemcachedImplicitRegistrationSet::State::UNCHANGED)
+    {
+      it->second = entry.second;
+    }
+  }
+}
+
+void MemcachedImplicitRegistrationSet::coalesce(const MemcachedImplicitRegistrationSet& older)
+{
+  coalesce_data_sets(_impis, older._impis);
+  coalesce_data_sets(_associated_impus, older._associated_impus);
+
+  // Our values are at least as up to date as the older copy's, but we must
+  // still write any that the older copy would have written.
+  _refreshed = _refreshed || older._refreshed;
+  _ims_sub_xml_set = _ims_sub_xml_set || older._ims_sub_xml_set;
+  _charging_addresses_set = _charging_addresses_set || older._charging_addresses_set;
+  _registration_state_set = _registration_state_set || older._registration_state_set;
+}
+
 // Helper function to get the details of an IMPU.
 // Note this doesn't sort out associated versus default impus.
 //
@@ -272,10 +681,17 @@ void MemcachedImplicitRegistrationSet::delete_impis()
 //  - try to find the Impu in the local store
 //  - if we get any errors other than NOT_FOUND, immediately give up and return
 //    the error
-//  - if we get NOT_FOUND from the local store:
+//  - if we get NOT_FOUND from the local store, and recently failed to find
+//    the Impu in any remote store (according to the negative cache), return
+//    NOT_FOUND
+//  - otherwise, if we get NOT_FOUND from the local store:
 //    - try all remote stores in parallel
-//    - if we get a result from a remote store, use that
-//    - if we get any other error, just ignore it (since we've already
+//    - as soon as we get a result from a remote store, use that, without
+//      waiting for the other remote stores
+//    - if every remote store returns NOT_FOUND, remember that in the
+//      negative cache
+//    - if we get any other error, or a remote store doesn't respond within
+//      the remote read timeout, just ignore it (since we've already
 //      established that the local store returned NOT_FOUND)
 Store::Status MemcachedCache::get_impu_for_impu_gr(const std::string& impu,
                                                    ImpuStore::Impu*& out_impu,
@@ -298,100 +714,175 @@ Store::Status MemcachedCache::get_impu_for_impu_gr(const std::string& impu,
     delete hook; hook = nullptr;
   }
 
-  if (status == Store::Status::NOT_FOUND)
+  uint64_t token = 0;
+
+  if ((status == Store::Status::NOT_FOUND) &&
+      ((_negative_cache == nullptr) ||
+       (!_negative_cache->start_lookup(IMPU_KEY_PREFIX + impu, token))))
   {
     // If we successfully connect to the local store but fail to find an Impu,
-    // try the remote stores
-    std::vector<std::promise<impu_result_t>*> promises;
+    // try the remote stores (unless we recently failed to find it in them)
+    ImpuStore::Impu* remote_impu = nullptr;
+    bool all_answered;
+
+    Store::Status remote_status =
+      get_from_remote_stores<ImpuStore::Impu>(
+        [impu, trail](ImpuStore* remote_store,
+                      ImpuStore::Impu*& data) -> Store::Status
+        {
+          return remote_store->get_impu(impu, data, trail);
+        },
+        remote_impu,
+        stopwatch,
+        use_first_result<ImpuStore::Impu>,
+        &all_answered);
+
+    if (remote_status == Store::Status::OK)
+    {
+      out_impu = remote_impu;
+      status = remote_status;
+    }
 
-    for (ImpuStore* remote_store : _remote_stores)
+    if (_negative_cache != nullptr)
     {
-      std::promise<impu_result_t>* promise = new std::promise<impu_result_t>();
-      promises.push_back(promise);
+      _negative_cache->end_lookup(IMPU_KEY_PREFIX + impu,
+                                  token,
+                                  (remote_status == Store::Status::OK) || (!all_answered));
+    }
+  }
 
-      // If we have a stopwatch, we need to time how long each of the parallel
-      // remote requests takes, so we need to create and start a StopWatch for
-      // each one.
-      Utils::StopWatch* remote_stopwatch = nullptr;
-      if (stopwatch)
-      {
-        remote_stopwatch = new Utils::StopWatch();
-        remote_stopwatch->start();
-      }
+  return status;
+}
 
-      _thread_pool.add_work([promise, remote_store, impu, trail, remote_stopwatch]()->void
-      {
-        // If we created a StopWatch, we now need to create an IOHook so that it
-        // will pause when we're doing network I/O
-        // These Hooks are thread_local, which is why this is done here (on the
-        // thread we'll use for the remote read)
-        Utils::IOHook* remote_hook = nullptr;
-        if (remote_stopwatch)
-        {
-          remote_hook = create_hook(remote_stopwatch);
-        }
+// Get the Impus for a batch of impus from the local store, falling back to the
+// remote stores for any that we don't find in the local store.
+// The exact logic is:
+//  - look up all of the impus in the local store as a single batch
+//  - if we get any errors other than NOT_FOUND, immediately give up and return
+//    the error
+//  - if any impus weren't found in the local store:
+//    - skip any that we recently failed to find in any remote store
+//      (according to the negative cache)
+//    - look up all of the missing impus as a single batch on each of the
+//      remote stores in parallel
+//    - use the first result we get from any remote store for each impu, and
+//      stop waiting once we have them all
+//    - ignore any errors from the remote stores (since we've already
+//      established that the local store returned NOT_FOUND)
+//    - if every remote store answered, remember any impus that none of them
+//      had in the negative cache
+Store::Status MemcachedCache::get_impus_for_impus_gr(const std::vector<std::string>& impus,
+                                                     std::map<std::string, ImpuStore::Impu*>& out_impus,
+                                                     SAS::TrailId trail,
+                                                     Utils::StopWatch* stopwatch)
+{
+  Utils::IOHook* hook = nullptr;
+
+  if (stopwatch)
+  {
+    hook = create_hook(stopwatch);
+  }
 
-        ImpuStore::Impu* remote_data = nullptr;
-        Store::Status remote_status = remote_store->get_impu(impu, remote_data, trail);
-        unsigned long remote_time = 0L;
+  std::vector<ImpuStore::Impu*> local_impus;
+  Store::Status status = _local_store->get_impus(impus, local_impus, trail);
 
-        if (remote_stopwatch)
-        {
-          delete remote_hook;
-          remote_stopwatch->read(remote_time);
-          delete remote_stopwatch;
-        }
+  // We've done the only network I/O on this thread that we were going to, so
+  // can safely delete our hook now
+  if (hook)
+  {
+    delete hook; hook = nullptr;
+  }
 
-        promise->set_value(impu_result_t(remote_status, remote_data, remote_time));
-      });
-    }
+  if (status == Store::Status::OK)
+  {
+    ImpuBatch found(local_impus);
+    std::vector<std::string> missing;
+    std::vector<uint64_t> tokens;
 
-    if (stopwatch)
+    for (const std::string& impu : impus)
     {
-      // Stop the main StopWatch while we wait for the remote reads to complete.
-      // We'll later add on the time we spent processing these, minus I/O time
-      stopwatch->stop();
-    }
+      if ((found.impus.find(impu) == found.impus.end()) &&
+          (!Utils::in_vector(impu, missing)))
+      {
+        // Skip any that we recently failed to find in the remote stores
+        uint64_t token = 0;
 
-    unsigned long remote_time_to_add = 0L;
+        if ((_negative_cache == nullptr) ||
+            (!_negative_cache->start_lookup(IMPU_KEY_PREFIX + impu, token)))
+        {
+          missing.push_back(impu);
+          tokens.push_back(token);
+        }
+      }
+    }
 
-    for (std::promise<impu_result_t>* promise : promises)
+    if (!missing.empty())
     {
-      std::future<impu_result_t> future = promise->get_future();
-      impu_result_t result = future.get();
+      size_t wanted = missing.size();
+      ImpuBatch* remote_impus = nullptr;
+      bool all_answered;
+
+      Store::Status remote_status =
+        get_from_remote_stores<ImpuBatch>(
+          [missing, trail](ImpuStore* remote_store,
+                           ImpuBatch*& batch) -> Store::Status
+          {
+            std::vector<ImpuStore::Impu*> data;
+            Store::Status status = remote_store->get_impus(missing, data, trail);
+
+            if (status == Store::Status::OK)
+            {
+              if (data.empty())
+              {
+                status = Store::Status::NOT_FOUND;
+              }
+              else
+              {
+                batch = new ImpuBatch(data);
+              }
+            }
+
+            return status;
+          },
+          remote_impus,
+          stopwatch,
+          [wanted](ImpuBatch*& remote_data, ImpuBatch*& result) -> bool
+          {
+            if (result == nullptr)
+            {
+              result = remote_data;
+              remote_data = nullptr;
+            }
+            else
+            {
+              result->merge(*remote_data);
+            }
+
+            return (result->impus.size() >= wanted);
+          },
+          &all_answered);
 
-      // Want to choose whichever request took the longest to add to our stopwatch time
-      unsigned long remote_time = std::get<2>(result);
-      if (remote_time > remote_time_to_add)
+      if (remote_status == Store::Status::OK)
       {
-        remote_time_to_add = remote_time;
+        found.merge(*remote_impus);
+        delete remote_impus;
       }
 
-      if ((status != Store::Status::OK) && (std::get<0>(result) == Store::Status::OK))
-      {
-        // If we've not yet set the impu, use the one from this remote if it succeeded
-        out_impu = std::get<1>(result);
-        status = Store::Status::OK;
-      }
-      else
+      if (_negative_cache != nullptr)
       {
-        ImpuStore::Impu* discard = std::get<1>(result);
-
-        if (discard)
+        for (size_t ii = 0; ii < missing.size(); ++ii)
         {
-          delete discard;
+          _negative_cache->end_lookup(IMPU_KEY_PREFIX + missing[ii],
+                                      tokens[ii],
+                                      (found.impus.find(missing[ii]) != found.impus.end()) ||
+                                      (!all_answered));
         }
       }
-
-      delete promise;
     }
 
-    // Restart the StopWatch
-    if (stopwatch)
-    {
-      stopwatch->start();
-      stopwatch->add_time(remote_time_to_add);
-    }
+    // Pass ownership of the Impus to the caller
+    out_impus.insert(found.impus.begin(), found.impus.end());
+    found.impus.clear();
   }
 
   return status;
@@ -420,12 +911,18 @@ Store::Status MemcachedCache::get_impus_for_impi(const std::string& impi,
 //  - try to find the mapping in the local store
 //  - if we get any errors other than NOT_FOUND, immediately give up and return
 //    the error
-//  - if we get NOT_FOUND from the local store:
-//    - try each remote store in turn
-//    - if we get OK from a remote store, we've found a mapping so return OK
-//    - if we get any other error, try the next remote store but don't set the
-//      return value to that error (since we've already established that the
-//      local store returned NOT_FOUND)
+//  - if we get NOT_FOUND from the local store, and recently failed to find
+//    the mapping in any remote store (according to the negative cache),
+//    return NOT_FOUND
+//  - otherwise, if we get NOT_FOUND from the local store:
+//    - try all remote stores in parallel
+//    - as soon as we get OK from a remote store, we've found a mapping so
+//      return OK
+//    - if every remote store returns NOT_FOUND, remember that in the
+//      negative cache
+//    - if we get any other error, or a remote store doesn't respond within
+//      the remote read timeout, ignore it (since we've already established
+//      that the local store returned NOT_FOUND)
 //
 // On success, out_mapping is set the to retrieved mapping.
 // On failure, out_mapping is unchanged.
@@ -436,121 +933,904 @@ Store::Status MemcachedCache::get_impi_mapping_gr(const std::string& impi,
 {
   Utils::IOHook* hook = nullptr;
 
-  // Create an IOHook that will pause the StopWatch while performing network I/O
-  if (stopwatch)
+  // Create an IOHook that will pause the StopWatch while performing network I/O
+  if (stopwatch)
+  {
+    hook = create_hook(stopwatch);
+  }
+
+  Store::Status status = _local_store->get_impi_mapping(impi, out_mapping, trail);
+
+  // We've done the only network I/O on this thread that we were going to, so
+  // can safely delete our hook now
+  if (hook)
+  {
+    delete hook; hook = nullptr;
+  }
+
+  uint64_t token = 0;
+
+  if ((status == Store::Status::NOT_FOUND) &&
+      ((_negative_cache == nullptr) ||
+       (!_negative_cache->start_lookup(IMPI_KEY_PREFIX + impi, token))))
+  {
+    // If we successfully connect to the local store but fail to find an
+    // ImpiMapping, try the remote stores (unless we recently failed to find
+    // it in them)
+    ImpuStore::ImpiMapping* remote_mapping = nullptr;
+    bool all_answered;
+
+    Store::Status remote_status =
+      get_from_remote_stores<ImpuStore::ImpiMapping>(
+        [impi, trail](ImpuStore* remote_store,
+                      ImpuStore::ImpiMapping*& mapping) -> Store::Status
+        {
+          return remote_store->get_impi_mapping(impi, mapping, trail);
+        },
+        remote_mapping,
+        stopwatch,
+        use_first_result<ImpuStore::ImpiMapping>,
+        &all_answered);
+
+    if (remote_status == Store::Status::OK)
+    {
+      out_mapping = remote_mapping;
+      status = remote_status;
+    }
+
+    if (_negative_cache != nullptr)
+    {
+      _negative_cache->end_lookup(IMPI_KEY_PREFIX + impi,
+                                  token,
+                                  (remote_status == Store::Status::OK) || (!all_answered));
+    }
+  }
+
+  return status;
+}
+
+// Performs a read on all of the remote stores in parallel. Each successful
+// result is passed to merge_fn, which may take ownership of it (by clearing
+// the remote data pointer) to build up the overall result, and returns
+// whether we now have everything we need. We return as soon as merge_fn says
+// we're done, once all of the reads have completed, or once the remote read
+// timeout (if any) has passed. Any reads that are still outstanding when we
+// return carry on in the background, and free their results when they
+// complete. A remote store that already has _max_remote_reads reads in flight
+// isn't read from at all, so that one which has stopped responding can't tie
+// up the whole thread pool.
+//
+// If a StopWatch is provided, it is paused while we wait, and then has the
+// time spent by the slowest of the remote reads that completed added to it.
+//
+// Returns OK and sets out_result if any remote read succeeded, and NOT_FOUND
+// otherwise, as the caller has already established that the local store
+// didn't have the data.
+template <class T>
+Store::Status MemcachedCache::get_from_remote_stores(
+                                 std::function<Store::Status(ImpuStore*, T*&)> get_fn,
+                                 T*& out_result,
+                                 Utils::StopWatch* stopwatch,
+                                 std::function<bool(T*&, T*&)> merge_fn,
+                                 bool* all_answered)
+{
+  if (all_answered)
+  {
+    *all_answered = true;
+  }
+
+  if (_remote_stores.empty())
+  {
+    return Store::Status::NOT_FOUND;
+  }
+
+  // Only read from the remote stores that don't already have as many reads in
+  // flight as they're allowed, e.g. because they've stopped responding.
+  std::vector<size_t> stores_to_read;
+
+  {
+    std::lock_guard<std::mutex> lock(_remote_reads_lock);
+
+    for (size_t ii = 0; ii < _remote_stores.size(); ++ii)
+    {
+      if (_remote_reads_in_flight[ii] < _max_remote_reads)
+      {
+        _remote_reads_in_flight[ii]++;
+        stores_to_read.push_back(ii);
+      }
+      else
+      {
+        TRC_DEBUG("Skipping remote store %lu with %d reads in flight",
+                  ii, _remote_reads_in_flight[ii]);
+      }
+    }
+  }
+
+  if (stores_to_read.empty())
+  {
+    if (all_answered)
+    {
+      *all_answered = false;
+    }
+
+    return Store::Status::NOT_FOUND;
+  }
+
+  std::shared_ptr<RemoteReadState<T>> state =
+    std::make_shared<RemoteReadState<T>>(stores_to_read.size());
+
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(_remote_read_timeout_ms);
+
+  for (size_t store_index : stores_to_read)
+  {
+    ImpuStore* remote_store = _remote_stores[store_index];
+
+    // If we have a stopwatch, we need to time how long each of the parallel
+    // remote requests takes, so we need to create and start a StopWatch for
+    // each one.
+    Utils::StopWatch* remote_stopwatch = nullptr;
+    if (stopwatch)
+    {
+      remote_stopwatch = new Utils::StopWatch();
+      remote_stopwatch->start();
+    }
+
+    _thread_pool.add_work([this, state, store_index, remote_store, get_fn, merge_fn, remote_stopwatch]()->void
+    {
+      // If we created a StopWatch, we now need to create an IOHook so that it
+      // will pause when we're doing network I/O
+      // These Hooks are thread_local, which is why this is done here (on the
+      // thread we'll use for the remote read)
+      Utils::IOHook* remote_hook = nullptr;
+      if (remote_stopwatch)
+      {
+        remote_hook = create_hook(remote_stopwatch);
+      }
+
+      T* remote_data = nullptr;
+      Store::Status remote_status = get_fn(remote_store, remote_data);
+      unsigned long remote_time = 0L;
+
+      if (remote_stopwatch)
+      {
+        delete remote_hook;
+        remote_stopwatch->read(remote_time);
+        delete remote_stopwatch;
+      }
+
+      TRC_DEBUG("Remote read completed with status %d in %lu us",
+                remote_status, remote_time);
+
+      {
+        std::lock_guard<std::mutex> lock(_remote_reads_lock);
+        _remote_reads_in_flight[store_index]--;
+      }
+
+      std::lock_guard<std::mutex> lock(state->lock);
+
+      if (!state->abandoned)
+      {
+        // Want to choose whichever request took the longest to add to our
+        // stopwatch time
+        state->remote_time = std::max(state->remote_time, remote_time);
+      }
+
+      if ((!state->abandoned) &&
+          (!state->complete) &&
+          (remote_status == Store::Status::OK))
+      {
+        state->complete = merge_fn(remote_data, state->result);
+      }
+
+      if ((remote_status != Store::Status::OK) &&
+          (remote_status != Store::Status::NOT_FOUND))
+      {
+        state->failed++;
+      }
+
+      // Free anything that merge_fn didn't take ownership of
+      delete remote_data;
+
+      state->outstanding--;
+      state->cond.notify_all();
+    });
+  }
+
+  if (stopwatch)
+  {
+    // Stop the main StopWatch while we wait for the remote reads to complete.
+    // We'll later add on the time we spent processing these, minus I/O time
+    stopwatch->stop();
+  }
+
+  Store::Status status;
+  unsigned long remote_time_to_add;
+
+  {
+    std::unique_lock<std::mutex> lock(state->lock);
+
+    std::function<bool()> done = [&state]() -> bool
+    {
+      return ((state->complete) ||
+              (state->outstanding == 0));
+    };
+
+    if (_remote_read_timeout_ms > 0)
+    {
+      if (!state->cond.wait_until(lock, deadline, done))
+      {
+        TRC_DEBUG("Timed out waiting for %lu remote store(s)",
+                  state->outstanding);
+      }
+    }
+    else
+    {
+      state->cond.wait(lock, done);
+    }
+
+    if (state->result != nullptr)
+    {
+      out_result = state->result;
+      state->result = nullptr;
+      status = Store::Status::OK;
+    }
+    else
+    {
+      status = Store::Status::NOT_FOUND;
+    }
+
+    if (all_answered)
+    {
+      *all_answered = ((stores_to_read.size() == _remote_stores.size()) &&
+                       (state->outstanding == 0) &&
+                       (state->failed == 0));
+    }
+
+    state->abandoned = true;
+    remote_time_to_add = state->remote_time;
+  }
+
+  // Restart the StopWatch
+  if (stopwatch)
+  {
+    stopwatch->start();
+    stopwatch->add_time(remote_time_to_add);
+  }
+
+  return status;
+}
+
+Store::Status MemcachedCache::get_implicit_registration_set_for_impu(const std::string& impu,
+                                                     SAS::TrailId trail,
+                                                     Utils::StopWatch* stopwatch,
+                                                     ImplicitRegistrationSet*& result)
+{
+
+  ImpuStore::Impu* data = nullptr;
+  Store::Status status = get_impu_for_impu_gr(impu, data, trail, stopwatch);
+
+  if (status == Store::Status::OK && !data->is_default_impu())
+  {
+    ImpuStore::AssociatedImpu* assoc_impu = (ImpuStore::AssociatedImpu*)data;
+
+    TRC_INFO("IMPU: %s maps to IMPU: %s", impu.c_str(), assoc_impu->default_impu.c_str());
+
+    status = get_impu_for_impu_gr(assoc_impu->default_impu, data, trail, stopwatch);
+
+    delete assoc_impu;
+
+    if ((status == Store::Status::OK) &&
+        (!is_valid_default_impu(impu, data)))
+    {
+      // Target IMPU is invalid - probably a window condition
+      // Treat as not found.
+      delete data;
+      status = Store::Status::NOT_FOUND;
+    }
+  }
+
+  if (status == Store::Status::OK)
+  {
+    result = new MemcachedImplicitRegistrationSet((ImpuStore::DefaultImpu*) data);
+    delete data;
+  }
+
+  return status;
+}
+
+bool MemcachedCache::try_get_implicit_registration_set_for_impu(const std::string& impu,
+                                                                ImplicitRegistrationSet*& result)
+{
+  ImpuStore::Impu* data = _local_store->get_cached_impu(impu);
+
+  if ((data != nullptr) && (!data->is_default_impu()))
+  {
+    ImpuStore::AssociatedImpu* assoc_impu = (ImpuStore::AssociatedImpu*)data;
+    data = _local_store->get_cached_impu(assoc_impu->default_impu);
+    delete assoc_impu;
+
+    if ((data != nullptr) &&
+        (!is_valid_default_impu(impu, data)))
+    {
+      // Leave the window condition for the blocking lookup to deal with
+      delete data; data = nullptr;
+    }
+  }
+
+  if (data == nullptr)
+  {
+    return false;
+  }
+
+  result = new MemcachedImplicitRegistrationSet((ImpuStore::DefaultImpu*)data);
+  delete data;
+
+  return true;
+}
+
+Store::Status MemcachedCache::get_implicit_registration_sets_for_impus(const std::vector<std::string>& impus,
+                                                                       SAS::TrailId trail,
+                                                                       Utils::StopWatch* stopwatch,
+                                                                       std::vector<ImplicitRegistrationSet*>& result)
+{
+  std::map<std::string, ImpuStore::Impu*> found;
+  Store::Status status = get_impus_for_impus_gr(impus, found, trail, stopwatch);
+
+  if (status == Store::Status::OK)
+  {
+    // We need the default IMPU for each associated IMPU that we found, so
+    // get any that we don't already have as a second batch
+    std::vector<std::string> default_impus;
+
+    for (const std::pair<const std::string, ImpuStore::Impu*>& entry : found)
+    {
+      if (!entry.second->is_default_impu())
+      {
+        const std::string& default_impu =
+          ((ImpuStore::AssociatedImpu*)entry.second)->default_impu;
+
+        if ((found.find(default_impu) == found.end()) &&
+            (!Utils::in_vector(default_impu, default_impus)))
+        {
+          default_impus.push_back(default_impu);
+        }
+      }
+    }
+
+    if (!default_impus.empty())
+    {
+      status = get_impus_for_impus_gr(default_impus, found, trail, stopwatch);
+    }
+  }
+
+  if (status == Store::Status::OK)
+  {
+    // As in BaseHssCache, the result is the IRS of the first of the IMPUs
+    // that we find
+    for (const std::string& impu : impus)
+    {
+      std::map<std::string, ImpuStore::Impu*>::iterator it = found.find(impu);
+
+      if (it == found.end())
+      {
+        continue;
+      }
+
+      ImpuStore::Impu* data = it->second;
+
+      if (!data->is_default_impu())
+      {
+        const std::string& default_impu =
+          ((ImpuStore::AssociatedImpu*)data)->default_impu;
+
+        TRC_INFO("IMPU: %s maps to IMPU: %s", impu.c_str(), default_impu.c_str());
+
+        it = found.find(default_impu);
+
+        if ((it != found.end()) && (is_valid_default_impu(impu, it->second)))
+        {
+          data = it->second;
+        }
+        else
+        {
+          data = nullptr;
+        }
+      }
+
+      if (data != nullptr)
+      {
+        result.push_back(
+          new MemcachedImplicitRegistrationSet((ImpuStore::DefaultImpu*)data));
+        break;
+      }
+    }
+  }
+
+  for (std::pair<const std::string, ImpuStore::Impu*>& entry : found)
+  {
+    delete entry.second;
+  }
+
+  return status;
+}
+
+MemcachedCache::MemcachedCache(ImpuStore* local_store,
+                               const std::vector<ImpuStore*>& remote_stores,
+                               int num_threads,
+                               ExceptionHandler* exception_handler,
+                               int remote_read_timeout_ms,
+                               int replication_threads,
+                               unsigned int max_replication_queue,
+                               SNMP::EventAccumulatorByScopeTable* replication_queue_size_table,
+                               SNMP::EventAccumulatorTable* replication_lag_table,
+                               size_t negative_cache_size,
+                               int negative_cache_ttl_ms,
+                               SNMP::CounterTable* negative_cache_hits_table,
+                               SNMP::CounterTable* negative_cache_misses_table,
+                               int lazy_refresh_s,
+                               SNMP::CounterTable* serialized_writes_table,
+                               SNMP::CounterTable* contention_retries_table,
+                               int local_write_threads) :
+  BaseHssCache(),
+  _local_store(local_store),
+  _remote_stores(remote_stores),
+  _remote_read_timeout_ms(remote_read_timeout_ms),
+  _thread_pool(num_threads,
+               exception_handler,
+               exception_callback,
+               0),
+  _num_threads(num_threads),
+  _remote_reads_in_flight(remote_stores.size(), 0),
+  _max_remote_reads(std::max(num_threads / ((int)remote_stores.size() + 1), 1)),
+  _local_write_pool(nullptr),
+  _replication_pool(nullptr),
+  _max_replication_queue(max_replication_queue),
+  _replication_lag_table(replication_lag_table),
+  _negative_cache(nullptr),
+  _lazy_refresh_s(lazy_refresh_s),
+  _serialized_writes_table(serialized_writes_table),
+  _contention_retries_table(contention_retries_table)
+{
+  _thread_pool.start();
+
+  // Record the time spent reading from and writing to the local and remote
+  // stores as separate stages.
+  _local_store->set_io_stage(StageLatency::LOCAL_STORE);
+
+  for (ImpuStore* remote_store : _remote_stores)
+  {
+    remote_store->set_io_stage(StageLatency::REMOTE_STORE);
+  }
+
+  // The negative cache only saves reads from the remote stores, so there's no
+  // point having one without them.
+  if ((!_remote_stores.empty()) &&
+      (negative_cache_size > 0) &&
+      (negative_cache_ttl_ms > 0))
+  {
+    _negative_cache = new NegativeCache(negative_cache_size,
+                                        negative_cache_ttl_ms,
+                                        negative_cache_hits_table,
+                                        negative_cache_misses_table);
+  }
+
+  if (local_write_threads > 0)
+  {
+    _local_write_pool = new FunctorThreadPool(local_write_threads,
+                                              exception_handler,
+                                              exception_callback,
+                                              0);
+    _local_write_pool->start();
+  }
+
+  if (replication_threads > 0)
+  {
+    _replication_pool = new FunctorThreadPool(replication_threads,
+                                              exception_handler,
+                                              exception_callback,
+                                              0,
+                                              replication_queue_size_table);
+    _replication_pool->start();
+  }
+}
+
+MemcachedCache::~MemcachedCache()
+{
+  if (_replication_pool)
+  {
+    _replication_pool->stop();
+    _replication_pool->join();
+    delete _replication_pool; _replication_pool = nullptr;
+  }
+
+  // Free any replication requests that weren't made before the pool stopped.
+  for (std::pair<const std::string, std::deque<ReplicationRequest*>>& entry : _replication_queues)
+  {
+    for (ReplicationRequest* request : entry.second)
+    {
+      delete request;
+    }
+  }
+
+  if (_local_write_pool)
+  {
+    _local_write_pool->stop();
+    _local_write_pool->join();
+    delete _local_write_pool; _local_write_pool = nullptr;
+  }
+
+  _thread_pool.stop();
+  _thread_pool.join();
+
+  delete _negative_cache; _negative_cache = nullptr;
+}
+
+MemcachedCache::NegativeCache::NegativeCache(size_t max_entries,
+                                             int ttl_ms,
+                                             SNMP::CounterTable* hits_table,
+                                             SNMP::CounterTable* misses_table) :
+  _max_entries(max_entries),
+  _ttl_ms(ttl_ms),
+  _hits_table(hits_table),
+  _misses_table(misses_table)
+{
+}
+
+bool MemcachedCache::NegativeCache::start_lookup(const std::string& key,
+                                                 uint64_t& token)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = _entries.find(key);
+
+  if (it != _entries.end())
+  {
+    if (now_ms() < it->second.expiry_ms)
+    {
+      TRC_DEBUG("%s was recently not found in any store", key.c_str());
+
+      if (_hits_table)
+      {
+        _hits_table->increment();
+      }
+
+      return true;
+    }
+
+    remove_entry(it);
+  }
+
+  if (_misses_table)
+  {
+    _misses_table->increment();
+  }
+
+  Lookups& lookups = _lookups[key];
+  lookups.count++;
+  token = lookups.invalidations;
+
+  return false;
+}
+
+void MemcachedCache::NegativeCache::end_lookup(const std::string& key,
+                                               uint64_t token,
+                                               bool found)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Lookups>::iterator lookups_it = _lookups.find(key);
+
+  if (lookups_it == _lookups.end())
+  {
+    // LCOV_EXCL_START - only if the caller didn't call start_lookup
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  // Only remember that the key wasn't found if it hasn't been written since
+  // the lookup started, as the lookup may have missed the write.
+  bool add = ((!found) && (lookups_it->second.invalidations == token));
+
+  if (--lookups_it->second.count == 0)
+  {
+    _lookups.erase(lookups_it);
+  }
+
+  if ((!add) || (_entries.find(key) != _entries.end()))
+  {
+    return;
+  }
+
+  TRC_DEBUG("Remembering that %s was not found in any store", key.c_str());
+
+  if (_entries.size() >= _max_entries)
+  {
+    // The oldest entry is at the back of the LRU list.
+    remove_entry(_entries.find(_lru.back()));
+  }
+
+  _lru.push_front(key);
+
+  Entry& entry = _entries[key];
+  entry.expiry_ms = now_ms() + _ttl_ms;
+  entry.lru_it = _lru.begin();
+}
+
+void MemcachedCache::NegativeCache::invalidate(const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Entry>::iterator it = _entries.find(key);
+
+  if (it != _entries.end())
+  {
+    remove_entry(it);
+  }
+
+  std::unordered_map<std::string, Lookups>::iterator lookups_it = _lookups.find(key);
+
+  if (lookups_it != _lookups.end())
+  {
+    lookups_it->second.invalidations++;
+  }
+}
+
+void MemcachedCache::NegativeCache::remove_entry(std::unordered_map<std::string, Entry>::iterator it)
+{
+  _lru.erase(it->second.lru_it);
+  _entries.erase(it);
+}
+
+uint64_t MemcachedCache::NegativeCache::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void MemcachedCache::invalidate_negative_cache(const std::vector<MemcachedImplicitRegistrationSet*>& irss)
+{
+  if (_negative_cache == nullptr)
+  {
+    return;
+  }
+
+  for (MemcachedImplicitRegistrationSet* irs : irss)
+  {
+    _negative_cache->invalidate(IMPU_KEY_PREFIX + irs->get_default_impu());
+
+    for (const std::string& impu : irs->get_associated_impus())
+    {
+      _negative_cache->invalidate(IMPU_KEY_PREFIX + impu);
+    }
+
+    for (const std::string& impi : irs->get_associated_impis())
+    {
+      _negative_cache->invalidate(IMPI_KEY_PREFIX + impi);
+    }
+  }
+}
+
+Store::Status MemcachedCache::perform(MemcachedCache::store_action action,
+                                      MemcachedCache::ReplicationType type,
+                                      const std::vector<MemcachedImplicitRegistrationSet*>& irss,
+                                      progress_callback progress_cb,
+                                      SAS::TrailId trail,
+                                      Utils::StopWatch* stopwatch)
+{
+   Store::Status status;
+   std::vector<std::string> replicate_now;
+
+   {
+     std::vector<std::unique_lock<std::mutex>> locks = lock_irss(irss);
+     status = action(_local_store, stopwatch);
+
+     // Queue the replication while we still hold the write locks, so that
+     // the changes to each IRS are queued, and so made to the remote stores,
+     // in the same order as they were made to the local one.
+     if ((status == Store::Status::OK) && (!_remote_stores.empty()))
+     {
+       for (MemcachedImplicitRegistrationSet* irs : irss)
+       {
+         // The caller owns the IRS, so queue a copy of it.
+         if (queue_replication(new ReplicationRequest(type,
+                                                      new MemcachedImplicitRegistrationSet(*irs),
+                                                      trail)))
+         {
+           replicate_now.push_back(irs->get_default_impu());
+         }
+       }
+     }
+   }
+
+   // Once the identities in the IRSs have been written to the local store,
+   // lookups will find them there, so we must stop remembering that they
+   // weren't found. We do this even if the write failed, as it may have been
+   // partly made.
+   if (type == ReplicationType::REPLICATE_PUT)
+   {
+     invalidate_negative_cache(irss);
+   }
+
+   if (status == Store::Status::OK)
+   {
+     // If the local store update succeeded, call the progress callback
+     progress_cb();
+
+     // Now make any replication that's fallen to this thread, but don't
+     // update the status (as we've already claimed success)
+     for (const std::string& default_impu : replicate_now)
+     {
+       process_replication_queue(default_impu);
+     }
+   }
+
+   return status;
+}
+
+std::vector<std::unique_lock<std::mutex>> MemcachedCache::lock_irss(const std::vector<MemcachedImplicitRegistrationSet*>& irss)
+{
+  // Several IRSs may share a lock, so work out the set of locks first.
+  std::set<size_t> indexes;
+
+  for (MemcachedImplicitRegistrationSet* irs : irss)
+  {
+    indexes.insert(std::hash<std::string>()(irs->get_default_impu()) % NUM_WRITE_LOCKS);
+  }
+
+  std::vector<std::unique_lock<std::mutex>> locks;
+
+  for (size_t index : indexes)
+  {
+    std::unique_lock<std::mutex> lock(_write_locks[index], std::try_to_lock);
+
+    if (!lock.owns_lock())
+    {
+      // Another write for this IRS (or one sharing its lock) is in progress.
+      // Had we not waited, our writes might have raced it.
+      TRC_DEBUG("Waiting for another write to complete");
+
+      if (_serialized_writes_table)
+      {
+        _serialized_writes_table->increment();
+      }
+
+      lock.lock();
+    }
+
+    locks.push_back(std::move(lock));
+  }
+
+  return locks;
+}
+
+void MemcachedCache::count_contention_retry()
+{
+  if (_contention_retries_table)
+  {
+    _contention_retries_table->increment();
+  }
+}
+
+bool MemcachedCache::queue_replication(ReplicationRequest* request)
+{
+  const std::string default_impu = request->irs->get_default_impu();
+  bool new_queue = false;
+  bool queue_full = false;
+
+  {
+    std::lock_guard<std::mutex> lock(_replication_lock);
+    std::map<std::string, std::deque<ReplicationRequest*>>::iterator it =
+      _replication_queues.find(default_impu);
+
+    if (it == _replication_queues.end())
+    {
+      new_queue = true;
+      queue_full = ((_max_replication_queue != 0) &&
+                    (_replication_queues.size() >= _max_replication_queue));
+      _replication_queues[default_impu].push_back(request);
+    }
+    else if ((!it->second.empty()) &&
+             (it->second.back()->type == request->type))
+    {
+      // There's already a request of the same type for this IRS that hasn't
+      // been started, so make both changes with the newer request. The lag
+      // is measured from when the older request was queued.
+      ReplicationRequest* older = it->second.back();
+      TRC_DEBUG("Coalescing replication request for %s", default_impu.c_str());
+      request->irs->coalesce(*older->irs);
+      std::swap(older->irs, request->irs);
+      older->trail = request->trail;
+      delete request; request = nullptr;
+    }
+    else
+    {
+      it->second.push_back(request);
+    }
+  }
+
+  if (!new_queue)
   {
-    hook = create_hook(stopwatch);
+    // Whichever thread is processing the queue for this IRS will make the
+    // request once it's made the ones ahead of it.
+    return false;
   }
 
-  Store::Status status = _local_store->get_impi_mapping(impi, out_mapping, trail);
-
-  if (status == Store::Status::NOT_FOUND)
+  if (!_replication_pool)
   {
-    // If we successfully connect to the local store but fail to find an
-    // ImpiMapping, try the remote stores
-    for (ImpuStore* remote_store : _remote_stores)
-    {
-      Store::Status remote_status = remote_store->get_impi_mapping(impi, out_mapping, trail);
-
-      if (remote_status == Store::Status::OK)
-      {
-        status = remote_status;
-        break;
-      }
-    }
+    // There aren't any replication threads, so this thread must replicate.
+    return true;
   }
 
-  if (hook)
+  if (queue_full)
   {
-    delete hook;
+    // There are too many IRSs waiting to be replicated, so do this one on
+    // this thread. It has its own queue, so any further requests for it are
+    // still made in order.
+    TRC_DEBUG("Replication queue full - replicating %s on this thread",
+              default_impu.c_str());
+    return true;
   }
 
-  return status;
+  _replication_pool->add_work([this, default_impu]() {
+    process_replication_queue(default_impu);
+  });
+
+  return false;
 }
 
-Store::Status MemcachedCache::get_implicit_registration_set_for_impu(const std::string& impu,
-                                                     SAS::TrailId trail,
-                                                     Utils::StopWatch* stopwatch,
-                                                     ImplicitRegistrationSet*& result)
+void MemcachedCache::process_replication_queue(const std::string& default_impu)
 {
-
-  ImpuStore::Impu* data = nullptr;
-  Store::Status status = get_impu_for_impu_gr(impu, data, trail, stopwatch);
-
-  if (status == Store::Status::OK && !data->is_default_impu())
+  while (true)
   {
-    ImpuStore::AssociatedImpu* assoc_impu = (ImpuStore::AssociatedImpu*)data;
-
-    TRC_INFO("IMPU: %s maps to IMPU: %s", impu.c_str(), assoc_impu->default_impu.c_str());
-
-    status = get_impu_for_impu_gr(assoc_impu->default_impu, data, trail, stopwatch);
+    ReplicationRequest* request = nullptr;
 
-    delete assoc_impu;
-
-    if (status == Store::Status::OK)
     {
-      // Is the target IMPU a default IMPU?
-      bool is_default = data->is_default_impu();
-
-      // Does the target IMPU have the source Associated IMPU as
-      // a default IMPU?
-      bool is_associated = (is_default &&
-                            ((ImpuStore::DefaultImpu*)data)->has_associated_impu(impu));
+      std::lock_guard<std::mutex> lock(_replication_lock);
+      std::map<std::string, std::deque<ReplicationRequest*>>::iterator it =
+        _replication_queues.find(default_impu);
 
-      if (!is_default || !is_associated)
+      if (it->second.empty())
       {
-        // Target IMPU is invalid - probably a window condition
-        // Log and treat as not found.
-        if (!is_default)
-        {
-          TRC_INFO("Non-default IMPU pointed by associated IMPU record");
-        }
-        else if (!is_associated)
-        {
-          TRC_INFO("Default IMPU does not contain IMPU as associated");
-        }
-
-        delete data;
-        status = Store::Status::NOT_FOUND;
+        _replication_queues.erase(it);
+        return;
       }
+
+      request = it->second.front();
+      it->second.pop_front();
     }
-  }
 
-  if (status == Store::Status::OK)
-  {
-    result = new MemcachedImplicitRegistrationSet((ImpuStore::DefaultImpu*) data);
-    delete data;
-  }
+    replicate_irs(request->type, request->irs, request->trail);
 
-  return status;
+    unsigned long lag_us;
+    if ((_replication_lag_table) && (request->queued.read(lag_us)))
+    {
+      _replication_lag_table->accumulate(lag_us);
+    }
+
+    delete request;
+  }
 }
 
-Store::Status MemcachedCache::perform(MemcachedCache::store_action action,
-                                      progress_callback progress_cb,
-                                      Utils::StopWatch* stopwatch)
+void MemcachedCache::replicate_irs(MemcachedCache::ReplicationType type,
+                                   MemcachedImplicitRegistrationSet* irs,
+                                   SAS::TrailId trail)
 {
-   Store::Status status = action(_local_store, stopwatch);
-
-   if (status == Store::Status::OK)
-   {
-     // If the local store update succeeded, call the progress callback
-     progress_cb();
-
-     // Now perform the action to all the remote stores, but don't update the
-     // status (as we've already claimed success)
-     for (ImpuStore* remote_store : _remote_stores)
-     {
-       Store::Status inner_status = action(remote_store, nullptr);
-       if (inner_status != Store::Status::OK)
-       {
-         // Nothing we can do, but log the error
-         TRC_DEBUG("Failed to perform operation to remote store with error %d",
-                   inner_status);
-       }
-     }
-   }
+  for (ImpuStore* remote_store : _remote_stores)
+  {
+    Store::Status status = (type == ReplicationType::REPLICATE_PUT) ?
+      put_irs_action(irs, trail, remote_store, nullptr) :
+      delete_irs_action(irs, trail, remote_store, nullptr);
 
-   return status;
+    if (status != Store::Status::OK)
+    {
+      // Nothing we can do, but log the error
+      TRC_DEBUG("Failed to perform operation to remote store with error %d",
+                status);
+    }
+  }
 }
 
 Store::Status MemcachedCache::put_implicit_registration_set(ImplicitRegistrationSet* irs,
@@ -566,7 +1846,12 @@ Store::Status MemcachedCache::put_implicit_registration_set(ImplicitRegistration
   {
     store_action action =
       std::bind(&MemcachedCache::put_irs_action, this, mirs, trail, _1, _2);
-    status = perform(action, progress_cb, stopwatch);
+    status = perform(action,
+                     ReplicationType::REPLICATE_PUT,
+                     {mirs},
+                     progress_cb,
+                     trail,
+                     stopwatch);
   }
   else
   {
@@ -578,6 +1863,76 @@ Store::Status MemcachedCache::put_implicit_registration_set(ImplicitRegistration
   return status;
 }
 
+void MemcachedCache::run_in_parallel(const std::vector<std::function<void()>>& ops,
+                                     ImpuStore* store,
+                                     Utils::StopWatch* stopwatch)
+{
+  // Operations on the local store mustn't share a pool with the remote
+  // stores, as the remote reads that time out are left running on that pool,
+  // and an unreachable remote store could fill it up while we hold the write
+  // locks.
+  FunctorThreadPool* pool = nullptr;
+
+  if (store == _local_store)
+  {
+    pool = _local_write_pool;
+  }
+  else if (_num_threads > 0)
+  {
+    pool = &_thread_pool;
+  }
+
+  // There's nothing to overlap if there's only one operation, and nothing to
+  // run them on if we don't have a pool.
+  if ((ops.size() <= 1) || (pool == nullptr))
+  {
+    for (const std::function<void()>& op : ops)
+    {
+      op();
+    }
+
+    return;
+  }
+
+  std::shared_ptr<ParallelOpsState> state =
+    std::make_shared<ParallelOpsState>(ops.size() - 1);
+
+  for (size_t ii = 1; ii < ops.size(); ++ii)
+  {
+    std::function<void()> op = ops[ii];
+
+    pool->add_work([state, op]()->void
+    {
+      op();
+
+      std::lock_guard<std::mutex> lock(state->lock);
+      state->outstanding--;
+      state->cond.notify_all();
+    });
+  }
+
+  // Run the first operation on this thread, rather than leaving it idle. Any
+  // IOHook the caller has set up pauses the StopWatch for its network I/O.
+  ops[0]();
+
+  if (stopwatch)
+  {
+    // Stop the StopWatch while we wait for the other operations, which are
+    // mostly network I/O.
+    stopwatch->stop();
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(state->lock);
+    state->cond.wait(lock, [&state]() -> bool { return (state->outstanding == 0); });
+  }
+
+  if (stopwatch)
+  {
+    stopwatch->start();
+  }
+}
+
 Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistrationSet* irs,
                                                        SAS::TrailId trail,
                                                        ImpuStore* store,
@@ -593,138 +1948,107 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
   }
 
   // Updating the mappings needs to be CASed, as each of the IMPIs maps
-  // to an array, which may be mutated by multiple Homesteads simultaneously
+  // to an array, which may be mutated by multiple Homesteads simultaneously.
+  //
+  // Old IMPI mappings are removed, unchanged IMPIs are refreshed if the IRS
+  // is being refreshed, and new IMPIs are added.
+  std::vector<ImpiMappingUpdate*> updates;
 
-  // Remove old IMPI mappings
   for (const std::string& impi : irs->impis(MemcachedImplicitRegistrationSet::State::DELETED))
   {
-    do
-    {
-      // We use a separate Status as failing to find an ImpiMapping shouldn't
-      // affect our overall Status
-      ImpuStore::ImpiMapping* mapping = nullptr;
-      Store::Status inner_status = store->get_impi_mapping(impi, mapping, trail);
-
-      if (inner_status == Store::Status::OK)
-      {
-        if (mapping->has_default_impu(irs->get_default_impu()))
-        {
-          mapping->remove_default_impu(irs->get_default_impu());
-
-          if (mapping->is_empty())
-          {
-            status = store->delete_impi_mapping(mapping, trail);
-          }
-          else
-          {
-            status = store->set_impi_mapping(mapping, trail);
-          }
-        }
-      }
-
-      delete mapping;
-
-    } while(status == Store::Status::DATA_CONTENTION);
+    updates.push_back(new ImpiMappingUpdate(impi, MemcachedImplicitRegistrationSet::State::DELETED));
   }
 
-  // Refresh unchanged IMPIs if the IRS is being refreshed
   if (irs->is_refreshed())
   {
     for (const std::string& impi : irs->impis(MemcachedImplicitRegistrationSet::State::UNCHANGED))
     {
-      do
-      {
-        // We use a separate Status as failing to find an ImpiMapping shouldn't
-        // affect our overall Status
-        ImpuStore::ImpiMapping* mapping = nullptr;
-        Store::Status inner_status = store->get_impi_mapping(impi, mapping, trail);
-
-        if (inner_status == Store::Status::OK)
-        {
-          int now = time(0);
-          mapping->set_expiry(irs->get_ttl() + now);
-
-          // Although we believe the IMPI-IMPU mapping is unchanged,
-          // in the background it may have been deleted, and re-added,
-          // so we should check that the data is still consistent with
-          // the Default IMPU record
-          if (!mapping->has_default_impu(irs->get_default_impu()))
-          {
-            mapping->add_default_impu(irs->get_default_impu());
-          }
-        }
-        else
-        {
-          int now = time(0);
-          mapping = new ImpuStore::ImpiMapping(impi, irs->get_default_impu(), irs->get_ttl() + now);
-        }
-
-        status = store->set_impi_mapping(mapping, trail);
-
-        delete mapping;
-      } while(status == Store::Status::DATA_CONTENTION);
+      updates.push_back(new ImpiMappingUpdate(impi, MemcachedImplicitRegistrationSet::State::UNCHANGED));
     }
   }
 
-  // Add new IMPIs
   for (const std::string& impi : irs->impis(MemcachedImplicitRegistrationSet::State::ADDED))
   {
-    int64_t expiry = time(0) + irs->get_ttl();
+    updates.push_back(new ImpiMappingUpdate(impi, MemcachedImplicitRegistrationSet::State::ADDED));
+  }
 
-    // Given we think this IMPI-IMPU mapping is new, and given
-    // multiple IMPI mapping to multiple IRS is rare, we assume
-    // that the IMPI-IMPU mapping does not exist. If it does, we'll
-    // perform a CAS contention resolution
-    ImpuStore::ImpiMapping* mapping = new ImpuStore::ImpiMapping(impi,
-                                                                 irs->get_default_impu(),
-                                                                 expiry);
+  std::vector<ImpiMappingUpdate*> pending = updates;
+  int64_t irs_expiry = time(0) + irs->get_ttl();
 
-    do
-    {
-      status = store->set_impi_mapping(mapping, trail);
+  while (!pending.empty())
+  {
+    // Read all of the mappings we need in parallel
+    std::vector<std::function<void()>> ops;
 
-      if (status == Store::Status::DATA_CONTENTION)
+    for (ImpiMappingUpdate* update : pending)
+    {
+      if (update->needs_read)
       {
-        ImpuStore::ImpiMapping* new_mapping = nullptr;
-        Store::Status inner_status = store->get_impi_mapping(impi, new_mapping, trail);
-
-        if (inner_status == Store::Status::OK)
+        ops.push_back([update, store, trail]()->void
         {
-          // We found an existing mapping so delete the old one and update the
-          // one we found
-          delete mapping;
-          mapping = new_mapping;
+          delete update->mapping; update->mapping = nullptr;
+          update->read_status = store->get_impi_mapping(update->impi,
+                                                        update->mapping,
+                                                        trail);
+        });
+      }
+    }
 
-          int now = time(0);
-          mapping->set_expiry(irs->get_ttl() + now);
+    run_in_parallel(ops, store, stopwatch);
+    ops.clear();
 
-          if (!mapping->has_default_impu(irs->get_default_impu()))
-          {
-            mapping->add_default_impu(irs->get_default_impu());
-          }
-          else if (!irs->is_refreshed())
-          {
-            // We aren't being refreshed, and the IMPU is present, so just mark
-            // the data as good
-            status = Store::Status::OK;
-          }
-        }
-        else if (inner_status == Store::Status::NOT_FOUND)
+    // Merge our changes into the mappings, and write back the ones that
+    // have changed, again in parallel
+    for (ImpiMappingUpdate* update : pending)
+    {
+      merge_impi_mapping(update, irs, irs_expiry, _lazy_refresh_s);
+
+      if (update->write == ImpiMappingUpdate::Write::SET)
+      {
+        ops.push_back([update, store, trail]()->void
         {
-          // If we've failed to find something in the store, having just had
-          // DATA_CONTENTION, then just leave the mapping untouched and go back
-          // around the loop, as we shouldn't hit DATA_CONTENTION next time we
-          // try to set the mapping
-        }
-        else
+          update->status = store->set_impi_mapping(update->mapping, trail);
+        });
+      }
+      else if (update->write == ImpiMappingUpdate::Write::DELETE)
+      {
+        ops.push_back([update, store, trail]()->void
         {
-          // We've hit some other error, so just bail out
-          status = inner_status;
-        }
+          update->status = store->delete_impi_mapping(update->mapping, trail);
+        });
       }
-    } while(status == Store::Status::DATA_CONTENTION);
+    }
 
-    delete mapping;
+    run_in_parallel(ops, store, stopwatch);
+
+    // Go round again for just the mappings that someone else changed under
+    // us
+    std::vector<ImpiMappingUpdate*> contended;
+
+    for (ImpiMappingUpdate* update : pending)
+    {
+      if (update->status == Store::Status::DATA_CONTENTION)
+      {
+        TRC_DEBUG("Contention updating IMPI mapping for %s - retrying",
+                  update->impi.c_str());
+        count_contention_retry();
+        update->needs_read = true;
+        contended.push_back(update);
+      }
+    }
+
+    pending.swap(contended);
+  }
+
+  for (ImpiMappingUpdate* update : updates)
+  {
+    if ((status == Store::Status::OK) &&
+        (update->status != Store::Status::OK))
+    {
+      status = update->status;
+    }
+
+    delete update;
   }
 
   if (hook)
@@ -749,56 +2073,157 @@ Store::Status MemcachedCache::update_irs_associated_impus(MemcachedImplicitRegis
     hook = create_hook(stopwatch);
   }
 
-  // Remove old associated IMPUs
-  for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::DELETED))
+  // The IRS will expire at irs_expiry, and the records we write last
+  // _lazy_refresh_s beyond that.
+  int64_t irs_expiry = time(0) + irs->get_ttl();
+  int64_t expiry = irs_expiry + _lazy_refresh_s;
+
+  std::vector<std::function<void()>> ops;
+  std::vector<ImpuStore::AssociatedImpu*> written;
+
+  std::function<void(const std::string&)> write_impu =
+    [&ops, &written, irs, store, trail, expiry](const std::string& associated_impu)
   {
-    do
+    ImpuStore::AssociatedImpu* impu = new ImpuStore::AssociatedImpu(associated_impu,
+                                                                    irs->get_default_impu(),
+                                                                    0L,
+                                                                    expiry,
+                                                                    store);
+    written.push_back(impu);
+
+    ops.push_back([impu, store, trail]()->void
     {
-      ImpuStore::Impu* mapping = nullptr;
-      store->get_impu(associated_impu, mapping, trail);
+      store->set_impu_without_cas(impu, trail);
+    });
+  };
+
+  // Add new associated IMPUs. These are blind writes, so they're made
+  // alongside the first reads of the associated IMPUs we're removing.
+  for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::ADDED))
+  {
+    write_impu(associated_impu);
+  }
+
+  // Refresh unchanged associated IMPUs if the IRS is being refreshed. If the
+  // refresh is lazy, we first read them, and only rewrite the ones that
+  // would expire before the IRS.
+  std::vector<AssociatedImpuUpdate*> refreshes;
 
-      if (mapping && !mapping->is_default_impu())
+  if (irs->is_refreshed())
+  {
+    for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::UNCHANGED))
+    {
+      if (_lazy_refresh_s > 0)
       {
-        ImpuStore::AssociatedImpu* assoc_mapping = (ImpuStore::AssociatedImpu*)mapping;
+        AssociatedImpuUpdate* refresh = new AssociatedImpuUpdate(associated_impu);
+        refreshes.push_back(refresh);
 
-        if (assoc_mapping->default_impu == irs->get_default_impu())
+        ops.push_back([refresh, store, trail]()->void
         {
-          status = store->delete_impu(mapping, trail);
-        }
+          store->get_impu(refresh->impu, refresh->mapping, trail);
+        });
+      }
+      else
+      {
+        write_impu(associated_impu);
       }
+    }
+  }
 
-      delete mapping;
-    } while(status == Store::Status::DATA_CONTENTION);
+  // Remove old associated IMPUs, as long as they still belong to this IRS
+  std::vector<AssociatedImpuUpdate*> deletes;
+
+  for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::DELETED))
+  {
+    deletes.push_back(new AssociatedImpuUpdate(associated_impu));
   }
 
-  // Refresh unchanged associated IMPUs if the IRS is being refreshed
-  if (irs->is_refreshed())
+  std::vector<AssociatedImpuUpdate*> pending = deletes;
+  bool first_round = true;
+
+  do
   {
-    for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::UNCHANGED))
+    for (AssociatedImpuUpdate* del : pending)
+    {
+      ops.push_back([del, store, trail]()->void
+      {
+        delete del->mapping; del->mapping = nullptr;
+        store->get_impu(del->impu, del->mapping, trail);
+      });
+    }
+
+    run_in_parallel(ops, store, stopwatch);
+    ops.clear();
+
+    // The unchanged IMPUs that need refreshing are written alongside the
+    // first round of deletes
+    if (first_round)
     {
-      int64_t expiry = time(0) + irs->get_ttl();
-      ImpuStore::AssociatedImpu* impu = new ImpuStore::AssociatedImpu(associated_impu,
-                                                                      irs->get_default_impu(),
-                                                                      0L,
-                                                                      expiry,
-                                                                      store);
+      for (AssociatedImpuUpdate* refresh : refreshes)
+      {
+        if (!belongs_to_irs(refresh->mapping, irs) ||
+            (refresh->mapping->expiry < irs_expiry))
+        {
+          write_impu(refresh->impu);
+        }
+        else
+        {
+          TRC_DEBUG("Associated IMPU %s doesn't need refreshing yet",
+                    refresh->impu.c_str());
+        }
+      }
 
-      store->set_impu_without_cas(impu, trail);
-      delete impu;
+      first_round = false;
+    }
+
+    for (AssociatedImpuUpdate* del : pending)
+    {
+      del->status = Store::Status::OK;
+
+      if (belongs_to_irs(del->mapping, irs))
+      {
+        ops.push_back([del, store, trail]()->void
+        {
+          del->status = store->delete_impu(del->mapping, trail);
+        });
+      }
+    }
+
+    run_in_parallel(ops, store, stopwatch);
+    ops.clear();
+
+    std::vector<AssociatedImpuUpdate*> contended;
+
+    for (AssociatedImpuUpdate* del : pending)
+    {
+      if (del->status == Store::Status::DATA_CONTENTION)
+      {
+        count_contention_retry();
+        contended.push_back(del);
+      }
+    }
+
+    pending.swap(contended);
+  } while (!pending.empty());
+
+  for (AssociatedImpuUpdate* del : deletes)
+  {
+    if ((status == Store::Status::OK) &&
+        (del->status != Store::Status::OK))
+    {
+      status = del->status;
     }
+
+    delete del;
   }
 
-  // Add new associated IMPUs
-  for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::ADDED))
+  for (AssociatedImpuUpdate* refresh : refreshes)
   {
-    int64_t expiry = time(0) + irs->get_ttl();
-    ImpuStore::AssociatedImpu* impu = new ImpuStore::AssociatedImpu(associated_impu,
-                                                                    irs->get_default_impu(),
-                                                                    0L,
-                                                                    expiry,
-                                                                    store);
+    delete refresh;
+  }
 
-    store->set_impu_without_cas(impu, trail);
+  for (ImpuStore::AssociatedImpu* impu : written)
+  {
     delete impu;
   }
 
@@ -892,11 +2317,14 @@ Store::Status MemcachedCache::create_irs_impu(MemcachedImplicitRegistrationSet*
 
 typedef Store::Status (ImpuStore::*irs_impu_action)(ImpuStore::Impu*, SAS::TrailId);
 
+// Performs the action on the IRS's default IMPU, retrying on contention. Each
+// retry is counted in contention_retries_table, if provided.
 Store::Status perform_irs_impu_action(irs_impu_action action,
                                       MemcachedImplicitRegistrationSet* irs,
                                       SAS::TrailId trail,
                                       ImpuStore* store,
-                                      Utils::StopWatch* stopwatch)
+                                      Utils::StopWatch* stopwatch,
+                                      SNMP::CounterTable* contention_retries_table)
 {
   Store::Status status = Store::Status::OK;
   ImpuStore::DefaultImpu* impu = irs->get_impu_for_store(store);
@@ -929,7 +2357,7 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
       // data, but we don't attempt to update local stores, and just
       // assume they'll fall into place.
       ImpuStore::Impu* mapped_impu = nullptr;
-      store->get_impu(irs->get_default_impu(), mapped_impu, trail);
+      store->get_impu_for_update(irs->get_default_impu(), mapped_impu, trail);
 
       if (mapped_impu == nullptr)
       {
@@ -976,6 +2404,12 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
     }
     delete impu; impu = nullptr;
 
+    if ((status == Store::Status::DATA_CONTENTION) &&
+        (contention_retries_table))
+    {
+      contention_retries_table->increment();
+    }
+
   } while(status == Store::Status::DATA_CONTENTION);
 
   if (hook)
@@ -995,7 +2429,8 @@ Store::Status MemcachedCache::update_irs_impu(MemcachedImplicitRegistrationSet*
                                  irs,
                                  trail,
                                  store,
-                                 stopwatch);
+                                 stopwatch,
+                                 _contention_retries_table);
 }
 
 Store::Status MemcachedCache::delete_irs_impu(MemcachedImplicitRegistrationSet* irs,
@@ -1009,7 +2444,8 @@ Store::Status MemcachedCache::delete_irs_impu(MemcachedImplicitRegistrationSet*
                                  irs,
                                  trail,
                                  store,
-                                 stopwatch);
+                                 stopwatch,
+                                 _contention_retries_table);
 }
 
 Store::Status MemcachedCache::put_irs_action(MemcachedImplicitRegistrationSet* irs,
@@ -1080,7 +2516,12 @@ Store::Status MemcachedCache::delete_implicit_registration_set(ImplicitRegistrat
   {
     store_action action =
       std::bind(&MemcachedCache::delete_irs_action, this, mirs, trail, _1, _2);
-    status = perform(action, progress_cb, stopwatch);
+    status = perform(action,
+                     ReplicationType::REPLICATE_DELETE,
+                     {mirs},
+                     progress_cb,
+                     trail,
+                     stopwatch);
   }
   else
   {
@@ -1102,7 +2543,23 @@ Store::Status MemcachedCache::delete_implicit_registration_sets(const std::vecto
 {
   store_action action =
     std::bind(&MemcachedCache::delete_irss_action, this, irss, trail, _1, _2);
-  Store::Status status = perform(action, progress_cb, stopwatch);
+
+  std::vector<MemcachedImplicitRegistrationSet*> mirss;
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    MemcachedImplicitRegistrationSet* mirs = (MemcachedImplicitRegistrationSet*)irs;
+    if (mirs->is_existing())
+    {
+      mirss.push_back(mirs);
+    }
+  }
+
+  Store::Status status = perform(action,
+                                 ReplicationType::REPLICATE_DELETE,
+                                 mirss,
+                                 progress_cb,
+                                 trail,
+                                 stopwatch);
   return status;
 }
 
@@ -1158,7 +2615,19 @@ Store::Status MemcachedCache::put_ims_subscription(ImsSubscription* subscription
 {
   store_action action =
     std::bind(&MemcachedCache::put_ims_sub_action, this, subscription, trail, _1, _2);
-  Store::Status status = perform(action, progress_cb, stopwatch);
+
+  std::vector<MemcachedImplicitRegistrationSet*> mirss;
+  for (BaseImsSubscription::Irs::value_type& irs : ((BaseImsSubscription*)subscription)->get_irs())
+  {
+    mirss.push_back((MemcachedImplicitRegistrationSet*)irs.second);
+  }
+
+  Store::Status status = perform(action,
+                                 ReplicationType::REPLICATE_PUT,
+                                 mirss,
+                                 progress_cb,
+                                 trail,
+                                 stopwatch);
   return status;
 }
 
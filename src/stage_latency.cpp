@@ -0,0 +1,86 @@
+/**
+ * @file stage_latency.cpp Breakdown of request latency by processing stage.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "stage_latency.h"
+#include "homesteadsasevent.h"
+#include "statisticsmanager.h"
+
+StatisticsManager* StageLatency::_stats_manager = NULL;
+
+void StageLatency::configure(StatisticsManager* stats_manager)
+{
+  _stats_manager = stats_manager;
+}
+
+void StageLatency::record(Stage stage, SAS::TrailId trail, unsigned long latency_us)
+{
+  if (stage == NONE)
+  {
+    return;
+  }
+
+  if (_stats_manager != NULL)
+  {
+    switch (stage)
+    {
+    case CACHE_QUEUE:
+      _stats_manager->update_H_cache_queue_latency_us(latency_us);
+      break;
+
+    case LOCAL_STORE:
+      _stats_manager->update_H_local_store_latency_us(latency_us);
+      break;
+
+    case REMOTE_STORE:
+      _stats_manager->update_H_remote_store_latency_us(latency_us);
+      break;
+
+    case HSS_SAR:
+      _stats_manager->update_H_hss_sar_latency_us(latency_us);
+      break;
+
+    case XML_BUILD:
+      _stats_manager->update_H_xml_build_latency_us(latency_us);
+      break;
+
+    case COMPRESSION:
+      _stats_manager->update_H_compression_latency_us(latency_us);
+      break;
+
+    case DECOMPRESSION:
+      _stats_manager->update_H_decompression_latency_us(latency_us);
+      break;
+
+    default:
+      break; // LCOV_EXCL_LINE - all stages are covered above.
+    }
+  }
+
+  if ((trail != 0) && (latency_us >= SAS_THRESHOLD_US))
+  {
+    SAS::Event event(trail, SASEvent::STAGE_LATENCY, 0);
+    event.add_static_param(stage);
+    event.add_static_param(latency_us);
+    SAS::report_event(event);
+  }
+}
+
+void StageLatency::Timer::stop()
+{
+  if (_running)
+  {
+    _running = false;
+    record(_stage,
+           _trail,
+           std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - _start).count());
+  }
+}
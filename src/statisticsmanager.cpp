@@ -23,6 +23,20 @@ StatisticsManager::StatisticsManager()
                                                            ".1.2.826.0.1.1578918.9.5.4");
   H_hss_subscription_latency_us = SNMP::EventAccumulatorTable::create("H_hss_subscription_latency_us",
                                                                  ".1.2.826.0.1.1578918.9.5.5");
+  H_cache_queue_latency_us = SNMP::EventAccumulatorTable::create("H_cache_queue_latency_us",
+                                                            ".1.2.826.0.1.1578918.9.5.23");
+  H_local_store_latency_us = SNMP::EventAccumulatorTable::create("H_local_store_latency_us",
+                                                            ".1.2.826.0.1.1578918.9.5.24");
+  H_remote_store_latency_us = SNMP::EventAccumulatorTable::create("H_remote_store_latency_us",
+                                                             ".1.2.826.0.1.1578918.9.5.25");
+  H_hss_sar_latency_us = SNMP::EventAccumulatorTable::create("H_hss_sar_latency_us",
+                                                        ".1.2.826.0.1.1578918.9.5.26");
+  H_xml_build_latency_us = SNMP::EventAccumulatorTable::create("H_xml_build_latency_us",
+                                                          ".1.2.826.0.1.1578918.9.5.27");
+  H_compression_latency_us = SNMP::EventAccumulatorTable::create("H_compression_latency_us",
+                                                            ".1.2.826.0.1.1578918.9.5.28");
+  H_decompression_latency_us = SNMP::EventAccumulatorTable::create("H_decompression_latency_us",
+                                                              ".1.2.826.0.1.1578918.9.5.30");
   H_incoming_requests = SNMP::CounterTable::create("H_incoming_requests",
                                                    ".1.2.826.0.1.1578918.9.5.6");
   H_rejected_overload = SNMP::CounterTable::create("H_rejected_overload",
@@ -36,6 +50,13 @@ StatisticsManager::~StatisticsManager()
   delete H_hsprov_latency_us; H_hsprov_latency_us = NULL;
   delete H_hss_digest_latency_us; H_hss_digest_latency_us = NULL;
   delete H_hss_subscription_latency_us; H_hss_subscription_latency_us = NULL;
+  delete H_cache_queue_latency_us; H_cache_queue_latency_us = NULL;
+  delete H_local_store_latency_us; H_local_store_latency_us = NULL;
+  delete H_remote_store_latency_us; H_remote_store_latency_us = NULL;
+  delete H_hss_sar_latency_us; H_hss_sar_latency_us = NULL;
+  delete H_xml_build_latency_us; H_xml_build_latency_us = NULL;
+  delete H_compression_latency_us; H_compression_latency_us = NULL;
+  delete H_decompression_latency_us; H_decompression_latency_us = NULL;
   delete H_incoming_requests; H_incoming_requests = NULL;
   delete H_rejected_overload; H_rejected_overload = NULL;
 }
@@ -31,6 +31,7 @@ TEST_F(BaseImsSubscriptionTest, BasicIrsHandling)
 
   EXPECT_NE(nullptr, mis->get_irs_for_default_impu(IMPU));
   EXPECT_EQ(1, mis->get_irs().size());
+  EXPECT_EQ(std::vector<ImplicitRegistrationSet*>({ irs }), mis->get_irss());
 
   delete mis;
 }
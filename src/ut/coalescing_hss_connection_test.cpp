@@ -0,0 +1,112 @@
+/**
+ * @file coalescing_hss_connection_test.cpp UT for CoalescingHssConnection.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "test_utils.hpp"
+
+#include "coalescing_hss_connection.h"
+#include "mockhssconnection.hpp"
+
+using ::testing::_;
+using ::testing::Field;
+using ::testing::SaveArg;
+using ::testing::StrictMock;
+
+static const std::string IMPI = "impi@example.com";
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string SERVER_NAME = "sip:scscf.example.com";
+static const std::string SERVICE_PROFILE = "<IMSSubscription/>";
+
+class CoalescingHssConnectionTest : public ::testing::Test
+{
+public:
+  CoalescingHssConnectionTest() : _conn(&_mock_conn) {}
+
+  virtual ~CoalescingHssConnectionTest() {}
+
+  static HssConnection::ServerAssignmentRequest sar(const std::string& impu)
+  {
+    return { IMPI, impu, SERVER_NAME, Cx::ServerAssignmentType::REGISTRATION, false, "" };
+  }
+
+  // Returns a callback that records the service profile of each SAA it's
+  // called with.
+  HssConnection::saa_cb record_answer()
+  {
+    return [this](const HssConnection::ServerAssignmentAnswer& saa)
+    {
+      _answers.push_back(saa.get_service_profile());
+    };
+  }
+
+  StrictMock<MockHssConnection> _mock_conn;
+  HssConnection::CoalescingHssConnection _conn;
+  std::vector<std::string> _answers;
+};
+
+// Identical SARs made while one is in flight share its answer.
+TEST_F(CoalescingHssConnectionTest, IdenticalSarsCoalesced)
+{
+  HssConnection::saa_cb inner_cb;
+  EXPECT_CALL(_mock_conn, send_server_assignment_request(_, _, 0, nullptr))
+    .WillOnce(SaveArg<0>(&inner_cb));
+
+  _conn.send_server_assignment_request(record_answer(), sar(IMPU), 0, nullptr);
+  _conn.send_server_assignment_request(record_answer(), sar(IMPU), 0, nullptr);
+  _conn.send_server_assignment_request(record_answer(), sar(IMPU), 0, nullptr);
+  EXPECT_TRUE(_answers.empty());
+
+  ChargingAddresses charging_addrs;
+  inner_cb(HssConnection::ServerAssignmentAnswer(HssConnection::ResultCode::SUCCESS,
+                                                 charging_addrs,
+                                                 SERVICE_PROFILE,
+                                                 ""));
+  EXPECT_EQ(std::vector<std::string>(3, SERVICE_PROFILE), _answers);
+
+  // The next SAR is sent to the HSS again
+  EXPECT_CALL(_mock_conn, send_server_assignment_request(_, _, 0, nullptr));
+  _conn.send_server_assignment_request(record_answer(), sar(IMPU), 0, nullptr);
+}
+
+// SARs that differ in any way are sent separately.
+TEST_F(CoalescingHssConnectionTest, DifferentSarsNotCoalesced)
+{
+  HssConnection::ServerAssignmentRequest dereg = sar(IMPU);
+  dereg.type = Cx::ServerAssignmentType::USER_DEREGISTRATION;
+
+  EXPECT_CALL(_mock_conn,
+              send_server_assignment_request(_, Field(&HssConnection::ServerAssignmentRequest::impu, IMPU), 0, nullptr))
+    .Times(2);
+  EXPECT_CALL(_mock_conn,
+              send_server_assignment_request(_, Field(&HssConnection::ServerAssignmentRequest::impu, "sip:other@example.com"), 0, nullptr));
+
+  _conn.send_server_assignment_request(record_answer(), sar(IMPU), 0, nullptr);
+  _conn.send_server_assignment_request(record_answer(), dereg, 0, nullptr);
+  _conn.send_server_assignment_request(record_answer(), sar("sip:other@example.com"), 0, nullptr);
+}
+
+// Other requests are passed straight through.
+TEST_F(CoalescingHssConnectionTest, OtherRequestsPassedThrough)
+{
+  HssConnection::MultimediaAuthRequest mar = { IMPI, IMPU, SERVER_NAME, "", "" };
+  HssConnection::UserAuthRequest uar = { IMPI, IMPU, "", "", false };
+  HssConnection::LocationInfoRequest lir = { IMPU, "", "" };
+
+  EXPECT_CALL(_mock_conn, send_multimedia_auth_request(_, _, 0, nullptr)).Times(2);
+  EXPECT_CALL(_mock_conn, send_user_auth_request(_, _, 0, nullptr)).Times(2);
+  EXPECT_CALL(_mock_conn, send_location_info_request(_, _, 0, nullptr)).Times(2);
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    _conn.send_multimedia_auth_request([](const HssConnection::MultimediaAuthAnswer&){}, mar, 0, nullptr);
+    _conn.send_user_auth_request([](const HssConnection::UserAuthAnswer&){}, uar, 0, nullptr);
+    _conn.send_location_info_request([](const HssConnection::LocationInfoAnswer&){}, lir, 0, nullptr);
+  }
+}
@@ -16,6 +16,7 @@
 #include <string>
 
 #include "charging_addresses.h"
+#include "homestead_xml_utils.h"
 #include "implicit_reg_set.h"
 
 class FakeImplicitRegistrationSet : public ImplicitRegistrationSet
@@ -23,7 +24,8 @@ class FakeImplicitRegistrationSet : public ImplicitRegistrationSet
   FakeImplicitRegistrationSet(const std::string& default_impu) :
     ImplicitRegistrationSet(),
     _default_impu(default_impu),
-    _ttl(0)
+    _ttl(0),
+    _version(0)
   {
   }
 
@@ -47,6 +49,16 @@ class FakeImplicitRegistrationSet : public ImplicitRegistrationSet
     return _associated_impis;
   }
 
+  virtual std::vector<std::string> get_associated_impus() const override
+  {
+    return _associated_impus;
+  }
+
+  void set_associated_impus(const std::vector<std::string>& impus)
+  {
+    _associated_impus = impus;
+  }
+
   virtual const ChargingAddresses& get_charging_addresses() const override
   {
     return _charging_addresses;
@@ -57,9 +69,36 @@ class FakeImplicitRegistrationSet : public ImplicitRegistrationSet
     return _ttl;
   }
 
+  virtual const IdentityIndex& get_identity_index() const override
+  {
+    return _identity_index;
+  }
+
+  void set_identity_index(const IdentityIndex& identity_index)
+  {
+    _identity_index = identity_index;
+  }
+
+  virtual uint64_t get_version() const override
+  {
+    return _version;
+  }
+
+  void set_version(uint64_t version)
+  {
+    _version = version;
+  }
+
   virtual void set_ims_sub_xml(const std::string& xml) override
   {
     _ims_sub_xml = xml;
+    _identity_index.clear();
+  }
+
+  virtual void set_ims_sub_xml(const XmlUtils::ParsedImsSubscription& ims_sub) override
+  {
+    _ims_sub_xml = ims_sub.xml();
+    _identity_index = ims_sub.identity_index();
   }
 
   virtual void set_reg_state(RegistrationState state) override
@@ -90,13 +129,21 @@ class FakeImplicitRegistrationSet : public ImplicitRegistrationSet
     _ttl = ttl;
   }
 
+  virtual ImplicitRegistrationSet* clone() const override
+  {
+    return new FakeImplicitRegistrationSet(*this);
+  }
+
 private:
   std::string _default_impu;
   std::string _ims_sub_xml;
+  IdentityIndex _identity_index;
   RegistrationState _reg_state;
   std::vector<std::string> _associated_impis;
+  std::vector<std::string> _associated_impus;
   ChargingAddresses _charging_addresses;
   int32_t _ttl;
+  uint64_t _version;
 };
 
 #endif
@@ -125,3 +125,275 @@ TEST_F(XmlUtilsTest, GetIdsMissingIds)
   std::string private_id = XmlUtils::get_private_id(xml);
   EXPECT_EQ("", private_id);
 }
+
+TEST_F(XmlUtilsTest, ParsedImsSubscription)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:barred@example.com</Identity><BarringIndication>1</BarringIndication></PublicIdentity><PublicIdentity><Identity>sip:first@example.com</Identity></PublicIdentity></ServiceProfile><ServiceProfile><PublicIdentity><Identity>sip:second@example.com</Identity></PublicIdentity><PublicIdentity><Identity>sip:first@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>";
+  XmlUtils::ParsedImsSubscription ims_sub(xml);
+
+  EXPECT_EQ(xml, ims_sub.xml());
+  ASSERT_NE((rapidxml::xml_node<>*)NULL, ims_sub.ims_subscription_node());
+  EXPECT_EQ("impi@example.com", ims_sub.private_id());
+  EXPECT_EQ("sip:first@example.com", ims_sub.default_id());
+  EXPECT_EQ(std::vector<std::string>({"sip:barred@example.com",
+                                      "sip:first@example.com",
+                                      "sip:second@example.com"}),
+            ims_sub.public_ids());
+}
+
+TEST_F(XmlUtilsTest, ParsedImsSubscriptionIdentityIndex)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:barred@example.com</Identity><BarringIndication>1</BarringIndication></PublicIdentity><PublicIdentity><Identity>sip:first@example.com</Identity><BarringIndication>0</BarringIndication></PublicIdentity><PublicIdentity><Identity>sip:wildcard@example.com</Identity><Extension><IdentityType>3</IdentityType><Extension><Extension><WildcardedIMPU>sip:!.*!@example.com</WildcardedIMPU></Extension></Extension></Extension></PublicIdentity></ServiceProfile></IMSSubscription>";
+  XmlUtils::ParsedImsSubscription ims_sub(xml);
+  const IdentityIndex& index = ims_sub.identity_index();
+
+  ASSERT_EQ(3u, index.identities.size());
+  EXPECT_EQ("sip:barred@example.com", index.identities[0].uri);
+  EXPECT_EQ(IdentityIndex::BARRED, index.identities[0].flags);
+  EXPECT_EQ("sip:first@example.com", index.identities[1].uri);
+  EXPECT_EQ(0, index.identities[1].flags);
+  EXPECT_EQ("sip:!.*!@example.com", index.identities[2].uri);
+  EXPECT_EQ(IdentityIndex::WILDCARD, index.identities[2].flags);
+  EXPECT_EQ("impi@example.com", index.private_id);
+
+  // The index gives the same IDs as the parsed subscription.
+  EXPECT_EQ(ims_sub.public_ids(), index.public_ids());
+  EXPECT_EQ(ims_sub.default_id(), index.default_id());
+}
+
+TEST_F(XmlUtilsTest, ParsedImsSubscriptionAllBarred)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:barred@example.com</Identity><BarringIndication>1</BarringIndication></PublicIdentity></ServiceProfile></IMSSubscription>";
+  XmlUtils::ParsedImsSubscription ims_sub(xml);
+
+  EXPECT_EQ("", ims_sub.private_id());
+  EXPECT_EQ("", ims_sub.default_id());
+  EXPECT_EQ(1u, ims_sub.public_ids().size());
+
+  // The default ID passed in is left unchanged.
+  std::string default_id = "unchanged";
+  XmlUtils::get_default_id(xml, default_id);
+  EXPECT_EQ("unchanged", default_id);
+}
+
+TEST_F(XmlUtilsTest, ParsedImsSubscriptionInvalid)
+{
+  XmlUtils::ParsedImsSubscription ims_sub("?xml veron=\"1.0\" encoding=\"UTF-8\"?>");
+
+  EXPECT_EQ((rapidxml::xml_node<>*)NULL, ims_sub.ims_subscription_node());
+  EXPECT_EQ("", ims_sub.private_id());
+  EXPECT_EQ("", ims_sub.default_id());
+  EXPECT_EQ(0u, ims_sub.public_ids().size());
+}
+
+// Checks that scanning the XML for its identities gets the same result as
+// parsing it.
+static void expect_scan_matches_parse(const std::string& xml)
+{
+  SCOPED_TRACE(xml);
+  XmlUtils::ParsedImsSubscription ims_sub(xml);
+  IdentityIndex index;
+
+  EXPECT_TRUE(XmlUtils::scan_identity_index(xml, index));
+  EXPECT_TRUE(ims_sub.identity_index() == index);
+}
+
+TEST_F(XmlUtilsTest, ScanIdentityIndex)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription><PrivateID>impi@example.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:barred@example.com</Identity><BarringIndication>1</BarringIndication></PublicIdentity><PublicIdentity><Identity>sip:first@example.com</Identity><Extension><IdentityType>0</IdentityType></Extension></PublicIdentity><InitialFilterCriteria><Priority>0</Priority></InitialFilterCriteria></ServiceProfile><ServiceProfile><PublicIdentity><Identity>sip:second@example.com</Identity></PublicIdentity><PublicIdentity><Identity>sip:first@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>";
+  IdentityIndex index;
+
+  ASSERT_TRUE(XmlUtils::scan_identity_index(xml, index));
+  EXPECT_EQ(std::vector<std::string>({"sip:barred@example.com",
+                                      "sip:first@example.com",
+                                      "sip:second@example.com"}),
+            index.public_ids());
+  EXPECT_EQ(IdentityIndex::BARRED, index.identities[0].flags);
+  EXPECT_EQ("sip:first@example.com", index.default_id());
+  EXPECT_EQ("impi@example.com", index.private_id);
+
+  expect_scan_matches_parse(xml);
+}
+
+TEST_F(XmlUtilsTest, ScanIdentityIndexMatchesParse)
+{
+  std::vector<std::string> xmls = {
+    // Empty, or without an IMSSubscription.
+    "",
+    "<?xml version=\"1.0\"?><Other><PrivateID>impi@example.com</PrivateID></Other>",
+
+    // Namespace prefixes are ignored.
+    "<ns:IMSSubscription xmlns:ns=\"urn:example\"><ns:PrivateID>impi@example.com</ns:PrivateID><ns:ServiceProfile><ns:PublicIdentity><ns:Identity>sip:impu@example.com</ns:Identity><ns:BarringIndication>0</ns:BarringIndication></ns:PublicIdentity></ns:ServiceProfile></ns:IMSSubscription>",
+
+    // Comments, CDATA, processing instructions, attributes (including
+    // markup characters), self-closing elements and whitespace.
+    "\xEF\xBB\xBF<?xml version='1.0'?>\n<!-- <IMSSubscription> -->\n<IMSSubscription a=\"<b>\" c = 'd'>\n  <PrivateID> impi@example.com </PrivateID>\n  <ServiceProfile>\n    <PublicIdentity>\n      <Identity><![CDATA[sip:cdata@example.com]]>sip:impu@example.com</Identity>\n      <BarringIndication/>\n    </PublicIdentity>\n    <?pi <Identity>?>\n    <PublicIdentity><Identity/></PublicIdentity>\n  </ServiceProfile>\n</IMSSubscription>\n",
+
+    // Predefined entities are decoded, others are left alone.
+    "<IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:&lt;a&amp;b&gt;&quot;&apos;&foo;@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>",
+
+    // Only the first IMSSubscription, PrivateID, Identity and
+    // BarringIndication count, and only where they're expected.
+    "<IMSSubscription><PrivateID>first</PrivateID><PrivateID>second</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:first@example.com<Identity>sip:nested@example.com</Identity></Identity><Identity>sip:second@example.com</Identity><BarringIndication>1</BarringIndication><BarringIndication>0</BarringIndication></PublicIdentity><Other><PublicIdentity><Identity>sip:other@example.com</Identity></PublicIdentity></Other></ServiceProfile></IMSSubscription><IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:third@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>",
+
+    // A PublicIdentity without an Identity is skipped.
+    "<IMSSubscription><ServiceProfile><PublicIdentity><BarringIndication>0</BarringIndication></PublicIdentity><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>",
+
+    // Wildcarded identities are taken from the Extension.
+    "<IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:wildcard@example.com</Identity><Extension><IdentityType>3</IdentityType><Extension><Extension><WildcardedIMPU>sip:!.*!@example.com</WildcardedIMPU></Extension></Extension></Extension></PublicIdentity><PublicIdentity><Identity>sip:impu@example.com</Identity><Extension/></PublicIdentity></ServiceProfile></IMSSubscription>",
+  };
+
+  for (const std::string& xml : xmls)
+  {
+    expect_scan_matches_parse(xml);
+  }
+}
+
+TEST_F(XmlUtilsTest, ScanIdentityIndexGivesUp)
+{
+  std::vector<std::string> xmls = {
+    // Things the scanner leaves to rapidxml.
+    "<!DOCTYPE IMSSubscription><IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>",
+    "<IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:&#105;mpu@example.com</Identity></PublicIdentity></ServiceProfile></IMSSubscription>",
+    std::string("<IMSSubscription><PrivateID>impi") + '\0' + "@example.com</PrivateID></IMSSubscription>",
+
+    // Invalid XML.
+    "?xml veron=\"1.0\" encoding=\"UTF-8\"?>",
+    "<IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:impu@example.com</Identity>",
+    "<IMSSubscription a=b></IMSSubscription>",
+    "<IMSSubscription><!-- unterminated </IMSSubscription>",
+    "<IMSSubscription></IMSSubscription></extra>",
+  };
+
+  for (const std::string& xml : xmls)
+  {
+    SCOPED_TRACE(xml);
+    IdentityIndex index;
+    EXPECT_FALSE(XmlUtils::scan_identity_index(xml, index));
+    EXPECT_TRUE(index.empty());
+
+    // The XML is parsed instead.
+    XmlUtils::ParsedImsSubscription ims_sub(xml);
+    EXPECT_TRUE(ims_sub.identity_index() == XmlUtils::get_identity_index(xml));
+  }
+}
+
+TEST_F(XmlUtilsTest, BuildFromParsedImsSubscription)
+{
+  FakeImplicitRegistrationSet irs = FakeImplicitRegistrationSet("");
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>test</IMSSubscription>");
+  irs.set_reg_state(RegistrationState::REGISTERED);
+  XmlUtils::ParsedImsSubscription ims_sub(irs.get_ims_sub_xml());
+
+  // The parsed IMS subscription can be used for more than one document.
+  for (int ii = 0; ii < 2; ii++)
+  {
+    std::string result;
+    int rc = XmlUtils::build_ClearwaterRegData_xml(&irs,
+                                                   ims_sub,
+                                                   result,
+                                                   RegistrationState::UNKNOWN);
+
+    ASSERT_EQ(200, rc);
+    ASSERT_EQ("<ClearwaterRegData>\n\t<RegistrationState>REGISTERED</RegistrationState>\n\t<IMSSubscription>test</IMSSubscription>\n</ClearwaterRegData>\n\n", result);
+  }
+}
+
+TEST_F(XmlUtilsTest, RegDataCacheHit)
+{
+  XmlUtils::ClearwaterRegDataCache cache(10);
+  FakeImplicitRegistrationSet irs = FakeImplicitRegistrationSet("sip:impu@example.com");
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>test</IMSSubscription>");
+  irs.set_reg_state(RegistrationState::REGISTERED);
+  irs.set_version(1);
+
+  std::string result;
+  EXPECT_FALSE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+
+  cache.put(&irs, RegistrationState::UNKNOWN, "cached");
+  EXPECT_TRUE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+  EXPECT_EQ("cached", result);
+}
+
+TEST_F(XmlUtilsTest, RegDataCacheKeyedOnRegStates)
+{
+  XmlUtils::ClearwaterRegDataCache cache(10);
+  FakeImplicitRegistrationSet irs = FakeImplicitRegistrationSet("sip:impu@example.com");
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>test</IMSSubscription>");
+  irs.set_reg_state(RegistrationState::REGISTERED);
+  irs.set_version(1);
+
+  std::string result;
+  cache.put(&irs, RegistrationState::UNKNOWN, "no previous state");
+  cache.put(&irs, RegistrationState::REGISTERED, "previously registered");
+
+  EXPECT_TRUE(cache.get(&irs, RegistrationState::REGISTERED, result));
+  EXPECT_EQ("previously registered", result);
+  EXPECT_TRUE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+  EXPECT_EQ("no previous state", result);
+  EXPECT_FALSE(cache.get(&irs, RegistrationState::NOT_REGISTERED, result));
+
+  irs.set_reg_state(RegistrationState::UNREGISTERED);
+  EXPECT_FALSE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+}
+
+TEST_F(XmlUtilsTest, RegDataCacheContentsChanged)
+{
+  // A cached document isn't used if the IMS subscription or charging
+  // addresses differ, even if the version is the same.
+  XmlUtils::ClearwaterRegDataCache cache(10);
+  FakeImplicitRegistrationSet irs = FakeImplicitRegistrationSet("sip:impu@example.com");
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>test</IMSSubscription>");
+  irs.set_reg_state(RegistrationState::REGISTERED);
+  irs.set_version(1);
+
+  std::string result;
+  cache.put(&irs, RegistrationState::UNKNOWN, "cached");
+
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>changed</IMSSubscription>");
+  EXPECT_FALSE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>test</IMSSubscription>");
+  irs.set_charging_addresses(ChargingAddresses({"ccf1"}, {}));
+  EXPECT_FALSE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+
+  // Replacing the entry makes it match again.
+  cache.put(&irs, RegistrationState::UNKNOWN, "replaced");
+  EXPECT_TRUE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+  EXPECT_EQ("replaced", result);
+  EXPECT_EQ(1u, cache._entries.size());
+}
+
+TEST_F(XmlUtilsTest, RegDataCacheNoVersion)
+{
+  XmlUtils::ClearwaterRegDataCache cache(10);
+  FakeImplicitRegistrationSet irs = FakeImplicitRegistrationSet("sip:impu@example.com");
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>test</IMSSubscription>");
+  irs.set_reg_state(RegistrationState::REGISTERED);
+
+  std::string result;
+  cache.put(&irs, RegistrationState::UNKNOWN, "cached");
+  EXPECT_EQ(0u, cache._entries.size());
+  EXPECT_FALSE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+}
+
+TEST_F(XmlUtilsTest, RegDataCacheEviction)
+{
+  XmlUtils::ClearwaterRegDataCache cache(2);
+  FakeImplicitRegistrationSet irs = FakeImplicitRegistrationSet("sip:impu@example.com");
+  irs.set_ims_sub_xml("<?xml?><IMSSubscription>test</IMSSubscription>");
+  irs.set_reg_state(RegistrationState::REGISTERED);
+
+  for (uint64_t version = 1; version <= 3; version++)
+  {
+    irs.set_version(version);
+    cache.put(&irs, RegistrationState::UNKNOWN, "cached");
+  }
+
+  // The least recently used entry, for version 1, has been evicted.
+  std::string result;
+  EXPECT_EQ(2u, cache._entries.size());
+  EXPECT_TRUE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+  irs.set_version(1);
+  EXPECT_FALSE(cache.get(&irs, RegistrationState::UNKNOWN, result));
+}
@@ -0,0 +1,153 @@
+/**
+ * @file hss_cache_processor_test.cpp UT for HssCacheProcessor.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <set>
+
+#include "test_utils.hpp"
+
+#include "hss_cache_processor.h"
+#include "fake_implicit_reg_set.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string ASSOC_IMPU = "sip:assoc_impu@example.com";
+static const std::string OTHER_IMPU = "sip:other_impu@example.com";
+
+typedef SingleFlight<std::string, HssCacheProcessor::irs_callbacks>::FlightPtr IrsFlight;
+
+class HssCacheProcessorTest : public testing::Test
+{
+public:
+  HssCacheProcessorTest() : _processor(NULL) {}
+
+  // Joins the IRS get in flight for the IMPU, returning the flight if this
+  // request started it.
+  IrsFlight join(const std::string& impu, int* result)
+  {
+    return _processor._irs_gets.join(
+      impu,
+      HssCacheProcessor::irs_callbacks(
+        [result](ImplicitRegistrationSet* irs) { *result = 1; delete irs; },
+        [result](Store::Status rc) { *result = -1; }));
+  }
+
+  HssCacheProcessor _processor;
+};
+
+TEST_F(HssCacheProcessorTest, JoinAfterWriteStartsNewFlight)
+{
+  FakeImplicitRegistrationSet irs(IMPU);
+  irs.set_associated_impus({ ASSOC_IMPU });
+
+  int first = 0;
+  int joined = 0;
+  int other = 0;
+  IrsFlight flight = join(ASSOC_IMPU, &first);
+  ASSERT_TRUE(flight != nullptr);
+  EXPECT_TRUE(join(ASSOC_IMPU, &joined) == nullptr);
+  IrsFlight other_flight = join(OTHER_IMPU, &other);
+  ASSERT_TRUE(other_flight != nullptr);
+
+  // A write to the IRS detaches the lookup for its associated IMPU, even
+  // though it wasn't the default IMPU that was requested, but not lookups
+  // for other subscribers.
+  _processor.detach_irs(&irs);
+
+  int after = 0;
+  IrsFlight new_flight = join(ASSOC_IMPU, &after);
+  EXPECT_TRUE(new_flight != nullptr);
+  EXPECT_TRUE(join(OTHER_IMPU, &other) == nullptr);
+
+  // The requests that joined before the write still get the old result, but
+  // the one after it doesn't.
+  std::vector<HssCacheProcessor::irs_callbacks> callbacks =
+    _processor._irs_gets.complete(ASSOC_IMPU, flight);
+  EXPECT_EQ(2u, callbacks.size());
+  for (HssCacheProcessor::irs_callbacks& cbs : callbacks)
+  {
+    cbs.second(Store::Status::NOT_FOUND);
+  }
+  EXPECT_EQ(-1, first);
+  EXPECT_EQ(-1, joined);
+  EXPECT_EQ(0, after);
+
+  _processor._irs_gets.complete(ASSOC_IMPU, new_flight);
+  _processor._irs_gets.complete(OTHER_IMPU, other_flight);
+}
+
+TEST_F(HssCacheProcessorTest, ShardForKey)
+{
+  // With a single shard, every request goes to it
+  _processor._thread_pools = { NULL };
+  EXPECT_EQ(0u, _processor.shard_for_key(IMPU));
+  EXPECT_EQ(0u, _processor.shard_for_key(""));
+
+  // With several, requests for the same key always go to the same shard,
+  // and different keys are spread between the shards.
+  _processor._thread_pools = { NULL, NULL, NULL, NULL };
+  std::set<size_t> shards;
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    std::string impu = "sip:impu" + std::to_string(ii) + "@example.com";
+    size_t shard = _processor.shard_for_key(impu);
+    EXPECT_LT(shard, 4u);
+    EXPECT_EQ(shard, _processor.shard_for_key(impu));
+    shards.insert(shard);
+  }
+
+  EXPECT_EQ(4u, shards.size());
+  _processor._thread_pools.clear();
+}
+
+TEST_F(HssCacheProcessorTest, ThreadsForShard)
+{
+  // The threads left over from an even split go to the first shards, so none
+  // are lost.
+  int total = 0;
+
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    int threads = HssCacheProcessor::threads_for_shard(50, 8, ii);
+    EXPECT_EQ((ii < 2) ? 7 : 6, threads);
+    total += threads;
+  }
+
+  EXPECT_EQ(50, total);
+
+  // Every shard gets at least one thread
+  EXPECT_EQ(1, HssCacheProcessor::threads_for_shard(2, 4, 3));
+  EXPECT_EQ(10, HssCacheProcessor::threads_for_shard(10, 1, 0));
+}
+
+class SummingQueueSizeTable : public SNMP::EventAccumulatorByScopeTable
+{
+public:
+  virtual void accumulate(uint32_t sample) override { total += sample; }
+  uint32_t total = 0;
+};
+
+TEST_F(HssCacheProcessorTest, ShardQueueSizeReportedToBothTables)
+{
+  SummingQueueSizeTable all_shards;
+  SummingQueueSizeTable shard;
+
+  HssCacheProcessor::ShardQueueSizeTable table(&all_shards, &shard);
+  table.accumulate(3);
+  table.accumulate(4);
+
+  EXPECT_EQ(7u, all_shards.total);
+  EXPECT_EQ(7u, shard.total);
+
+  // The table for all the shards is optional
+  HssCacheProcessor::ShardQueueSizeTable shard_only(nullptr, &shard);
+  shard_only.accumulate(1);
+  EXPECT_EQ(8u, shard.total);
+}
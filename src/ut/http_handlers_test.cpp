@@ -1416,6 +1416,211 @@ TEST_F(HTTPHandlersTest, ImpuReadRegDataMainline)
   EXPECT_EQ(REGDATA_READ_RESULT, req.content());
 }
 
+TEST_F(HTTPHandlersTest, ImpuReadRegDataRenderedCache)
+{
+  // Test that repeated GETs of an unchanged IRS are served from the cache of
+  // rendered documents.
+  XmlUtils::ClearwaterRegDataCache reg_data_cache(10);
+  ImpuRegDataTask::Config cfg(true, 3600, 7200, true, &reg_data_cache);
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    MockHttpStack::Request req(_httpstack,
+                               "/impu/" + IMPU + "/reg-data",
+                               "",
+                               "",
+                               "",
+                               htp_method_GET);
+    ImpuReadRegDataTask* task = new ImpuReadRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+    FakeImplicitRegistrationSet* irs = new FakeImplicitRegistrationSet(IMPU);
+    irs->add_associated_impi(IMPI);
+    irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+    irs->set_reg_state(RegistrationState::REGISTERED);
+    irs->set_version(1);
+
+    EXPECT_CALL(*_cache, get_implicit_registration_set_for_impu(_, _, IMPU, FAKE_TRAIL_ID, _))
+      .WillOnce(InvokeArgument<0>(irs));
+    EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+
+    task->run();
+
+    if (ii == 0)
+    {
+      EXPECT_EQ(REGDATA_READ_RESULT, req.content());
+
+      // Tamper with the cached document, to check that the second GET is
+      // served from it.
+      ASSERT_EQ(1u, reg_data_cache._entries.size());
+      reg_data_cache._entries.begin()->second.xml = "cached";
+    }
+    else
+    {
+      EXPECT_EQ("cached", req.content());
+    }
+  }
+}
+
+TEST_F(HTTPHandlersTest, ImpuReadRegDataNotModified)
+{
+  // Test that a GET whose If-None-Match matches the version and state of the
+  // IRS gets a 304 with no body.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuReadRegDataTask* task = new ImpuReadRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  FakeImplicitRegistrationSet* irs = new FakeImplicitRegistrationSet(IMPU);
+  irs->add_associated_impi(IMPI);
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+  irs->set_reg_state(RegistrationState::REGISTERED);
+  irs->set_version(7);
+  req.add_header_to_incoming_req("If-None-Match",
+                                 ImpuRegDataTask::reg_data_etag(irs));
+
+  EXPECT_CALL(*_cache, get_implicit_registration_set_for_impu(_, _, IMPU, FAKE_TRAIL_ID, _))
+    .WillOnce(InvokeArgument<0>(irs));
+  EXPECT_CALL(*_httpstack, send_reply(_, 304, _));
+
+  task->run();
+
+  EXPECT_EQ("", req.content());
+}
+
+TEST_F(HTTPHandlersTest, ImpuReadRegDataNotModifiedWeakList)
+{
+  // Test that If-None-Match can hold a list of tags, which are compared
+  // weakly.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuReadRegDataTask* task = new ImpuReadRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  FakeImplicitRegistrationSet* irs = new FakeImplicitRegistrationSet(IMPU);
+  irs->add_associated_impi(IMPI);
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+  irs->set_reg_state(RegistrationState::UNREGISTERED);
+  irs->set_version(7);
+  req.add_header_to_incoming_req("If-None-Match",
+                                 "\"6-0-0000000000000000\", W/" +
+                                 ImpuRegDataTask::reg_data_etag(irs));
+
+  EXPECT_CALL(*_cache, get_implicit_registration_set_for_impu(_, _, IMPU, FAKE_TRAIL_ID, _))
+    .WillOnce(InvokeArgument<0>(irs));
+  EXPECT_CALL(*_httpstack, send_reply(_, 304, _));
+
+  task->run();
+
+  EXPECT_EQ("", req.content());
+}
+
+TEST_F(HTTPHandlersTest, ImpuReadRegDataModified)
+{
+  // Test that a GET whose If-None-Match doesn't match the IRS (here, because
+  // the registration state has changed) gets the full document.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuReadRegDataTask* task = new ImpuReadRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  FakeImplicitRegistrationSet* irs = new FakeImplicitRegistrationSet(IMPU);
+  irs->add_associated_impi(IMPI);
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+  irs->set_reg_state(RegistrationState::UNREGISTERED);
+  irs->set_version(7);
+  req.add_header_to_incoming_req("If-None-Match",
+                                 ImpuRegDataTask::reg_data_etag(irs));
+  irs->set_reg_state(RegistrationState::REGISTERED);
+
+  EXPECT_CALL(*_cache, get_implicit_registration_set_for_impu(_, _, IMPU, FAKE_TRAIL_ID, _))
+    .WillOnce(InvokeArgument<0>(irs));
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+
+  task->run();
+
+  EXPECT_EQ(REGDATA_READ_RESULT, req.content());
+}
+
+TEST_F(HTTPHandlersTest, ImpuReadRegDataContentModified)
+{
+  // Test that a GET whose If-None-Match has the same version and state as
+  // the IRS, but was for different contents, gets the full document.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuReadRegDataTask* task = new ImpuReadRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  FakeImplicitRegistrationSet* irs = new FakeImplicitRegistrationSet(IMPU);
+  irs->add_associated_impi(IMPI);
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+  irs->set_reg_state(RegistrationState::REGISTERED);
+  irs->set_charging_addresses(FULL_CHARGING_ADDRESSES);
+  irs->set_version(7);
+  req.add_header_to_incoming_req("If-None-Match",
+                                 ImpuRegDataTask::reg_data_etag(irs));
+
+  // The charging addresses change, but the IRS has the same version.
+  irs->set_charging_addresses(NO_CHARGING_ADDRESSES);
+  std::string etag = ImpuRegDataTask::reg_data_etag(irs);
+  EXPECT_NE(req.header("If-None-Match"), etag);
+
+  // As does the IMS subscription.
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION2);
+  EXPECT_NE(etag, ImpuRegDataTask::reg_data_etag(irs));
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+
+  EXPECT_CALL(*_cache, get_implicit_registration_set_for_impu(_, _, IMPU, FAKE_TRAIL_ID, _))
+    .WillOnce(InvokeArgument<0>(irs));
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+
+  task->run();
+
+  EXPECT_EQ(REGDATA_READ_RESULT, req.content());
+}
+
+TEST_F(HTTPHandlersTest, ImpuReadRegDataNoVersion)
+{
+  // Test that an IRS without a version can't be matched, even by "*".
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  req.add_header_to_incoming_req("If-None-Match", "*");
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuReadRegDataTask* task = new ImpuReadRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  FakeImplicitRegistrationSet* irs = new FakeImplicitRegistrationSet(IMPU);
+  irs->add_associated_impi(IMPI);
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+  irs->set_reg_state(RegistrationState::REGISTERED);
+
+  EXPECT_CALL(*_cache, get_implicit_registration_set_for_impu(_, _, IMPU, FAKE_TRAIL_ID, _))
+    .WillOnce(InvokeArgument<0>(irs));
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+
+  task->run();
+
+  EXPECT_EQ(REGDATA_READ_RESULT, req.content());
+}
+
 TEST_F(HTTPHandlersTest, ImpuReadRegDataCacheGetNotFound)
 {
   // Test that GET request not foudn in cache results in 404
@@ -2156,6 +2361,36 @@ TEST_F(HTTPHandlersTest, ImpuRegDataCallMainline)
   EXPECT_EQ(REGDATA_RESULT_WAS_REG, req.content());
 }
 
+TEST_F(HTTPHandlersTest, ImpuRegDataCallIfNoneMatch)
+{
+  // Tests that If-None-Match is ignored on a PUT, even if it matches the IRS
+  MockHttpStack::Request req = make_request("call", true, false, false);
+
+  ImpuRegDataTask::Config cfg(true, 3600, 7200);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Create IRS to be returned from the cache
+  FakeImplicitRegistrationSet* irs = new FakeImplicitRegistrationSet(IMPU);
+  irs->set_ims_sub_xml(IMPU_IMS_SUBSCRIPTION);
+  irs->set_reg_state(RegistrationState::REGISTERED);
+  irs->set_charging_addresses(NO_CHARGING_ADDRESSES);
+  irs->add_associated_impi(IMPI);
+  irs->set_version(7);
+  req.add_header_to_incoming_req("If-None-Match",
+                                 ImpuRegDataTask::reg_data_etag(irs));
+
+  // Set up the cache to return our IRS
+  EXPECT_CALL(*_cache, get_implicit_registration_set_for_impu(_, _, IMPU, FAKE_TRAIL_ID, _))
+    .WillOnce(InvokeArgument<0>(irs));
+
+  // Check the response
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+
+  task->run();
+
+  EXPECT_EQ(REGDATA_RESULT_WAS_REG, req.content());
+}
+
 TEST_F(HTTPHandlersTest, ImpuRegDataCallWildcard)
 {
   // Tests a "call" request for a wildcard impu
@@ -0,0 +1,155 @@
+/**
+ * @file impu_dictionary_test.cpp UT for IMPU dictionary training and loading
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "impu_dictionary.h"
+#include "impu_store.h"
+#include "test_utils.hpp"
+
+static const std::string COMMON =
+  "<ApplicationServer><ServerName>sip:as.example.com</ServerName>"
+  "<DefaultHandling>0</DefaultHandling></ApplicationServer>";
+
+// Builds num samples, each made up of the common string surrounded by data
+// unique to the sample.
+static std::vector<std::string> make_samples(int num)
+{
+  std::vector<std::string> samples;
+
+  for (int ii = 0; ii < num; ++ii)
+  {
+    samples.push_back("{\"impu\":\"sip:" + std::to_string(ii * 7919) +
+                      "@example.com\"," + COMMON + "\"expiry\":" +
+                      std::to_string(ii * 104729) + "}");
+  }
+
+  return samples;
+}
+
+static std::string read_file(const std::string& path)
+{
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+static void write_file(const std::string& path, const std::string& contents)
+{
+  std::ofstream file(path, std::ios::out | std::ios::binary);
+  file << contents;
+}
+
+class ImpuDictionaryTest : public ::testing::Test
+{
+  void SetUp()
+  {
+    char dir_template[] = "/tmp/impu_dictionary_test.XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir_template));
+    dir = dir_template;
+  }
+
+  void TearDown()
+  {
+    for (const std::string& file : files)
+    {
+      unlink(file.c_str());
+    }
+
+    rmdir(dir.c_str());
+  }
+
+  std::string file(const std::string& name)
+  {
+    files.push_back(dir + "/" + name);
+    return files.back();
+  }
+
+  std::string dir;
+  std::vector<std::string> files;
+};
+
+TEST_F(ImpuDictionaryTest, TrainFindsCommonStrings)
+{
+  std::vector<std::string> samples = make_samples(20);
+  std::string dictionary = ImpuDictionaryTrainer::train(samples, 65536);
+
+  // The common string is in the dictionary once, and nothing unique to a
+  // sample is in it
+  EXPECT_NE(std::string::npos, dictionary.find(COMMON));
+  EXPECT_EQ(dictionary.find(COMMON), dictionary.rfind(COMMON));
+  EXPECT_EQ(std::string::npos, dictionary.find(std::to_string(19 * 104729)));
+}
+
+TEST_F(ImpuDictionaryTest, TrainMaxSize)
+{
+  std::string dictionary = ImpuDictionaryTrainer::train(make_samples(20), 32);
+
+  EXPECT_FALSE(dictionary.empty());
+  EXPECT_LE(dictionary.size(), 32);
+  EXPECT_NE(std::string::npos, make_samples(1)[0].find(dictionary));
+}
+
+TEST_F(ImpuDictionaryTest, TrainNothingInCommon)
+{
+  EXPECT_EQ("", ImpuDictionaryTrainer::train({}, 65536));
+  EXPECT_EQ("", ImpuDictionaryTrainer::train(make_samples(20), 8));
+  EXPECT_EQ("", ImpuDictionaryTrainer::train({ "short", "strings" }, 65536));
+  EXPECT_EQ("",
+            ImpuDictionaryTrainer::train({ "abcdefghijklmnopqrstuvwxyz",
+                                           "ABCDEFGHIJKLMNOPQRSTUVWXYZ" },
+                                         65536));
+}
+
+TEST_F(ImpuDictionaryTest, TrainerWritesDictionary)
+{
+  std::string output = file("trained.dict");
+  ImpuDictionaryTrainer trainer(output, 3, 65536);
+  std::vector<std::string> samples = make_samples(3);
+
+  trainer.add_sample("impu0", samples[0]);
+  trainer.add_sample("impu1", samples[1]);
+
+  // Only the first sample for each key is used
+  trainer.add_sample("impu1", samples[2]);
+  EXPECT_TRUE(trainer.wants_samples());
+  EXPECT_NE(0, access(output.c_str(), F_OK));
+
+  // The last sample starts training in the background
+  trainer.add_sample("impu2", samples[2]);
+  EXPECT_FALSE(trainer.wants_samples());
+  trainer.wait_for_training();
+  EXPECT_EQ(ImpuDictionaryTrainer::train(samples, 65536), read_file(output));
+}
+
+TEST_F(ImpuDictionaryTest, LoadDictionaries)
+{
+  write_file(file("11.dict"), COMMON);
+  write_file(file("12.txt"), COMMON);
+  write_file(file("thirteen.dict"), COMMON);
+  write_file(file("300.dict"), COMMON);
+  write_file(file("14.dict"), "");
+
+  EXPECT_EQ(1, load_impu_dictionaries(dir));
+  EXPECT_TRUE(ImpuStore::Impu::has_dictionary(11));
+  EXPECT_FALSE(ImpuStore::Impu::has_dictionary(12));
+  EXPECT_FALSE(ImpuStore::Impu::has_dictionary(14));
+}
+
+TEST_F(ImpuDictionaryTest, LoadDictionariesNoDirectory)
+{
+  EXPECT_EQ(0, load_impu_dictionaries(dir + "/missing"));
+}
@@ -9,6 +9,8 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <functional>
+
 #include "impu_store.h"
 #include "localstore.h"
 #include "test_interposer.hpp"
@@ -16,6 +18,7 @@
 
 static const std::string IMPU = "sip:impu@example.com";
 static const std::string ASSOC_IMPU = "sip:assoc_impu@example.com";
+static const std::string IMPU_2 = "sip:impu_2@example.com";
 static const std::vector<std::string> NO_ASSOCIATED_IMPUS;
 static const std::vector<std::string> IMPUS = { IMPU };
 static const ChargingAddresses NO_CHARGING_ADDRESSES = ChargingAddresses({}, {});
@@ -206,6 +209,158 @@ TEST_F(ImpuStoreTest, GetDefaultImpu)
   delete local_store;
 }
 
+// Decodes reuse per-thread buffers, so check that decoding a large record and
+// then a smaller one gets the right data for each, including when the JSON
+// DOM is too big for the thread's memory pool.
+TEST_F(ImpuStoreTest, GetDefaultImpusOfDifferentSizes)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  std::vector<std::string> many_impis;
+  for (int i = 0; i < 2000; ++i)
+  {
+    many_impis.push_back("impi" + std::to_string(i) + "@example.com");
+  }
+
+  std::string large_service_profile = SERVICE_PROFILE + std::string(100000, 'x');
+
+  ImpuStore::DefaultImpu* large_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               NO_ASSOCIATED_IMPUS,
+                               many_impis,
+                               RegistrationState::REGISTERED,
+                               NO_CHARGING_ADDRESSES,
+                               large_service_profile,
+                               0L,
+                               expiry,
+                               impu_store);
+  impu_store->set_impu(large_impu, 0);
+  delete large_impu;
+
+  ImpuStore::DefaultImpu* small_impu =
+    new ImpuStore::DefaultImpu(ASSOC_IMPU,
+                               NO_ASSOCIATED_IMPUS,
+                               IMPIS,
+                               RegistrationState::UNREGISTERED,
+                               NO_CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               impu_store);
+  impu_store->set_impu(small_impu, 0);
+  delete small_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(many_impis, ((ImpuStore::DefaultImpu*)got_impu)->impis);
+  EXPECT_EQ(large_service_profile,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+  delete got_impu; got_impu = nullptr;
+
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(IMPIS, ((ImpuStore::DefaultImpu*)got_impu)->impis);
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+  EXPECT_EQ(RegistrationState::UNREGISTERED,
+            ((ImpuStore::DefaultImpu*)got_impu)->registration_state);
+  delete got_impu;
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetImpus)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               { ASSOC_IMPU },
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               NO_CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               impu_store);
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(default_impu, 0);
+  impu_store->set_impu(assoc_impu, 0);
+
+  delete default_impu;
+  delete assoc_impu;
+
+  // Look up both IMPUs (one of them twice) and one that doesn't exist. We get
+  // back one entry for each IMPU that was found.
+  std::vector<ImpuStore::Impu*> got_impus;
+  Store::Status status =
+    impu_store->get_impus({ IMPU, "sip:unknown@example.com", ASSOC_IMPU, IMPU },
+                          got_impus,
+                          0L);
+
+  ASSERT_EQ(Store::Status::OK, status);
+  ASSERT_EQ(2, got_impus.size());
+  ASSERT_EQ(IMPU, got_impus[0]->impu);
+  ASSERT_TRUE(got_impus[0]->is_default_impu());
+  ASSERT_EQ(ASSOC_IMPU, got_impus[1]->impu);
+  ASSERT_FALSE(got_impus[1]->is_default_impu());
+
+  for (ImpuStore::Impu* impu : got_impus)
+  {
+    delete impu;
+  }
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetImpusInvalidData)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  time(0) + 1,
+                                  impu_store);
+  impu_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  local_store->set_data("impu",
+                        IMPU,
+                        INVALID_JSON,
+                        0,
+                        1,
+                        0L);
+
+  // If any of the IMPUs can't be read, the whole batch fails
+  std::vector<ImpuStore::Impu*> got_impus;
+  Store::Status status =
+    impu_store->get_impus({ ASSOC_IMPU, IMPU }, got_impus, 0L);
+
+  ASSERT_EQ(Store::Status::ERROR, status);
+  ASSERT_TRUE(got_impus.empty());
+
+  delete impu_store;
+  delete local_store;
+}
+
 TEST_F(ImpuStoreTest, SetAssociatedImpu)
 {
   LocalStore* local_store = new LocalStore();
@@ -399,11 +554,10 @@ TEST_F(ImpuStoreVersion0Test, InvalidCompressData)
 TEST_F(ImpuStoreVersion0Test, InvalidJson)
 {
   encode_varbyte(INVALID_JSON.size(), data);
-  char* buffer = nullptr;
+  const char* buffer = nullptr;
   int comp_size;
   ImpuStore::Impu::compress_data_v0(INVALID_JSON, buffer, comp_size);
   data.append(buffer, comp_size);
-  free(buffer);
 
   ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
 }
@@ -411,13 +565,12 @@ TEST_F(ImpuStoreVersion0Test, InvalidJson)
 TEST_F(ImpuStoreVersion0Test, NotJsonObject)
 {
   encode_varbyte(JSON_ARRAY.size(), data);
-  char* buffer;
+  const char* buffer;
   int comp_size;
   ImpuStore::Impu::compress_data_v0(JSON_ARRAY, buffer, comp_size);
   data.append(buffer, comp_size);
 
   ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
-  free(buffer);
 }
 
 TEST_F(ImpuStoreVersion0Test, BufferResize)
@@ -430,116 +583,1189 @@ TEST_F(ImpuStoreVersion0Test, BufferResize)
     data.push_back((i % length) + 34);
   }
 
-  char* buffer = nullptr;
+  const char* buffer = nullptr;
   int comp_size;
   ImpuStore::Impu::compress_data_v0(data, buffer, comp_size);
-  free(buffer);
+  EXPECT_GT(comp_size, 0);
+
+  // The thread's buffer is big enough for the large data, and compressing
+  // something small afterwards still gives the right answer.
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      NO_ASSOCIATED_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+  std::string record;
+  ASSERT_EQ(Store::Status::OK, default_impu.to_data(record));
+
+  ImpuStore::Impu* got_impu = ImpuStore::Impu::from_data(IMPU, record, 0, nullptr);
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+  delete got_impu;
 }
 
-TEST_F(ImpuStoreTest, ImpiMappingInvalidJson)
+class ImpuStoreVersion1Test : public ImpuStoreTest
 {
-  ASSERT_EQ(nullptr,
-            ImpuStore::ImpiMapping::from_data(IMPI,
-                                              INVALID_JSON,
-                                              0L));
-}
+  void SetUp()
+  {
+    data.push_back((char) ImpuStore::DATA_VERSION_BINARY);
+  }
 
-TEST_F(ImpuStoreTest, ImpiMappingNotJsonObject)
-{
-  ASSERT_EQ(nullptr,
-            ImpuStore::ImpiMapping::from_data(IMPI,
-                                              JSON_ARRAY,
-                                              0L));
-}
+  void TearDown()
+  {
+    data.clear();
+  }
 
-TEST_F(ImpuStoreTest, ImpuNotFound)
+  std::string data;
+};
+
+TEST_F(ImpuStoreVersion1Test, DefaultImpuRoundTrip)
 {
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ImpuStore* impu_store =
+    new ImpuStore(local_store, 0, 0, ImpuStore::DATA_VERSION_BINARY);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               { ASSOC_IMPU },
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               ChargingAddresses({ "ccf1", "ccf2" }, { "ecf" }),
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               impu_store);
+
+  EXPECT_EQ(Store::Status::OK,
+            impu_store->set_impu(default_impu, 0));
+
+  // The record is stored in the binary format
+  std::string stored;
+  uint64_t cas;
+  local_store->get_data("impu", IMPU, stored, cas, 0L);
+  ASSERT_FALSE(stored.empty());
+  EXPECT_EQ(ImpuStore::DATA_VERSION_BINARY, stored[0]);
 
   ImpuStore::Impu* got_impu = nullptr;
-  Store::Status status = impu_store->get_impu(IMPU, got_impu, 0L);
-  ASSERT_EQ(status, Store::Status::NOT_FOUND);
-  ASSERT_EQ(nullptr, got_impu);
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_TRUE(got_impu->is_default_impu());
+
+  ImpuStore::DefaultImpu* got = (ImpuStore::DefaultImpu*)got_impu;
+  EXPECT_EQ(IMPU, got->impu);
+  EXPECT_EQ(expiry, got->expiry);
+  EXPECT_EQ(RegistrationState::REGISTERED, got->registration_state);
+  EXPECT_EQ(std::vector<std::string>({ ASSOC_IMPU }), got->associated_impus);
+  EXPECT_EQ(IMPIS, got->impis);
+  EXPECT_EQ(std::deque<std::string>({ "ccf1", "ccf2" }), got->charging_addresses.ccfs);
+  EXPECT_EQ(std::deque<std::string>({ "ecf" }), got->charging_addresses.ecfs);
+  EXPECT_EQ(SERVICE_PROFILE, got->service_profile);
 
+  delete got_impu;
+  delete default_impu;
   delete impu_store;
   delete local_store;
 }
 
-TEST_F(ImpuStoreTest, ImpiMappingNotFound)
+TEST_F(ImpuStoreVersion1Test, AssociatedImpuRoundTrip)
 {
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ImpuStore* impu_store =
+    new ImpuStore(local_store, 0, 0, ImpuStore::DATA_VERSION_BINARY);
 
-  ImpuStore::ImpiMapping* mapping = nullptr;
-  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
-  ASSERT_EQ(nullptr, mapping);
-  ASSERT_EQ(status, Store::Status::NOT_FOUND);
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, 0L, expiry, impu_store);
+
+  EXPECT_EQ(Store::Status::OK,
+            impu_store->set_impu(assoc_impu, 0));
 
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_FALSE(got_impu->is_default_impu());
+  EXPECT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
+  EXPECT_EQ(expiry, got_impu->expiry);
+
+  delete got_impu;
+  delete assoc_impu;
   delete impu_store;
   delete local_store;
 }
 
-TEST_F(ImpuStoreTest, ImpiMappingBadJson)
+TEST_F(ImpuStoreVersion1Test, ReadsVersion0)
 {
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
-  local_store->set_data("impi_mapping",
-                        IMPI,
-                        INVALID_JSON,
-                        0,
-                        1,
-                        0L);
+  ImpuStore* v0_store = new ImpuStore(local_store);
+  ImpuStore* v1_store =
+    new ImpuStore(local_store, 0, 0, ImpuStore::DATA_VERSION_BINARY);
 
-  ImpuStore::ImpiMapping* mapping = nullptr;
-  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
-  ASSERT_EQ(nullptr, mapping);
-  ASSERT_EQ(status, Store::Status::ERROR);
+  int expiry = time(0) + 1;
 
-  delete impu_store;
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               NO_ASSOCIATED_IMPUS,
+                               IMPIS,
+                               RegistrationState::UNREGISTERED,
+                               NO_CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               v0_store);
+
+  EXPECT_EQ(Store::Status::OK, v0_store->set_impu(default_impu, 0));
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, v1_store->get_impu(IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+  EXPECT_EQ(RegistrationState::UNREGISTERED,
+            ((ImpuStore::DefaultImpu*)got_impu)->registration_state);
+
+  delete got_impu;
+  delete default_impu;
+  delete v1_store;
+  delete v0_store;
   delete local_store;
 }
 
-TEST_F(ImpuStoreTest, ImpuSetWithoutCas)
+TEST_F(ImpuStoreVersion1Test, NoType)
 {
-  LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
 
-  int expiry = time(0) + 1;
+TEST_F(ImpuStoreVersion1Test, UnknownType)
+{
+  data.push_back((char) 5);
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
 
-  ImpuStore::AssociatedImpu* assoc_impu =
-    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
-                                  IMPU,
-                                  0L,
-                                  expiry,
-                                  impu_store);
+TEST_F(ImpuStoreVersion1Test, Truncated)
+{
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      { ASSOC_IMPU },
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+  std::string full;
+  default_impu.to_data(full, ImpuStore::DATA_VERSION_BINARY);
+
+  // Every prefix of the record is invalid
+  for (size_t length = 1; length < full.size(); ++length)
+  {
+    std::string truncated = full.substr(0, length);
+    ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, truncated, 0, nullptr));
+  }
 
-  ASSERT_EQ(Store::Status::OK,
-            impu_store->set_impu_without_cas(assoc_impu, 0));
+  // As is the record with data on the end
+  full.push_back('x');
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, full, 0, nullptr));
+}
 
-  delete assoc_impu;
-  delete impu_store;
-  delete local_store;
+TEST_F(ImpuStoreVersion1Test, IntegerTooLong)
+{
+  // An associated IMPU whose expiry has more bytes than fit in 64 bits
+  data.push_back((char) 1);
+  for (int i = 0; i < 10; ++i)
+  {
+    data.push_back((char) 0xff);
+  }
+  data.push_back((char) 0x01);
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
 }
 
-TEST_F(ImpuStoreTest, DeleteImpu)
+// Trained dictionaries last as long as the process, so each test that loads
+// one uses its own ID.
+TEST_F(ImpuStoreTest, TrainedDictionaryRoundTrip)
 {
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ImpuStore* impu_store =
+    new ImpuStore(local_store, 0, 0, ImpuStore::DATA_VERSION_TRAINED_LZ4, 7);
 
   int expiry = time(0) + 1;
 
-  ImpuStore::AssociatedImpu* assoc_impu =
-    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
-                                  IMPU,
-                                  0L,
-                                  expiry,
-                                  impu_store);
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               { ASSOC_IMPU },
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               NO_CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               impu_store);
 
-  ASSERT_EQ(Store::Status::OK,
-            impu_store->delete_impu(assoc_impu, 0));
+  // Train the dictionary on the IMPU itself, so it compresses better than
+  // with the version 0 dictionary.
+  ASSERT_TRUE(ImpuStore::Impu::add_dictionary(7, default_impu->to_json()));
+  EXPECT_TRUE(ImpuStore::Impu::has_dictionary(7));
 
-  delete assoc_impu;
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(default_impu, 0));
+
+  std::string stored;
+  uint64_t cas;
+  local_store->get_data("impu", IMPU, stored, cas, 0L);
+  ASSERT_TRUE(stored.size() > 2);
+  EXPECT_EQ(ImpuStore::DATA_VERSION_TRAINED_LZ4, stored[0]);
+  EXPECT_EQ(7, stored[1]);
+
+  std::string v0_data;
+  ASSERT_EQ(Store::Status::OK, default_impu->to_data(v0_data));
+  EXPECT_LT(stored.size(), v0_data.size());
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_TRUE(got_impu->is_default_impu());
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+  EXPECT_EQ(std::vector<std::string>({ ASSOC_IMPU }),
+            ((ImpuStore::DefaultImpu*)got_impu)->associated_impus);
+
+  delete got_impu;
+  delete default_impu;
   delete impu_store;
   delete local_store;
 }
+
+TEST_F(ImpuStoreTest, TrainedDictionaryNotLoaded)
+{
+  // Writing with a dictionary that isn't loaded falls back to version 0
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store =
+    new ImpuStore(local_store, 0, 0, ImpuStore::DATA_VERSION_TRAINED_LZ4, 8);
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, 0L, time(0) + 1, impu_store);
+
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(assoc_impu, 0));
+
+  std::string stored;
+  uint64_t cas;
+  local_store->get_data("impu", ASSOC_IMPU, stored, cas, 0L);
+  ASSERT_FALSE(stored.empty());
+  EXPECT_EQ(ImpuStore::DATA_VERSION_JSON_LZ4, stored[0]);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
+
+  // Reading data written with a dictionary that isn't loaded fails
+  std::string data;
+  data.push_back((char) ImpuStore::DATA_VERSION_TRAINED_LZ4);
+  EXPECT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+  data.push_back((char) 8);
+  data.append(stored.substr(1));
+  EXPECT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+
+  delete got_impu;
+  delete assoc_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, AddInvalidDictionary)
+{
+  std::string dictionary = "\"service_profile\":\"<IMSSubscription>";
+
+  EXPECT_FALSE(ImpuStore::Impu::add_dictionary(0, dictionary));
+  EXPECT_FALSE(ImpuStore::Impu::add_dictionary(256, dictionary));
+  EXPECT_FALSE(ImpuStore::Impu::add_dictionary(9, ""));
+  EXPECT_FALSE(ImpuStore::Impu::add_dictionary(
+                 9,
+                 std::string(ImpuStore::Impu::MAX_DICTIONARY_SIZE + 1, 'x')));
+  EXPECT_FALSE(ImpuStore::Impu::has_dictionary(9));
+
+  // A dictionary can be loaded again, but not changed
+  EXPECT_TRUE(ImpuStore::Impu::add_dictionary(9, dictionary));
+  EXPECT_TRUE(ImpuStore::Impu::add_dictionary(9, dictionary));
+  EXPECT_FALSE(ImpuStore::Impu::add_dictionary(9, dictionary + "x"));
+}
+
+class ImpuStoreSharedProfileTest : public ImpuStoreTest
+{
+  void SetUp()
+  {
+    local_store = new LocalStore();
+    impu_store = new ImpuStore(local_store, 0, 0,
+                               ImpuStore::DATA_VERSION_JSON_LZ4, 0,
+                               true, 10);
+  }
+
+  void TearDown()
+  {
+    delete impu_store;
+    delete local_store;
+  }
+
+  ImpuStore::DefaultImpu* make_impu(const std::string& impu,
+                                    const std::string& service_profile,
+                                    int ttl = 300)
+  {
+    return new ImpuStore::DefaultImpu(impu,
+                                      NO_ASSOCIATED_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      service_profile,
+                                      0L,
+                                      time(0) + ttl,
+                                      impu_store);
+  }
+
+  // Gets the expiry that the shared service profile is stored with, or 0 if
+  // it isn't stored.
+  int64_t get_stored_profile_expiry(const std::string& profile)
+  {
+    std::string data;
+    uint64_t cas;
+    std::string stored;
+    int64_t expiry = 0;
+
+    if ((local_store->get_data("service_profile",
+                               ImpuStore::hash_service_profile(profile),
+                               data,
+                               cas,
+                               0L) != Store::Status::OK) ||
+        (!ImpuStore::decode_service_profile(data, stored, expiry)))
+    {
+      return 0;
+    }
+
+    EXPECT_EQ(profile, stored);
+    return expiry;
+  }
+
+  // Decodes the IMPU as stored, without filling in a shared service profile
+  ImpuStore::DefaultImpu* get_stored_impu(const std::string& impu)
+  {
+    std::string data;
+    uint64_t cas;
+    local_store->get_data("impu", impu, data, cas, 0L);
+    return (ImpuStore::DefaultImpu*)ImpuStore::Impu::from_data(impu, data, cas, nullptr);
+  }
+
+  LocalStore* local_store;
+  ImpuStore* impu_store;
+};
+
+TEST_F(ImpuStoreSharedProfileTest, ServiceProfileShared)
+{
+  ImpuStore::DefaultImpu* impu_1 = make_impu(IMPU, SERVICE_PROFILE);
+  ImpuStore::DefaultImpu* impu_2 = make_impu(ASSOC_IMPU, SERVICE_PROFILE);
+  std::string hash = ImpuStore::hash_service_profile(SERVICE_PROFILE);
+
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu_1, 0L));
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu_2, 0L));
+
+  // The IMPUs are stored with a reference to the service profile, which is
+  // stored separately
+  ImpuStore::DefaultImpu* stored = get_stored_impu(ASSOC_IMPU);
+  ASSERT_NE(nullptr, stored);
+  EXPECT_EQ("", stored->service_profile);
+  EXPECT_EQ(hash, stored->service_profile_hash);
+  delete stored;
+
+  std::string data;
+  uint64_t cas;
+  EXPECT_EQ(Store::Status::OK,
+            local_store->get_data("service_profile", hash, data, cas, 0L));
+
+  // Reading the IMPU fills in the service profile, whether or not the
+  // reading store shares service profiles
+  ImpuStore* other_store = new ImpuStore(local_store);
+
+  for (ImpuStore* store : { impu_store, other_store })
+  {
+    ImpuStore::Impu* got_impu = nullptr;
+    ASSERT_EQ(Store::Status::OK, store->get_impu(IMPU, got_impu, 0L));
+    ASSERT_NE(nullptr, got_impu);
+    EXPECT_EQ(SERVICE_PROFILE,
+              ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+    delete got_impu;
+  }
+
+  delete other_store;
+  delete impu_1;
+  delete impu_2;
+}
+
+TEST_F(ImpuStoreSharedProfileTest, ServiceProfileSharedBinary)
+{
+  ImpuStore* binary_store = new ImpuStore(local_store, 0, 0,
+                                          ImpuStore::DATA_VERSION_BINARY, 0,
+                                          true, 10);
+  ImpuStore::DefaultImpu* impu = make_impu(IMPU, SERVICE_PROFILE);
+
+  EXPECT_EQ(Store::Status::OK, binary_store->set_impu(impu, 0L));
+
+  ImpuStore::DefaultImpu* stored = get_stored_impu(IMPU);
+  ASSERT_NE(nullptr, stored);
+  EXPECT_EQ("", stored->service_profile);
+  EXPECT_EQ(ImpuStore::hash_service_profile(SERVICE_PROFILE),
+            stored->service_profile_hash);
+  delete stored;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, binary_store->get_impu(IMPU, got_impu, 0L));
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+
+  delete got_impu;
+  delete impu;
+  delete binary_store;
+}
+
+TEST_F(ImpuStoreSharedProfileTest, ServiceProfileNotRewrittenWhileStored)
+{
+  ImpuStore::DefaultImpu* impu_1 = make_impu(IMPU, SERVICE_PROFILE);
+  ImpuStore::DefaultImpu* impu_2 = make_impu(ASSOC_IMPU, SERVICE_PROFILE);
+  ImpuStore::DefaultImpu* impu_3 = make_impu(IMPU_2, SERVICE_PROFILE, 1000);
+  std::string hash = ImpuStore::hash_service_profile(SERVICE_PROFILE);
+
+  // The service profile is stored to last twice as long as the IMPU
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu_1, 0L));
+  EXPECT_LE(impu_1->expiry + 300, get_stored_profile_expiry(SERVICE_PROFILE));
+  local_store->delete_data("service_profile", hash, 0L);
+
+  // The store has already stored the service profile to last longer than
+  // the second IMPU, so doesn't write it again
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu_2, 0L));
+  EXPECT_EQ(0, get_stored_profile_expiry(SERVICE_PROFILE));
+
+  // But it does for an IMPU that outlives it
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu_3, 0L));
+  EXPECT_LE(impu_3->expiry + 1000, get_stored_profile_expiry(SERVICE_PROFILE));
+
+  delete impu_1;
+  delete impu_2;
+  delete impu_3;
+}
+
+TEST_F(ImpuStoreSharedProfileTest, ServiceProfileNeverShortened)
+{
+  // One node stores the service profile for a long-lived IMPU
+  ImpuStore::DefaultImpu* impu_1 = make_impu(IMPU, SERVICE_PROFILE, 3000);
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu_1, 0L));
+  int64_t expiry = get_stored_profile_expiry(SERVICE_PROFILE);
+  EXPECT_LE(impu_1->expiry + 3000, expiry);
+
+  // Another node, which hasn't seen the service profile, writes a
+  // short-lived IMPU that refers to it. It doesn't shorten the service
+  // profile's life.
+  ImpuStore* other_store = new ImpuStore(local_store, 0, 0,
+                                         ImpuStore::DATA_VERSION_JSON_LZ4, 0,
+                                         true, 10);
+  ImpuStore::DefaultImpu* impu_2 = make_impu(ASSOC_IMPU, SERVICE_PROFILE, 300);
+  EXPECT_EQ(Store::Status::OK, other_store->set_impu(impu_2, 0L));
+  EXPECT_EQ(expiry, get_stored_profile_expiry(SERVICE_PROFILE));
+
+  // It extends it for an IMPU that would outlive it
+  ImpuStore::DefaultImpu* impu_3 = make_impu(IMPU_2, SERVICE_PROFILE, 10000);
+  EXPECT_EQ(Store::Status::OK, other_store->set_impu(impu_3, 0L));
+  EXPECT_LE(impu_3->expiry + 10000, get_stored_profile_expiry(SERVICE_PROFILE));
+
+  delete impu_1;
+  delete impu_2;
+  delete impu_3;
+  delete other_store;
+}
+
+TEST_F(ImpuStoreSharedProfileTest, ServiceProfileMissing)
+{
+  ImpuStore::DefaultImpu* impu = make_impu(IMPU, SERVICE_PROFILE);
+  std::string hash = ImpuStore::hash_service_profile(SERVICE_PROFILE);
+
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu, 0L));
+  delete impu;
+
+  // The store evicts the service profile, but not the IMPU
+  local_store->delete_data("service_profile", hash, 0L);
+
+  // A store without the service profile cached can't read the IMPU. This is
+  // an error, rather than the IMPU not being found, as it still exists.
+  ImpuStore* other_store = new ImpuStore(local_store, 0, 0,
+                                         ImpuStore::DATA_VERSION_JSON_LZ4, 0,
+                                         true, 10);
+  ImpuStore::Impu* got_impu = nullptr;
+  EXPECT_EQ(Store::Status::ERROR,
+            other_store->get_impu(IMPU, got_impu, 0L));
+  EXPECT_EQ(nullptr, got_impu);
+
+  // But it can get the IMPU to write over it
+  ASSERT_EQ(Store::Status::OK,
+            other_store->get_impu_for_update(IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  ImpuStore::DefaultImpu* stored = (ImpuStore::DefaultImpu*)got_impu;
+  EXPECT_TRUE(stored->service_profile_missing);
+  EXPECT_EQ("", stored->service_profile);
+  EXPECT_NE(0UL, stored->cas);
+
+  // Writing over it with its CAS succeeds, and stores the service profile
+  // again
+  impu = new ImpuStore::DefaultImpu(IMPU,
+                                    NO_ASSOCIATED_IMPUS,
+                                    IMPIS,
+                                    RegistrationState::REGISTERED,
+                                    NO_CHARGING_ADDRESSES,
+                                    SERVICE_PROFILE,
+                                    stored->cas,
+                                    time(0) + 300,
+                                    other_store);
+  EXPECT_EQ(Store::Status::OK, other_store->set_impu(impu, 0L));
+  delete impu;
+  delete got_impu; got_impu = nullptr;
+
+  ASSERT_EQ(Store::Status::OK, other_store->get_impu(IMPU, got_impu, 0L));
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile);
+  EXPECT_FALSE(((ImpuStore::DefaultImpu*)got_impu)->service_profile_missing);
+
+  delete got_impu;
+  delete other_store;
+}
+
+TEST_F(ImpuStoreSharedProfileTest, ServiceProfileCollision)
+{
+  // Another service profile is stored under this one's hash
+  std::string hash = ImpuStore::hash_service_profile(SERVICE_PROFILE);
+  local_store->set_data_without_cas("service_profile", hash, "other", 300, 0L);
+
+  ImpuStore::DefaultImpu* impu = make_impu(IMPU, SERVICE_PROFILE);
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu, 0L));
+
+  // So the service profile is stored inline
+  ImpuStore::DefaultImpu* stored = get_stored_impu(IMPU);
+  ASSERT_NE(nullptr, stored);
+  EXPECT_EQ(SERVICE_PROFILE, stored->service_profile);
+  EXPECT_EQ("", stored->service_profile_hash);
+  delete stored;
+
+  delete impu;
+}
+
+TEST_F(ImpuStoreSharedProfileTest, ServiceProfileCorrupt)
+{
+  ImpuStore::DefaultImpu* impu = make_impu(IMPU, SERVICE_PROFILE);
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu, 0L));
+
+  // Read with a store without a service profile cache, so it has to read
+  // the service profile from the store
+  ImpuStore* other_store = new ImpuStore(local_store);
+  std::string hash = ImpuStore::hash_service_profile(SERVICE_PROFILE);
+  local_store->set_data_without_cas("service_profile", hash, "other", 300, 0L);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  EXPECT_EQ(Store::Status::ERROR, other_store->get_impu(IMPU, got_impu, 0L));
+  EXPECT_EQ(nullptr, got_impu);
+
+  delete other_store;
+  delete impu;
+}
+
+TEST_F(ImpuStoreTest, ServiceProfileCacheEviction)
+{
+  ImpuStore::ServiceProfileCache cache(2);
+  std::string profile;
+  int64_t stored_expiry;
+
+  cache.put("a", "profile a", 10);
+  cache.put("b", "profile b", 0);
+
+  // Storing a profile again keeps the latest expiry
+  cache.put("a", "profile a", 5);
+  EXPECT_TRUE(cache.get_stored_expiry("a", "profile a", stored_expiry));
+  EXPECT_EQ(10, stored_expiry);
+  EXPECT_FALSE(cache.get_stored_expiry("a", "profile b", stored_expiry));
+
+  // "b" is now the least recently used, so is evicted
+  cache.put("c", "profile c", 0);
+  EXPECT_FALSE(cache.get("b", profile));
+  EXPECT_TRUE(cache.get("a", profile));
+  EXPECT_EQ("profile a", profile);
+  EXPECT_TRUE(cache.get("c", profile));
+  EXPECT_EQ("profile c", profile);
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingInvalidJson)
+{
+  ASSERT_EQ(nullptr,
+            ImpuStore::ImpiMapping::from_data(IMPI,
+                                              INVALID_JSON,
+                                              0L));
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingNotJsonObject)
+{
+  ASSERT_EQ(nullptr,
+            ImpuStore::ImpiMapping::from_data(IMPI,
+                                              JSON_ARRAY,
+                                              0L));
+}
+
+TEST_F(ImpuStoreTest, ImpuNotFound)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  Store::Status status = impu_store->get_impu(IMPU, got_impu, 0L);
+  ASSERT_EQ(status, Store::Status::NOT_FOUND);
+  ASSERT_EQ(nullptr, got_impu);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingNotFound)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  ImpuStore::ImpiMapping* mapping = nullptr;
+  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
+  ASSERT_EQ(nullptr, mapping);
+  ASSERT_EQ(status, Store::Status::NOT_FOUND);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingBadJson)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+  local_store->set_data("impi_mapping",
+                        IMPI,
+                        INVALID_JSON,
+                        0,
+                        1,
+                        0L);
+
+  ImpuStore::ImpiMapping* mapping = nullptr;
+  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
+  ASSERT_EQ(nullptr, mapping);
+  ASSERT_EQ(status, Store::Status::ERROR);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, ImpuSetWithoutCas)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->set_impu_without_cas(assoc_impu, 0));
+
+  delete assoc_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, DeleteImpu)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->delete_impu(assoc_impu, 0));
+
+  delete assoc_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, LocalCacheHit)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, 100, 1000);
+
+  int expiry = time(0) + 60;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  delete got_impu;
+
+  // Remove the record from under the ImpuStore - the next read should be
+  // served from the local cache.
+  local_store->delete_data("impu", ASSOC_IMPU, 0);
+
+  got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(ASSOC_IMPU, got_impu->impu);
+  ASSERT_EQ(expiry, got_impu->expiry);
+  ASSERT_EQ(IMPU,
+            dynamic_cast<ImpuStore::AssociatedImpu*>(got_impu)->default_impu);
+
+  delete got_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetCachedImpu)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, 100, 1000);
+
+  int expiry = time(0) + 60;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  // The IMPU is only in the local cache once it's been read
+  ASSERT_EQ(nullptr, impu_store->get_cached_impu(ASSOC_IMPU));
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  delete got_impu;
+
+  got_impu = impu_store->get_cached_impu(ASSOC_IMPU);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(ASSOC_IMPU, got_impu->impu);
+
+  delete got_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, LocalCacheInvalidatedOnWrite)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, 100, 1000);
+
+  int expiry = time(0) + 60;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+
+  // Writing the IMPU must invalidate the cached copy, so that the next read
+  // picks up the new CAS.
+  uint64_t old_cas = got_impu->cas;
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impu(got_impu, 0));
+  delete got_impu;
+
+  got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  ASSERT_NE(old_cas, got_impu->cas);
+
+  // Deleting the IMPU must also invalidate the cached copy.
+  ASSERT_EQ(Store::Status::OK, impu_store->delete_impu(got_impu, 0));
+  delete got_impu;
+
+  got_impu = nullptr;
+  ASSERT_EQ(Store::Status::NOT_FOUND,
+            impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  ASSERT_EQ(nullptr, got_impu);
+
+  delete impu_store;
+  delete local_store;
+}
+
+// A LocalStore that runs a function, once, after the next read from it.
+class InterleavingStore : public LocalStore
+{
+public:
+  virtual Status get_data(const std::string& table,
+                          const std::string& key,
+                          std::string& data,
+                          uint64_t& cas,
+                          SAS::TrailId trail,
+                          bool log_body = false,
+                          Format format = HEX) override
+  {
+    Status status = LocalStore::get_data(table, key, data, cas, trail, log_body, format);
+
+    std::function<void()> after_get;
+    after_get.swap(_after_get);
+
+    if (after_get)
+    {
+      after_get();
+    }
+
+    return status;
+  }
+
+  std::function<void()> _after_get;
+};
+
+TEST_F(ImpuStoreTest, LocalCacheReadRacesWrite)
+{
+  InterleavingStore* local_store = new InterleavingStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, 100, 1000);
+
+  int expiry = time(0) + 60;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  // Write the IMPU while it's being read, after the old record has been
+  // read from the store.
+  local_store->_after_get = [impu_store, expiry]()
+  {
+    ImpuStore::AssociatedImpu new_impu(ASSOC_IMPU,
+                                       "sip:other@example.com",
+                                       0L,
+                                       expiry,
+                                       impu_store);
+    impu_store->set_impu_without_cas(&new_impu, 0);
+  };
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  ASSERT_EQ(IMPU,
+            dynamic_cast<ImpuStore::AssociatedImpu*>(got_impu)->default_impu);
+  delete got_impu;
+
+  // The old record must not have been cached, so the next read sees the new
+  // one.
+  ASSERT_EQ(nullptr, impu_store->get_cached_impu(ASSOC_IMPU));
+
+  got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  ASSERT_EQ("sip:other@example.com",
+            dynamic_cast<ImpuStore::AssociatedImpu*>(got_impu)->default_impu);
+  delete got_impu;
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, LocalCacheMaxAge)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, 100, 100);
+
+  int expiry = time(0) + 60;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  delete got_impu;
+
+  local_store->delete_data("impu", ASSOC_IMPU, 0);
+
+  // Once the entry is older than the maximum age it's no longer used.
+  cwtest_advance_time_ms(101);
+
+  got_impu = nullptr;
+  ASSERT_EQ(Store::Status::NOT_FOUND,
+            impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  ASSERT_EQ(nullptr, got_impu);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, LocalCacheHonoursRecordExpiry)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, 100, 60000);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  delete got_impu;
+
+  cwtest_advance_time_ms(1000);
+
+  got_impu = nullptr;
+  ASSERT_EQ(Store::Status::NOT_FOUND,
+            impu_store->get_impu(ASSOC_IMPU, got_impu, 0));
+  ASSERT_EQ(nullptr, got_impu);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, LocalCacheReplaceAndInvalidate)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore::LocalCache* cache = new ImpuStore::LocalCache(100, 1000);
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 60;
+
+  ImpuStore::AssociatedImpu assoc_impu(ASSOC_IMPU, IMPU, 1L, expiry, impu_store);
+  ImpuStore::AssociatedImpu other_impu(ASSOC_IMPU, IMPU, 2L, expiry, impu_store);
+
+  cache->put(&assoc_impu, cache->generation(ASSOC_IMPU));
+  ImpuStore::Impu* got_impu = cache->get(ASSOC_IMPU);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(1L, got_impu->cas);
+  delete got_impu;
+
+  // Caching the same IMPU again replaces the existing entry.
+  cache->put(&other_impu, cache->generation(ASSOC_IMPU));
+  got_impu = cache->get(ASSOC_IMPU);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(2L, got_impu->cas);
+  delete got_impu;
+
+  cache->invalidate(ASSOC_IMPU);
+  ASSERT_EQ(nullptr, cache->get(ASSOC_IMPU));
+
+  // An IMPU read before it was invalidated isn't cached.
+  uint64_t generation = cache->generation(ASSOC_IMPU);
+  cache->invalidate(ASSOC_IMPU);
+  cache->put(&assoc_impu, generation);
+  ASSERT_EQ(nullptr, cache->get(ASSOC_IMPU));
+
+  delete cache;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, LocalCacheEviction)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  // A cache of this size holds one entry per shard, so caching more IMPUs
+  // than there are shards must evict some of them.
+  ImpuStore::LocalCache* cache = new ImpuStore::LocalCache(16, 1000);
+
+  int expiry = time(0) + 60;
+  std::vector<std::string> impus;
+
+  for (int ii = 0; ii < 32; ++ii)
+  {
+    impus.push_back("sip:impu" + std::to_string(ii) + "@example.com");
+    ImpuStore::AssociatedImpu impu(impus.back(), IMPU, 0L, expiry, impu_store);
+    cache->put(&impu, cache->generation(impu.impu));
+  }
+
+  int hits = 0;
+
+  for (const std::string& impu : impus)
+  {
+    ImpuStore::Impu* got_impu = cache->get(impu);
+
+    if (got_impu != nullptr)
+    {
+      hits++;
+      delete got_impu;
+    }
+  }
+
+  ASSERT_GT(hits, 0);
+  ASSERT_LE(hits, 16);
+
+  delete cache;
+  delete impu_store;
+  delete local_store;
+}
+
+class ImpuStoreIdentityIndexTest : public ImpuStoreTest
+{
+  void SetUp()
+  {
+    local_store = new LocalStore();
+
+    index.identities.emplace_back(IMPU, 0);
+    index.identities.emplace_back(ASSOC_IMPU, IdentityIndex::BARRED);
+    index.identities.emplace_back("sip:!.*!@example.com", IdentityIndex::WILDCARD);
+    index.private_id = IMPI;
+  }
+
+  void TearDown()
+  {
+    delete local_store;
+  }
+
+  // Writes an IMPU with the identity index to a store with the given
+  // options, then reads it back with a store that doesn't store indexes.
+  ImpuStore::DefaultImpu* round_trip(int data_version,
+                                     bool share_service_profiles,
+                                     bool store_identity_index)
+  {
+    ImpuStore* impu_store = new ImpuStore(local_store, 0, 0,
+                                          data_version, 0,
+                                          share_service_profiles, 10,
+                                          store_identity_index);
+    ImpuStore::DefaultImpu* impu =
+      new ImpuStore::DefaultImpu(IMPU,
+                                 { ASSOC_IMPU },
+                                 IMPIS,
+                                 RegistrationState::REGISTERED,
+                                 NO_CHARGING_ADDRESSES,
+                                 SERVICE_PROFILE,
+                                 0L,
+                                 time(0) + 300,
+                                 impu_store);
+    impu->identity_index = index;
+
+    EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu, 0L));
+
+    ImpuStore* other_store = new ImpuStore(local_store);
+    ImpuStore::Impu* got_impu = nullptr;
+    EXPECT_EQ(Store::Status::OK, other_store->get_impu(IMPU, got_impu, 0L));
+
+    delete other_store;
+    delete impu;
+    delete impu_store;
+
+    return (ImpuStore::DefaultImpu*)got_impu;
+  }
+
+  LocalStore* local_store;
+  IdentityIndex index;
+};
+
+TEST_F(ImpuStoreIdentityIndexTest, JsonRoundTrip)
+{
+  ImpuStore::DefaultImpu* got =
+    round_trip(ImpuStore::DATA_VERSION_JSON_LZ4, false, true);
+  ASSERT_NE(nullptr, got);
+  EXPECT_EQ(SERVICE_PROFILE, got->service_profile);
+  EXPECT_TRUE(index == got->identity_index);
+  EXPECT_EQ(ASSOC_IMPU, got->identity_index.identities[1].uri);
+  EXPECT_EQ(IMPI, got->identity_index.private_id);
+  delete got;
+}
+
+TEST_F(ImpuStoreIdentityIndexTest, BinaryRoundTrip)
+{
+  ImpuStore::DefaultImpu* got =
+    round_trip(ImpuStore::DATA_VERSION_BINARY, false, true);
+  ASSERT_NE(nullptr, got);
+  EXPECT_EQ(SERVICE_PROFILE, got->service_profile);
+  EXPECT_TRUE(index == got->identity_index);
+  delete got;
+}
+
+TEST_F(ImpuStoreIdentityIndexTest, BinaryRoundTripSharedProfile)
+{
+  ImpuStore::DefaultImpu* got =
+    round_trip(ImpuStore::DATA_VERSION_BINARY, true, true);
+  ASSERT_NE(nullptr, got);
+  EXPECT_EQ(SERVICE_PROFILE, got->service_profile);
+  EXPECT_TRUE(index == got->identity_index);
+  delete got;
+}
+
+TEST_F(ImpuStoreIdentityIndexTest, NotStored)
+{
+  // Unless the store is configured to store the index, it's dropped, so that
+  // nodes that don't understand it can read the IMPU
+  for (int data_version : { ImpuStore::DATA_VERSION_JSON_LZ4,
+                            ImpuStore::DATA_VERSION_BINARY })
+  {
+    ImpuStore::DefaultImpu* got = round_trip(data_version, false, false);
+    ASSERT_NE(nullptr, got);
+    EXPECT_EQ(SERVICE_PROFILE, got->service_profile);
+    EXPECT_TRUE(got->identity_index.empty());
+    delete got;
+  }
+}
+
+TEST_F(ImpuStoreIdentityIndexTest, BinaryMismatchedFlags)
+{
+  // A binary record whose index has fewer flags than identities is rejected
+  std::string data;
+  data.push_back(ImpuStore::DATA_VERSION_BINARY);
+  data.push_back(0);                      // Default IMPU
+  data.push_back(1);                      // Expiry
+  data.push_back(1);                      // Registered
+  data.append(4, '\0');                   // No IMPUs, IMPIs, CCFs or ECFs
+  data.push_back(0);                      // No service profile
+  data.push_back(0);                      // No service profile hash
+  data.push_back(1);                      // One identity...
+  data.push_back((char)IMPU.size());
+  data.append(IMPU);
+  data.push_back(0);                      // ...but no flags
+  data.push_back(0);                      // No private ID
+
+  EXPECT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0L, nullptr));
+}
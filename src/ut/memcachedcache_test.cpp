@@ -9,6 +9,12 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <atomic>
+#include <mutex>
+#include <semaphore.h>
+#include <set>
+#include <thread>
+
 #include "memcached_cache.h"
 #include "test_interposer.hpp"
 #include "test_utils.hpp"
@@ -18,9 +24,13 @@
 
 using ::testing::_;
 using ::testing::DoAll;
+using ::testing::Field;
+using ::testing::Invoke;
 using ::testing::InvokeWithoutArgs;
 using ::testing::Return;
+using ::testing::SetArgReferee;
 using ::testing::StrictMock;
+using ::testing::Truly;
 
 static LocalStore LOCAL_STORE;
 static LocalStore LOCAL_STORE_2;
@@ -300,6 +310,41 @@ TEST_F(MemcachedImplicitRegistrationSetTest, SetServiceProfileDifferent)
   delete mirs;
 }
 
+TEST_F(MemcachedImplicitRegistrationSetTest, IdentityIndex)
+{
+  int expiry = time(0) + 1;
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      ASSOC_IMPUS_2,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE_2,
+                                      CAS,
+                                      expiry,
+                                      nullptr);
+  default_impu.identity_index.identities.emplace_back(IMPU, 0);
+  default_impu.identity_index.private_id = IMPI;
+
+  // The IRS takes the index stored with the IMPU
+  MemcachedImplicitRegistrationSet mirs(&default_impu);
+  EXPECT_TRUE(default_impu.identity_index == mirs.get_identity_index());
+
+  // Setting the service profile replaces the index with its identities,
+  // which are written with the IMPU
+  mirs.set_ims_sub_xml(SERVICE_PROFILE);
+  EXPECT_EQ(std::vector<std::string>({ IMPU, ASSOC_IMPU, ASSOC_IMPU_2 }),
+            mirs.get_identity_index().public_ids());
+  EXPECT_EQ(IMPU, mirs.get_identity_index().default_id());
+  EXPECT_EQ(IMPI, mirs.get_identity_index().private_id);
+
+  ImpuStore::DefaultImpu* got_impu = mirs.get_impu();
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_TRUE(mirs.get_identity_index() == got_impu->identity_index);
+
+  delete got_impu;
+}
+
 TEST_F(MemcachedImplicitRegistrationSetTest, SetRegistrationState)
 {
   MemcachedImplicitRegistrationSet* mirs =
@@ -657,6 +702,94 @@ TEST_F(MemcachedImplicitRegistrationSetTest, DeleteImpis)
 }
 
 
+TEST_F(MemcachedImplicitRegistrationSetTest, Coalesce)
+{
+  int expiry = time(0) + 1;
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      ASSOC_IMPUS,
+                                      { IMPI, IMPI_2 },
+                                      RegistrationState::REGISTERED,
+                                      CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      CAS,
+                                      expiry,
+                                      &IMPU_STORE);
+
+  // The older copy adds one IMPI and deletes another
+  MemcachedImplicitRegistrationSet older(&default_impu);
+  older.add_associated_impi(IMPI_3);
+  older.delete_associated_impi(IMPI_2);
+  older.set_ttl(10);
+
+  // The newer copy was read after the older copy was written, so has the
+  // added IMPI unchanged and no record of the deleted one
+  ImpuStore::DefaultImpu newer_impu(IMPU,
+                                    ASSOC_IMPUS,
+                                    { IMPI, IMPI_3 },
+                                    RegistrationState::REGISTERED,
+                                    CHARGING_ADDRESSES,
+                                    SERVICE_PROFILE,
+                                    CAS_2,
+                                    expiry,
+                                    &IMPU_STORE);
+
+  MemcachedImplicitRegistrationSet newer(&newer_impu);
+  newer.add_associated_impi(IMPI_4);
+  newer.set_ims_sub_xml(SERVICE_PROFILE_2);
+
+  newer.coalesce(older);
+
+  std::vector<std::string> added = { IMPI_3, IMPI_4 };
+  std::vector<std::string> unchanged = { IMPI };
+  std::vector<std::string> deleted = { IMPI_2 };
+  EXPECT_EQ(added, newer.impis(MemcachedImplicitRegistrationSet::State::ADDED));
+  EXPECT_EQ(unchanged, newer.impis(MemcachedImplicitRegistrationSet::State::UNCHANGED));
+  EXPECT_EQ(deleted, newer.impis(MemcachedImplicitRegistrationSet::State::DELETED));
+  EXPECT_EQ(ASSOC_IMPUS, newer.impus(MemcachedImplicitRegistrationSet::State::UNCHANGED));
+  EXPECT_EQ(SERVICE_PROFILE_2, newer.get_ims_sub_xml());
+  EXPECT_TRUE(newer.is_refreshed());
+}
+
+TEST_F(MemcachedImplicitRegistrationSetTest, Clone)
+{
+  int expiry = time(0) + 1;
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      ASSOC_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      CAS,
+                                      expiry,
+                                      &IMPU_STORE);
+
+  MemcachedImplicitRegistrationSet mirs(&default_impu);
+  mirs.add_associated_impi(IMPI_2);
+
+  MemcachedImplicitRegistrationSet* clone =
+    dynamic_cast<MemcachedImplicitRegistrationSet*>(mirs.clone());
+  ASSERT_NE(nullptr, clone);
+
+  // The clone has the same data and changes as the original, but changing
+  // one doesn't change the other
+  EXPECT_EQ(mirs.get_associated_impis(), clone->get_associated_impis());
+  EXPECT_TRUE(clone->has_changed_impis());
+  EXPECT_TRUE(clone->is_existing());
+
+  clone->set_ims_sub_xml(SERVICE_PROFILE_2);
+  EXPECT_EQ(SERVICE_PROFILE, mirs.get_ims_sub_xml());
+
+  ImpuStore::DefaultImpu* impu = clone->get_impu_for_store(&IMPU_STORE);
+  ASSERT_NE(nullptr, impu);
+  EXPECT_EQ(CAS, impu->cas);
+
+  delete impu;
+  delete clone;
+}
+
+
 class MemcachedCacheTest : public ControlTimeTest
 {
 public:
@@ -1117,6 +1250,59 @@ TEST_F(MemcachedCacheTest, PutIrsWithExistingUnrefreshed)
   delete irs;
 }
 
+TEST_F(MemcachedCacheTest, PutIrsOverImpuWithMissingServiceProfile)
+{
+  // Write the IMPU to the local store with a shared service profile, which
+  // the store then evicts
+  ImpuStore sharing_store(_lls, 0, 0, ImpuStore::DATA_VERSION_JSON_LZ4, 0, true, 10);
+  int expiry = time(0) + 10;
+
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               NO_IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               &sharing_store);
+  sharing_store.set_impu(di, 0L);
+  delete di;
+
+  _lls->delete_data("service_profile",
+                    ImpuStore::hash_service_profile(SERVICE_PROFILE),
+                    0L);
+
+  // The IMPU can't be read, but isn't treated as not found
+  ImplicitRegistrationSet* irs = nullptr;
+  EXPECT_EQ(Store::Status::ERROR,
+            _memcached_cache->get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs));
+  EXPECT_EQ(nullptr, irs);
+
+  // So the subscriber's data is written afresh (e.g. from the HSS)
+  irs = _memcached_cache->create_implicit_registration_set();
+  irs->set_ttl(10);
+  irs->set_ims_sub_xml(SERVICE_PROFILE);
+  irs->set_reg_state(RegistrationState::REGISTERED);
+  irs->set_charging_addresses(CHARGING_ADDRESSES);
+  irs->add_associated_impi(IMPI);
+
+  // Writing the IRS to the local store replaces the IMPU there, rather than
+  // retrying forever
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  EXPECT_EQ(Store::Status::OK,
+            _memcached_cache->put_implicit_registration_set(irs, _progress_callback, 0L, nullptr));
+  delete irs;
+
+  ImpuStore::Impu* impu = nullptr;
+  EXPECT_EQ(Store::Status::OK, _local_store->get_impu(IMPU, impu, 0L));
+  ASSERT_NE(nullptr, impu);
+  EXPECT_EQ(SERVICE_PROFILE, ((ImpuStore::DefaultImpu*)impu)->service_profile);
+  EXPECT_EQ(IMPIS, ((ImpuStore::DefaultImpu*)impu)->impis);
+  delete impu;
+}
+
 TEST_F(MemcachedCacheTest, PutIrsWithExistingNotRefreshedConflictAssociated)
 {
   int expiry = time(0) + 1;
@@ -1534,6 +1720,110 @@ TEST_F(MemcachedCacheTest, GetIrsForImpus)
   }
 }
 
+TEST_F(MemcachedCacheTest, GetIrsForImpusBatch)
+{
+  // The first IRS is in the local store, and the second only in a remote
+  // store.
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _local_store);
+  _local_store->set_impu(di, 0L);
+  delete di;
+
+  di = new ImpuStore::DefaultImpu(IMPU_2,
+                                  ASSOC_IMPUS_2,
+                                  IMPIS_2,
+                                  RegistrationState::REGISTERED,
+                                  CHARGING_ADDRESSES,
+                                  SERVICE_PROFILE,
+                                  0L,
+                                  time(0) + 1,
+                                  _remote_store_2);
+  _remote_store_2->set_impu(di, 0L);
+  delete di;
+
+  ImpuStore::AssociatedImpu* ai =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU_3,
+                                  IMPU_2,
+                                  0L,
+                                  time(0) + 1,
+                                  _remote_store_2);
+  _remote_store_2->set_impu(ai, 0L);
+  delete ai;
+
+  std::vector<ImplicitRegistrationSet*> irss;
+
+  // The first IMPU we find is the associated IMPU in the remote store, so we
+  // get its IRS back.
+  Store::Status status =
+    _memcached_cache->get_implicit_registration_sets_for_impus({ASSOC_IMPU_5,
+                                                                ASSOC_IMPU_3,
+                                                                IMPU},
+                                                               0L,
+                                                               nullptr,
+                                                               irss);
+
+  EXPECT_EQ(Store::Status::OK, status);
+  ASSERT_EQ(1, irss.size());
+  EXPECT_EQ(IMPU_2, irss[0]->get_default_impu());
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    delete irs;
+  }
+}
+
+TEST_F(MemcachedCacheTest, GetIrsForImpusBatchInvalidDefault)
+{
+  // The associated IMPU points at a default IMPU that doesn't list it, so
+  // we skip it and use the next IMPU.
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _local_store);
+  _local_store->set_impu(di, 0L);
+  delete di;
+
+  ImpuStore::AssociatedImpu* ai =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU_3,
+                                  IMPU,
+                                  0L,
+                                  time(0) + 1,
+                                  _local_store);
+  _local_store->set_impu(ai, 0L);
+  delete ai;
+
+  std::vector<ImplicitRegistrationSet*> irss;
+
+  Store::Status status =
+    _memcached_cache->get_implicit_registration_sets_for_impus({ASSOC_IMPU_3,
+                                                                ASSOC_IMPU},
+                                                               0L,
+                                                               nullptr,
+                                                               irss);
+
+  EXPECT_EQ(Store::Status::OK, status);
+  EXPECT_EQ(0, irss.size());
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    delete irs;
+  }
+}
+
 TEST_F(MemcachedCacheTest, GetImsSubscriptionNotFound)
 {
   ImsSubscription* subscription = nullptr;
@@ -1769,28 +2059,1100 @@ TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsDataContentionError)
   delete mirs;
 }
 
-TEST_F(MemcachedCacheMockStoreTest, StopWatchGetImpuForImpuGR)
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsOnlyContendedRetried)
 {
-  ImpuStore::Impu* result = nullptr;
-  Utils::StopWatch stopwatch;
-  stopwatch.start();
+  // Tests that if we add several ImpiMappings and only one of them hits
+  // DATA_CONTENTION, only that one is read and written again
+  MemcachedImplicitRegistrationSet* mirs = new MemcachedImplicitRegistrationSet();
 
-  // The local store will take 10ms to return NOT_FOUND
-  EXPECT_CALL(*_local_mock_store, get_impu(_, _, _))
-    .WillOnce(DoAll(InvokeWithoutArgs(advance_time_10_ms), Return(Store::Status::NOT_FOUND)));
+  mirs->set_ttl(1);
+  mirs->set_ims_sub_xml(SERVICE_PROFILE);
+  mirs->set_reg_state(RegistrationState::REGISTERED);
+  mirs->add_associated_impi(IMPI);
+  mirs->add_associated_impi(IMPI_2);
 
-  // The first remote store will take an additional 25ms to return NOT_FOUND
-  EXPECT_CALL(*_remote_mock_store1, get_impu(_, _, _))
-  .WillOnce(DoAll(InvokeWithoutArgs(advance_time_25_ms), Return(Store::Status::NOT_FOUND)));
+  // The first set of IMPI hits contention, the second succeeds
+  EXPECT_CALL(*_local_mock_store,
+              set_impi_mapping(Field(&ImpuStore::ImpiMapping::impi, IMPI), _))
+    .WillOnce(Return(Store::Status::DATA_CONTENTION))
+    .WillOnce(Return(Store::Status::OK));
 
-  // The second remote store will take an additional 50ms to return NOT_FOUND
-  EXPECT_CALL(*_remote_mock_store2, get_impu(_, _, _))
-  .WillOnce(DoAll(InvokeWithoutArgs(advance_time_50_ms), Return(Store::Status::NOT_FOUND)));
+  // IMPI_2 is only written once, and never read
+  EXPECT_CALL(*_local_mock_store,
+              set_impi_mapping(Field(&ImpuStore::ImpiMapping::impi, IMPI_2), _))
+    .WillOnce(Return(Store::Status::OK));
 
-  _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, &stopwatch);
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
 
-  // The stopwatch should have advanced by 85ms
-  unsigned long time = 0L;
-  EXPECT_TRUE(stopwatch.read(time));
-  EXPECT_EQ(time, 85000);
+  Store::Status status = _memcached_cache->update_irs_impi_mappings(mirs, 0L, _local_mock_store, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+
+  delete mirs;
+}
+
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsErrorReported)
+{
+  // Tests that if the update of one ImpiMapping fails, we report the error,
+  // even though the others succeed
+  MemcachedImplicitRegistrationSet* mirs = new MemcachedImplicitRegistrationSet();
+
+  mirs->set_ttl(1);
+  mirs->set_ims_sub_xml(SERVICE_PROFILE);
+  mirs->set_reg_state(RegistrationState::REGISTERED);
+  mirs->add_associated_impi(IMPI);
+  mirs->add_associated_impi(IMPI_2);
+
+  EXPECT_CALL(*_local_mock_store,
+              set_impi_mapping(Field(&ImpuStore::ImpiMapping::impi, IMPI), _))
+    .WillOnce(Return(Store::Status::ERROR));
+  EXPECT_CALL(*_local_mock_store,
+              set_impi_mapping(Field(&ImpuStore::ImpiMapping::impi, IMPI_2), _))
+    .WillOnce(Return(Store::Status::OK));
+
+  Store::Status status = _memcached_cache->update_irs_impi_mappings(mirs, 0L, _local_mock_store, nullptr);
+  EXPECT_EQ(Store::Status::ERROR, status);
+
+  delete mirs;
+}
+
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsAssociatedImpusDataContention)
+{
+  // Tests that associated IMPUs are added and removed, and that a delete that
+  // hits DATA_CONTENTION is retried without redoing the writes
+  int expiry = time(0) + 1;
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      { ASSOC_IMPU, ASSOC_IMPU_3 },
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      CAS,
+                                      expiry,
+                                      &IMPU_STORE);
+
+  // The new XML keeps ASSOC_IMPU, adds ASSOC_IMPU_2 and removes ASSOC_IMPU_3.
+  // The IRS isn't refreshed, so ASSOC_IMPU isn't rewritten.
+  MemcachedImplicitRegistrationSet mirs(&default_impu);
+  mirs.set_ims_sub_xml(SERVICE_PROFILE);
+
+  EXPECT_CALL(*_local_mock_store,
+              set_impu_without_cas(Field(&ImpuStore::Impu::impu, ASSOC_IMPU_2), _))
+    .WillOnce(Return(Store::Status::OK));
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU_3, IMPU, CAS, expiry, &IMPU_STORE);
+  ImpuStore::AssociatedImpu* assoc_impu_2 =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU_3, IMPU, CAS_2, expiry, &IMPU_STORE);
+
+  EXPECT_CALL(*_local_mock_store, get_impu(ASSOC_IMPU_3, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(assoc_impu), Return(Store::Status::OK)))
+    .WillOnce(DoAll(SetArgReferee<1>(assoc_impu_2), Return(Store::Status::OK)));
+
+  EXPECT_CALL(*_local_mock_store, delete_impu(_, _))
+    .WillOnce(Return(Store::Status::DATA_CONTENTION))
+    .WillOnce(Return(Store::Status::OK));
+
+  Store::Status status = _memcached_cache->update_irs_associated_impus(&mirs, 0L, _local_mock_store, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsLazyRefresh)
+{
+  // Tests that if refreshes are lazy, refreshing an IRS only rewrites the
+  // IMPI mappings that would expire before it, and that those are written to
+  // last longer than the IRS
+  MemcachedCache cache(_local_mock_store, {}, 2, nullptr, 0, 0, 0, nullptr, nullptr, 0, 0, nullptr, nullptr, 3600);
+  int now = time(0);
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      ASSOC_IMPUS,
+                                      { IMPI, IMPI_2 },
+                                      RegistrationState::REGISTERED,
+                                      CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      CAS,
+                                      now + 10,
+                                      &IMPU_STORE);
+
+  MemcachedImplicitRegistrationSet mirs(&default_impu);
+  mirs.set_ttl(10);
+
+  // The mapping for IMPI lasts well beyond the refreshed IRS, but the one for
+  // IMPI_2 would expire first
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, IMPU, now + 1000);
+  ImpuStore::ImpiMapping* mapping_2 =
+    new ImpuStore::ImpiMapping(IMPI_2, IMPU, now + 5);
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(mapping), Return(Store::Status::OK)));
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI_2, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(mapping_2), Return(Store::Status::OK)));
+
+  // Only IMPI_2 is rewritten, to last an hour beyond the IRS
+  EXPECT_CALL(*_local_mock_store,
+              set_impi_mapping(Truly([now](ImpuStore::ImpiMapping* m)
+                                     {
+                                       return ((m->impi == IMPI_2) &&
+                                               (m->get_expiry() == now + 10 + 3600));
+                                     }), _))
+    .WillOnce(Return(Store::Status::OK));
+
+  Store::Status status = cache.update_irs_impi_mappings(&mirs, 0L, _local_mock_store, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsAssociatedImpusLazyRefresh)
+{
+  // Tests that if refreshes are lazy, refreshing an IRS only rewrites the
+  // associated IMPUs that would expire before it, or that are missing
+  MemcachedCache cache(_local_mock_store, {}, 2, nullptr, 0, 0, 0, nullptr, nullptr, 0, 0, nullptr, nullptr, 3600);
+  int now = time(0);
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      { ASSOC_IMPU, ASSOC_IMPU_2 },
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      CAS,
+                                      now + 10,
+                                      &IMPU_STORE);
+
+  MemcachedImplicitRegistrationSet mirs(&default_impu);
+  mirs.set_ttl(10);
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, CAS, now + 1000, &IMPU_STORE);
+
+  EXPECT_CALL(*_local_mock_store, get_impu(ASSOC_IMPU, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(assoc_impu), Return(Store::Status::OK)));
+  EXPECT_CALL(*_local_mock_store, get_impu(ASSOC_IMPU_2, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  // Only the missing IMPU is written
+  EXPECT_CALL(*_local_mock_store,
+              set_impu_without_cas(Field(&ImpuStore::Impu::impu, ASSOC_IMPU_2), _))
+    .WillOnce(Return(Store::Status::OK));
+
+  Store::Status status = cache.update_irs_associated_impus(&mirs, 0L, _local_mock_store, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, TryGetIrsFromLocalCache)
+{
+  // Tests that an IRS can be got without blocking if both the associated
+  // IMPU and its default IMPU are in the local store's cache
+  int expiry = time(0) + 10;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, CAS, expiry, &IMPU_STORE);
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               CAS,
+                               expiry,
+                               &IMPU_STORE);
+
+  EXPECT_CALL(*_local_mock_store, get_cached_impu(ASSOC_IMPU))
+    .WillOnce(Return(assoc_impu));
+  EXPECT_CALL(*_local_mock_store, get_cached_impu(IMPU))
+    .WillOnce(Return(default_impu));
+
+  ImplicitRegistrationSet* irs = nullptr;
+  EXPECT_TRUE(_memcached_cache->try_get_implicit_registration_set_for_impu(ASSOC_IMPU, irs));
+  ASSERT_NE(nullptr, irs);
+  EXPECT_EQ(IMPU, irs->get_default_impu());
+  EXPECT_EQ(RegistrationState::REGISTERED, irs->get_reg_state());
+
+  delete irs;
+}
+
+TEST_F(MemcachedCacheMockStoreTest, TryGetIrsNotInLocalCache)
+{
+  // Tests that we don't get an IRS without blocking if its default IMPU isn't
+  // in the local store's cache, and that the remote stores aren't consulted
+  int expiry = time(0) + 10;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, CAS, expiry, &IMPU_STORE);
+
+  EXPECT_CALL(*_local_mock_store, get_cached_impu(ASSOC_IMPU))
+    .WillOnce(Return(assoc_impu));
+  EXPECT_CALL(*_local_mock_store, get_cached_impu(IMPU))
+    .WillOnce(Return(nullptr));
+
+  ImplicitRegistrationSet* irs = nullptr;
+  EXPECT_FALSE(_memcached_cache->try_get_implicit_registration_set_for_impu(ASSOC_IMPU, irs));
+  EXPECT_EQ(nullptr, irs);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, StopWatchGetImpuForImpuGR)
+{
+  ImpuStore::Impu* result = nullptr;
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
+  // The local store will take 10ms to return NOT_FOUND
+  EXPECT_CALL(*_local_mock_store, get_impu(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(advance_time_10_ms), Return(Store::Status::NOT_FOUND)));
+
+  // The first remote store will take an additional 25ms to return NOT_FOUND
+  EXPECT_CALL(*_remote_mock_store1, get_impu(_, _, _))
+  .WillOnce(DoAll(InvokeWithoutArgs(advance_time_25_ms), Return(Store::Status::NOT_FOUND)));
+
+  // The second remote store will take an additional 50ms to return NOT_FOUND
+  EXPECT_CALL(*_remote_mock_store2, get_impu(_, _, _))
+  .WillOnce(DoAll(InvokeWithoutArgs(advance_time_50_ms), Return(Store::Status::NOT_FOUND)));
+
+  _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, &stopwatch);
+
+  // The stopwatch should have advanced by 85ms
+  unsigned long time = 0L;
+  EXPECT_TRUE(stopwatch.read(time));
+  EXPECT_EQ(time, 85000);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpiMappingGRRemotesInParallel)
+{
+  ImpuStore::ImpiMapping* result = nullptr;
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU}, time(0) + 1);
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  // The first remote store fails, but the second finds the mapping. Both
+  // remote stores are queried, whether or not the other has already returned.
+  EXPECT_CALL(*_remote_mock_store1, get_impi_mapping(IMPI, _, _))
+    .WillRepeatedly(Return(Store::Status::ERROR));
+  EXPECT_CALL(*_remote_mock_store2, get_impi_mapping(IMPI, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(mapping), Return(Store::Status::OK)));
+
+  Store::Status status =
+    _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, nullptr);
+
+  EXPECT_EQ(Store::Status::OK, status);
+  EXPECT_EQ(mapping, result);
+
+  delete result;
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpiMappingGRNotFound)
+{
+  ImpuStore::ImpiMapping* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::ERROR));
+
+  Store::Status status =
+    _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, nullptr);
+
+  // Errors from the remote stores are ignored, as the local store has already
+  // told us that the mapping doesn't exist
+  EXPECT_EQ(Store::Status::NOT_FOUND, status);
+  EXPECT_EQ(nullptr, result);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, StopWatchGetImpiMappingGR)
+{
+  ImpuStore::ImpiMapping* result = nullptr;
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
+  // The local store will take 10ms to return NOT_FOUND
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(advance_time_10_ms), Return(Store::Status::NOT_FOUND)));
+
+  // The first remote store will take an additional 25ms to return NOT_FOUND
+  EXPECT_CALL(*_remote_mock_store1, get_impi_mapping(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(advance_time_25_ms), Return(Store::Status::NOT_FOUND)));
+
+  // The second remote store will take an additional 50ms to return NOT_FOUND
+  EXPECT_CALL(*_remote_mock_store2, get_impi_mapping(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(advance_time_50_ms), Return(Store::Status::NOT_FOUND)));
+
+  _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, &stopwatch);
+
+  // As with IMPU reads, the stopwatch should have advanced by 85ms
+  unsigned long time = 0L;
+  EXPECT_TRUE(stopwatch.read(time));
+  EXPECT_EQ(time, 85000);
+}
+
+// Used to hold up a remote store read until the test releases it
+static sem_t remote_read_sem;
+
+static void wait_for_remote_read_sem()
+{
+  sem_wait(&remote_read_sem);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpuForImpuGRReturnsOnFirstSuccess)
+{
+  sem_init(&remote_read_sem, 0, 0);
+
+  ImpuStore::Impu* result = nullptr;
+  ImpuStore::Impu* slow_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, 1L, time(0) + 1, &IMPU_STORE);
+  ImpuStore::Impu* fast_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, 2L, time(0) + 1, &IMPU_STORE);
+
+  EXPECT_CALL(*_local_mock_store, get_impu(ASSOC_IMPU, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  // The first remote store doesn't respond until after we've returned the
+  // result from the second. Its result must be freed in the background.
+  EXPECT_CALL(*_remote_mock_store1, get_impu(ASSOC_IMPU, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(wait_for_remote_read_sem),
+                    SetArgReferee<1>(slow_impu),
+                    Return(Store::Status::OK)));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(ASSOC_IMPU, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(fast_impu), Return(Store::Status::OK)));
+
+  Store::Status status =
+    _memcached_cache->get_impu_for_impu_gr(ASSOC_IMPU, result, 0L, nullptr);
+
+  EXPECT_EQ(Store::Status::OK, status);
+  EXPECT_EQ(fast_impu, result);
+
+  // Let the slow remote read complete. It's then tidied up when the cache
+  // waits for its thread pool to finish.
+  sem_post(&remote_read_sem);
+
+  delete result;
+}
+
+// Tests that use real time, for the remote read timeout
+class MemcachedCacheRemoteTimeoutTest : public ::testing::Test
+{
+public:
+  virtual void SetUp() override
+  {
+    sem_init(&remote_read_sem, 0, 0);
+    _local_mock_store = new StrictMock<MockImpuStore>();
+    _remote_mock_store1 = new StrictMock<MockImpuStore>();
+    _remote_mock_store2 = new StrictMock<MockImpuStore>();
+    _memcached_cache = new MemcachedCache(_local_mock_store,
+                                          {_remote_mock_store1, _remote_mock_store2},
+                                          2,
+                                          nullptr,
+                                          10);
+  }
+
+  virtual void TearDown() override
+  {
+    // Release any remote reads that are still outstanding
+    sem_post(&remote_read_sem);
+    delete _memcached_cache;
+    delete _local_mock_store;
+    delete _remote_mock_store1;
+    delete _remote_mock_store2;
+    sem_destroy(&remote_read_sem);
+  }
+
+private:
+  StrictMock<MockImpuStore>* _local_mock_store;
+  StrictMock<MockImpuStore>* _remote_mock_store1;
+  StrictMock<MockImpuStore>* _remote_mock_store2;
+  MemcachedCache* _memcached_cache;
+};
+
+TEST_F(MemcachedCacheRemoteTimeoutTest, GetImpuForImpuGRTimesOut)
+{
+  ImpuStore::Impu* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impu(IMPU, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  // One remote store doesn't have the IMPU, and the other doesn't respond
+  // until after we've given up on it.
+  EXPECT_CALL(*_remote_mock_store1, get_impu(IMPU, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(IMPU, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(wait_for_remote_read_sem),
+                    Return(Store::Status::NOT_FOUND)));
+
+  Store::Status status =
+    _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr);
+
+  EXPECT_EQ(Store::Status::NOT_FOUND, status);
+  EXPECT_EQ(nullptr, result);
+}
+
+TEST_F(MemcachedCacheRemoteTimeoutTest, GetImpiMappingGRTimesOut)
+{
+  ImpuStore::ImpiMapping* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impi_mapping(IMPI, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(wait_for_remote_read_sem),
+                    Return(Store::Status::NOT_FOUND)));
+  EXPECT_CALL(*_remote_mock_store2, get_impi_mapping(IMPI, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(wait_for_remote_read_sem),
+                    Return(Store::Status::NOT_FOUND)));
+
+  Store::Status status =
+    _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, nullptr);
+
+  EXPECT_EQ(Store::Status::NOT_FOUND, status);
+  EXPECT_EQ(nullptr, result);
+
+  // Both remote reads are blocked, so release the second one too
+  sem_post(&remote_read_sem);
+}
+
+TEST_F(MemcachedCacheRemoteTimeoutTest, SkipsRemoteStoreAtReadLimit)
+{
+  ImpuStore::Impu* result = nullptr;
+
+  // The second remote store doesn't respond, so the first read leaves a read
+  // to it in flight, which is as many as it's allowed with two threads.
+  EXPECT_CALL(*_local_mock_store, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(IMPU, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs(wait_for_remote_read_sem),
+                    Return(Store::Status::NOT_FOUND)));
+
+  Store::Status status =
+    _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr);
+  EXPECT_EQ(Store::Status::NOT_FOUND, status);
+
+  // The next read doesn't go to the second remote store at all.
+  status = _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr);
+  EXPECT_EQ(Store::Status::NOT_FOUND, status);
+  EXPECT_EQ(nullptr, result);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetIrsForImpusSingleBatchPerStore)
+{
+  std::vector<ImplicitRegistrationSet*> irss;
+  ImpuStore::Impu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU, IMPU, 1L, time(0) + 1, &IMPU_STORE);
+  ImpuStore::Impu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               2L,
+                               time(0) + 1,
+                               &IMPU_STORE);
+
+  // The local store has the associated IMPU, and the default IMPU is only
+  // found on one of the remote stores. Each store is only asked once.
+  std::vector<std::string> all_impus = {ASSOC_IMPU, IMPU};
+  std::vector<std::string> missing_impus = {IMPU};
+
+  EXPECT_CALL(*_local_mock_store, get_impus(all_impus, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(std::vector<ImpuStore::Impu*>({assoc_impu})),
+                    Return(Store::Status::OK)));
+  EXPECT_CALL(*_remote_mock_store1, get_impus(missing_impus, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(std::vector<ImpuStore::Impu*>({default_impu})),
+                    Return(Store::Status::OK)));
+  EXPECT_CALL(*_remote_mock_store2, get_impus(missing_impus, _, _))
+    .WillRepeatedly(Return(Store::Status::OK));
+
+  Store::Status status =
+    _memcached_cache->get_implicit_registration_sets_for_impus(all_impus,
+                                                               0L,
+                                                               nullptr,
+                                                               irss);
+
+  EXPECT_EQ(Store::Status::OK, status);
+  ASSERT_EQ(1, irss.size());
+  EXPECT_EQ(IMPU, irss[0]->get_default_impu());
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    delete irs;
+  }
+}
+
+// Counter table that just counts, so that tests can check the statistics.
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  CountingCounterTable() : count(0) {}
+  void increment() { count++; }
+  int count;
+};
+
+static const int NEGATIVE_CACHE_TTL_MS = 1000;
+
+class MemcachedCacheNegativeCacheTest : public ControlTimeTest
+{
+public:
+  virtual void SetUp() override
+  {
+    _local_mock_store = new StrictMock<MockImpuStore>();
+    _remote_mock_store1 = new StrictMock<MockImpuStore>();
+    _remote_mock_store2 = new StrictMock<MockImpuStore>();
+    _memcached_cache = new MemcachedCache(_local_mock_store,
+                                          {_remote_mock_store1, _remote_mock_store2},
+                                          2,
+                                          nullptr,
+                                          0,
+                                          0,
+                                          0,
+                                          nullptr,
+                                          nullptr,
+                                          100,
+                                          NEGATIVE_CACHE_TTL_MS,
+                                          &_hits,
+                                          &_misses);
+  }
+
+  virtual void TearDown() override
+  {
+    delete _memcached_cache;
+    delete _local_mock_store;
+    delete _remote_mock_store1;
+    delete _remote_mock_store2;
+  }
+
+private:
+  StrictMock<MockImpuStore>* _local_mock_store;
+  StrictMock<MockImpuStore>* _remote_mock_store1;
+  StrictMock<MockImpuStore>* _remote_mock_store2;
+  MemcachedCache* _memcached_cache;
+  CountingCounterTable _hits;
+  CountingCounterTable _misses;
+};
+
+// An IMPU that no store has is only looked up in the remote stores again once
+// the negative cache entry has expired. The local store is always checked.
+TEST_F(MemcachedCacheNegativeCacheTest, GetImpuNotFoundRemembered)
+{
+  ImpuStore::Impu* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impu(IMPU, _, _))
+    .Times(3)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(1, _hits.count);
+  EXPECT_EQ(1, _misses.count);
+
+  cwtest_advance_time_ms(NEGATIVE_CACHE_TTL_MS);
+
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(nullptr, result);
+  EXPECT_EQ(1, _hits.count);
+  EXPECT_EQ(2, _misses.count);
+}
+
+// If a remote store fails, we don't know that the IMPU isn't there, so we
+// look it up again next time.
+TEST_F(MemcachedCacheNegativeCacheTest, GetImpuRemoteErrorNotRemembered)
+{
+  ImpuStore::Impu* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::ERROR));
+
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(0, _hits.count);
+  EXPECT_EQ(2, _misses.count);
+}
+
+TEST_F(MemcachedCacheNegativeCacheTest, GetImpiMappingNotFoundRemembered)
+{
+  ImpuStore::ImpiMapping* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impi_mapping(IMPI, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, nullptr));
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, nullptr));
+  EXPECT_EQ(nullptr, result);
+  EXPECT_EQ(1, _hits.count);
+}
+
+// IMPUs that are looked up in a batch are remembered individually.
+TEST_F(MemcachedCacheNegativeCacheTest, GetImpusNotFoundRemembered)
+{
+  std::vector<ImplicitRegistrationSet*> irss;
+  std::vector<std::string> impus = {IMPU, IMPU_2};
+
+  EXPECT_CALL(*_local_mock_store, get_impus(impus, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::OK));
+  EXPECT_CALL(*_remote_mock_store1, get_impus(impus, _, _))
+    .WillOnce(Return(Store::Status::OK));
+  EXPECT_CALL(*_remote_mock_store2, get_impus(impus, _, _))
+    .WillOnce(Return(Store::Status::OK));
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    EXPECT_EQ(Store::Status::OK,
+              _memcached_cache->get_implicit_registration_sets_for_impus(impus,
+                                                                         0L,
+                                                                         nullptr,
+                                                                         irss));
+    EXPECT_EQ(0, irss.size());
+  }
+
+  EXPECT_EQ(2, _hits.count);
+  EXPECT_EQ(2, _misses.count);
+}
+
+// Writing an IRS stops us remembering that its identities weren't found.
+TEST_F(MemcachedCacheNegativeCacheTest, WriteInvalidates)
+{
+  ImpuStore::Impu* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impu(ASSOC_IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(ASSOC_IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(ASSOC_IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+
+  _memcached_cache->get_impu_for_impu_gr(ASSOC_IMPU, result, 0L, nullptr);
+
+  MemcachedImplicitRegistrationSet mirs;
+  mirs.set_ims_sub_xml(SERVICE_PROFILE);
+  mirs.add_associated_impi(IMPI);
+  _memcached_cache->invalidate_negative_cache({&mirs});
+
+  _memcached_cache->get_impu_for_impu_gr(ASSOC_IMPU, result, 0L, nullptr);
+  EXPECT_EQ(0, _hits.count);
+}
+
+TEST(NegativeCacheTest, InvalidatedDuringLookup)
+{
+  MemcachedCache::NegativeCache cache(10, NEGATIVE_CACHE_TTL_MS);
+  uint64_t token;
+
+  // The key is written while it's being looked up, so the lookup may have
+  // missed it, and we mustn't remember that it wasn't found.
+  EXPECT_FALSE(cache.start_lookup(IMPU, token));
+  cache.invalidate(IMPU);
+  cache.end_lookup(IMPU, token, false);
+  EXPECT_FALSE(cache.start_lookup(IMPU, token));
+
+  // A lookup that found the key isn't remembered either.
+  cache.end_lookup(IMPU, token, true);
+  EXPECT_FALSE(cache.start_lookup(IMPU, token));
+  cache.end_lookup(IMPU, token, false);
+  EXPECT_TRUE(cache.start_lookup(IMPU, token));
+}
+
+TEST(NegativeCacheTest, Eviction)
+{
+  MemcachedCache::NegativeCache cache(2, NEGATIVE_CACHE_TTL_MS);
+  uint64_t token;
+
+  for (const std::string& key : {IMPU, IMPU_2, ASSOC_IMPU})
+  {
+    EXPECT_FALSE(cache.start_lookup(key, token));
+    cache.end_lookup(key, token, false);
+  }
+
+  // The oldest entry was evicted to make room for the newest
+  EXPECT_TRUE(cache.start_lookup(ASSOC_IMPU, token));
+  EXPECT_TRUE(cache.start_lookup(IMPU_2, token));
+  EXPECT_FALSE(cache.start_lookup(IMPU, token));
+  cache.end_lookup(IMPU, token, true);
+}
+
+// Tests that use real time, for the remote replication threads
+class MemcachedCacheReplicationTest : public ::testing::Test
+{
+public:
+  virtual void SetUp() override
+  {
+    _lls = new LocalStore();
+    _local_store = new ImpuStore(_lls);
+    _rls = new LocalStore();
+    _remote_store = new ImpuStore(_rls);
+    _memcached_cache = new MemcachedCache(_local_store,
+                                          {_remote_store},
+                                          1,
+                                          nullptr,
+                                          0,
+                                          1,
+                                          1);
+    _mock_progress_cb = new MockProgressCallback();
+  }
+
+  virtual void TearDown() override
+  {
+    delete _mock_progress_cb;
+    delete _memcached_cache;
+    delete _remote_store;
+    delete _rls;
+    delete _local_store;
+    delete _lls;
+  }
+
+  // Wait for the replication threads to finish any queued requests.
+  void wait_for_replication()
+  {
+    while (true)
+    {
+      {
+        std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+        if (_memcached_cache->_replication_queues.empty())
+        {
+          return;
+        }
+      }
+
+      usleep(1000);
+    }
+  }
+
+  // Get an IRS for IMPU from the local store, adding the given IMPI to it.
+  ImplicitRegistrationSet* get_irs_adding_impi(const std::string& impi)
+  {
+    ImplicitRegistrationSet* irs = nullptr;
+    _memcached_cache->get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+    irs->add_associated_impi(impi);
+    return irs;
+  }
+
+  void set_local_impu()
+  {
+    ImpuStore::DefaultImpu* di =
+      new ImpuStore::DefaultImpu(IMPU,
+                                 ASSOC_IMPUS,
+                                 NO_IMPIS,
+                                 RegistrationState::REGISTERED,
+                                 CHARGING_ADDRESSES,
+                                 SERVICE_PROFILE,
+                                 0L,
+                                 time(0) + 10,
+                                 _local_store);
+
+    _local_store->set_impu(di, 0L);
+
+    delete di;
+  }
+
+  bool remote_has_impi_mapping(const std::string& impi)
+  {
+    ImpuStore::ImpiMapping* mapping = nullptr;
+    _remote_store->get_impi_mapping(impi, mapping, 0L);
+    bool found = (mapping != nullptr) && (mapping->has_default_impu(IMPU));
+    delete mapping;
+    return found;
+  }
+
+private:
+  LocalStore* _lls;
+  ImpuStore* _local_store;
+  LocalStore* _rls;
+  ImpuStore* _remote_store;
+
+  MemcachedCache* _memcached_cache;
+};
+
+TEST_F(MemcachedCacheReplicationTest, PutIrsReplicatedAsynchronously)
+{
+  set_local_impu();
+  ImplicitRegistrationSet* irs = get_irs_adding_impi(IMPI);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  Store::Status status = _memcached_cache->put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+
+  // The caller's IRS can be freed before the write is replicated
+  delete irs;
+
+  wait_for_replication();
+
+  ImpuStore::Impu* impu = nullptr;
+  _remote_store->get_impu(IMPU, impu, 0L);
+  ASSERT_NE(nullptr, impu);
+  EXPECT_TRUE(impu->is_default_impu());
+  delete impu;
+
+  EXPECT_TRUE(remote_has_impi_mapping(IMPI));
+}
+
+TEST_F(MemcachedCacheReplicationTest, PutIrsCoalesced)
+{
+  set_local_impu();
+
+  // Pretend a replication thread is already working on this IRS, so that the
+  // following writes wait in its queue
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    _memcached_cache->_replication_queues[IMPU];
+  }
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback()).Times(2);
+
+  ImplicitRegistrationSet* irs = get_irs_adding_impi(IMPI);
+  _memcached_cache->put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  delete irs;
+
+  irs = get_irs_adding_impi(IMPI_2);
+  _memcached_cache->put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  delete irs;
+
+  // The two writes are replicated with a single request, which adds both IMPIs
+  std::deque<MemcachedCache::ReplicationRequest*> queue;
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    queue = _memcached_cache->_replication_queues[IMPU];
+  }
+
+  ASSERT_EQ(1, queue.size());
+  std::vector<std::string> added = { IMPI, IMPI_2 };
+  EXPECT_EQ(added,
+            queue.front()->irs->impis(MemcachedImplicitRegistrationSet::State::ADDED));
+
+  // Let the request run
+  _memcached_cache->process_replication_queue(IMPU);
+
+  EXPECT_TRUE(remote_has_impi_mapping(IMPI));
+  EXPECT_TRUE(remote_has_impi_mapping(IMPI_2));
+}
+
+TEST_F(MemcachedCacheReplicationTest, PutIrsDeleteIrsNotCoalesced)
+{
+  set_local_impu();
+
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    _memcached_cache->_replication_queues[IMPU];
+  }
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback()).Times(2);
+
+  ImplicitRegistrationSet* irs = get_irs_adding_impi(IMPI);
+  _memcached_cache->put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  delete irs;
+
+  _memcached_cache->get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+  _memcached_cache->delete_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  delete irs;
+
+  // The put and the delete are replicated in order
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    std::deque<MemcachedCache::ReplicationRequest*>& queue =
+      _memcached_cache->_replication_queues[IMPU];
+    ASSERT_EQ(2, queue.size());
+    EXPECT_EQ(MemcachedCache::ReplicationType::REPLICATE_PUT, queue[0]->type);
+    EXPECT_EQ(MemcachedCache::ReplicationType::REPLICATE_DELETE, queue[1]->type);
+  }
+
+  _memcached_cache->process_replication_queue(IMPU);
+
+  ImpuStore::Impu* impu = nullptr;
+  _remote_store->get_impu(IMPU, impu, 0L);
+  EXPECT_EQ(nullptr, impu);
+  EXPECT_FALSE(remote_has_impi_mapping(IMPI));
+}
+
+TEST_F(MemcachedCacheReplicationTest, ReplicationQueuedInLocalWriteOrder)
+{
+  // Tests that a write is queued for replication before the IRS's write lock
+  // is released, so that a later write to the same IRS (here, one made as
+  // soon as the first has succeeded locally) can't be queued ahead of it.
+  set_local_impu();
+
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    _memcached_cache->_replication_queues[IMPU];
+  }
+
+  progress_callback delete_irs = [this]()
+  {
+    ImplicitRegistrationSet* irs = nullptr;
+    _memcached_cache->get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+    _memcached_cache->delete_implicit_registration_set(irs, [](){}, 0L, nullptr);
+    delete irs;
+  };
+
+  ImplicitRegistrationSet* irs = get_irs_adding_impi(IMPI);
+  _memcached_cache->put_implicit_registration_set(irs, delete_irs, 0L, nullptr);
+  delete irs;
+
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    std::deque<MemcachedCache::ReplicationRequest*>& queue =
+      _memcached_cache->_replication_queues[IMPU];
+    ASSERT_EQ(2, queue.size());
+    EXPECT_EQ(MemcachedCache::ReplicationType::REPLICATE_PUT, queue[0]->type);
+    EXPECT_EQ(MemcachedCache::ReplicationType::REPLICATE_DELETE, queue[1]->type);
+  }
+
+  _memcached_cache->process_replication_queue(IMPU);
+
+  ImpuStore::Impu* impu = nullptr;
+  _remote_store->get_impu(IMPU, impu, 0L);
+  EXPECT_EQ(nullptr, impu);
+}
+
+TEST_F(MemcachedCacheReplicationTest, QueueFullReplicatesOnCallingThread)
+{
+  set_local_impu();
+
+  // Fill the queue with another IRS
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    _memcached_cache->_replication_queues[IMPU_2];
+  }
+
+  ImplicitRegistrationSet* irs = get_irs_adding_impi(IMPI);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  _memcached_cache->put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  delete irs;
+
+  // The write has been replicated without waiting for the replication threads
+  EXPECT_TRUE(remote_has_impi_mapping(IMPI));
+
+  {
+    std::lock_guard<std::mutex> lock(_memcached_cache->_replication_lock);
+    _memcached_cache->_replication_queues.erase(IMPU_2);
+  }
+}
+
+TEST(MemcachedCacheWriteSerializationTest, WritesForSameIrsSerialized)
+{
+  // Tests that a write has to wait for another write to the same IRS, and
+  // that this is counted
+  StrictMock<MockImpuStore> local_store;
+  CountingCounterTable serialized_writes;
+  MemcachedCache cache(&local_store, {}, 0, nullptr, 0, 0, 0, nullptr, nullptr, 0, 0, nullptr, nullptr, 0, &serialized_writes, nullptr);
+
+  MemcachedImplicitRegistrationSet irs;
+  irs.set_ims_sub_xml(SERVICE_PROFILE);
+
+  std::vector<std::unique_lock<std::mutex>> locks = cache.lock_irss({&irs});
+
+  std::atomic<bool> other_locked(false);
+  std::thread other([&cache, &irs, &other_locked]()
+  {
+    std::vector<std::unique_lock<std::mutex>> other_locks = cache.lock_irss({&irs});
+    other_locked = true;
+  });
+
+  usleep(50000);
+  EXPECT_FALSE(other_locked);
+
+  locks.clear();
+  other.join();
+
+  EXPECT_TRUE(other_locked);
+  EXPECT_EQ(1, serialized_writes.count);
+}
+
+TEST(MemcachedCacheWriteSerializationTest, ContentionRetriesCounted)
+{
+  // Tests that CAS writes that hit DATA_CONTENTION and are retried are
+  // counted
+  StrictMock<MockImpuStore> local_store;
+  CountingCounterTable contention_retries;
+  MemcachedCache cache(&local_store, {}, 0, nullptr, 0, 0, 0, nullptr, nullptr, 0, 0, nullptr, nullptr, 0, nullptr, &contention_retries);
+
+  MemcachedImplicitRegistrationSet* mirs = new MemcachedImplicitRegistrationSet();
+  mirs->set_ttl(1);
+  mirs->set_ims_sub_xml(SERVICE_PROFILE);
+  mirs->add_associated_impi(IMPI);
+
+  EXPECT_CALL(local_store, set_impi_mapping(_, _))
+    .WillOnce(Return(Store::Status::DATA_CONTENTION))
+    .WillOnce(Return(Store::Status::OK));
+  EXPECT_CALL(local_store, get_impi_mapping(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  EXPECT_EQ(Store::Status::OK,
+            cache.update_irs_impi_mappings(mirs, 0L, &local_store, nullptr));
+  EXPECT_EQ(1, contention_retries.count);
+
+  delete mirs;
+}
+
+TEST(MemcachedCacheLocalWriteTest, LocalWritesUseOwnPool)
+{
+  // Tests that the reads and writes to the local store for a single write
+  // are run in parallel on the local write pool, even when there are no
+  // remote threads
+  StrictMock<MockImpuStore> local_store;
+  MemcachedCache cache(&local_store, {}, 0, nullptr, 0, 0, 0, nullptr, nullptr, 0, 0, nullptr, nullptr, 0, nullptr, nullptr, 2);
+
+  MemcachedImplicitRegistrationSet* mirs = new MemcachedImplicitRegistrationSet();
+  mirs->set_ttl(1);
+  mirs->set_ims_sub_xml(SERVICE_PROFILE);
+  mirs->add_associated_impi(IMPI);
+  mirs->add_associated_impi(IMPI_2);
+
+  std::mutex lock;
+  std::set<std::thread::id> threads;
+
+  EXPECT_CALL(local_store, get_impi_mapping(_, _, _))
+    .Times(2)
+    .WillRepeatedly(Invoke([&lock, &threads](const std::string impi,
+                                             ImpuStore::ImpiMapping*& mapping,
+                                             SAS::TrailId trail)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      threads.insert(std::this_thread::get_id());
+      return Store::Status::NOT_FOUND;
+    }));
+  EXPECT_CALL(local_store, set_impi_mapping(_, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::OK));
+
+  EXPECT_EQ(Store::Status::OK,
+            cache.update_irs_impi_mappings(mirs, 0L, &local_store, nullptr));
+
+  // One read was made by this thread, and the other by the pool
+  EXPECT_EQ(2u, threads.size());
+  EXPECT_EQ(1u, threads.count(std::this_thread::get_id()));
+
+  delete mirs;
 }
@@ -25,6 +25,17 @@ public:
   MOCK_METHOD2(add_impu, Store::Status(Impu* impu, SAS::TrailId trail));
   MOCK_METHOD2(set_impu, Store::Status(Impu* impu, SAS::TrailId trail));
   MOCK_METHOD3(get_impu, Store::Status(const std::string& impu, Impu*& out_impu, SAS::TrailId trail));
+  MOCK_METHOD1(get_cached_impu, Impu*(const std::string& impu));
+
+  // Most tests don't care whether an IMPU is read in order to write over it.
+  virtual Store::Status get_impu_for_update(const std::string& impu,
+                                            Impu*& out_impu,
+                                            SAS::TrailId trail) override
+  {
+    return get_impu(impu, out_impu, trail);
+  }
+
+  MOCK_METHOD3(get_impus, Store::Status(const std::vector<std::string>& impus, std::vector<Impu*>& out_impus, SAS::TrailId trail));
   MOCK_METHOD2(delete_impu, Store::Status(Impu* impu, SAS::TrailId trail));
   MOCK_METHOD2(set_impi_mapping, Store::Status(ImpiMapping* mapping, SAS::TrailId trail));
   MOCK_METHOD3(get_impi_mapping, Store::Status(const std::string impi, ImpiMapping*& out_mapping, SAS::TrailId trail));
@@ -22,6 +22,7 @@ public:
 
   MOCK_METHOD1(set_charging_addrs, void(const ChargingAddresses& new_addresses));
   MOCK_METHOD1(get_irs_for_default_impu, ImplicitRegistrationSet*(const std::string& impu));
+  MOCK_METHOD0(get_irss, std::vector<ImplicitRegistrationSet*>());
 };
 
 #endif
@@ -27,6 +27,13 @@ public:
   MOCK_METHOD1(update_H_hss_digest_latency_us, void(unsigned long sample));
   MOCK_METHOD1(update_H_hss_subscription_latency_us, void(unsigned long sample));
   MOCK_METHOD1(update_H_hsprov_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_cache_queue_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_local_store_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_remote_store_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_hss_sar_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_xml_build_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_compression_latency_us, void(unsigned long sample));
+  MOCK_METHOD1(update_H_decompression_latency_us, void(unsigned long sample));
 
   MOCK_METHOD0(incr_H_incoming_requests, void());
   MOCK_METHOD0(incr_H_rejected_overload, void());
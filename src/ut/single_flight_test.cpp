@@ -0,0 +1,59 @@
+/**
+ * @file single_flight_test.cpp UT for SingleFlight.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "test_utils.hpp"
+
+#include "single_flight.h"
+
+typedef SingleFlight<std::string, int> TestSingleFlight;
+
+TEST(SingleFlightTest, JoinInFlight)
+{
+  TestSingleFlight flights;
+
+  TestSingleFlight::FlightPtr flight = flights.join("key", 1);
+  ASSERT_TRUE(flight != nullptr);
+
+  // Later requests for the same key join the first, but other keys get their
+  // own flight
+  EXPECT_TRUE(flights.join("key", 2) == nullptr);
+  EXPECT_TRUE(flights.join("key", 3) == nullptr);
+
+  TestSingleFlight::FlightPtr other = flights.join("other", 4);
+  ASSERT_TRUE(other != nullptr);
+  EXPECT_EQ(2u, flights.size());
+
+  EXPECT_EQ(std::vector<int>({ 1, 2, 3 }), flights.complete("key", flight));
+  EXPECT_EQ(std::vector<int>({ 4 }), flights.complete("other", other));
+  EXPECT_EQ(0u, flights.size());
+
+  // Once the flight is complete, the next request starts a new one
+  EXPECT_TRUE(flights.join("key", 5) != nullptr);
+}
+
+TEST(SingleFlightTest, Detach)
+{
+  TestSingleFlight flights;
+
+  TestSingleFlight::FlightPtr flight = flights.join("key", 1);
+  EXPECT_TRUE(flights.join("key", 2) == nullptr);
+
+  // After detaching, requests start a new flight, and completing the old
+  // flight doesn't affect the new one
+  flights.detach("key");
+  TestSingleFlight::FlightPtr new_flight = flights.join("key", 3);
+  ASSERT_TRUE(new_flight != nullptr);
+  EXPECT_TRUE(flights.join("key", 4) == nullptr);
+
+  EXPECT_EQ(std::vector<int>({ 1, 2 }), flights.complete("key", flight));
+  EXPECT_TRUE(flights.join("key", 5) == nullptr);
+  EXPECT_EQ(std::vector<int>({ 3, 4, 5 }), flights.complete("key", new_flight));
+}
@@ -0,0 +1,92 @@
+/**
+ * @file stage_latency_test.cpp UT for StageLatency.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "test_utils.hpp"
+
+#include "mockstatisticsmanager.hpp"
+#include "stage_latency.h"
+
+using ::testing::_;
+using ::testing::StrictMock;
+
+const SAS::TrailId FAKE_TRAIL_ID = 0x12345678;
+
+class StageLatencyTest : public ::testing::Test
+{
+public:
+  StageLatencyTest()
+  {
+    StageLatency::configure(&_stats);
+  }
+
+  virtual ~StageLatencyTest()
+  {
+    StageLatency::configure(NULL);
+  }
+
+  StrictMock<MockStatisticsManager> _stats;
+};
+
+TEST_F(StageLatencyTest, RecordEachStage)
+{
+  // Each stage is accumulated into its own statistic
+  EXPECT_CALL(_stats, update_H_cache_queue_latency_us(1));
+  EXPECT_CALL(_stats, update_H_local_store_latency_us(2));
+  EXPECT_CALL(_stats, update_H_remote_store_latency_us(3));
+  EXPECT_CALL(_stats, update_H_hss_sar_latency_us(4));
+  EXPECT_CALL(_stats, update_H_xml_build_latency_us(5));
+  EXPECT_CALL(_stats, update_H_compression_latency_us(6));
+  EXPECT_CALL(_stats, update_H_decompression_latency_us(StageLatency::SAS_THRESHOLD_US + 7));
+
+  StageLatency::record(StageLatency::CACHE_QUEUE, FAKE_TRAIL_ID, 1);
+  StageLatency::record(StageLatency::LOCAL_STORE, FAKE_TRAIL_ID, 2);
+  StageLatency::record(StageLatency::REMOTE_STORE, FAKE_TRAIL_ID, 3);
+  StageLatency::record(StageLatency::HSS_SAR, FAKE_TRAIL_ID, 4);
+  StageLatency::record(StageLatency::XML_BUILD, FAKE_TRAIL_ID, 5);
+  StageLatency::record(StageLatency::COMPRESSION, 0, 6);
+
+  // Only long enough times are also logged to SAS
+  StageLatency::record(StageLatency::DECOMPRESSION,
+                       FAKE_TRAIL_ID,
+                       StageLatency::SAS_THRESHOLD_US + 7);
+}
+
+TEST_F(StageLatencyTest, NoStageIgnored)
+{
+  // The strict mock fails the test if anything is recorded
+  StageLatency::record(StageLatency::NONE, FAKE_TRAIL_ID, 1);
+  StageLatency::Timer timer(StageLatency::NONE, FAKE_TRAIL_ID);
+}
+
+TEST_F(StageLatencyTest, TimerRecordsOnce)
+{
+  // The timer records when it's stopped, and not again when it's destroyed
+  EXPECT_CALL(_stats, update_H_xml_build_latency_us(_)).Times(1);
+
+  StageLatency::Timer timer(StageLatency::XML_BUILD, FAKE_TRAIL_ID);
+  timer.stop();
+  timer.stop();
+}
+
+TEST_F(StageLatencyTest, TimerRecordsOnDestruction)
+{
+  EXPECT_CALL(_stats, update_H_hss_sar_latency_us(_)).Times(1);
+
+  {
+    StageLatency::Timer timer(StageLatency::HSS_SAR, FAKE_TRAIL_ID);
+  }
+}
+
+TEST(StageLatencyUnconfiguredTest, OnlyLoggedToSas)
+{
+  // With no statistics manager configured, recording doesn't crash
+  StageLatency::record(StageLatency::LOCAL_STORE, FAKE_TRAIL_ID, 1);
+}